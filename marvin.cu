@@ -15,6 +15,8 @@ int main(int argc, char **argv){
         cout<<"       example: "<<argv[0]<<" test examples/mnist/lenet.json examples/mnist/lenet.marvin ip1,conv2 examples/mnist/ip1.tensor,examples/mnist/conv2.tensor"<<endl;
         cout<<argv[0]<<" activate network.json model1.marvin[,model2.marvin,...] response_name_data response_name1[,name2,...] response1_channels[,response2_channels,...] file_prefix topK maxIterations"<<endl;
         cout<<"       example: "<<argv[0]<<" activate examples/mnist/lenet.json examples/mnist/lenet.marvin data conv1,conv2 [0,1,2],[0,1,2,3,4,5] examples/mnist/filters_ 100 20"<<endl;
+        cout<<argv[0]<<" records records.tensor data1.tensor[,data2.tensor,...] label.tensor"<<endl;
+        cout<<"       example: "<<argv[0]<<" records examples/mnist/train-records.tensor examples/mnist/train-images.tensor examples/mnist/train-labels.tensor"<<endl;
         return 0;
 
     }
@@ -48,6 +50,10 @@ int main(int argc, char **argv){
     }else if(0==strcmp(argv[1], "test")){
 
         Net net(argv[2]);
+        if (argc>=6){
+            vector<string> keep = getStringVector(argv[4]);
+            net.keep_responses.insert(net.keep_responses.end(), keep.begin(), keep.end());
+        }
         net.Malloc(Testing);
 
         vector<string> models = getStringVector(argv[3]);
@@ -66,12 +72,19 @@ int main(int argc, char **argv){
     }else if(0==strcmp(argv[1], "activate")){
 
         Net net(argv[2]);
+        vector<string> keep = getStringVector(argv[5]);
+        net.keep_responses.insert(net.keep_responses.end(), keep.begin(), keep.end());
+        net.keep_responses.push_back(argv[4]);
         net.Malloc(Testing);
         
         vector<string> models = getStringVector(argv[3]);
         for (int m=0;m<models.size();++m)   net.loadWeights(models[m]);
 
         net.getTopActivations(argv[4], getStringVector(argv[5]), getIntVectorVector(argv[6]), argv[7], atoi(argv[8]), atoi(argv[9]));
+    }else if(0==strcmp(argv[1], "records")){
+
+        if (argc!=5) FatalError(__LINE__);
+        writeRecords(argv[2], getStringVector(argv[3]), argv[4]);
     }
 
     return 0;
@@ -78,6 +78,7 @@
 #include <random>
 #include <algorithm>
 #include <map>
+#include <list>
 #include <vector>
 #include <string>
 #include <typeinfo>
@@ -85,11 +86,27 @@
 #include <thread>
 #include <chrono>
 #include <future>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <type_traits>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
 #include <cuda.h>
 #include <cublas_v2.h>
 #include <curand.h>
 #include <cudnn.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__AVX2__) || defined(__AVX512F__) || defined(__F16C__)
+#include <immintrin.h>
+#endif
 
 #define USE_OPENCV 0
 
@@ -113,6 +130,7 @@ enum SolverAlgorithm { SGD, AdaDelta, AdaGrad, Adam, NAG, RMSprop};
 enum Regularizer { L2, L1 };
 enum LRN { CrossChannel, DivisiveNormalization };
 enum ElementWiseOp { ElementWise_EQL, ElementWise_MUL, ElementWise_SUM, ElementWise_MIN, ElementWise_MAX };
+enum Device { DeviceGPU, DeviceCPU };
 
 
 ComputeT anyval;
@@ -817,6 +835,13 @@ public:
         else{ std::cout<<"Unsupported "<<name<<" = "<<this->member[name]->returnString()<<std::endl; FatalError(__LINE__); }
     };
 
+    void set(std::string name, Device &variable, Device default_value){
+        if (this->member.find(name) == this->member.end())                              variable = default_value;
+        else if (0 == this->member[name]->returnString().compare("GPU"))                variable = DeviceGPU;
+        else if (0 == this->member[name]->returnString().compare("CPU"))                variable = DeviceCPU;
+        else{ std::cout<<"Unsupported "<<name<<" = "<<this->member[name]->returnString()<<std::endl; FatalError(__LINE__); }
+    };
+
     void set(std::string name, cudnnBatchNormMode_t &variable, cudnnBatchNormMode_t default_value){
         if (this->member.find(name) == this->member.end())                                  variable = default_value;
         else if (0 == this->member[name]->returnString().compare("Spatial"))                variable = CUDNN_BATCHNORM_SPATIAL;
@@ -1082,6 +1107,207 @@ void parseNetworkJSON(std::string filename, JSON* train_obj, JSON* test_obj, JSO
 // Utility
 //////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Memory helpers: the same buffer management for both devices, using aligned host memory on the CPU
+
+// What the allocations made while an account is current (see MemoryAccountScope) hold right now, and their peak,
+// GPU and host memory apart
+struct MemoryAccount{
+    size_t bytes;
+    size_t peak;
+    size_t hostBytes;
+    size_t hostPeak;
+    MemoryAccount(): bytes(0), peak(0), hostBytes(0), hostPeak(0){};
+
+    size_t on(Device device) const{ return device==DeviceCPU ? hostBytes : bytes; };
+};
+
+// Caching allocator behind deviceMalloc and deviceFree. Requests are rounded up to size classes, four per
+// power of two so that at most a quarter is wasted, and freed blocks wait in per-device bins for the next
+// request of the same class instead of going back to cudaMalloc or the C library. Host blocks are 64-byte
+// aligned for SIMD loads; GPU blocks keep the 256-byte alignment of cudaMalloc. When a GPU runs out of memory,
+// the blocks cached for it are released and the allocation is retried.
+class MemoryArena{
+    struct Block{
+        int device;         // GPU id, -1 for host memory
+        size_t bytes;       // size class
+        size_t requested;
+        MemoryAccount* account;
+    };
+
+    std::mutex mtx;
+    std::map<void*, Block> live;
+    std::map<std::pair<int, size_t>, std::vector<void*> > bins;
+
+    cudaError_t systemMalloc(int device, void** ptr, size_t bytes){
+        if (device>=0) return cudaMalloc(ptr, bytes);
+        if (posix_memalign(ptr, 64, bytes)!=0){
+            *ptr = NULL;
+            return cudaErrorMemoryAllocation;
+        }
+        return cudaSuccess;
+    };
+
+    void systemFree(int device, void* ptr){
+        if (device>=0) cudaFree(ptr);
+        else           free(ptr);
+    };
+
+    // device < -1 releases the bins of every device
+    void trimLocked(int device){
+        for (std::map<std::pair<int, size_t>, std::vector<void*> >::iterator it=bins.begin(); it!=bins.end(); ++it){
+            if (device>=-1 && it->first.first!=device) continue;
+            for (int i=0;i<it->second.size();++i){
+                systemFree(it->first.first, it->second[i]);
+                cachedBytes -= it->first.second;
+            }
+            it->second.clear();
+        }
+    };
+
+public:
+    size_t liveBytes;       // size classes handed out
+    size_t requestedBytes;  // what was asked for them
+    size_t cachedBytes;     // freed blocks waiting in the bins
+    size_t peakBytes;       // of liveBytes + cachedBytes
+    size_t systemAllocations;
+    size_t reuses;
+
+    MemoryArena(): liveBytes(0), requestedBytes(0), cachedBytes(0), peakBytes(0), systemAllocations(0), reuses(0){};
+
+    // never destroyed: the blocks may outlive static objects and the CUDA context is torn down at exit anyway
+    static MemoryArena& get(){
+        static MemoryArena* arena = new MemoryArena;
+        return *arena;
+    };
+
+    static MemoryAccount*& currentAccount(){
+        static thread_local MemoryAccount* account = NULL;
+        return account;
+    };
+
+    static size_t sizeClass(size_t bytes){
+        if (bytes<=256) return 256;
+        size_t p = 256;
+        while (p*2 < bytes) p *= 2;
+        size_t q = p/4;     // p < bytes <= 2p, in steps of p/4
+        return (bytes + q - 1) / q * q;
+    };
+
+    cudaError_t allocate(Device device, void** ptr, size_t bytes){
+        int id = -1;
+        if (device==DeviceGPU){
+            cudaError_t e = cudaGetDevice(&id);
+            if (e!=cudaSuccess) return e;
+        }
+        const size_t rounded = sizeClass(bytes);
+
+        std::lock_guard<std::mutex> lock(mtx);
+        std::vector<void*>& bin = bins[std::make_pair(id, rounded)];
+        void* p = NULL;
+        if (!bin.empty()){
+            p = bin.back();
+            bin.pop_back();
+            cachedBytes -= rounded;
+            ++reuses;
+        }else{
+            cudaError_t e = systemMalloc(id, &p, rounded);
+            if (e!=cudaSuccess && id>=0){
+                cudaGetLastError();
+                trimLocked(id);
+                e = systemMalloc(id, &p, rounded);
+            }
+            if (e!=cudaSuccess){
+                *ptr = NULL;
+                return e;
+            }
+            ++systemAllocations;
+        }
+
+        Block block = {id, rounded, bytes, currentAccount()};
+        live[p] = block;
+        liveBytes += rounded;
+        requestedBytes += bytes;
+        peakBytes = std::max(peakBytes, liveBytes + cachedBytes);
+        if (block.account!=NULL && id<0){
+            block.account->hostBytes += rounded;
+            block.account->hostPeak = std::max(block.account->hostPeak, block.account->hostBytes);
+        }else if (block.account!=NULL){
+            block.account->bytes += rounded;
+            block.account->peak = std::max(block.account->peak, block.account->bytes);
+        }
+        *ptr = p;
+        return cudaSuccess;
+    };
+
+    cudaError_t release(void* ptr){
+        if (ptr==NULL) return cudaSuccess;
+        std::lock_guard<std::mutex> lock(mtx);
+        std::map<void*, Block>::iterator it = live.find(ptr);
+        if (it==live.end()) return cudaErrorInvalidDevicePointer;
+        const Block& block = it->second;
+        bins[std::make_pair(block.device, block.bytes)].push_back(ptr);
+        liveBytes -= block.bytes;
+        requestedBytes -= block.requested;
+        cachedBytes += block.bytes;
+        if (block.account!=NULL){
+            if (block.device<0) block.account->hostBytes -= block.bytes;
+            else                block.account->bytes     -= block.bytes;
+        }
+        live.erase(it);
+        return cudaSuccess;
+    };
+
+    // give the cached blocks back to the system: those of one GPU, of the host (-1) or of all devices. Nothing
+    // calls it implicitly, as the bins also hold the blocks of other nets; a process that is done with a model
+    // and will not build another of similar size can call it.
+    void trim(int device = -2){
+        std::lock_guard<std::mutex> lock(mtx);
+        trimLocked(device);
+    };
+
+    // an account that goes away stops being charged for the blocks it still holds
+    void forget(MemoryAccount* account){
+        std::lock_guard<std::mutex> lock(mtx);
+        for (std::map<void*, Block>::iterator it=live.begin(); it!=live.end(); ++it){
+            if (it->second.account==account) it->second.account = NULL;
+        }
+    };
+
+    void print();
+};
+
+// charges the allocations of the current thread to an account while in scope
+class MemoryAccountScope{
+    MemoryAccount* previous;
+public:
+    MemoryAccountScope(MemoryAccount* account): previous(MemoryArena::currentAccount()){ MemoryArena::currentAccount() = account; };
+    ~MemoryAccountScope(){ MemoryArena::currentAccount() = previous; };
+};
+
+template <typename T>
+cudaError_t deviceMalloc(Device device, T** ptr, size_t bytes){
+    void* p = NULL;
+    cudaError_t e = MemoryArena::get().allocate(device, &p, bytes);
+    *ptr = (T*)p;
+    return e;
+}
+
+cudaError_t deviceFree(Device device, void* ptr){
+    return MemoryArena::get().release(ptr);
+}
+
+cudaError_t deviceMemset(Device device, void* ptr, int value, size_t bytes){
+    if (device==DeviceGPU) return cudaMemset(ptr, value, bytes);
+    memset(ptr, value, bytes);
+    return cudaSuccess;
+}
+
+cudaError_t deviceMemcpy(Device device, void* dst, const void* src, size_t bytes, cudaMemcpyKind kind){
+    if (device==DeviceGPU) return cudaMemcpy(dst, src, bytes, kind);
+    if (dst!=src) memcpy(dst, src, bytes);
+    return cudaSuccess;
+}
+
 bool is_file_exist(const std::string& fileName){
     std::ifstream infile(fileName);
     return infile.good();
@@ -1103,6 +1329,15 @@ void memorySizePrint(size_t bytes){
     }
 }
 
+void MemoryArena::print(){
+    std::lock_guard<std::mutex> lock(mtx);
+    std::cout<<"Memory arena: ";  memorySizePrint(liveBytes);
+    std::cout<<" in use for ";     memorySizePrint(requestedBytes);
+    std::cout<<" requested, ";     memorySizePrint(cachedBytes);
+    std::cout<<" cached, peak ";   memorySizePrint(peakBytes);
+    std::cout<<", "<<systemAllocations<<" system allocations, "<<reuses<<" reuses"<<std::endl;
+}
+
 void veciPrint(const std::vector<int>& v){
     std::cout<<"["<<v.size()<<"]={";
     if (v.size()>0) std::cout<<v[0];
@@ -1236,9 +1471,9 @@ bool same_dim_EC(const std::vector<int>& dimA, const std::vector<int>& dimB){
     return true;
 }
 
-size_t checkNaN(StorageT* dataGPU, size_t n){
+size_t checkNaN(StorageT* dataGPU, size_t n, Device device=DeviceGPU){
     StorageT* CPUmem = new StorageT[n];
-    cudaMemcpy(CPUmem, dataGPU, n*sizeofStorageT, cudaMemcpyDeviceToHost);
+    deviceMemcpy(device, CPUmem, dataGPU, n*sizeofStorageT, cudaMemcpyDeviceToHost);
     size_t countNaN = 0;
     for (size_t i=0;i<n;++i) if (ISNAN(CPUmem[i])) ++countNaN;
     if (countNaN>0){
@@ -1248,14 +1483,48 @@ size_t checkNaN(StorageT* dataGPU, size_t n){
     return countNaN;
 }
 
-std::vector<size_t> randperm(size_t n, std::mt19937& rng){
+std::vector<size_t> identityperm(size_t n){
     std::vector<size_t> v(n);
     for (size_t i=0;i<n;++i) v[i]=i;
+    return v;
+}
+
+std::vector<size_t> randperm(size_t n, std::mt19937& rng){
+    std::vector<size_t> v = identityperm(n);
 
     shuffle ( v.begin(), v.end(), rng );
     return v;
 }
 
+// A permutation for storage that prefers sequential reads: runs of chunk consecutive items are visited in a
+// random order, and their items stream through a buffer of the given size from which the next item is drawn
+// at random. Items stay within about buffer positions of their chunk, so a reader only needs the chunks that
+// overlap the buffer, each read front to back.
+std::vector<size_t> randpermChunked(size_t n, size_t chunk, size_t buffer, std::mt19937& rng){
+    if (chunk<=1) return randperm(n, rng);
+    if (buffer<1) buffer = 1;
+    std::vector<size_t> chunks = randperm((n + chunk - 1) / chunk, rng);
+    std::vector<size_t> v;
+    v.reserve(n);
+    std::vector<size_t> pool;
+    pool.reserve(buffer);
+    for (size_t c=0;c<chunks.size();++c){
+        size_t begin = chunks[c] * chunk;
+        size_t end = std::min(n, begin + chunk);
+        for (size_t i=begin;i<end;++i){
+            pool.push_back(i);
+            if (pool.size() < buffer) continue;
+            size_t k = std::uniform_int_distribution<size_t>(0, pool.size()-1)(rng);
+            v.push_back(pool[k]);
+            pool[k] = pool.back();
+            pool.pop_back();
+        }
+    }
+    shuffle ( pool.begin(), pool.end(), rng );
+    v.insert(v.end(), pool.begin(), pool.end());
+    return v;
+}
+
 template <typename T>
 std::vector<size_t> sort_indexes(const std::vector<T> &v) {
     // initialize original index locations
@@ -2468,13 +2737,13 @@ __global__ void Kernel_maxElement(size_t N, const StorageT *x, size_t* pMaxID, C
 }
 
 void GPU_maxElement(size_t N, const StorageT *x, size_t* cpuMaxID, ComputeT* cpuMaxValue){
-    size_t* gpuMaxID;    cudaMalloc(&gpuMaxID,    sizeof(size_t));
-    ComputeT* gpuMaxValue; cudaMalloc(&gpuMaxValue, sizeof(ComputeT));
+    size_t* gpuMaxID;    deviceMalloc(DeviceGPU, &gpuMaxID,    sizeof(size_t));
+    ComputeT* gpuMaxValue; deviceMalloc(DeviceGPU, &gpuMaxValue, sizeof(ComputeT));
 
     Kernel_maxElement<<<1,1>>>(N, x, gpuMaxID, gpuMaxValue);
 
-    cudaMemcpy(cpuMaxID, gpuMaxID, sizeof(size_t), cudaMemcpyDeviceToHost);          cudaFree(gpuMaxID);
-    cudaMemcpy(cpuMaxValue, gpuMaxValue, sizeof(ComputeT), cudaMemcpyDeviceToHost);    cudaFree(gpuMaxValue);
+    cudaMemcpy(cpuMaxID, gpuMaxID, sizeof(size_t), cudaMemcpyDeviceToHost);          deviceFree(DeviceGPU, gpuMaxID);
+    cudaMemcpy(cpuMaxValue, gpuMaxValue, sizeof(ComputeT), cudaMemcpyDeviceToHost);    deviceFree(DeviceGPU, gpuMaxValue);
 }
 
 __global__ void Kernel_Hasum(size_t N, const half *x, int incx, float *result){
@@ -2490,10 +2759,10 @@ __global__ void Kernel_Hasum(size_t N, const half *x, int incx, float *result){
 
 cublasStatus_t Hasum(cublasHandle_t handle, int n, const half *x, int incx, float *result){
     float* answer;
-    cudaMalloc(&answer, sizeof(float));
+    deviceMalloc(DeviceGPU, &answer, sizeof(float));
     Kernel_Hasum<<<1,1>>>(n, x, incx, answer);
     cudaMemcpy(result, answer, sizeof(float), cudaMemcpyDeviceToHost);
-    cudaFree(answer);
+    deviceFree(DeviceGPU, answer);
     return CUBLAS_STATUS_SUCCESS;
 }
 
@@ -2507,163 +2776,1955 @@ cublasStatus_t Hgemm(cublasHandle_t handle, cublasOperation_t transa, cublasOper
 
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
-// File format
+// CPU kernels
 //////////////////////////////////////////////////////////////////////////////////////////////////
 
-uint8_t typeID(std::type_index t){
-    if (t==typeid(half))        return uint8_t(0);
-    if (t==typeid(float))       return uint8_t(1);
-    if (t==typeid(double))      return uint8_t(2);
-    if (t==typeid(uint8_t))     return uint8_t(3);
-    if (t==typeid(uint16_t))    return uint8_t(4);
-    if (t==typeid(uint32_t))    return uint8_t(5);
-    if (t==typeid(uint64_t))    return uint8_t(6);
-    if (t==typeid(int8_t))      return uint8_t(7);
-    if (t==typeid(int16_t))     return uint8_t(8);
-    if (t==typeid(int32_t))     return uint8_t(9);
-    if (t==typeid(int64_t))     return uint8_t(10);
-    if (t==typeid(char))        return uint8_t(11);
-    if (t==typeid(bool))        return uint8_t(12);
-    FatalError(__LINE__);       return uint8_t(255);
-}
+// A persistent pool of worker threads shared by all the layers running on the CPU.
+// The calling thread takes part in every job. Nested calls (or calls made while another
+// thread owns the pool, e.g. a data prefetching thread) simply run serially.
+class CPUThreadPool{
+    std::vector<std::thread> workers;
+    std::mutex mtx;
+    std::mutex busy;
+    std::condition_variable cv_work;
+    std::condition_variable cv_done;
+    const std::function<void(size_t, size_t)>* job;
+    size_t jobN;
+    size_t jobGrain;
+    std::atomic<size_t> next;
+    int active;
+    unsigned long generation;
+    bool stop;
+
+    static bool& inside(){
+        static thread_local bool flag = false;
+        return flag;
+    };
+
+    void work(){
+        inside() = true;
+        while (true){
+            size_t begin = next.fetch_add(jobGrain);
+            if (begin >= jobN) break;
+            (*job)(begin, std::min(jobN, begin + jobGrain));
+        }
+        inside() = false;
+    };
 
-uint8_t readTypeID(std::string filename){
-    FILE* fp = fopen(filename.c_str(),"rb");
-    while (fp==NULL) {
-        std::cerr<<"readTypeID: fail to open file "<<filename<<". Please provide it first. Will retry after 5 seconds."<<std::endl;
-        std::this_thread::sleep_for(std::chrono::seconds(5));
-        fp = fopen(filename.c_str(),"rb");
-    }
-    size_t read_cnt;
-    uint8_t fpTypeid; read_cnt = fread((void*)(&fpTypeid), sizeof(uint8_t), 1, fp);     if (read_cnt!=1) { std::cerr<<"Error at readTypeID: no data type. "<<std::endl; FatalError(__LINE__); }
-    fclose(fp);
-    return fpTypeid;
-}
+    // seen: the last job published before the worker started, which it must not join
+    void loop(unsigned long seen){
+        while (true){
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv_work.wait(lock, [&]{ return stop || generation != seen; });
+                if (stop) return;
+                seen = generation;
+            }
+            work();
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                if (--active == 0) cv_done.notify_one();
+            }
+        }
+    };
+
+    void shutdown(){
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            stop = true;
+        }
+        cv_work.notify_all();
+        for (int t=0;t<workers.size();++t){
+            if (workers[t].joinable()){
+                if (workers[t].get_id() == std::this_thread::get_id()) workers[t].detach();
+                else workers[t].join();
+            }
+        }
+        workers.clear();
+        stop = false;
+    };
 
-template <class T>
-class Tensor{
 public:
-    std::vector<int> dim;
-    T* CPUmem;
-    std::string name;
+    CPUThreadPool(): job(NULL), jobN(0), jobGrain(1), next(0), active(0), generation(0), stop(false){};
 
-    // compile will check if your time is not correct for writeGPU and readGPU
-    void writeGPU(T* GPUmem){
-        cudaMemcpy(GPUmem, CPUmem, numel()*sizeof(T), cudaMemcpyHostToDevice);
+    ~CPUThreadPool(){ shutdown(); };
+
+    int size(){ return workers.size() + 1; };
+
+    void resize(int nThreads){
+        if (nThreads < 1) nThreads = 1;
+        if (nThreads == size()) return;
+        std::lock_guard<std::mutex> owner(busy);
+        shutdown();
+        // no job runs while busy is held, so generation stays put
+        for (int t=1;t<nThreads;++t){
+            workers.push_back(std::thread(&CPUThreadPool::loop, this, generation));
+        }
     };
 
-    void readGPU(T* GPUmem){
-        cudaMemcpy(CPUmem, GPUmem, numel()*sizeof(T), cudaMemcpyDeviceToHost);
+    void run(size_t N, size_t grain, const std::function<void(size_t, size_t)>& fn){
+        if (N == 0) return;
+        if (grain == 0) grain = 1;
+        if (workers.empty() || grain >= N || inside() || !busy.try_lock()){
+            fn(0, N);
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            job = &fn;
+            jobN = N;
+            jobGrain = grain;
+            next = 0;
+            active = workers.size();
+            ++generation;
+        }
+        cv_work.notify_all();
+        work();
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv_done.wait(lock, [&]{ return active == 0; });
+            job = NULL;
+        }
+        busy.unlock();
     };
+};
 
-    Tensor(): CPUmem(NULL){};
+CPUThreadPool& CPUPool(){
+    static CPUThreadPool pool;
+    return pool;
+}
 
-    size_t numel(){ return marvin::numel(dim); };
+// CPU_threads <= 0 means one thread per hardware core
+void setCPUThreads(int CPU_threads){
+    if (CPU_threads <= 0) CPU_threads = std::thread::hardware_concurrency();
+    if (CPU_threads <= 0) CPU_threads = 1;
+    CPUPool().resize(CPU_threads);
+}
 
-    size_t numBytes(){ return sizeof(T)*numel(); };
+// run fn(begin, end) over [0, N) split into chunks of at least grain items
+void CPU_parallel_for(size_t N, const std::function<void(size_t, size_t)>& fn, size_t grain=0){
+    if (grain == 0){
+        grain = N / (size_t(CPUPool().size()) * 4);
+        if (grain == 0) grain = 1;
+    }
+    CPUPool().run(N, grain, fn);
+}
 
-    int numofitems(){ return dim[0]; };
+inline ComputeT CPUValue2ComputeT(const half& x){ return cpu_half2float(x); }
+template <typename T>
+inline ComputeT CPUValue2ComputeT(const T& x){ return ComputeT(x); }
 
-    size_t sizeofitem(){ return marvin::sizeofitem(dim); };
+inline void CPUComputeT2Value(ComputeT x, half& y){ y = cpu_float2half(x); }
+template <typename T>
+inline void CPUComputeT2Value(ComputeT x, T& y){ y = T(x); }
+
+// Bulk type conversion for loading .tensor files: x holds n values of type S at any alignment, y receives
+// them as T. float<->half uses F16C when the host compiler targets it (e.g. -Xcompiler -mf16c), and
+// otherwise branch-free versions of cpu_float2half/cpu_half2float (same rounding, to nearest even) that
+// compilers can vectorize. Other pairs convert through double.
+
+inline uint16_t CPU_float2half_bits(uint32_t f){
+    uint32_t sign = (f >> 16) & 0x8000;
+    f &= 0x7fffffff;
+    // denormal or zero: adding 0.5 lines the half mantissa up with the bottom of the float one
+    float small; memcpy(&small, &f, sizeof(float)); small += 0.5f;
+    uint32_t denorm; memcpy(&denorm, &small, sizeof(float)); denorm -= 0x3f000000;
+    // normal: rebias the exponent and round to nearest even on the 13 dropped bits
+    uint32_t normal = (f + 0xc8000fff + ((f >> 13) & 1)) >> 13;
+    uint32_t h = f >= 0x47800000 ? 0x7c00 : (f < 0x38800000 ? denorm : normal);
+    return f > 0x7f800000 ? uint16_t(0x7fff) : uint16_t(sign | h);
+}
 
-    ~Tensor(){
-        if (CPUmem!=NULL)   delete[] CPUmem;
-    };
+inline uint32_t CPU_half2float_bits(uint16_t h){
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t em = uint32_t(h & 0x7fff) << 13;
+    // scaling by 2^112 rebiases normals and normalizes denormals in one multiplication
+    float v; memcpy(&v, &em, sizeof(float)); v *= 5.192296858534828e33f;
+    uint32_t f; memcpy(&f, &v, sizeof(float));
+    if (em >= (0x7c00u << 13)) return (em & 0x7fe000) ? 0x7fffffff : (sign | 0x7f800000);
+    return sign | f;
+}
 
-    void initialize(T val){
-        for (size_t i=0;i<numel();++i){
-            CPUmem[i]=val;
+inline double CPUValue2Double(const half& x){ return cpu_half2float(x); }
+template <typename S>
+inline double CPUValue2Double(const S& x){ return double(x); }
+
+inline void CPUDouble2Value(double x, half& y){ y = cpu_float2half(float(x)); }
+template <typename T>
+inline void CPUDouble2Value(double x, T& y){ y = T(x); }
+
+template <typename S, typename T>
+void CPU_convert(size_t n, const void* x, T* y){
+    if (std::is_same<S, T>::value){
+        memcpy((void*)y, x, n * sizeof(T));
+        return;
+    }
+    const char* p = (const char*)x;
+    for (size_t i=0;i<n;++i){
+        S v; memcpy(&v, p + i*sizeof(S), sizeof(S));
+        CPUDouble2Value(CPUValue2Double(v), y[i]);
+    }
+}
+
+template <>
+void CPU_convert<float, half>(size_t n, const void* x, half* y){
+    const char* p = (const char*)x;
+    size_t i = 0;
+#if defined(__F16C__)
+    for (; i+8<=n; i+=8){
+        __m256 v = _mm256_loadu_ps((const float*)(p + i*sizeof(float)));
+        _mm_storeu_si128((__m128i*)(y + i), _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+    }
+#endif
+    for (; i<n; ++i){
+        uint32_t f; memcpy(&f, p + i*sizeof(float), sizeof(float));
+        y[i].x = CPU_float2half_bits(f);
+    }
+}
+
+template <>
+void CPU_convert<half, float>(size_t n, const void* x, float* y){
+    const char* p = (const char*)x;
+    size_t i = 0;
+#if defined(__F16C__)
+    for (; i+8<=n; i+=8){
+        __m128i h = _mm_loadu_si128((const __m128i*)(p + i*sizeof(half)));
+        _mm256_storeu_ps(y + i, _mm256_cvtph_ps(h));
+    }
+#endif
+    for (; i<n; ++i){
+        uint16_t h; memcpy(&h, p + i*sizeof(half), sizeof(half));
+        uint32_t f = CPU_half2float_bits(h);
+        memcpy(y + i, &f, sizeof(float));
+    }
+}
+
+// the types Tensor::read converts between: half, float and double
+inline bool CPUConvertible(uint8_t type){ return type <= 2; }
+
+ComputeT CPU_asum(size_t N, const StorageT* x){
+    double r = 0;
+    for (size_t i=0;i<N;++i) r += fabs(CPUStorage2ComputeT(x[i]));
+    return ComputeT(r);
+}
+
+void CPU_Accuracy_MultinomialLogistic(size_t N, int C, int M, size_t wN, const StorageT *pred, const StorageT *label, const StorageT *weight, const StorageT *weightTensor, StorageT *loss){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            int l = int(CPUStorage2ComputeT(label[idx]));
+            size_t baseID = (idx / M) * C * M + idx % M;
+            ComputeT prob = CPUStorage2ComputeT(pred[baseID + l * M]);
+            ComputeT res = 1;
+            for (int d = 0; d < C; ++d){
+                if (CPUStorage2ComputeT(pred[baseID + d * M]) > prob){
+                    res = 0;
+                    break;
+                }
+            }
+            if (weight != NULL) res *= CPUStorage2ComputeT(weight[l]);
+            if (weightTensor != NULL) res *= CPUStorage2ComputeT(weightTensor[idx % wN]);
+            loss[idx] = CPUCompute2StorageT(res);
         }
-    };
+    });
+}
 
-    size_t readHeader(FILE* fp){
-        size_t read_cnt;
-        uint8_t myTypeid = typeID(typeid(T));
-        uint32_t myTypesizeof = uint32_t(sizeof(T));
-        uint8_t fpTypeid;       read_cnt = fread((void*)(&fpTypeid), sizeof(uint8_t), 1, fp);       if (read_cnt!=1) { std::cerr<<"Error at Tensor::readHeader: no data type. "<<std::endl; FatalError(__LINE__); }
-        uint32_t fpTypesizeof;  read_cnt = fread((void*)(&fpTypesizeof), sizeof(uint32_t), 1, fp);  if (read_cnt!=1) { std::cerr<<"Error at Tensor::readHeader: no data size. "<<std::endl; FatalError(__LINE__); }
-        int lenName;
-        read_cnt = fread((void*)(&lenName), sizeof(int), 1, fp);
-        if (read_cnt!=1) { std::cerr<<"Error at Tensor::readHeader: wrong data type. "<<std::endl; FatalError(__LINE__); }
-        name.resize(lenName);
-        if (lenName>0){
-            read_cnt = fread((void*)(name.data()), sizeof(char), lenName, fp);
-            if (read_cnt!=lenName) { std::cerr<<"Error at Tensor::readHeader: wrong data type. "<<std::endl; FatalError(__LINE__); }
+void CPU_Loss_MultinomialLogistic(size_t N, int C, int M, size_t wN, const StorageT* pred, const StorageT* label, const StorageT* weight, const StorageT *weightTensor, StorageT *loss){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            int l = int(CPUStorage2ComputeT(label[idx]));
+            size_t elementID = (idx / M) * C * M + l * M + (idx % M);
+            ComputeT res = log(std::max(CPUStorage2ComputeT(pred[elementID]), ComputeT_MIN));
+            if (weight != NULL) res *= CPUStorage2ComputeT(weight[l]);
+            if (weightTensor != NULL) res *= CPUStorage2ComputeT(weightTensor[elementID % wN]);
+            loss[idx] = CPUCompute2StorageT(res);
+        }
+    });
+}
+
+void CPU_LossGrad_MultinomialLogistic(size_t N, int C, int M, size_t wN, ComputeT scale, const StorageT *pred, const StorageT *label, const StorageT *weight, const StorageT *weightTensor, StorageT *diff){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            int l = int(CPUStorage2ComputeT(label[idx]));
+            size_t elementID = (idx / M) * C * M + l * M + (idx % M);
+            ComputeT prob = std::max(CPUStorage2ComputeT(pred[elementID]), ComputeT_MIN);
+            ComputeT s = scale;
+            if (weight != NULL) s *= CPUStorage2ComputeT(weight[l]);
+            if (weightTensor != NULL) s *= CPUStorage2ComputeT(weightTensor[elementID % wN]);
+            diff[elementID] = CPUCompute2StorageT(CPUStorage2ComputeT(diff[elementID]) + s / prob);
+        }
+    });
+}
+
+void CPU_LossGrad_MultinomialLogistic_StableSoftmax(size_t N, int C, int M, size_t wN, ComputeT scale, const StorageT *pred, const StorageT *label, const StorageT *weight, const StorageT *weightTensor, StorageT *diff){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            int l = int(CPUStorage2ComputeT(label[idx]));
+            size_t baseID = (idx / M) * C * M + idx % M;
+            size_t elementID = baseID + l * M;
+            ComputeT s = scale;
+            if (weight != NULL) s *= CPUStorage2ComputeT(weight[l]);
+            for (int d = 0; d < C; ++d){
+                size_t k = baseID + d * M;
+                ComputeT g = s * CPUStorage2ComputeT(pred[k]);
+                if (weightTensor != NULL) g *= CPUStorage2ComputeT(weightTensor[k % wN]);
+                diff[k] = CPUCompute2StorageT(CPUStorage2ComputeT(diff[k]) + g);
+            }
+            ComputeT g = s;
+            if (weightTensor != NULL) g *= CPUStorage2ComputeT(weightTensor[elementID % wN]);
+            diff[elementID] = CPUCompute2StorageT(CPUStorage2ComputeT(diff[elementID]) - g);
+        }
+    });
+}
+
+void CPU_Loss_SmoothL1(size_t N, const StorageT *pred, const StorageT *target, const StorageT *weight, StorageT *loss){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            ComputeT val = CPUStorage2ComputeT(pred[idx]) - CPUStorage2ComputeT(target[idx]);
+            if (weight != NULL) val *= CPUStorage2ComputeT(weight[idx]);
+            ComputeT abs_val = fabs(val);
+            loss[idx] = CPUCompute2StorageT(abs_val < 1 ? ComputeT(0.5) * val * val : abs_val - ComputeT(0.5));
         }
-        int nbDims;
-        read_cnt = fread((void*)(&nbDims), sizeof(int), 1, fp);
-        if (read_cnt!=1) { std::cerr<<"Error at Tensor::readHeader: wrong data type. "<<std::endl; FatalError(__LINE__); }
-        dim.resize(nbDims);
-        if (nbDims>0){
-            read_cnt = fread((void*)(&dim[0]), sizeof(int), nbDims, fp);
-            if (read_cnt!=nbDims) { std::cerr<<"Error at Tensor::readHeader: wrong data type. "<<std::endl; FatalError(__LINE__); }
+    });
+}
+
+void CPU_LossGrad_SmoothL1(size_t N, ComputeT scale, const StorageT *pred, const StorageT *target, const StorageT *weight, StorageT *diff){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            ComputeT val = CPUStorage2ComputeT(pred[idx]) - CPUStorage2ComputeT(target[idx]);
+            if (weight != NULL) val *= CPUStorage2ComputeT(weight[idx]);
+            ComputeT g = fabs(val) < 1 ? val : ComputeT((ComputeT(0) < val) - (val < ComputeT(0)));
+            diff[idx] = CPUCompute2StorageT(CPUStorage2ComputeT(diff[idx]) + scale * g);
         }
+    });
+}
 
-        size_t headerBytes = sizeof(uint8_t) + sizeof(uint32_t) + sizeof(int) + lenName*sizeof(char) + sizeof(int) + nbDims*sizeof(int);
+void CPU_Loss_EuclideanSSE(size_t N, const StorageT *pred, const StorageT *target, const StorageT *weight, StorageT *loss){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            ComputeT val = CPUStorage2ComputeT(pred[idx]) - CPUStorage2ComputeT(target[idx]);
+            if (weight != NULL) val *= CPUStorage2ComputeT(weight[idx]);
+            loss[idx] = CPUCompute2StorageT(ComputeT(0.5) * val * val);
+        }
+    });
+}
 
-        if (myTypeid!=fpTypeid || myTypesizeof!=fpTypesizeof){
-            std::cerr<<"Error at Tensor::readHeader: wrong data type. "<<std::endl; FatalError(__LINE__);
+void CPU_LossGrad_EuclideanSSE(size_t N, ComputeT scale, const StorageT *pred, const StorageT *target, const StorageT *weight, StorageT *diff){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            ComputeT val = CPUStorage2ComputeT(pred[idx]) - CPUStorage2ComputeT(target[idx]);
+            if (weight != NULL) val *= CPUStorage2ComputeT(weight[idx]);
+            diff[idx] = CPUCompute2StorageT(CPUStorage2ComputeT(diff[idx]) + scale * val);
         }
+    });
+}
 
-        return headerBytes;
-    };
+void CPU_Loss_Contrastive(size_t N, int C, ComputeT margin, const StorageT *a, const StorageT *b, const StorageT *y, StorageT *loss){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            ComputeT d = 0;
+            for (int c = 0; c < C; ++c){
+                ComputeT d_i = CPUStorage2ComputeT(a[idx * C + c]) - CPUStorage2ComputeT(b[idx * C + c]);
+                d += d_i * d_i;
+            }
+            ComputeT y_n = CPUStorage2ComputeT(y[idx]);
+            ComputeT p = std::max(margin - ComputeT(sqrt(d)), ComputeT(0));
+            loss[idx] = CPUCompute2StorageT(ComputeT(0.5) * (y_n * d + (ComputeT(1) - y_n) * p * p));
+        }
+    });
+}
 
-    //support continuous read across many NdTensors
-    T* read(FILE* fp,int batch_size=1){
-        if (CPUmem!=NULL){
-            delete[] CPUmem;
-            CPUmem = NULL;
+void CPU_LossGrad_Contrastive(size_t N, int C, ComputeT margin, ComputeT scale, const StorageT *a, const StorageT *b, const StorageT *y, StorageT *a_diff, StorageT *b_diff){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            ComputeT coeff = scale;
+            if (!(int)(CPUStorage2ComputeT(y[idx]))){
+                ComputeT dist_sq = 0;
+                for (int c = 0; c < C; ++c){
+                    ComputeT diff_i = CPUStorage2ComputeT(a[idx * C + c]) - CPUStorage2ComputeT(b[idx * C + c]);
+                    dist_sq += diff_i * diff_i;
+                }
+                ComputeT dist = sqrt(dist_sq);
+                ComputeT mdist = margin - dist;
+                if (!(mdist > 0)) continue;
+                coeff = -scale * mdist / (dist + ComputeT(1e-4));
+            }
+            for (int c = 0; c < C; ++c){
+                size_t i = idx * C + c;
+                ComputeT beta = coeff * (CPUStorage2ComputeT(a[i]) - CPUStorage2ComputeT(b[i]));
+                if (a_diff != NULL) a_diff[i] = CPUCompute2StorageT(CPUStorage2ComputeT(a_diff[i]) + beta);
+                if (b_diff != NULL) b_diff[i] = CPUCompute2StorageT(CPUStorage2ComputeT(b_diff[i]) - beta);
+            }
         }
+    });
+}
 
-        size_t read_cnt;
+// N values of x laid out as items of sizeofitem: x = (x - mean) * scale - shift in one pass, with mean an item
+// or NULL. Work is split by items across the CPU pool and done in ComputeT blocks, so half storage is converted
+// with the bulk routines and rounded once.
+#define CPU_PREPROCESS_BLOCK 1024
+void CPU_preprocess(size_t N, size_t sizeofitem, StorageT* x, const StorageT* mean, ComputeT scale, ComputeT shift){
+    CPU_parallel_for(N / sizeofitem, [=](size_t begin, size_t end){
+        ComputeT v[CPU_PREPROCESS_BLOCK];
+        ComputeT m[CPU_PREPROCESS_BLOCK];
+        for (size_t item=begin;item<end;++item){
+            for (size_t k=0;k<sizeofitem;k+=CPU_PREPROCESS_BLOCK){
+                size_t n = std::min(size_t(CPU_PREPROCESS_BLOCK), sizeofitem - k);
+                StorageT* d = x + item * sizeofitem + k;
+                CPU_convert<StorageT>(n, d, v);
+                if (mean==NULL){
+                    for (size_t j=0;j<n;++j) v[j] = v[j] * scale - shift;
+                }else{
+                    CPU_convert<StorageT>(n, mean + k, m);
+                    for (size_t j=0;j<n;++j) v[j] = (v[j] - m[j]) * scale - shift;
+                }
+                CPU_convert<ComputeT>(n, v, d);
+            }
+        }
+    }, std::max(size_t(1), size_t(1<<16) / sizeofitem));
+}
 
-        uint8_t myTypeid = typeID(typeid(T));
-        uint32_t myTypesizeof = uint32_t(sizeof(T));
+// One item of a DiskDataLayer batch in a single pass: crop the size_crop window at begin out of an item of
+// size_data = {channels, spatial dims...}, mirror it along the second spatial dimension (the only one for 1-D
+// data), convert it to StorageT and subtract mean (an item of the cropped size, or NULL). Channels are the
+// outer loop and every row of the last dimension is read and written contiguously; a row that needs neither
+// conversion nor mirroring nor mean is a memcpy.
+template <typename T>
+void CPU_crop_mirror_convert_subtract(const std::vector<int>& size_data, const std::vector<int>& size_crop, const int* begin, bool mirror, const T* pIn, const StorageT* pMean, StorageT* pOut){
+    int dims = size_crop.size();
+    int flip = dims>1 ? 1 : 0;
+    int last = dims-1;
+    size_t row = size_crop[last];
+
+    std::vector<size_t> strideIn(dims);
+    strideIn[last] = 1;
+    for (int d=last-1;d>=0;--d) strideIn[d] = strideIn[d+1] * size_data[d+2];
+    size_t channelIn = strideIn[0] * size_data[1];
+
+    // where each output row starts in a channel of the input
+    size_t rows = 1;
+    for (int d=0;d<last;++d) rows *= size_crop[d];
+    std::vector<size_t> rowIn(rows);
+    std::vector<int> pos(dims, 0);
+    for (size_t r=0;r<rows;++r){
+        size_t offset = 0;
+        for (int d=0;d<last;++d){
+            size_t x = begin[d] + pos[d];
+            if (mirror && d==flip) x = size_data[d+1] - 1 - x;
+            offset += x * strideIn[d];
+        }
+        rowIn[r] = offset;
+        for (int d=last-1;d>=0;--d){
+            if (++pos[d] < size_crop[d]) break;
+            pos[d] = 0;
+        }
+    }
 
-        uint8_t fpTypeid;       read_cnt = fread((void*)(&fpTypeid), sizeof(uint8_t), 1, fp);       if (read_cnt!=1) return NULL;
-        uint32_t fpTypesizeof;  read_cnt = fread((void*)(&fpTypesizeof), sizeof(uint32_t), 1, fp);  if (read_cnt!=1) return NULL;
+    bool reverse = mirror && flip==last;
+    size_t first = reverse ? size_data[last+1] - 1 - begin[last] : begin[last];
+    bool copy = std::is_same<T, StorageT>::value && pMean==NULL && !reverse;
+
+    for (int c=0;c<size_data[0];++c){
+        for (size_t r=0;r<rows;++r){
+            const T* src = pIn + c * channelIn + rowIn[r] + first;
+            StorageT* dst = pOut + (c * rows + r) * row;
+            const StorageT* mean = pMean==NULL ? NULL : pMean + (c * rows + r) * row;
+            if (copy){
+                memcpy((void*)dst, (const void*)src, row * sizeof(T));
+            }else if (reverse){
+                if (mean==NULL) for (size_t j=0;j<row;++j) dst[j] = CPUCompute2StorageT(CPUValue2ComputeT(*(src - j)));
+                else            for (size_t j=0;j<row;++j) dst[j] = CPUCompute2StorageT(CPUValue2ComputeT(*(src - j)) - CPUStorage2ComputeT(mean[j]));
+            }else{
+                if (mean==NULL) for (size_t j=0;j<row;++j) dst[j] = CPUCompute2StorageT(CPUValue2ComputeT(src[j]));
+                else            for (size_t j=0;j<row;++j) dst[j] = CPUCompute2StorageT(CPUValue2ComputeT(src[j]) - CPUStorage2ComputeT(mean[j]));
+            }
+        }
+    }
+}
 
-        if (myTypeid!=fpTypeid || myTypesizeof!=fpTypesizeof){
+void CPU_set_value(size_t N, StorageT* dst, StorageT value){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx) dst[idx] = value;
+    });
+}
 
-            if (myTypeid==fpTypeid && myTypesizeof!=fpTypesizeof){ std::cerr<<"Tensor read error: same type but different sizeof, maybe different computer architecture. "<<std::endl; FatalError(__LINE__);}
+void CPU_set_ones(size_t N, StorageT* dst){
+    CPU_set_value(N, dst, CPUCompute2StorageT(1));
+}
 
-            //if (myTypeid!=fpTypeid){ std::cerr<<"Tensor read error: different types. "<<std::endl; FatalError(__LINE__); }
+void CPU_set_zeros(size_t N, StorageT* dst){
+    CPU_set_value(N, dst, CPUCompute2StorageT(0));
+}
 
-            if (myTypeid==typeID(typeid(half)) && fpTypeid==typeID(typeid(float))){
-                //std::cout<<std::endl<<"converting from float to half"<<std::endl;
-                fseek(fp, -(sizeof(uint8_t)+sizeof(uint32_t)), SEEK_CUR);
-                Tensor<float>* floatTensor = new Tensor<float>(fp);
-                this->dim  = floatTensor->dim ;
-                this->name = floatTensor->name;
-                Malloc(batch_size);
-                for(size_t i=0; i<numel(); ++i){
-                    half v = cpu_float2half(floatTensor->CPUmem[i]);
-                    memcpy(((half*)(CPUmem))+i,&v,sizeof(half));
-                }
-                delete floatTensor;
-            }else if (myTypeid==typeID(typeid(float)) && fpTypeid==typeID(typeid(half))){
-                fseek(fp, -(sizeof(uint8_t)+sizeof(uint32_t)), SEEK_CUR);
-                Tensor<half>* halfTensor = new Tensor<half>(fp);
-                this->dim  = halfTensor->dim ;
-                this->name = halfTensor->name;
-                Malloc(batch_size);
-                for(size_t i=0; i<numel(); ++i){
-                    float v = cpu_half2float(halfTensor->CPUmem[i]);
-                    memcpy(((float*)(CPUmem))+i,&v,sizeof(float));
-                }
-                delete halfTensor;
-            }else if (myTypeid==typeID(typeid(double)) && fpTypeid==typeID(typeid(float))){
-                fseek(fp, -(sizeof(uint8_t)+sizeof(uint32_t)), SEEK_CUR);
-                Tensor<float>* floatTensor = new Tensor<float>(fp);
-                this->dim  = floatTensor->dim ;
-                this->name = floatTensor->name;
-                Malloc(batch_size);
-                for(size_t i=0; i<numel(); ++i){
-                    double v = double(floatTensor->CPUmem[i]);
-                    memcpy(((double*)(CPUmem))+i,&v,sizeof(double));
-                }
-                delete floatTensor;
-            }else if (myTypeid==typeID(typeid(float)) && fpTypeid==typeID(typeid(double))){
+void CPU_set_one_hot(size_t N, StorageT* dst, size_t idx2hot){
+    CPU_set_zeros(N, dst);
+    if (idx2hot < N) dst[idx2hot] = CPUCompute2StorageT(1);
+}
+
+void CPU_elementwise_multiplication(size_t N, StorageT* dst, const StorageT* srcA, const StorageT* srcB){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx) dst[idx] = CPUCompute2StorageT(CPUStorage2ComputeT(srcA[idx]) * CPUStorage2ComputeT(srcB[idx]));
+    });
+}
+
+void CPU_elementwise_comparison(size_t N, StorageT* dst, const StorageT* srcA, const StorageT* srcB){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            bool equal = bool(CPUStorage2ComputeT(dst[idx])) && (CPUStorage2ComputeT(srcA[idx]) == CPUStorage2ComputeT(srcB[idx]));
+            dst[idx] = CPUCompute2StorageT(ComputeT(equal));
+        }
+    });
+}
+
+void CPU_elementwise_acc(size_t N, StorageT* dst, const StorageT* src){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx) dst[idx] = CPUCompute2StorageT(CPUStorage2ComputeT(dst[idx]) + CPUStorage2ComputeT(src[idx]));
+    });
+}
+
+void CPU_xpy(size_t N, const StorageT* x, StorageT* y){
+    CPU_elementwise_acc(N, y, x);
+}
+
+void CPU_bsa2b(size_t N, const StorageT* a, StorageT* b){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx) b[idx] = CPUCompute2StorageT(CPUStorage2ComputeT(b[idx]) - CPUStorage2ComputeT(a[idx]));
+    });
+}
+
+void CPU_maxElement(size_t N, const StorageT *x, size_t* cpuMaxID, ComputeT* cpuMaxValue){
+    ComputeT maxValue = CPUStorage2ComputeT(x[0]);
+    size_t maxID = 0;
+    for (size_t i=1;i<N;++i){
+        ComputeT v = CPUStorage2ComputeT(x[i]);
+        if (v > maxValue){
+            maxValue = v;
+            maxID = i;
+        }
+    }
+    if (cpuMaxID!=NULL)    *cpuMaxID = maxID;
+    if (cpuMaxValue!=NULL) *cpuMaxValue = maxValue;
+}
+
+void CPU_copyforward(size_t N, const StorageT* in, StorageT* out, int sizeofitem_in, int sizeofitem_out, int offset){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            memcpy(out + idx*sizeofitem_out + offset, in + idx*sizeofitem_in, sizeofitem_in * sizeofStorageT);
+        }
+    }, 1);
+}
+
+void CPU_copybackward(size_t N, StorageT* in, const StorageT* out, int sizeofitem_in, int sizeofitem_out, int offset){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            StorageT* pIn = in + idx*sizeofitem_in;
+            const StorageT* pOut = out + idx*sizeofitem_out + offset;
+            for (int i=0;i<sizeofitem_in;++i) pIn[i] = CPUCompute2StorageT(CPUStorage2ComputeT(pIn[i]) + CPUStorage2ComputeT(pOut[i]));
+        }
+    }, 1);
+}
+
+// N-D version of Kernel_ROIforward_* / Kernel_ROIbackward_*: od and id are the dimensions without the batch
+void CPU_ROI(size_t N, StorageT* out, StorageT* in, const StorageT* start, std::vector<int> od, std::vector<int> id, bool forward){
+    int K = od.size();
+    size_t spel = numel(od);
+    CPU_parallel_for(N/spel, [&](size_t begin, size_t end){
+        std::vector<int> offset(K);
+        for (size_t n = begin; n < end; ++n){
+            for (int k=0;k<K;++k) offset[k] = int(CPUStorage2ComputeT(start[n*K+k]));
+            for (size_t s = 0; s < spel; ++s){
+                size_t rem = s;
+                size_t i = 0;
+                size_t stride = 1;
+                for (int k=K-1;k>=0;--k){
+                    i += (rem % od[k] + offset[k]) * stride;
+                    rem /= od[k];
+                    stride *= id[k];
+                }
+                i += n * stride;
+                size_t o = n * spel + s;
+                if (forward) out[o] = in[i];
+                else         in[i] = CPUCompute2StorageT(CPUStorage2ComputeT(in[i]) + CPUStorage2ComputeT(out[o]));
+            }
+        }
+    }, 1);
+}
+
+void CPU_CoeffElementWiseSum(size_t N, bool accumulate, const ComputeT coeff, const StorageT* coeff_data, const size_t num_offset, const size_t dim, const StorageT* in, StorageT* out){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            const ComputeT final_coeff = coeff_data ? (CPUStorage2ComputeT(coeff_data[num_offset + idx / dim]) * coeff) : coeff;
+            ComputeT v = CPUStorage2ComputeT(in[idx]) * final_coeff;
+            if (accumulate) v += CPUStorage2ComputeT(out[idx]);
+            out[idx] = CPUCompute2StorageT(v);
+        }
+    });
+}
+
+// Fast-RCNN style ROI max pooling for 2D (rois of 5 values) and 3D (rois of 7 values)
+void CPU_ROIPoolForward(size_t num_rois, const StorageT* in_data, const StorageT* in_rois, StorageT* out_data, size_t* argmax_data, const ComputeT spatial_scale, const int channels, std::vector<int> in_spatial, std::vector<int> pooled){
+    int K = in_spatial.size();
+    size_t in_spel = numel(in_spatial);
+    size_t out_spel = numel(pooled);
+    CPU_parallel_for(num_rois * channels, [&](size_t begin, size_t end){
+        std::vector<int> lo(K), hi(K), p(K), x(K);
+        std::vector<int> roi_start(K);
+        std::vector<ComputeT> bin_size(K);
+        for (size_t nc = begin; nc < end; ++nc){
+            size_t n = nc / channels;
+            int c = nc % channels;
+            const StorageT* roi = in_rois + n * (1 + 2 * K);
+            int roi_batch_ind = CPUStorage2ComputeT(roi[0]);
+            for (int k=0;k<K;++k){
+                roi_start[k] = round(CPUStorage2ComputeT(roi[1+2*k]) * spatial_scale);
+                int roi_end  = round(CPUStorage2ComputeT(roi[2+2*k]) * spatial_scale);
+                // Force malformed ROIs to be 1x1
+                bin_size[k] = ComputeT(std::max(roi_end - roi_start[k] + 1, 1)) / ComputeT(pooled[k]);
+            }
+            size_t in_offset = (size_t(roi_batch_ind) * channels + c) * in_spel;
+            for (size_t o = 0; o < out_spel; ++o){
+                size_t rem = o;
+                bool is_empty = false;
+                for (int k=K-1;k>=0;--k){
+                    p[k] = rem % pooled[k];
+                    rem /= pooled[k];
+                    lo[k] = std::min(std::max(int(floor(ComputeT(p[k]) * bin_size[k])) + roi_start[k], 0), in_spatial[k]);
+                    hi[k] = std::min(std::max(int(ceil(ComputeT(p[k] + 1) * bin_size[k])) + roi_start[k], 0), in_spatial[k]);
+                    is_empty = is_empty || (hi[k] <= lo[k]);
+                }
+                // Define an empty pooling region to be zero
+                ComputeT maxval = is_empty ? 0 : -FLT_MAX;
+                size_t maxidx = SIZE_MAX;
+                if (!is_empty){
+                    x = lo;
+                    while (true){
+                        size_t in_index = 0;
+                        for (int k=0;k<K;++k) in_index = in_index * in_spatial[k] + x[k];
+                        in_index += in_offset;
+                        ComputeT v = CPUStorage2ComputeT(in_data[in_index]);
+                        if (v > maxval){
+                            maxval = v;
+                            maxidx = in_index;
+                        }
+                        int k = K-1;
+                        while (k>=0 && ++x[k]==hi[k]){ x[k] = lo[k]; --k; }
+                        if (k<0) break;
+                    }
+                }
+                out_data[nc * out_spel + o] = CPUCompute2StorageT(maxval);
+                if (argmax_data!=NULL) argmax_data[nc * out_spel + o] = maxidx;
+            }
+        }
+    }, 1);
+}
+
+// scatter the pooled gradients back to the recorded argmax; every input channel is owned by one task
+void CPU_ROIPoolBackward(size_t num_rois, StorageT* in_diff, const StorageT* out_diff, const size_t* argmax_data, const int channels, size_t out_spel){
+    CPU_parallel_for(channels, [&](size_t begin, size_t end){
+        for (size_t c = begin; c < end; ++c){
+            for (size_t n = 0; n < num_rois; ++n){
+                size_t base = (n * channels + c) * out_spel;
+                for (size_t o = 0; o < out_spel; ++o){
+                    size_t i = argmax_data[base + o];
+                    if (i == SIZE_MAX) continue;
+                    in_diff[i] = CPUCompute2StorageT(CPUStorage2ComputeT(in_diff[i]) + CPUStorage2ComputeT(out_diff[base + o]));
+                }
+            }
+        }
+    }, 1);
+}
+
+void CPU_update_solver(SolverAlgorithm solver, Regularizer regularizer, int iter, size_t N, int nNets, ComputeT decay, ComputeT momentum, ComputeT momentum2, ComputeT delta, ComputeT rms_decay, ComputeT lr, const StorageT* weights, StorageT* gradients){
+    ComputeT adam_lr = lr * sqrt(1-pow(momentum2,iter+1)) / (1-pow(momentum,iter+1));
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            ComputeT w = CPUStorage2ComputeT(weights[idx]);
+            ComputeT u = CPUStorage2ComputeT(gradients[idx]);
+            size_t h_idx  = N*(nNets+1)+idx;
+            size_t h2_idx = N*(nNets+2)+idx;
+            ComputeT g;
+            if (regularizer==L1)    g = (w>0) ? decay : ((w<0) ? -decay : 0);
+            else                    g = decay * w;
+            for (int k=1; k<nNets+1; ++k) g += CPUStorage2ComputeT(gradients[N*k+idx]);
+            ComputeT h, h2, t;
+            switch (solver){
+                case SGD:
+                    gradients[idx] = CPUCompute2StorageT(momentum * u + lr * g);
+                    break;
+                case AdaDelta:
+                    h  = CPUStorage2ComputeT(gradients[h_idx]);
+                    h2 = CPUStorage2ComputeT(gradients[h2_idx]);
+                    h = momentum * h + (1-momentum)*g*g;
+                    g = g * sqrt( (delta+h2) / (delta+h) );
+                    h2= momentum * h2+ (1-momentum)*g*g;
+                    gradients[h_idx]  = CPUCompute2StorageT(h);
+                    gradients[h2_idx] = CPUCompute2StorageT(h2);
+                    gradients[idx] = CPUCompute2StorageT(lr * g);
+                    break;
+                case AdaGrad:
+                    h = CPUStorage2ComputeT(gradients[h_idx]) + g * g;
+                    gradients[h_idx] = CPUCompute2StorageT(h);
+                    gradients[idx] = CPUCompute2StorageT(momentum * u + lr * g / (sqrt(h) + delta));
+                    break;
+                case Adam:
+                    h  = CPUStorage2ComputeT(gradients[h_idx]);
+                    h2 = CPUStorage2ComputeT(gradients[h2_idx]);
+                    h = momentum * h + (1-momentum )*g;
+                    h2= momentum2* h2+ (1-momentum2)*g*g;
+                    gradients[h_idx]  = CPUCompute2StorageT(h);
+                    gradients[h2_idx] = CPUCompute2StorageT(h2);
+                    gradients[idx] = CPUCompute2StorageT(adam_lr * h / (sqrt(h2) + delta));
+                    break;
+                case NAG:
+                    h = CPUStorage2ComputeT(gradients[h_idx]);
+                    t = h;
+                    h = momentum * h + lr * g;
+                    gradients[h_idx] = CPUCompute2StorageT(h);
+                    gradients[idx] = CPUCompute2StorageT((1+momentum) * h - momentum * t);
+                    break;
+                case RMSprop:
+                    h = CPUStorage2ComputeT(gradients[h_idx]);
+                    h = rms_decay * h + (1-rms_decay) * g * g;
+                    gradients[h_idx] = CPUCompute2StorageT(h);
+                    gradients[idx] = CPUCompute2StorageT(lr * g / (sqrt(h) + delta));
+                    break;
+            }
+        }
+    });
+}
+
+// Packed-panel GEMM for the CPU backend (the BLIS/GotoBLAS loop structure):
+// C is split into MCxNC tiles processed in parallel; for every KC slice of the inner dimension a tile
+// packs its block of op(A) into MR-row panels and its block of op(B) into NR-column panels, converting
+// StorageT to ComputeT on the way, and an MRxNR register-blocked micro-kernel accumulates the product
+// into a ComputeT copy of the tile. C is only touched once per tile (alpha, beta and the conversion
+// back to StorageT), so half storage is accumulated in float over the whole inner dimension.
+//
+// The micro-kernel uses AVX-512 or AVX2+FMA when the host compiler targets them
+// (e.g. nvcc -Xcompiler -march=native) and a portable version that compilers auto-vectorize otherwise.
+
+#if defined(__AVX512F__) && DATATYPE!=2
+    #define CPU_GEMM_MR 32
+    #define CPU_GEMM_NR 8
+#elif defined(__AVX2__) && defined(__FMA__) && DATATYPE!=2
+    #define CPU_GEMM_MR 16
+    #define CPU_GEMM_NR 6
+#else
+    #define CPU_GEMM_MR 8
+    #define CPU_GEMM_NR 4
+#endif
+#define CPU_GEMM_MC (CPU_GEMM_MR*8)
+#define CPU_GEMM_NC (CPU_GEMM_NR*16)
+#define CPU_GEMM_KC 256
+
+// c[MR x NR] (column-major, leading dimension ldc) = (first ? 0 : c) + a_panel * b_panel over kc
+inline void CPU_gemm_micro(int kc, const ComputeT* a, const ComputeT* b, ComputeT* c, int ldc, bool first){
+#if defined(__AVX512F__) && DATATYPE!=2
+    __m512 c0[CPU_GEMM_NR], c1[CPU_GEMM_NR];
+    for (int j=0;j<CPU_GEMM_NR;++j){
+        c0[j] = first ? _mm512_setzero_ps() : _mm512_loadu_ps(c + j*ldc);
+        c1[j] = first ? _mm512_setzero_ps() : _mm512_loadu_ps(c + j*ldc + 16);
+    }
+    for (int l=0;l<kc;++l){
+        __m512 a0 = _mm512_loadu_ps(a);
+        __m512 a1 = _mm512_loadu_ps(a + 16);
+        for (int j=0;j<CPU_GEMM_NR;++j){
+            __m512 bj = _mm512_set1_ps(b[j]);
+            c0[j] = _mm512_fmadd_ps(a0, bj, c0[j]);
+            c1[j] = _mm512_fmadd_ps(a1, bj, c1[j]);
+        }
+        a += CPU_GEMM_MR;
+        b += CPU_GEMM_NR;
+    }
+    for (int j=0;j<CPU_GEMM_NR;++j){
+        _mm512_storeu_ps(c + j*ldc,      c0[j]);
+        _mm512_storeu_ps(c + j*ldc + 16, c1[j]);
+    }
+#elif defined(__AVX2__) && defined(__FMA__) && DATATYPE!=2
+    __m256 c0[CPU_GEMM_NR], c1[CPU_GEMM_NR];
+    for (int j=0;j<CPU_GEMM_NR;++j){
+        c0[j] = first ? _mm256_setzero_ps() : _mm256_loadu_ps(c + j*ldc);
+        c1[j] = first ? _mm256_setzero_ps() : _mm256_loadu_ps(c + j*ldc + 8);
+    }
+    for (int l=0;l<kc;++l){
+        __m256 a0 = _mm256_loadu_ps(a);
+        __m256 a1 = _mm256_loadu_ps(a + 8);
+        for (int j=0;j<CPU_GEMM_NR;++j){
+            __m256 bj = _mm256_broadcast_ss(b + j);
+            c0[j] = _mm256_fmadd_ps(a0, bj, c0[j]);
+            c1[j] = _mm256_fmadd_ps(a1, bj, c1[j]);
+        }
+        a += CPU_GEMM_MR;
+        b += CPU_GEMM_NR;
+    }
+    for (int j=0;j<CPU_GEMM_NR;++j){
+        _mm256_storeu_ps(c + j*ldc,     c0[j]);
+        _mm256_storeu_ps(c + j*ldc + 8, c1[j]);
+    }
+#else
+    ComputeT acc[CPU_GEMM_NR][CPU_GEMM_MR];
+    for (int j=0;j<CPU_GEMM_NR;++j)
+        for (int i=0;i<CPU_GEMM_MR;++i) acc[j][i] = first ? ComputeT(0) : c[i + j*ldc];
+    for (int l=0;l<kc;++l){
+        for (int j=0;j<CPU_GEMM_NR;++j){
+            const ComputeT bj = b[j];
+            for (int i=0;i<CPU_GEMM_MR;++i) acc[j][i] += a[i] * bj;
+        }
+        a += CPU_GEMM_MR;
+        b += CPU_GEMM_NR;
+    }
+    for (int j=0;j<CPU_GEMM_NR;++j)
+        for (int i=0;i<CPU_GEMM_MR;++i) c[i + j*ldc] = acc[j][i];
+#endif
+}
+
+// pack op(A)[i0:i0+mc, l0:l0+kc] into MR-row panels, zero padded to a multiple of MR
+template <typename T>
+inline void CPU_gemm_packA(cublasOperation_t transa, const T* A, int lda, int i0, int mc, int l0, int kc, ComputeT* Ap){
+    for (int p=0;p<mc;p+=CPU_GEMM_MR){
+        const int mr = std::min(CPU_GEMM_MR, mc - p);
+        for (int l=0;l<kc;++l){
+            for (int r=0;r<mr;++r){
+                const size_t i = i0 + p + r, ll = l0 + l;
+                *Ap++ = CPUValue2ComputeT(transa==CUBLAS_OP_N ? A[i + ll*size_t(lda)] : A[ll + i*size_t(lda)]);
+            }
+            for (int r=mr;r<CPU_GEMM_MR;++r) *Ap++ = ComputeT(0);
+        }
+    }
+}
+
+// pack op(B)[l0:l0+kc, j0:j0+nc] into NR-column panels, zero padded to a multiple of NR
+template <typename T>
+inline void CPU_gemm_packB(cublasOperation_t transb, const T* B, int ldb, int l0, int kc, int j0, int nc, ComputeT* Bp){
+    for (int q=0;q<nc;q+=CPU_GEMM_NR){
+        const int nr = std::min(CPU_GEMM_NR, nc - q);
+        for (int l=0;l<kc;++l){
+            for (int s=0;s<nr;++s){
+                const size_t j = j0 + q + s, ll = l0 + l;
+                *Bp++ = CPUValue2ComputeT(transb==CUBLAS_OP_N ? B[ll + j*size_t(ldb)] : B[j + ll*size_t(ldb)]);
+            }
+            for (int s=nr;s<CPU_GEMM_NR;++s) *Bp++ = ComputeT(0);
+        }
+    }
+}
+
+// C = alpha * op(A) * op(B) + beta * C in column-major order, with the same arguments as cublas<t>gemm.
+// As in cuBLAS, C is not read when beta is zero. T is StorageT for the layers, or ComputeT for intermediate buffers.
+template <typename T>
+void CPU_gemm(cublasOperation_t transa, cublasOperation_t transb, int m, int n, int k, const ComputeT *alpha, const T *A, int lda, const T *B, int ldb, const ComputeT *beta, T *C, int ldc){
+    if (m <= 0 || n <= 0) return;
+    const ComputeT a = *alpha;
+    const ComputeT b = *beta;
+    const int tilesM = (m + CPU_GEMM_MC - 1) / CPU_GEMM_MC;
+    const int tilesN = (n + CPU_GEMM_NC - 1) / CPU_GEMM_NC;
+
+    CPU_parallel_for(size_t(tilesM) * tilesN, [&](size_t begin, size_t end){
+        static thread_local std::vector<ComputeT> Ap, Bp, Ct;
+        Ap.resize(CPU_GEMM_MC * CPU_GEMM_KC);
+        Bp.resize(CPU_GEMM_KC * CPU_GEMM_NC);
+        Ct.resize(CPU_GEMM_MC * CPU_GEMM_NC);
+        for (size_t t = begin; t < end; ++t){
+            const int i0 = (t % tilesM) * CPU_GEMM_MC;
+            const int j0 = (t / tilesM) * CPU_GEMM_NC;
+            const int mc = std::min(CPU_GEMM_MC, m - i0);
+            const int nc = std::min(CPU_GEMM_NC, n - j0);
+
+            if (k <= 0) std::fill(Ct.begin(), Ct.end(), ComputeT(0));
+            for (int l0 = 0; l0 < k; l0 += CPU_GEMM_KC){
+                const int kc = std::min(CPU_GEMM_KC, k - l0);
+                CPU_gemm_packA(transa, A, lda, i0, mc, l0, kc, &Ap[0]);
+                CPU_gemm_packB(transb, B, ldb, l0, kc, j0, nc, &Bp[0]);
+                for (int q = 0; q < nc; q += CPU_GEMM_NR){
+                    for (int p = 0; p < mc; p += CPU_GEMM_MR){
+                        CPU_gemm_micro(kc, &Ap[size_t(p) * kc], &Bp[size_t(q) * kc], &Ct[p + size_t(q) * CPU_GEMM_MC], CPU_GEMM_MC, l0 == 0);
+                    }
+                }
+            }
+
+            for (int j = 0; j < nc; ++j){
+                T* Ccol = C + i0 + (j0 + j) * size_t(ldc);
+                const ComputeT* acc = &Ct[size_t(j) * CPU_GEMM_MC];
+                if (b == 0) for (int i = 0; i < mc; ++i) CPUComputeT2Value(a * acc[i], Ccol[i]);
+                else        for (int i = 0; i < mc; ++i) CPUComputeT2Value(a * acc[i] + b * CPUValue2ComputeT(Ccol[i]), Ccol[i]);
+            }
+        }
+    }, 1);
+}
+
+// CPU convolution engines:
+//   direct: slides each filter tap over the input rows, best for few channels per group (e.g. the first layer, depthwise)
+//   im2col: unrolls the receptive fields of a group into a (C/group*window) x out matrix and calls CPU_gemm
+//   1x1:    unit window, unit stride and no padding, where the input already is that matrix
+//   winograd: forward only, for 2D 3x3 windows with unit stride and upscale (requested with "fwdAlgo": "winograd")
+enum CPUConvAlgo { CPUConvAuto, CPUConvDirect, CPUConvIm2col, CPUConv1x1, CPUConvWinograd };
+
+// the largest im2col buffer (in StorageT elements) a worker may allocate before falling back to direct
+#define CPU_CONV_COL_MAX (size_t(64)*1024*1024)
+
+// Geometry of an N-D grouped convolution in NC[spatial] layout, used by Convolution and Deconvolution
+class CPUConvGeometry{
+public:
+    int N;      // batch size
+    int C;      // input channels
+    int K;      // output channels
+    int group;
+    std::vector<int> in, out, window, stride, padding, upscale;
+    size_t in_spel, out_spel, window_spel;
+    size_t out_item;    // elements between the items of y and dy: K*out_spel, unless they are a slice of a larger response
+    CPUConvAlgo algo;
+
+    CPUConvGeometry(){};
+
+    CPUConvGeometry(const std::vector<int>& dimIn, const std::vector<int>& dimOut, const std::vector<int>& window_, const std::vector<int>& stride_, const std::vector<int>& padding_, const std::vector<int>& upscale_, int group_):
+        group(group_), window(window_), stride(stride_), padding(padding_), upscale(upscale_){
+        N = dimIn[0];
+        C = dimIn[1];
+        K = dimOut[1];
+        in  = std::vector<int>(dimIn.begin()+2,  dimIn.end());
+        out = std::vector<int>(dimOut.begin()+2, dimOut.end());
+        in_spel = numel(in);
+        out_spel = numel(out);
+        window_spel = numel(window);
+        out_item = size_t(K) * out_spel;
+        algo = choose();
+    };
+
+    // where channel k of item n starts in y or dy
+    size_t outAt(size_t n, size_t k) const{ return n * out_item + k * out_spel; };
+
+    bool isPointwise() const{
+        for (int d=0;d<in.size();++d){
+            if (window[d]!=1 || stride[d]!=1 || padding[d]!=0) return false;
+        }
+        return true;
+    };
+
+    bool fitsWinograd() const{
+        return in.size()==2 && window[0]==3 && window[1]==3 && stride[0]==1 && stride[1]==1 &&
+               upscale[0]==1 && upscale[1]==1 && C / group >= 4 && K / group >= 4;
+    };
+
+    // use Winograd for the forward pass when the geometry allows it, keeping the current choice otherwise
+    void preferWinograd(){
+        if (fitsWinograd()) algo = CPUConvWinograd;
+    };
+
+    CPUConvAlgo choose() const{
+        if (isPointwise()) return CPUConv1x1;
+        const size_t rows = size_t(C / group) * window_spel;
+        // GEMM only pays off once both the reduction and the number of filters per group are big enough
+        if (rows < 16 || K / group < 4 || rows * out_spel > CPU_CONV_COL_MAX) return CPUConvDirect;
+        return CPUConvIm2col;
+    };
+
+    // Visit every output row (all spatial dimensions but the last) that a filter tap reads from a valid input row.
+    // f(out_row, in_row, lo, hi): output o in [lo,hi) on the last dimension reads input in_row + o*stride.
+    template <typename F>
+    void tapRows(size_t tap, F f) const{
+        int S = out.size();
+        int t[8], lo[8], hi[8], o[8];
+        size_t rem = tap;
+        for (int d=S-1;d>=0;--d){ t[d] = rem % window[d]; rem /= window[d]; }
+        for (int d=0;d<S;++d){
+            // valid o: 0 <= o*stride - padding + t*upscale < in
+            int shift = t[d]*upscale[d] - padding[d];
+            lo[d] = shift >= 0 ? 0 : (-shift + stride[d] - 1) / stride[d];
+            hi[d] = in[d] - shift <= 0 ? 0 : std::min(out[d], (in[d] - shift - 1) / stride[d] + 1);
+            if (lo[d] >= hi[d]) return;
+        }
+        int last = S-1;
+        ptrdiff_t lastShift = t[last]*upscale[last] - padding[last];
+        for (int d=0;d<last;++d) o[d] = lo[d];
+        while (true){
+            ptrdiff_t out_row = 0, in_row = 0;
+            for (int d=0;d<last;++d){
+                out_row = out_row * out[d] + o[d];
+                in_row  = in_row  * in[d]  + (o[d]*stride[d] - padding[d] + t[d]*upscale[d]);
+            }
+            f(out_row * out[last], in_row * in[last] + lastShift, lo[last], hi[last]);
+            int d = last-1;
+            while (d>=0 && ++o[d]==hi[d]){ o[d] = lo[d]; --d; }
+            if (d<0) break;
+        }
+    };
+};
+
+// y (N,K,out) = conv(x (N,C,in), w (K,C/group,window)); overwrite or accumulate into y
+void CPU_conv_forward_direct(const CPUConvGeometry& g, const StorageT* x, const StorageT* w, StorageT* y, bool accumulate){
+    const int Cg = g.C / g.group;
+    const int Kg = g.K / g.group;
+    const int sLast = g.stride.back();
+    CPU_parallel_for(size_t(g.N) * g.K, [&](size_t begin, size_t end){
+        std::vector<ComputeT> acc(g.out_spel);
+        std::vector<ComputeT> xin(g.in_spel);
+        for (size_t nk = begin; nk < end; ++nk){
+            int n = nk / g.K;
+            int k = nk % g.K;
+            int c0 = (k / Kg) * Cg;
+            std::fill(acc.begin(), acc.end(), ComputeT(0));
+            for (int cg = 0; cg < Cg; ++cg){
+                const StorageT* xc = x + (size_t(n) * g.C + c0 + cg) * g.in_spel;
+                for (size_t i = 0; i < g.in_spel; ++i) xin[i] = CPUStorage2ComputeT(xc[i]);
+                const StorageT* wkc = w + (size_t(k) * Cg + cg) * g.window_spel;
+                for (size_t tap = 0; tap < g.window_spel; ++tap){
+                    const ComputeT wv = CPUStorage2ComputeT(wkc[tap]);
+                    if (wv == 0) continue;
+                    g.tapRows(tap, [&](ptrdiff_t out_row, ptrdiff_t in_row, int lo, int hi){
+                        ComputeT* a = &acc[out_row];
+                        const ComputeT* xi = &xin[0] + in_row;
+                        if (sLast == 1) for (int o = lo; o < hi; ++o) a[o] += wv * xi[o];
+                        else            for (int o = lo; o < hi; ++o) a[o] += wv * xi[o * sLast];
+                    });
+                }
+            }
+            StorageT* yk = y + g.outAt(n, k);
+            if (accumulate) for (size_t i = 0; i < g.out_spel; ++i) yk[i] = CPUCompute2StorageT(CPUStorage2ComputeT(yk[i]) + acc[i]);
+            else            for (size_t i = 0; i < g.out_spel; ++i) yk[i] = CPUCompute2StorageT(acc[i]);
+        }
+    }, 1);
+}
+
+// dx (N,C,in) = conv^T(dy (N,K,out), w); overwrite or accumulate into dx
+void CPU_conv_backward_data_direct(const CPUConvGeometry& g, const StorageT* w, const StorageT* dy, StorageT* dx, bool accumulate){
+    const int Cg = g.C / g.group;
+    const int Kg = g.K / g.group;
+    const int sLast = g.stride.back();
+    CPU_parallel_for(size_t(g.N) * g.C, [&](size_t begin, size_t end){
+        std::vector<ComputeT> acc(g.in_spel);
+        std::vector<ComputeT> dyk(g.out_spel);
+        for (size_t nc = begin; nc < end; ++nc){
+            int n = nc / g.C;
+            int c = nc % g.C;
+            int grp = c / Cg;
+            int cg = c % Cg;
+            std::fill(acc.begin(), acc.end(), ComputeT(0));
+            for (int k = grp * Kg; k < (grp + 1) * Kg; ++k){
+                const StorageT* dyp = dy + g.outAt(n, k);
+                for (size_t i = 0; i < g.out_spel; ++i) dyk[i] = CPUStorage2ComputeT(dyp[i]);
+                const StorageT* wkc = w + (size_t(k) * Cg + cg) * g.window_spel;
+                for (size_t tap = 0; tap < g.window_spel; ++tap){
+                    const ComputeT wv = CPUStorage2ComputeT(wkc[tap]);
+                    if (wv == 0) continue;
+                    g.tapRows(tap, [&](ptrdiff_t out_row, ptrdiff_t in_row, int lo, int hi){
+                        const ComputeT* d = &dyk[out_row];
+                        ComputeT* a = &acc[0] + in_row;
+                        if (sLast == 1) for (int o = lo; o < hi; ++o) a[o] += wv * d[o];
+                        else            for (int o = lo; o < hi; ++o) a[o * sLast] += wv * d[o];
+                    });
+                }
+            }
+            StorageT* dxc = dx + nc * g.in_spel;
+            if (accumulate) for (size_t i = 0; i < g.in_spel; ++i) dxc[i] = CPUCompute2StorageT(CPUStorage2ComputeT(dxc[i]) + acc[i]);
+            else            for (size_t i = 0; i < g.in_spel; ++i) dxc[i] = CPUCompute2StorageT(acc[i]);
+        }
+    }, 1);
+}
+
+// dw (K,C/group,window) = correlation of x (N,C,in) with dy (N,K,out); overwrite or accumulate into dw
+void CPU_conv_backward_filter_direct(const CPUConvGeometry& g, const StorageT* x, const StorageT* dy, StorageT* dw, bool accumulate){
+    const int Cg = g.C / g.group;
+    const int Kg = g.K / g.group;
+    const int sLast = g.stride.back();
+    CPU_parallel_for(size_t(g.K) * Cg, [&](size_t begin, size_t end){
+        std::vector<ComputeT> acc(g.window_spel);
+        std::vector<ComputeT> xin(g.in_spel);
+        std::vector<ComputeT> dyk(g.out_spel);
+        for (size_t kc = begin; kc < end; ++kc){
+            int k = kc / Cg;
+            int c = (k / Kg) * Cg + kc % Cg;
+            std::fill(acc.begin(), acc.end(), ComputeT(0));
+            for (int n = 0; n < g.N; ++n){
+                const StorageT* xc = x + (size_t(n) * g.C + c) * g.in_spel;
+                for (size_t i = 0; i < g.in_spel; ++i) xin[i] = CPUStorage2ComputeT(xc[i]);
+                const StorageT* dyp = dy + g.outAt(n, k);
+                for (size_t i = 0; i < g.out_spel; ++i) dyk[i] = CPUStorage2ComputeT(dyp[i]);
+                for (size_t tap = 0; tap < g.window_spel; ++tap){
+                    ComputeT s = 0;
+                    g.tapRows(tap, [&](ptrdiff_t out_row, ptrdiff_t in_row, int lo, int hi){
+                        const ComputeT* d = &dyk[out_row];
+                        const ComputeT* xi = &xin[0] + in_row;
+                        if (sLast == 1) for (int o = lo; o < hi; ++o) s += d[o] * xi[o];
+                        else            for (int o = lo; o < hi; ++o) s += d[o] * xi[o * sLast];
+                    });
+                    acc[tap] += s;
+                }
+            }
+            StorageT* dwp = dw + kc * g.window_spel;
+            if (accumulate) for (size_t i = 0; i < g.window_spel; ++i) dwp[i] = CPUCompute2StorageT(CPUStorage2ComputeT(dwp[i]) + acc[i]);
+            else            for (size_t i = 0; i < g.window_spel; ++i) dwp[i] = CPUCompute2StorageT(acc[i]);
+        }
+    }, 1);
+}
+
+// col (C/group*window, out) = the receptive fields of the C/group channels starting at xg
+void CPU_im2col(const CPUConvGeometry& g, const StorageT* xg, StorageT* col){
+    const int sLast = g.stride.back();
+    const StorageT zeroS = CPUCompute2StorageT(ComputeT(0));
+    CPU_parallel_for(size_t(g.C / g.group) * g.window_spel, [&](size_t begin, size_t end){
+        for (size_t r = begin; r < end; ++r){
+            const StorageT* xc = xg + (r / g.window_spel) * g.in_spel;
+            StorageT* row = col + r * g.out_spel;
+            std::fill(row, row + g.out_spel, zeroS);
+            g.tapRows(r % g.window_spel, [&](ptrdiff_t out_row, ptrdiff_t in_row, int lo, int hi){
+                StorageT* o_ = row + out_row;
+                const StorageT* xi = xc + in_row;
+                if (sLast == 1) for (int o = lo; o < hi; ++o) o_[o] = xi[o];
+                else            for (int o = lo; o < hi; ++o) o_[o] = xi[o * sLast];
+            });
+        }
+    }, 1);
+}
+
+// dxg (C/group, in) = sum of the receptive fields in col scattered back; overwrite or accumulate into dxg
+void CPU_col2im(const CPUConvGeometry& g, const StorageT* col, StorageT* dxg, bool accumulate){
+    const int sLast = g.stride.back();
+    CPU_parallel_for(g.C / g.group, [&](size_t begin, size_t end){
+        std::vector<ComputeT> acc(g.in_spel);
+        for (size_t cg = begin; cg < end; ++cg){
+            StorageT* dxc = dxg + cg * g.in_spel;
+            if (accumulate) for (size_t i = 0; i < g.in_spel; ++i) acc[i] = CPUStorage2ComputeT(dxc[i]);
+            else            std::fill(acc.begin(), acc.end(), ComputeT(0));
+            for (size_t tap = 0; tap < g.window_spel; ++tap){
+                const StorageT* row = col + (cg * g.window_spel + tap) * g.out_spel;
+                g.tapRows(tap, [&](ptrdiff_t out_row, ptrdiff_t in_row, int lo, int hi){
+                    const StorageT* c_ = row + out_row;
+                    ComputeT* a = &acc[0] + in_row;
+                    if (sLast == 1) for (int o = lo; o < hi; ++o) a[o] += CPUStorage2ComputeT(c_[o]);
+                    else            for (int o = lo; o < hi; ++o) a[o * sLast] += CPUStorage2ComputeT(c_[o]);
+                });
+            }
+            for (size_t i = 0; i < g.in_spel; ++i) dxc[i] = CPUCompute2StorageT(acc[i]);
+        }
+    }, 1);
+}
+
+// Run f(task, col) for every task. With enough tasks to keep every worker busy they run in parallel, each
+// with serial GEMMs; otherwise they run one after the other and the parallelism comes from inside CPU_gemm.
+template <typename F>
+void CPU_conv_tasks(size_t tasks, F f){
+    if (tasks >= size_t(CPUPool().size())){
+        CPU_parallel_for(tasks, [&](size_t begin, size_t end){
+            std::vector<StorageT> col;
+            for (size_t t = begin; t < end; ++t) f(t, col);
+        }, 1);
+    }else{
+        std::vector<StorageT> col;
+        for (size_t t = 0; t < tasks; ++t) f(t, col);
+    }
+}
+
+// GEMM formulation per sample n and group: y_ng (Kg, out) = w_g (Kg, C/group*window) * col_ng (C/group*window, out)
+void CPU_conv_forward_gemm(const CPUConvGeometry& g, const StorageT* x, const StorageT* w, StorageT* y, bool accumulate){
+    const int Cg = g.C / g.group;
+    const int Kg = g.K / g.group;
+    const size_t rows = size_t(Cg) * g.window_spel;
+    const ComputeT alpha = 1;
+    const ComputeT beta = accumulate ? 1 : 0;
+    CPU_conv_tasks(size_t(g.N) * g.group, [&](size_t t, std::vector<StorageT>& col){
+        const int n = t / g.group;
+        const int grp = t % g.group;
+        const StorageT* xg = x + (size_t(n) * g.C + grp * Cg) * g.in_spel;
+        const StorageT* A = xg;
+        if (g.algo != CPUConv1x1){
+            col.resize(rows * g.out_spel);
+            CPU_im2col(g, xg, &col[0]);
+            A = &col[0];
+        }
+        CPU_gemm(CUBLAS_OP_N, CUBLAS_OP_N, g.out_spel, Kg, rows, &alpha, A, g.out_spel,
+                 w + grp * Kg * rows, rows, &beta, y + g.outAt(n, grp * Kg), g.out_spel);
+    });
+}
+
+// col_ng = w_g^T * dy_ng, then scattered back into dx by col2im
+void CPU_conv_backward_data_gemm(const CPUConvGeometry& g, const StorageT* w, const StorageT* dy, StorageT* dx, bool accumulate){
+    const int Cg = g.C / g.group;
+    const int Kg = g.K / g.group;
+    const size_t rows = size_t(Cg) * g.window_spel;
+    const ComputeT alpha = 1;
+    const ComputeT beta = accumulate ? 1 : 0;
+    const ComputeT zero = 0;
+    CPU_conv_tasks(size_t(g.N) * g.group, [&](size_t t, std::vector<StorageT>& col){
+        const int n = t / g.group;
+        const int grp = t % g.group;
+        const StorageT* dyg = dy + g.outAt(n, grp * Kg);
+        const StorageT* wg = w + grp * Kg * rows;
+        StorageT* dxg = dx + (size_t(n) * g.C + grp * Cg) * g.in_spel;
+        if (g.algo == CPUConv1x1){
+            CPU_gemm(CUBLAS_OP_N, CUBLAS_OP_T, g.out_spel, Cg, Kg, &alpha, dyg, g.out_spel, wg, rows, &beta, dxg, g.in_spel);
+        }else{
+            col.resize(rows * g.out_spel);
+            CPU_gemm(CUBLAS_OP_N, CUBLAS_OP_T, g.out_spel, rows, Kg, &alpha, dyg, g.out_spel, wg, rows, &zero, &col[0], g.out_spel);
+            CPU_col2im(g, &col[0], dxg, accumulate);
+        }
+    });
+}
+
+// dw_g = sum_n dy_ng * col_ng^T; every group owns its slice of dw, so only groups run in parallel
+void CPU_conv_backward_filter_gemm(const CPUConvGeometry& g, const StorageT* x, const StorageT* dy, StorageT* dw, bool accumulate){
+    const int Cg = g.C / g.group;
+    const int Kg = g.K / g.group;
+    const size_t rows = size_t(Cg) * g.window_spel;
+    const ComputeT alpha = 1;
+    const ComputeT one = 1;
+    const ComputeT zero = 0;
+    CPU_conv_tasks(g.group, [&](size_t grp, std::vector<StorageT>& col){
+        for (int n = 0; n < g.N; ++n){
+            const StorageT* xg = x + (size_t(n) * g.C + grp * Cg) * g.in_spel;
+            const StorageT* A = xg;
+            if (g.algo != CPUConv1x1){
+                col.resize(rows * g.out_spel);
+                CPU_im2col(g, xg, &col[0]);
+                A = &col[0];
+            }
+            CPU_gemm(CUBLAS_OP_T, CUBLAS_OP_N, rows, Kg, g.out_spel, &alpha, A, g.out_spel,
+                     dy + g.outAt(n, grp * Kg), g.out_spel,
+                     (n == 0 && !accumulate) ? &zero : &one, dw + grp * Kg * rows, rows);
+        }
+    });
+}
+
+// Winograd F(2x2,3x3): every 2x2 output tile costs 16 multiplications per channel pair instead of 36.
+// The filters become U = G g G^T and the 4x4 input tiles V = B^T d B; for each of the 16 positions of the
+// transformed tile, the products summed over the input channels form one GEMM (tiles x C/group) * (C/group x K/group),
+// and the output tiles come back as A^T M A. Tiles are processed in chunks of whole tile rows to bound the size of V and M.
+#define CPU_WINOGRAD_CHUNK (size_t(8)*1024*1024)
+
+// number of tile rows transformed at once
+size_t CPU_winograd_row_chunk(const CPUConvGeometry& g){
+    const size_t TW = (g.out[1] + 1) / 2;
+    const size_t tileRows = size_t((g.out[0] + 1) / 2) * g.N;
+    return std::max(size_t(1), std::min(tileRows, CPU_WINOGRAD_CHUNK / (16 * size_t(g.C / g.group + g.K / g.group) * TW)));
+}
+
+void CPU_conv_forward_winograd(const CPUConvGeometry& g, const StorageT* x, const StorageT* w, StorageT* y, bool accumulate){
+    const int Cg = g.C / g.group;
+    const int Kg = g.K / g.group;
+    const int H = g.in[0], W = g.in[1];
+    const int OH = g.out[0], OW = g.out[1];
+    const int padH = g.padding[0], padW = g.padding[1];
+    const int TW = (OW + 1) / 2;
+    const int TH = (OH + 1) / 2;
+    const size_t tileRows = size_t(TH) * g.N;
+    const size_t rowChunk = CPU_winograd_row_chunk(g);
+    const int DW = 2 * TW + 2;
+    const ComputeT one = 1;
+    const ComputeT zero = 0;
+
+    // U[group][xi] is a (C/group x K/group) column-major matrix
+    std::vector<ComputeT> U(size_t(g.group) * 16 * Cg * Kg);
+    CPU_parallel_for(size_t(g.K) * Cg, [&](size_t begin, size_t end){
+        for (size_t kc = begin; kc < end; ++kc){
+            const size_t k = kc / Cg, c = kc % Cg;
+            const StorageT* f = w + kc * 9;
+            ComputeT t[4][3];
+            for (int j = 0; j < 3; ++j){
+                const ComputeT f0 = CPUStorage2ComputeT(f[j]), f1 = CPUStorage2ComputeT(f[3+j]), f2 = CPUStorage2ComputeT(f[6+j]);
+                t[0][j] = f0;
+                t[1][j] = (f0 + f1 + f2) * ComputeT(0.5);
+                t[2][j] = (f0 - f1 + f2) * ComputeT(0.5);
+                t[3][j] = f2;
+            }
+            ComputeT* u = &U[((k / Kg) * 16 * Kg + k % Kg) * Cg + c];
+            const size_t step = size_t(Kg) * Cg;
+            for (int i = 0; i < 4; ++i){
+                u[(i*4+0) * step] = t[i][0];
+                u[(i*4+1) * step] = (t[i][0] + t[i][1] + t[i][2]) * ComputeT(0.5);
+                u[(i*4+2) * step] = (t[i][0] - t[i][1] + t[i][2]) * ComputeT(0.5);
+                u[(i*4+3) * step] = t[i][2];
+            }
+        }
+    });
+
+    std::vector<ComputeT> V(16 * Cg * rowChunk * TW);
+    std::vector<ComputeT> M(16 * Kg * rowChunk * TW);
+    for (int grp = 0; grp < g.group; ++grp){
+        for (size_t r0 = 0; r0 < tileRows; r0 += rowChunk){
+            const size_t rc = std::min(rowChunk, tileRows - r0);
+            const size_t tc = rc * TW;
+
+            // V[xi] is a (tiles x C/group) column-major matrix, filled one tile row at a time
+            CPU_parallel_for(Cg, [&](size_t begin, size_t end){
+                std::vector<ComputeT> d(4 * DW), b(4 * DW);
+                for (size_t c = begin; c < end; ++c){
+                    for (size_t r = 0; r < rc; ++r){
+                        const size_t n = (r0 + r) / TH;
+                        const int h0 = int((r0 + r) % TH) * 2 - padH;
+                        const StorageT* xc = x + (n * g.C + grp * Cg + c) * g.in_spel;
+                        for (int i = 0; i < 4; ++i){
+                            ComputeT* di = &d[i * DW];
+                            const int h = h0 + i;
+                            if (h < 0 || h >= H){
+                                std::fill(di, di + DW, ComputeT(0));
+                                continue;
+                            }
+                            const StorageT* row = xc + size_t(h) * W;
+                            for (int q = 0; q < DW; ++q){
+                                const int ww = q - padW;
+                                di[q] = (ww >= 0 && ww < W) ? CPUStorage2ComputeT(row[ww]) : ComputeT(0);
+                            }
+                        }
+                        for (int q = 0; q < DW; ++q){
+                            b[q]          = d[q]          - d[2 * DW + q];
+                            b[DW + q]     = d[DW + q]     + d[2 * DW + q];
+                            b[2 * DW + q] = d[2 * DW + q] - d[DW + q];
+                            b[3 * DW + q] = d[DW + q]     - d[3 * DW + q];
+                        }
+                        for (int i = 0; i < 4; ++i){
+                            const ComputeT* bi = &b[i * DW];
+                            ComputeT* v0 = &V[((i*4+0) * Cg + c) * tc + r * TW];
+                            ComputeT* v1 = &V[((i*4+1) * Cg + c) * tc + r * TW];
+                            ComputeT* v2 = &V[((i*4+2) * Cg + c) * tc + r * TW];
+                            ComputeT* v3 = &V[((i*4+3) * Cg + c) * tc + r * TW];
+                            for (int tw = 0; tw < TW; ++tw){
+                                v0[tw] = bi[2*tw]   - bi[2*tw+2];
+                                v1[tw] = bi[2*tw+1] + bi[2*tw+2];
+                                v2[tw] = bi[2*tw+2] - bi[2*tw+1];
+                                v3[tw] = bi[2*tw+1] - bi[2*tw+3];
+                            }
+                        }
+                    }
+                }
+            }, 1);
+
+            // M[xi] (tiles x K/group) = V[xi] * U[xi]
+            CPU_conv_tasks(16, [&](size_t xi, std::vector<StorageT>& col){
+                CPU_gemm(CUBLAS_OP_N, CUBLAS_OP_N, tc, Kg, Cg, &one, &V[xi * Cg * tc], tc,
+                         &U[(grp * 16 + xi) * Kg * Cg], Cg, &zero, &M[xi * Kg * tc], tc);
+            });
+
+            CPU_parallel_for(Kg, [&](size_t begin, size_t end){
+                std::vector<ComputeT> a(8 * TW);
+                for (size_t k = begin; k < end; ++k){
+                    for (size_t r = 0; r < rc; ++r){
+                        const size_t n = (r0 + r) / TH;
+                        const int h0 = int((r0 + r) % TH) * 2;
+                        for (int j = 0; j < 4; ++j){
+                            const ComputeT* m0 = &M[((0+j) * Kg + k) * tc + r * TW];
+                            const ComputeT* m1 = &M[((4+j) * Kg + k) * tc + r * TW];
+                            const ComputeT* m2 = &M[((8+j) * Kg + k) * tc + r * TW];
+                            const ComputeT* m3 = &M[((12+j) * Kg + k) * tc + r * TW];
+                            ComputeT* a0 = &a[j * TW];
+                            ComputeT* a1 = &a[(4+j) * TW];
+                            for (int tw = 0; tw < TW; ++tw){
+                                a0[tw] = m0[tw] + m1[tw] + m2[tw];
+                                a1[tw] = m1[tw] - m2[tw] - m3[tw];
+                            }
+                        }
+                        StorageT* yk = y + g.outAt(n, grp * Kg + k);
+                        for (int i = 0; i < 2 && h0 + i < OH; ++i){
+                            const ComputeT* ai = &a[i * 4 * TW];
+                            StorageT* row = yk + size_t(h0 + i) * OW;
+                            for (int tw = 0; tw < TW; ++tw){
+                                const ComputeT o0 = ai[tw] + ai[TW + tw] + ai[2*TW + tw];
+                                const ComputeT o1 = ai[TW + tw] - ai[2*TW + tw] - ai[3*TW + tw];
+                                row[2*tw] = CPUCompute2StorageT(accumulate ? CPUStorage2ComputeT(row[2*tw]) + o0 : o0);
+                                if (2*tw + 1 < OW) row[2*tw+1] = CPUCompute2StorageT(accumulate ? CPUStorage2ComputeT(row[2*tw+1]) + o1 : o1);
+                            }
+                        }
+                    }
+                }
+            }, 1);
+        }
+    }
+}
+
+void CPU_conv_forward(const CPUConvGeometry& g, const StorageT* x, const StorageT* w, StorageT* y, bool accumulate){
+    if (g.algo == CPUConvDirect)        CPU_conv_forward_direct(g, x, w, y, accumulate);
+    else if (g.algo == CPUConvWinograd) CPU_conv_forward_winograd(g, x, w, y, accumulate);
+    else                                CPU_conv_forward_gemm(g, x, w, y, accumulate);
+}
+
+void CPU_conv_backward_data(const CPUConvGeometry& g, const StorageT* w, const StorageT* dy, StorageT* dx, bool accumulate){
+    if (g.algo == CPUConvDirect) CPU_conv_backward_data_direct(g, w, dy, dx, accumulate);
+    else                         CPU_conv_backward_data_gemm(g, w, dy, dx, accumulate);
+}
+
+void CPU_conv_backward_filter(const CPUConvGeometry& g, const StorageT* x, const StorageT* dy, StorageT* dw, bool accumulate){
+    if (g.algo == CPUConvDirect) CPU_conv_backward_filter_direct(g, x, dy, dw, accumulate);
+    else                         CPU_conv_backward_filter_gemm(g, x, dy, dw, accumulate);
+}
+
+// Scratch bytes the forward or backward passes allocate with a given algorithm
+size_t CPU_conv_workspace(const CPUConvGeometry& g, CPUConvAlgo algo){
+    const size_t Cg = g.C / g.group;
+    const size_t Kg = g.K / g.group;
+    if (algo == CPUConvIm2col){
+        const size_t tasks = size_t(g.N) * g.group;
+        const size_t workers = tasks >= size_t(CPUPool().size()) ? CPUPool().size() : 1;
+        return workers * Cg * g.window_spel * g.out_spel * sizeofStorageT;
+    }
+    if (algo == CPUConvWinograd){
+        const size_t TW = (g.out[1] + 1) / 2;
+        return (size_t(g.group) * 16 * Cg * Kg + 16 * (Cg + Kg) * CPU_winograd_row_chunk(g) * TW) * sizeof(ComputeT);
+    }
+    return 0;
+}
+
+// Time every algorithm that applies to g and needs at most workspace bytes, for each of the three passes,
+// and return the fastest ones. Direct needs no scratch memory and is always a candidate.
+void CPU_conv_autotune(const CPUConvGeometry& g, size_t workspace, CPUConvAlgo& fwd, CPUConvAlgo& bwdData, CPUConvAlgo& bwdFilter){
+    // not zeros: the direct kernels skip zero weights
+    const StorageT value = CPUCompute2StorageT(ComputeT(0.01));
+    std::vector<StorageT> x(size_t(g.N) * g.C * g.in_spel, value);
+    std::vector<StorageT> y(size_t(g.N) * g.K * g.out_spel, value);
+    std::vector<StorageT> w(size_t(g.K) * (g.C / g.group) * g.window_spel, value);
+
+    std::vector<CPUConvAlgo> candidates;
+    candidates.push_back(CPUConvDirect);
+    candidates.push_back(g.isPointwise() ? CPUConv1x1 : CPUConvIm2col);
+    if (g.fitsWinograd()) candidates.push_back(CPUConvWinograd);
+
+    CPUConvAlgo* chosen[3] = {&fwd, &bwdData, &bwdFilter};
+    CPUConvGeometry t = g;
+    for (int pass=0;pass<3;++pass){
+        unsigned long long best = 0;
+        *chosen[pass] = CPUConvDirect;
+        for (int c=0;c<candidates.size();++c){
+            t.algo = candidates[c];
+            if (t.algo == CPUConvWinograd && pass != 0) continue;
+            if (CPU_conv_workspace(t, t.algo) > workspace) continue;
+            // the faster of two runs, so that the first touch of the buffers is not counted
+            unsigned long long elapsed = 0;
+            for (int r=0;r<2;++r){
+                unsigned long long begin = get_timestamp();
+                if (pass == 0)      CPU_conv_forward(t, &x[0], &w[0], &y[0], false);
+                else if (pass == 1) CPU_conv_backward_data(t, &w[0], &y[0], &x[0], false);
+                else                CPU_conv_backward_filter(t, &x[0], &y[0], &w[0], false);
+                unsigned long long delta = get_timestamp() - begin;
+                if (r == 0 || delta < elapsed) elapsed = delta;
+            }
+            if (c == 0 || elapsed < best){
+                best = elapsed;
+                *chosen[pass] = t.algo;
+            }
+        }
+    }
+}
+
+// y (N,K,spel) += b (K); the items of y are `item` elements apart when it is a slice, K*spel when item is 0
+void CPU_bias_forward(size_t N, int K, size_t spel, const StorageT* b, StorageT* y, size_t item = 0){
+    if (item == 0) item = K * spel;
+    CPU_parallel_for(N * K, [=](size_t begin, size_t end){
+        for (size_t nk = begin; nk < end; ++nk){
+            ComputeT bk = CPUStorage2ComputeT(b[nk % K]);
+            StorageT* p = y + (nk / K) * item + (nk % K) * spel;
+            for (size_t i = 0; i < spel; ++i) p[i] = CPUCompute2StorageT(CPUStorage2ComputeT(p[i]) + bk);
+        }
+    }, 1);
+}
+
+// db (K) += sum of dy (N,K,spel) over N and spel; item as for CPU_bias_forward
+void CPU_bias_backward(size_t N, int K, size_t spel, const StorageT* dy, StorageT* db, size_t item = 0){
+    if (item == 0) item = K * spel;
+    CPU_parallel_for(K, [=](size_t begin, size_t end){
+        for (size_t k = begin; k < end; ++k){
+            ComputeT s = 0;
+            for (size_t n = 0; n < N; ++n){
+                const StorageT* p = dy + n * item + k * spel;
+                for (size_t i = 0; i < spel; ++i) s += CPUStorage2ComputeT(p[i]);
+            }
+            db[k] = CPUCompute2StorageT(CPUStorage2ComputeT(db[k]) + s);
+        }
+    }, 1);
+}
+
+// N-D pooling over every (n,c) plane, matching cudnnPoolingForward/Backward
+void CPU_pooling(cudnnPoolingMode_t mode, size_t planes, const std::vector<int>& in, const std::vector<int>& out, const std::vector<int>& window, const std::vector<int>& stride, const std::vector<int>& padding, const StorageT* x, StorageT* y, const StorageT* dy, StorageT* dx){
+    int S = in.size();
+    size_t in_spel = numel(in);
+    size_t out_spel = numel(out);
+    size_t window_spel = numel(window);
+    bool backward = (dx != NULL);
+    CPU_parallel_for(planes, [&](size_t begin, size_t end){
+        std::vector<int> lo(S), hi(S), p(S);
+        for (size_t plane = begin; plane < end; ++plane){
+            const StorageT* xp = x + plane * in_spel;
+            for (size_t o = 0; o < out_spel; ++o){
+                size_t rem = o;
+                size_t count = 1;
+                for (int d=S-1;d>=0;--d){
+                    int od = rem % out[d];
+                    rem /= out[d];
+                    lo[d] = std::max(od * stride[d] - padding[d], 0);
+                    hi[d] = std::min(od * stride[d] - padding[d] + window[d], in[d]);
+                    count *= std::max(hi[d] - lo[d], 0);
+                }
+                ComputeT result = 0;
+                size_t argmax = SIZE_MAX;
+                if (count > 0){
+                    ComputeT maxval = -FLT_MAX;
+                    p = lo;
+                    while (true){
+                        size_t i = 0;
+                        for (int d=0;d<S;++d) i = i * in[d] + p[d];
+                        ComputeT v = CPUStorage2ComputeT(xp[i]);
+                        if (mode == CUDNN_POOLING_MAX){
+                            if (v > maxval){ maxval = v; argmax = i; }
+                        }else if (backward){
+                            ComputeT divisor = (mode == CUDNN_POOLING_AVERAGE_COUNT_INCLUDE_PADDING) ? window_spel : count;
+                            dx[plane * in_spel + i] = CPUCompute2StorageT(CPUStorage2ComputeT(dx[plane * in_spel + i]) + CPUStorage2ComputeT(dy[plane * out_spel + o]) / divisor);
+                        }else{
+                            result += v;
+                        }
+                        int d = S-1;
+                        while (d>=0 && ++p[d]==hi[d]){ p[d] = lo[d]; --d; }
+                        if (d<0) break;
+                    }
+                    if (mode == CUDNN_POOLING_MAX) result = maxval;
+                    else if (mode == CUDNN_POOLING_AVERAGE_COUNT_INCLUDE_PADDING) result /= window_spel;
+                    else result /= count;
+                }
+                if (!backward){
+                    y[plane * out_spel + o] = CPUCompute2StorageT(result);
+                }else if (mode == CUDNN_POOLING_MAX && argmax != SIZE_MAX){
+                    dx[plane * in_spel + argmax] = CPUCompute2StorageT(CPUStorage2ComputeT(dx[plane * in_spel + argmax]) + CPUStorage2ComputeT(dy[plane * out_spel + o]));
+                }
+            }
+        }
+    }, 1);
+}
+
+// cross channel LRN: y = x / (k + alpha/n * sum x^2)^beta, matching cudnnLRNCrossChannelForward/Backward
+void CPU_LRN(size_t N, int C, size_t spel, unsigned lrnN, double lrnAlpha, double lrnBeta, double lrnK, const StorageT* x, const StorageT* y, StorageT* out, const StorageT* dy){
+    const int before = (lrnN - 1) / 2;
+    const int after = lrnN - 1 - before;
+    const ComputeT alpha_n = lrnAlpha / lrnN;
+    bool backward = (dy != NULL);
+    const size_t chunk = 256;
+    size_t chunks = (spel + chunk - 1) / chunk;
+    CPU_parallel_for(N * chunks, [&](size_t begin, size_t end){
+        std::vector<ComputeT> scale(size_t(C) * chunk);
+        std::vector<ComputeT> ratio;
+        if (backward) ratio.resize(size_t(C) * chunk);
+        for (size_t job = begin; job < end; ++job){
+            size_t n = job / chunks;
+            size_t s0 = (job % chunks) * chunk;
+            size_t len = std::min(chunk, spel - s0);
+            const StorageT* xn = x + n * C * spel + s0;
+            for (int c = 0; c < C; ++c){
+                ComputeT* sc = &scale[c * chunk];
+                std::fill(sc, sc + len, ComputeT(0));
+                for (int j = std::max(0, c - before); j <= std::min(C - 1, c + after); ++j){
+                    const StorageT* xj = xn + size_t(j) * spel;
+                    for (size_t s = 0; s < len; ++s){ ComputeT v = CPUStorage2ComputeT(xj[s]); sc[s] += v * v; }
+                }
+                for (size_t s = 0; s < len; ++s) sc[s] = lrnK + alpha_n * sc[s];
+            }
+            StorageT* on = out + n * C * spel + s0;
+            if (!backward){
+                for (int c = 0; c < C; ++c){
+                    for (size_t s = 0; s < len; ++s){
+                        on[c * spel + s] = CPUCompute2StorageT(CPUStorage2ComputeT(xn[c * spel + s]) * pow(scale[c * chunk + s], ComputeT(-lrnBeta)));
+                    }
+                }
+            }else{
+                const StorageT* yn = y + n * C * spel + s0;
+                const StorageT* dyn = dy + n * C * spel + s0;
+                for (int c = 0; c < C; ++c){
+                    for (size_t s = 0; s < len; ++s){
+                        ratio[c * chunk + s] = CPUStorage2ComputeT(dyn[c * spel + s]) * CPUStorage2ComputeT(yn[c * spel + s]) / scale[c * chunk + s];
+                    }
+                }
+                for (int c = 0; c < C; ++c){
+                    for (size_t s = 0; s < len; ++s){
+                        ComputeT acc = 0;
+                        for (int j = std::max(0, c - after); j <= std::min(C - 1, c + before); ++j) acc += ratio[j * chunk + s];
+                        ComputeT xv = CPUStorage2ComputeT(xn[c * spel + s]);
+                        ComputeT v = CPUStorage2ComputeT(dyn[c * spel + s]) * pow(scale[c * chunk + s], ComputeT(-lrnBeta)) - ComputeT(2) * alpha_n * lrnBeta * xv * acc;
+                        on[c * spel + s] = CPUCompute2StorageT(v);
+                    }
+                }
+            }
+        }
+    }, 1);
+}
+
+// softmax across channels for each (n, spatial) location
+void CPU_softmax_forward(size_t N, int C, size_t spel, const StorageT* x, StorageT* y){
+    CPU_parallel_for(N * spel, [=](size_t begin, size_t end){
+        std::vector<ComputeT> e(C);
+        for (size_t ns = begin; ns < end; ++ns){
+            size_t base = (ns / spel) * C * spel + ns % spel;
+            ComputeT maxval = CPUStorage2ComputeT(x[base]);
+            for (int c = 1; c < C; ++c) maxval = std::max(maxval, ComputeT(CPUStorage2ComputeT(x[base + c * spel])));
+            ComputeT sum = 0;
+            for (int c = 0; c < C; ++c){ e[c] = exp(CPUStorage2ComputeT(x[base + c * spel]) - maxval); sum += e[c]; }
+            for (int c = 0; c < C; ++c) y[base + c * spel] = CPUCompute2StorageT(e[c] / sum);
+        }
+    });
+}
+
+// dx = y .* (dy - sum(y .* dy)) over groups of `len` consecutive elements
+void CPU_softmax_backward(size_t groups, size_t len, const StorageT* y, const StorageT* dy, StorageT* dx){
+    CPU_parallel_for(groups, [=](size_t begin, size_t end){
+        for (size_t gi = begin; gi < end; ++gi){
+            const StorageT* yp = y + gi * len;
+            const StorageT* dyp = dy + gi * len;
+            StorageT* dxp = dx + gi * len;
+            ComputeT dot = 0;
+            for (size_t i = 0; i < len; ++i) dot += CPUStorage2ComputeT(yp[i]) * CPUStorage2ComputeT(dyp[i]);
+            for (size_t i = 0; i < len; ++i) dxp[i] = CPUCompute2StorageT(CPUStorage2ComputeT(yp[i]) * (CPUStorage2ComputeT(dyp[i]) - dot));
+        }
+    }, 1);
+}
+
+inline ComputeT CPU_activate(cudnnActivationMode_t mode, ComputeT v){
+    switch (mode){
+        case CUDNN_ACTIVATION_RELU:     return v > 0 ? v : ComputeT(0);
+        case CUDNN_ACTIVATION_SIGMOID:  return ComputeT(1) / (ComputeT(1) + exp(-v));
+        case CUDNN_ACTIVATION_TANH:     return std::tanh(v);
+        default:                        return v;
+    }
+}
+
+void CPU_activation_forward(cudnnActivationMode_t mode, size_t N, const StorageT* x, StorageT* y){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t i = begin; i < end; ++i) y[i] = CPUCompute2StorageT(CPU_activate(mode, CPUStorage2ComputeT(x[i])));
+    });
+}
+
+// y (N,K,spel) = activation(y + b (K)) in one pass, the epilogue of a layer with a fused activation; b may be NULL,
+// item as for CPU_bias_forward
+void CPU_bias_activation_forward(size_t N, int K, size_t spel, const StorageT* b, cudnnActivationMode_t mode, StorageT* y, size_t item = 0){
+    if (item == 0) item = K * spel;
+    CPU_parallel_for(N * K, [=](size_t begin, size_t end){
+        for (size_t nk = begin; nk < end; ++nk){
+            ComputeT bk = b==NULL ? ComputeT(0) : CPUStorage2ComputeT(b[nk % K]);
+            StorageT* p = y + (nk / K) * item + (nk % K) * spel;
+            for (size_t i = 0; i < spel; ++i) p[i] = CPUCompute2StorageT(CPU_activate(mode, CPUStorage2ComputeT(p[i]) + bk));
+        }
+    }, std::max(size_t(1), size_t(4096) / std::max(spel, size_t(1))));
+}
+
+void CPU_activation_backward(cudnnActivationMode_t mode, size_t N, const StorageT* y, const StorageT* dy, const StorageT* x, StorageT* dx){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t i = begin; i < end; ++i){
+            ComputeT g = CPUStorage2ComputeT(dy[i]);
+            ComputeT v = CPUStorage2ComputeT(y[i]);
+            switch (mode){
+                case CUDNN_ACTIVATION_RELU:     g = CPUStorage2ComputeT(x[i]) > 0 ? g : ComputeT(0);    break;
+                case CUDNN_ACTIVATION_SIGMOID:  g = g * v * (ComputeT(1) - v);                       break;
+                case CUDNN_ACTIVATION_TANH:     g = g * (ComputeT(1) - v * v);                       break;
+                default: break;
+            }
+            dx[i] = CPUCompute2StorageT(g);
+        }
+    });
+}
+
+// inverted dropout: mask is kept (one byte per element) for the backward pass
+void CPU_dropout_forward(size_t N, ComputeT ratio, unsigned long seed, const StorageT* x, StorageT* y, uint8_t* mask){
+    const ComputeT scale = ComputeT(1) / (ComputeT(1) - ratio);
+    const size_t chunk = 4096;
+    CPU_parallel_for((N + chunk - 1) / chunk, [=](size_t begin, size_t end){
+        for (size_t c = begin; c < end; ++c){
+            std::mt19937 gen(seed + c);
+            std::bernoulli_distribution keep(1 - ratio);
+            for (size_t i = c * chunk; i < std::min(N, (c + 1) * chunk); ++i){
+                mask[i] = keep(gen);
+                y[i] = CPUCompute2StorageT(mask[i] ? CPUStorage2ComputeT(x[i]) * scale : ComputeT(0));
+            }
+        }
+    }, 1);
+}
+
+void CPU_dropout_backward(size_t N, ComputeT ratio, const uint8_t* mask, const StorageT* dy, StorageT* dx){
+    const ComputeT scale = ComputeT(1) / (ComputeT(1) - ratio);
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t i = begin; i < end; ++i) dx[i] = CPUCompute2StorageT(mask[i] ? CPUStorage2ComputeT(dy[i]) * scale : ComputeT(0));
+    });
+}
+
+// Batch normalization with batch statistics, matching cudnnBatchNormalizationForwardTraining/Backward.
+// x is viewed as (N, stats, inner): statistic j is taken over n < N and s < inner
+// (inner is the spatial size for spatial mode and 1 for per-activation mode).
+void CPU_batchnorm_forward(size_t N, size_t stats, size_t inner, double epsilon, double factor, const StorageT* x, StorageT* y, const StorageT* scale, const StorageT* bias, StorageT* runningMean, StorageT* runningVar, StorageT* saveMean, StorageT* saveInvVar){
+    CPU_parallel_for(stats, [=](size_t begin, size_t end){
+        for (size_t j = begin; j < end; ++j){
+            size_t M = N * inner;
+            double sum = 0, sum2 = 0;
+            for (size_t n = 0; n < N; ++n){
+                const StorageT* p = x + (n * stats + j) * inner;
+                for (size_t s = 0; s < inner; ++s){
+                    double v = CPUStorage2ComputeT(p[s]);
+                    sum += v;
+                    sum2 += v * v;
+                }
+            }
+            double mean = sum / M;
+            double var = std::max(sum2 / M - mean * mean, 0.0);
+            double invstd = 1.0 / sqrt(var + epsilon);
+            double sc = CPUStorage2ComputeT(scale[j]);
+            double bi = CPUStorage2ComputeT(bias[j]);
+            for (size_t n = 0; n < N; ++n){
+                const StorageT* p = x + (n * stats + j) * inner;
+                StorageT* q = y + (n * stats + j) * inner;
+                for (size_t s = 0; s < inner; ++s) q[s] = CPUCompute2StorageT(ComputeT((CPUStorage2ComputeT(p[s]) - mean) * invstd * sc + bi));
+            }
+            if (runningMean != NULL) runningMean[j] = CPUCompute2StorageT(ComputeT((1 - factor) * CPUStorage2ComputeT(runningMean[j]) + factor * mean));
+            if (runningVar  != NULL) runningVar[j]  = CPUCompute2StorageT(ComputeT((1 - factor) * CPUStorage2ComputeT(runningVar[j])  + factor * var * M / std::max(M - 1, size_t(1))));
+            if (saveMean    != NULL) saveMean[j]    = CPUCompute2StorageT(ComputeT(mean));
+            if (saveInvVar  != NULL) saveInvVar[j]  = CPUCompute2StorageT(ComputeT(invstd));
+        }
+    }, 1);
+}
+
+// overwrites dx, dscale and dbias, using the mean and inverse std saved by the forward pass
+void CPU_batchnorm_backward(size_t N, size_t stats, size_t inner, const StorageT* x, const StorageT* dy, StorageT* dx, const StorageT* scale, StorageT* dscale, StorageT* dbias, const StorageT* saveMean, const StorageT* saveInvVar){
+    CPU_parallel_for(stats, [=](size_t begin, size_t end){
+        for (size_t j = begin; j < end; ++j){
+            size_t M = N * inner;
+            double mean = CPUStorage2ComputeT(saveMean[j]);
+            double invstd = CPUStorage2ComputeT(saveInvVar[j]);
+            double sum_dy = 0, sum_dy_xhat = 0;
+            for (size_t n = 0; n < N; ++n){
+                const StorageT* p = x + (n * stats + j) * inner;
+                const StorageT* d = dy + (n * stats + j) * inner;
+                for (size_t s = 0; s < inner; ++s){
+                    double g = CPUStorage2ComputeT(d[s]);
+                    sum_dy += g;
+                    sum_dy_xhat += g * (CPUStorage2ComputeT(p[s]) - mean) * invstd;
+                }
+            }
+            double k = CPUStorage2ComputeT(scale[j]) * invstd / M;
+            for (size_t n = 0; n < N; ++n){
+                const StorageT* p = x + (n * stats + j) * inner;
+                const StorageT* d = dy + (n * stats + j) * inner;
+                StorageT* q = dx + (n * stats + j) * inner;
+                for (size_t s = 0; s < inner; ++s){
+                    double xhat = (CPUStorage2ComputeT(p[s]) - mean) * invstd;
+                    q[s] = CPUCompute2StorageT(ComputeT(k * (M * CPUStorage2ComputeT(d[s]) - sum_dy - xhat * sum_dy_xhat)));
+                }
+            }
+            dscale[j] = CPUCompute2StorageT(ComputeT(sum_dy_xhat));
+            dbias[j]  = CPUCompute2StorageT(ComputeT(sum_dy));
+        }
+    }, 1);
+}
+
+void CPU_LSTM_acts_forward(size_t N, int dim, const StorageT* X, StorageT* X_acts){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            int d = idx % (4*dim);
+            ComputeT v = CPUStorage2ComputeT(X[idx]);
+            X_acts[idx] = CPUCompute2StorageT(d < 3*dim ? ComputeT(1) / (ComputeT(1) + std::exp(-v)) : std::tanh(v));
+        }
+    });
+}
+
+void CPU_LSTM_unit_forward(size_t N, int dim, const StorageT* C_prev, const StorageT* X, const StorageT* flush, StorageT* C, StorageT* H){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            size_t n = idx / dim;
+            int d = idx % dim;
+            const StorageT* X_offset = X + 4*dim*n;
+            ComputeT i = CPUStorage2ComputeT(X_offset[d]);
+            ComputeT f = CPUStorage2ComputeT(X_offset[dim+d]);
+            ComputeT o = CPUStorage2ComputeT(X_offset[2*dim+d]);
+            ComputeT g = CPUStorage2ComputeT(X_offset[3*dim+d]);
+            ComputeT c = CPUStorage2ComputeT(flush[n]) * f * CPUStorage2ComputeT(C_prev[idx]) + i * g;
+            C[idx] = CPUCompute2StorageT(c);
+            H[idx] = CPUCompute2StorageT(o * std::tanh(c));
+        }
+    });
+}
+
+void CPU_LSTM_unit_backward(size_t N, int dim, const StorageT* C_prev, const StorageT* X, const StorageT* C, const StorageT* H, const StorageT* flush, const StorageT* C_diff, const StorageT* H_diff, StorageT* C_prev_diff, StorageT* X_diff){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            size_t n = idx / dim;
+            int d = idx % dim;
+            const StorageT* X_offset = X + 4*dim*n;
+            ComputeT i = CPUStorage2ComputeT(X_offset[d]);
+            ComputeT f = CPUStorage2ComputeT(X_offset[dim+d]);
+            ComputeT o = CPUStorage2ComputeT(X_offset[2*dim+d]);
+            ComputeT g = CPUStorage2ComputeT(X_offset[3*dim+d]);
+            ComputeT c_prev = CPUStorage2ComputeT(C_prev[idx]);
+            ComputeT fl = CPUStorage2ComputeT(flush[n]);
+            ComputeT tanh_c = std::tanh(CPUStorage2ComputeT(C[idx]));
+            ComputeT h_diff = CPUStorage2ComputeT(H_diff[idx]);
+            ComputeT c_term = CPUStorage2ComputeT(C_diff[idx]) + h_diff * o * (1 - tanh_c * tanh_c);
+            C_prev_diff[idx] = CPUCompute2StorageT(fl * c_term * f);
+            StorageT* X_diff_offset = X_diff + 4*dim*n;
+            X_diff_offset[d]       = CPUCompute2StorageT(c_term * g);
+            X_diff_offset[dim+d]   = CPUCompute2StorageT(fl * c_term * c_prev);
+            X_diff_offset[2*dim+d] = CPUCompute2StorageT(h_diff * tanh_c);
+            X_diff_offset[3*dim+d] = CPUCompute2StorageT(c_term * i);
+        }
+    });
+}
+
+void CPU_LSTM_acts_backward(size_t N, int dim, const StorageT* X_acts, const StorageT* X_acts_diff, StorageT* X_diff){
+    CPU_parallel_for(N, [=](size_t begin, size_t end){
+        for (size_t idx = begin; idx < end; ++idx){
+            int d = idx % (4*dim);
+            ComputeT a = CPUStorage2ComputeT(X_acts[idx]);
+            ComputeT ad = CPUStorage2ComputeT(X_acts_diff[idx]);
+            X_diff[idx] = CPUCompute2StorageT(d < 3*dim ? ad * a * (ComputeT(1) - a) : ad * (ComputeT(1) - a * a));
+        }
+    });
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// File format
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+uint8_t typeID(std::type_index t){
+    if (t==typeid(half))        return uint8_t(0);
+    if (t==typeid(float))       return uint8_t(1);
+    if (t==typeid(double))      return uint8_t(2);
+    if (t==typeid(uint8_t))     return uint8_t(3);
+    if (t==typeid(uint16_t))    return uint8_t(4);
+    if (t==typeid(uint32_t))    return uint8_t(5);
+    if (t==typeid(uint64_t))    return uint8_t(6);
+    if (t==typeid(int8_t))      return uint8_t(7);
+    if (t==typeid(int16_t))     return uint8_t(8);
+    if (t==typeid(int32_t))     return uint8_t(9);
+    if (t==typeid(int64_t))     return uint8_t(10);
+    if (t==typeid(char))        return uint8_t(11);
+    if (t==typeid(bool))        return uint8_t(12);
+    FatalError(__LINE__);       return uint8_t(255);
+}
+
+uint8_t readTypeID(std::string filename){
+    FILE* fp = fopen(filename.c_str(),"rb");
+    while (fp==NULL) {
+        std::cerr<<"readTypeID: fail to open file "<<filename<<". Please provide it first. Will retry after 5 seconds."<<std::endl;
+        std::this_thread::sleep_for(std::chrono::seconds(5));
+        fp = fopen(filename.c_str(),"rb");
+    }
+    size_t read_cnt;
+    uint8_t fpTypeid; read_cnt = fread((void*)(&fpTypeid), sizeof(uint8_t), 1, fp);     if (read_cnt!=1) { std::cerr<<"Error at readTypeID: no data type. "<<std::endl; FatalError(__LINE__); }
+    fclose(fp);
+    return fpTypeid;
+}
+
+template <class T>
+class Tensor{
+public:
+    std::vector<int> dim;
+    T* CPUmem;
+    std::string name;
+    bool isView;    // CPUmem belongs to someone else, such as a TensorFile mapping
+
+    // compile will check if your time is not correct for writeGPU and readGPU
+    void writeGPU(T* GPUmem, Device device=DeviceGPU){
+        deviceMemcpy(device, GPUmem, CPUmem, numel()*sizeof(T), cudaMemcpyHostToDevice);
+    };
+
+    void readGPU(T* GPUmem, Device device=DeviceGPU){
+        deviceMemcpy(device, CPUmem, GPUmem, numel()*sizeof(T), cudaMemcpyDeviceToHost);
+    };
+
+    Tensor(): CPUmem(NULL), isView(false){};
+
+    size_t numel(){ return marvin::numel(dim); };
+
+    size_t numBytes(){ return sizeof(T)*numel(); };
+
+    int numofitems(){ return dim[0]; };
+
+    size_t sizeofitem(){ return marvin::sizeofitem(dim); };
+
+    ~Tensor(){
+        if (CPUmem!=NULL && !isView)    checkCUDA(__LINE__, deviceFree(DeviceCPU, CPUmem));
+    };
+
+    void initialize(T val){
+        for (size_t i=0;i<numel();++i){
+            CPUmem[i]=val;
+        }
+    };
+
+    size_t readHeader(FILE* fp){
+        size_t read_cnt;
+        uint8_t myTypeid = typeID(typeid(T));
+        uint32_t myTypesizeof = uint32_t(sizeof(T));
+        uint8_t fpTypeid;       read_cnt = fread((void*)(&fpTypeid), sizeof(uint8_t), 1, fp);       if (read_cnt!=1) { std::cerr<<"Error at Tensor::readHeader: no data type. "<<std::endl; FatalError(__LINE__); }
+        uint32_t fpTypesizeof;  read_cnt = fread((void*)(&fpTypesizeof), sizeof(uint32_t), 1, fp);  if (read_cnt!=1) { std::cerr<<"Error at Tensor::readHeader: no data size. "<<std::endl; FatalError(__LINE__); }
+        int lenName;
+        read_cnt = fread((void*)(&lenName), sizeof(int), 1, fp);
+        if (read_cnt!=1) { std::cerr<<"Error at Tensor::readHeader: wrong data type. "<<std::endl; FatalError(__LINE__); }
+        name.resize(lenName);
+        if (lenName>0){
+            read_cnt = fread((void*)(name.data()), sizeof(char), lenName, fp);
+            if (read_cnt!=lenName) { std::cerr<<"Error at Tensor::readHeader: wrong data type. "<<std::endl; FatalError(__LINE__); }
+        }
+        int nbDims;
+        read_cnt = fread((void*)(&nbDims), sizeof(int), 1, fp);
+        if (read_cnt!=1) { std::cerr<<"Error at Tensor::readHeader: wrong data type. "<<std::endl; FatalError(__LINE__); }
+        dim.resize(nbDims);
+        if (nbDims>0){
+            read_cnt = fread((void*)(&dim[0]), sizeof(int), nbDims, fp);
+            if (read_cnt!=nbDims) { std::cerr<<"Error at Tensor::readHeader: wrong data type. "<<std::endl; FatalError(__LINE__); }
+        }
+
+        size_t headerBytes = sizeof(uint8_t) + sizeof(uint32_t) + sizeof(int) + lenName*sizeof(char) + sizeof(int) + nbDims*sizeof(int);
+
+        if (myTypeid!=fpTypeid || myTypesizeof!=fpTypesizeof){
+            std::cerr<<"Error at Tensor::readHeader: wrong data type. "<<std::endl; FatalError(__LINE__);
+        }
+
+        return headerBytes;
+    };
+
+    //support continuous read across many NdTensors
+    T* read(FILE* fp,int batch_size=1){
+        if (CPUmem!=NULL){
+            if (!isView) checkCUDA(__LINE__, deviceFree(DeviceCPU, CPUmem));
+            CPUmem = NULL;
+        }
+        isView = false;
+
+        size_t read_cnt;
+
+        uint8_t myTypeid = typeID(typeid(T));
+        uint32_t myTypesizeof = uint32_t(sizeof(T));
+
+        uint8_t fpTypeid;       read_cnt = fread((void*)(&fpTypeid), sizeof(uint8_t), 1, fp);       if (read_cnt!=1) return NULL;
+        uint32_t fpTypesizeof;  read_cnt = fread((void*)(&fpTypesizeof), sizeof(uint32_t), 1, fp);  if (read_cnt!=1) return NULL;
+
+        if (myTypeid!=fpTypeid || myTypesizeof!=fpTypesizeof){
+
+            if (myTypeid==fpTypeid && myTypesizeof!=fpTypesizeof){ std::cerr<<"Tensor read error: same type but different sizeof, maybe different computer architecture. "<<std::endl; FatalError(__LINE__);}
+
+            //if (myTypeid!=fpTypeid){ std::cerr<<"Tensor read error: different types. "<<std::endl; FatalError(__LINE__); }
+
+            if (myTypeid==typeID(typeid(half)) && fpTypeid==typeID(typeid(float))){
+                //std::cout<<std::endl<<"converting from float to half"<<std::endl;
+                fseek(fp, -(sizeof(uint8_t)+sizeof(uint32_t)), SEEK_CUR);
+                Tensor<float>* floatTensor = new Tensor<float>(fp);
+                this->dim  = floatTensor->dim ;
+                this->name = floatTensor->name;
+                Malloc(batch_size);
+                for(size_t i=0; i<numel(); ++i){
+                    half v = cpu_float2half(floatTensor->CPUmem[i]);
+                    memcpy(((half*)(CPUmem))+i,&v,sizeof(half));
+                }
+                delete floatTensor;
+            }else if (myTypeid==typeID(typeid(float)) && fpTypeid==typeID(typeid(half))){
+                fseek(fp, -(sizeof(uint8_t)+sizeof(uint32_t)), SEEK_CUR);
+                Tensor<half>* halfTensor = new Tensor<half>(fp);
+                this->dim  = halfTensor->dim ;
+                this->name = halfTensor->name;
+                Malloc(batch_size);
+                for(size_t i=0; i<numel(); ++i){
+                    float v = cpu_half2float(halfTensor->CPUmem[i]);
+                    memcpy(((float*)(CPUmem))+i,&v,sizeof(float));
+                }
+                delete halfTensor;
+            }else if (myTypeid==typeID(typeid(double)) && fpTypeid==typeID(typeid(float))){
+                fseek(fp, -(sizeof(uint8_t)+sizeof(uint32_t)), SEEK_CUR);
+                Tensor<float>* floatTensor = new Tensor<float>(fp);
+                this->dim  = floatTensor->dim ;
+                this->name = floatTensor->name;
+                Malloc(batch_size);
+                for(size_t i=0; i<numel(); ++i){
+                    double v = double(floatTensor->CPUmem[i]);
+                    memcpy(((double*)(CPUmem))+i,&v,sizeof(double));
+                }
+                delete floatTensor;
+            }else if (myTypeid==typeID(typeid(float)) && fpTypeid==typeID(typeid(double))){
                 fseek(fp, -(sizeof(uint8_t)+sizeof(uint32_t)), SEEK_CUR);
                 Tensor<double>* doubleTensor = new Tensor<double>(fp);
                 this->dim  = doubleTensor->dim ;
@@ -2723,7 +4784,7 @@ public:
             Malloc(batch_size);
             read_cnt = fread((void*)(CPUmem), sizeof(T), n, fp);
             if (read_cnt!=n){
-                delete [] CPUmem;
+                checkCUDA(__LINE__, deviceFree(DeviceCPU, CPUmem));
                 CPUmem = NULL;
                 return NULL;
             }
@@ -2737,11 +4798,11 @@ public:
         std::cout<<"  ";        memorySizePrint(n*sizeof(T));   std::cout<<std::endl;
 
         if (batch_size==1 || dim[0]%batch_size ==0){
-            CPUmem = new T [n];
+            checkCUDA(__LINE__, deviceMalloc(DeviceCPU, &CPUmem, n * sizeof(T)) );
         }else{
             int dim0 =  (dim[0]/batch_size + 1) * batch_size;
             size_t oversize = n/dim[0] * dim0;
-            CPUmem = new T [oversize];
+            checkCUDA(__LINE__, deviceMalloc(DeviceCPU, &CPUmem, oversize * sizeof(T)) );
             memset((void*)(CPUmem+n),0, (oversize-n)*sizeof(T));
         }
     };
@@ -2807,17 +4868,21 @@ public:
         return;
     };
 
-    Tensor(std::string filename, int batch_size=1): CPUmem(NULL){ read(filename,batch_size); };
+    Tensor(std::string filename, int batch_size=1): CPUmem(NULL), isView(false){ read(filename,batch_size); };
 
-    Tensor(FILE* fp): CPUmem(NULL){ read(fp); };
+    Tensor(FILE* fp): CPUmem(NULL), isView(false){ read(fp); };
 
-    Tensor(std::vector<int> dim_): dim(dim_){ CPUmem = new T [numel()]; };
+    Tensor(std::vector<int> dim_): dim(dim_), isView(false){ checkCUDA(__LINE__, deviceMalloc(DeviceCPU, &CPUmem, numBytes()) ); };
 
-    Tensor(std::vector<int> dim_, T* ptr_data): dim(dim_){ CPUmem = ptr_data; };
+    // takes ownership of ptr_data, which must come from deviceMalloc(DeviceCPU, ...)
+    Tensor(std::vector<int> dim_, T* ptr_data): dim(dim_), isView(false){ CPUmem = ptr_data; };
 
-    Tensor(std::vector<int> dim_, T initValue): dim(dim_){
+    // does not take ownership of view
+    Tensor(std::string name_, std::vector<int> dim_, T* view): name(name_), dim(dim_), CPUmem(view), isView(true){};
+
+    Tensor(std::vector<int> dim_, T initValue): dim(dim_), isView(false){
         int n = numel();
-        CPUmem = new T [n];
+        checkCUDA(__LINE__, deviceMalloc(DeviceCPU, &CPUmem, n * sizeof(T)) );
         if (initValue == T(0))
             memset(CPUmem, 0, n*sizeof(T));
         else
@@ -2825,20 +4890,20 @@ public:
 
     };
 
-    Tensor(std::string name_, std::vector<int> dim_): name(name_),dim(dim_){
-        CPUmem = new T [numel()];
+    Tensor(std::string name_, std::vector<int> dim_): name(name_),dim(dim_), isView(false){
+        checkCUDA(__LINE__, deviceMalloc(DeviceCPU, &CPUmem, numBytes()) );
     };
 
     void permute(std::vector<size_t> v){
         size_t nbItems = numofitems();
         size_t sizeofitem_ = sizeofitem();
         size_t nbBytes = sizeofitem_ * sizeof(T);
-        T* CPUmemNew = new T[numel()];
+        T* CPUmemNew;    checkCUDA(__LINE__, deviceMalloc(DeviceCPU, &CPUmemNew, numBytes()) );
         memcpy(CPUmemNew, CPUmem, nbItems * nbBytes);
         for (size_t i=0;i<nbItems;++i){
             memcpy(CPUmem+i*sizeofitem_, CPUmemNew+v[i]*sizeofitem_, nbBytes);
         }
-        delete [] CPUmemNew;
+        checkCUDA(__LINE__, deviceFree(DeviceCPU, CPUmemNew));
     };
 
 
@@ -2891,28 +4956,110 @@ public:
     };
 };
 
-template <class T>
-std::vector<Tensor<T>*> readTensors(std::string filename, size_t max_count = SIZE_MAX){
+// Container layout, version 1. The tensors are stored one after another as before (header, then payload),
+// followed by a trailing table of contents so that a tensor can be found without walking the file:
+//   end marker    a uint8 header with no name and no dimensions; sequential readers (readTensors.m, io.py)
+//                 already stop at nbDims==0, so they keep reading these files
+//   zero padding  up to a multiple of 8 bytes
+//   index         per tensor: uint64 header offset, uint64 payload offset, uint8 type, 3 padding bytes,
+//                 uint32 sizeof type, int32 name length, int32 nbDims, name, dims, zero padding to 8 bytes
+//   footer        uint64 index offset, uint32 number of tensors, uint32 version, 8 magic bytes "MARVNIDX"
+// Files without the footer are scanned header by header, as the format has always allowed.
+
+#define TENSOR_INDEX_VERSION    1
+#define TENSOR_INDEX_MAGIC      "MARVNIDX"
+#define TENSOR_CONVERT_CHUNK    (1<<18)     // elements converted per task when loading
+
+struct TensorIndexEntry{
+    std::string name;
+    uint8_t typeID;
+    uint32_t sizeofType;
+    std::vector<int> dim;
+    size_t header;      // byte offset of the header
+    size_t payload;     // byte offset of the data
+};
 
-    FILE* fp = fopen(filename.c_str(),"rb");
+void writeTensorIndex(FILE* fp, const std::vector<TensorIndexEntry>& entries){
+    const uint8_t zeros[8] = {0,0,0,0,0,0,0,0};
+
+    uint8_t markerType = typeID(typeid(uint8_t));
+    uint32_t markerSizeof = sizeof(uint8_t);
+    int markerZero = 0;
+    fwrite((void*)(&markerType), sizeof(uint8_t), 1, fp);
+    fwrite((void*)(&markerSizeof), sizeof(uint32_t), 1, fp);
+    fwrite((void*)(&markerZero), sizeof(int), 1, fp);
+    fwrite((void*)(&markerZero), sizeof(int), 1, fp);
+
+    off_t offset = ftello(fp);
+    if (offset % 8 != 0) fwrite(zeros, 1, 8 - offset % 8, fp);
+    uint64_t indexOffset = ftello(fp);
+
+    for (int i=0;i<entries.size();++i){
+        const TensorIndexEntry& e = entries[i];
+        uint64_t header = e.header;
+        uint64_t payload = e.payload;
+        int lenName = e.name.size();
+        int nbDims = e.dim.size();
+        fwrite((void*)(&header), sizeof(uint64_t), 1, fp);
+        fwrite((void*)(&payload), sizeof(uint64_t), 1, fp);
+        fwrite((void*)(&e.typeID), sizeof(uint8_t), 1, fp);
+        fwrite(zeros, 1, 3, fp);
+        fwrite((void*)(&e.sizeofType), sizeof(uint32_t), 1, fp);
+        fwrite((void*)(&lenName), sizeof(int), 1, fp);
+        fwrite((void*)(&nbDims), sizeof(int), 1, fp);
+        if (lenName>0) fwrite((void*)(e.name.data()), sizeof(char), lenName, fp);
+        if (nbDims>0) fwrite((void*)(&e.dim[0]), sizeof(int), nbDims, fp);
+        size_t tail = (lenName + nbDims*sizeof(int)) % 8;
+        if (tail != 0) fwrite(zeros, 1, 8 - tail, fp);
+    }
 
-    while (fp==NULL) {
-        std::cerr<<"readTensors: fail to open file "<<filename<<". Please provide it first. Will retry after 5 seconds."<<std::endl;
-        std::this_thread::sleep_for(std::chrono::seconds(5));
-        fp = fopen(filename.c_str(),"rb");
+    uint32_t count = entries.size();
+    uint32_t version = TENSOR_INDEX_VERSION;
+    fwrite((void*)(&indexOffset), sizeof(uint64_t), 1, fp);
+    fwrite((void*)(&count), sizeof(uint32_t), 1, fp);
+    fwrite((void*)(&version), sizeof(uint32_t), 1, fp);
+    fwrite(TENSOR_INDEX_MAGIC, sizeof(char), 8, fp);
+    if (ferror (fp)){
+        std::cerr << "disk writing failed"<<std::endl;
+        FatalError(__LINE__);
     }
+}
 
-    std::vector<Tensor<T>*> tensors;
-    size_t count = 0;
-    while (feof(fp)==0) {
-        tensors.push_back(new Tensor<T>(fp));
-        count++;
-        if (count>=max_count) break;
-        int c = getc(fp);
-        ungetc(c, fp);
+// the header of a tensor described by e, whatever its type
+void writeTensorHeader(FILE* fp, const TensorIndexEntry& e){
+    int lenName = e.name.size();
+    int nbDims = e.dim.size();
+    fwrite((void*)(&e.typeID), sizeof(uint8_t), 1, fp);
+    fwrite((void*)(&e.sizeofType), sizeof(uint32_t), 1, fp);
+    fwrite((void*)(&lenName), sizeof(int), 1, fp);
+    if (lenName>0) fwrite((void*)(e.name.data()), sizeof(char), lenName, fp);
+    fwrite((void*)(&nbDims), sizeof(int), 1, fp);
+    if (nbDims>0) fwrite((void*)(&e.dim[0]), sizeof(int), nbDims, fp);
+    if (ferror (fp)){
+        std::cerr << "disk writing failed"<<std::endl;
+        FatalError(__LINE__);
     }
-    fclose(fp);
-    return tensors;
+}
+
+// writes the header of t with dims dim, and returns its entry in the index
+template <class T>
+TensorIndexEntry writeIndexedHeader(FILE* fp, Tensor<T>* t, const std::vector<int>& dim){
+    TensorIndexEntry e;
+    e.name = t->name;
+    e.typeID = typeID(typeid(T));
+    e.sizeofType = sizeof(T);
+    e.dim = dim;
+    e.header = ftello(fp);
+    t->writeHeader(fp, dim);
+    e.payload = ftello(fp);
+    return e;
+}
+
+// writes t, adding it to the index to be written with writeTensorIndex before the file is closed
+template <class T>
+void writeIndexed(FILE* fp, Tensor<T>* t, std::vector<TensorIndexEntry>& index){
+    index.push_back(writeIndexedHeader(fp, t, t->dim));
+    t->writeData(fp);
 }
 
 template <class T>
@@ -2924,17 +5071,304 @@ void writeTensors(std::string filename, std::vector<Tensor<T>*> tensors){
         fp = fopen(filename.c_str(),"wb");
     }
 
+    std::vector<TensorIndexEntry> entries;
     for(int i=0;i<tensors.size();++i){
-        tensors[i]->write(fp);
+        writeIndexed(fp, tensors[i], entries);
     }
+    writeTensorIndex(fp, entries);
     fclose(fp);
 }
 
+// A .tensor/.marvin file mapped into memory. The table of contents is read from the footer when there is one,
+// and built by walking the headers otherwise. The payload of a tensor is used in place when it is stored with
+// the type asked for, instead of going through fread into a new buffer.
+// The mapping is private: writes through a view (mean subtraction, shuffling) land in copy-on-write pages and
+// never reach the file. Payloads follow variable-length headers and may be unaligned for their type, so get()
+// only hands out aligned views unless told the caller just copies. Views live as long as the TensorFile.
+class TensorFile{
+    char* base;
+    size_t bytes;
+    std::map<std::string,int> byName;
+
+    void take(size_t& offset, void* dst, size_t n){
+        if (offset + n > bytes){ std::cerr<<"TensorFile: "<<filename<<" is truncated at byte "<<offset<<std::endl; FatalError(__LINE__); }
+        memcpy(dst, base + offset, n);
+        offset += n;
+    };
+
+    void check(const TensorIndexEntry& e){
+        if (e.payload + numel(e.dim) * e.sizeofType > bytes){ std::cerr<<"TensorFile: "<<filename<<" is truncated in "<<e.name<<std::endl; FatalError(__LINE__); }
+    };
+
+    template <class T>
+    bool convertible(const TensorIndexEntry& e){
+        return CPUConvertible(e.typeID) && CPUConvertible(typeID(typeid(T)));
+    };
+
+    // elements [begin, end) of e into y
+    template <class T>
+    void convert(const TensorIndexEntry& e, T* y, size_t begin, size_t end){
+        const char* x = base + e.payload + begin * e.sizeofType;
+        switch (e.typeID){
+            case 0: CPU_convert<half>  (end - begin, x, y + begin); break;
+            case 1: CPU_convert<float> (end - begin, x, y + begin); break;
+            case 2: CPU_convert<double>(end - begin, x, y + begin); break;
+        }
+    };
+
+    bool readIndex(){
+        const size_t footerBytes = sizeof(uint64_t) + 2*sizeof(uint32_t) + 8;
+        if (bytes < footerBytes || memcmp(base + bytes - 8, TENSOR_INDEX_MAGIC, 8)!=0) return false;
+
+        size_t offset = bytes - footerBytes;
+        uint64_t indexOffset;   take(offset, &indexOffset, sizeof(uint64_t));
+        uint32_t count;         take(offset, &count, sizeof(uint32_t));
+        uint32_t version;       take(offset, &version, sizeof(uint32_t));
+        if (version > TENSOR_INDEX_VERSION){
+            std::cerr<<"TensorFile: "<<filename<<" has an index of version "<<version<<", newer than this build understands"<<std::endl;
+            FatalError(__LINE__);
+        }
+
+        offset = indexOffset;
+        entries.resize(count);
+        for (int i=0;i<count;++i){
+            TensorIndexEntry& e = entries[i];
+            uint64_t header;    take(offset, &header, sizeof(uint64_t));
+            uint64_t payload;   take(offset, &payload, sizeof(uint64_t));
+            e.header = header;
+            e.payload = payload;
+            take(offset, &e.typeID, sizeof(uint8_t));
+            offset += 3;
+            take(offset, &e.sizeofType, sizeof(uint32_t));
+            int lenName;        take(offset, &lenName, sizeof(int));
+            int nbDims;         take(offset, &nbDims, sizeof(int));
+            e.name.resize(lenName);
+            if (lenName>0) take(offset, &e.name[0], lenName);
+            e.dim.resize(nbDims);
+            if (nbDims>0) take(offset, &e.dim[0], nbDims * sizeof(int));
+            size_t tail = (lenName + nbDims*sizeof(int)) % 8;
+            if (tail != 0) offset += 8 - tail;
+            check(e);
+        }
+        return true;
+    };
+
+    void scan(){
+        size_t offset = 0;
+        while (offset < bytes){
+            TensorIndexEntry e;
+            e.header = offset;
+            take(offset, &e.typeID, sizeof(uint8_t));
+            take(offset, &e.sizeofType, sizeof(uint32_t));
+            int lenName;
+            take(offset, &lenName, sizeof(int));
+            e.name.resize(lenName);
+            if (lenName>0) take(offset, &e.name[0], lenName);
+            int nbDims;
+            take(offset, &nbDims, sizeof(int));
+            if (nbDims==0) break;   // end marker, or the zero padding at the end of a feature file
+            e.dim.resize(nbDims);
+            take(offset, &e.dim[0], nbDims * sizeof(int));
+            e.payload = offset;
+            check(e);
+            offset += numel(e.dim) * e.sizeofType;
+            entries.push_back(e);
+        }
+    };
+
+public:
+    typedef TensorIndexEntry Entry;
+
+    std::string filename;
+    std::vector<Entry> entries;
+
+    TensorFile(std::string filename_): base(NULL), bytes(0), filename(filename_){
+        int fd = open(filename.c_str(), O_RDONLY);
+        while (fd<0) {
+            std::cerr<<"TensorFile: fail to open file "<<filename<<". Please provide it first. Will retry after 5 seconds."<<std::endl;
+            std::this_thread::sleep_for(std::chrono::seconds(5));
+            fd = open(filename.c_str(), O_RDONLY);
+        }
+        struct stat st;
+        if (fstat(fd, &st)!=0){ std::cerr<<"TensorFile: fail to stat "<<filename<<std::endl; FatalError(__LINE__); }
+        bytes = st.st_size;
+        if (bytes>0){
+            void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (p==MAP_FAILED){ std::cerr<<"TensorFile: fail to map "<<filename<<std::endl; FatalError(__LINE__); }
+            base = (char*)p;
+        }
+        close(fd);
+
+        if (!readIndex()) scan();
+        for (int i=entries.size()-1;i>=0;--i) byName[entries[i].name] = i;
+    };
+
+    ~TensorFile(){
+        if (base!=NULL) munmap(base, bytes);
+    };
+
+    // the first tensor called name, or -1
+    int find(const std::string& name){
+        std::map<std::string,int>::iterator it = byName.find(name);
+        return it==byName.end() ? -1 : it->second;
+    };
+
+    // Read-ahead for the payload of e, about to be copied out in one pass. Tensors used in place (get) keep the
+    // default, as MemoryData gathers from them in random order.
+    void sequential(const Entry& e){
+        if (base==NULL) return;
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t begin = e.payload / page * page;
+        size_t end = std::min(bytes, e.payload + numel(e.dim) * e.sizeofType);
+        if (end > begin) madvise(base + begin, end - begin, MADV_SEQUENTIAL);
+    };
+
+    // a copy of tensor i, converted to T if it is stored otherwise, padded to a whole number of batches
+    template <class T>
+    Tensor<T>* read(int i, int batch_size=1){
+        const Entry& e = entries[i];
+        sequential(e);
+        Tensor<T>* t = new Tensor<T>();
+        if (e.typeID==typeID(typeid(T)) && e.sizeofType==sizeof(T)){
+            t->name = e.name;
+            t->dim = e.dim;
+            t->Malloc(batch_size);
+            memcpy((void*)(t->CPUmem), base + e.payload, t->numBytes());
+            return t;
+        }
+        if (convertible<T>(e)){
+            t->name = e.name;
+            t->dim = e.dim;
+            t->Malloc(batch_size);
+            CPU_parallel_for(t->numel(), [&](size_t begin, size_t end){
+                convert(e, t->CPUmem, begin, end);
+            }, TENSOR_CONVERT_CHUNK);
+            return t;
+        }
+        FILE* fp = fopen(filename.c_str(),"rb");
+        if (fp==NULL || fseeko(fp, off_t(e.header), SEEK_SET)!=0){ std::cerr<<"TensorFile: fail to read "<<filename<<std::endl; FatalError(__LINE__); }
+        t->read(fp, batch_size);
+        fclose(fp);
+        return t;
+    };
+
+    // Tensor i in place when it is stored as T, as long as the payload is aligned for T (unless aligned is false,
+    // for callers that only copy from it) and, for batch_size>1, needs no padding to a whole number of batches.
+    // Otherwise a copy from read().
+    template <class T>
+    Tensor<T>* get(int i, int batch_size=1, bool aligned=true){
+        const Entry& e = entries[i];
+        bool sameType = e.typeID==typeID(typeid(T)) && e.sizeofType==sizeof(T);
+        bool padded = batch_size>1 && e.dim[0] % batch_size != 0;
+        if (sameType && !padded && (!aligned || e.payload % sizeof(T)==0)){
+            return new Tensor<T>(e.name, e.dim, (T*)(base + e.payload));
+        }
+        return read<T>(i, batch_size);
+    };
+
+    // Every tensor, for callers that copy them somewhere else (such as Net::loadWeights). Tensors that need
+    // converting are cut into chunks and converted together on the CPU pool, so a model stored as float
+    // loads into half storage on all cores instead of one.
+    template <class T>
+    std::vector<Tensor<T>*> tensors(){
+        std::vector<Tensor<T>*> all(entries.size(), NULL);
+        std::vector<std::pair<int,size_t> > chunks;     // (tensor, first element)
+        for (int i=0;i<entries.size();++i){
+            const Entry& e = entries[i];
+            sequential(e);
+            if (e.typeID==typeID(typeid(T)) && e.sizeofType==sizeof(T)){
+                all[i] = get<T>(i, 1, false);
+            }else if (convertible<T>(e)){
+                all[i] = new Tensor<T>(e.name, e.dim);
+                for (size_t k=0;k<numel(e.dim);k+=TENSOR_CONVERT_CHUNK) chunks.push_back(std::make_pair(i,k));
+            }else{
+                all[i] = read<T>(i);
+            }
+        }
+        CPU_parallel_for(chunks.size(), [&](size_t begin, size_t end){
+            for (size_t c=begin;c<end;++c){
+                int i = chunks[c].first;
+                size_t k = chunks[c].second;
+                convert(entries[i], all[i]->CPUmem, k, std::min(k + TENSOR_CONVERT_CHUNK, numel(entries[i].dim)));
+            }
+        }, 1);
+        return all;
+    };
+};
+
+template <class T>
+std::vector<Tensor<T>*> readTensors(std::string filename, size_t max_count = SIZE_MAX){
+    TensorFile file(filename);
+    std::vector<Tensor<T>*> tensors;
+    for (size_t i=0;i<file.entries.size() && i<max_count;++i){
+        tensors.push_back(file.read<T>(i));
+    }
+    return tensors;
+}
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
 // Response and Layer
 //////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Buffers shared by responses whose lifetimes do not overlap. Net::Malloc gives a buffer back to the pool after
+// the last layer touching its response; the next response takes the smallest free buffer that is big enough,
+// or grows the largest free one when none is.
+class ResponsePool{
+    Device device;
+    std::vector<StorageT*> buffers;
+    std::vector<size_t> bytes;
+    std::vector<bool> busy;
+public:
+    size_t requestedBytes; // what the responses would take with a buffer each
+
+    ResponsePool(Device device_): device(device_), requestedBytes(0){};
+
+    ~ResponsePool(){
+        for (int i=0;i<buffers.size();++i) checkCUDA(__LINE__, deviceFree(device, buffers[i]));
+    };
+
+    size_t totalBytes(){
+        size_t total = 0;
+        for (int i=0;i<bytes.size();++i) total += bytes[i];
+        return total;
+    };
+
+    // returns how much the pool grew
+    size_t acquire(size_t n, StorageT** p){
+        requestedBytes += n;
+        int best = -1, largest = -1;
+        for (int i=0;i<buffers.size();++i){
+            if (busy[i]) continue;
+            if (bytes[i]>=n && (best<0 || bytes[i]<bytes[best])) best = i;
+            if (largest<0 || bytes[i]>bytes[largest]) largest = i;
+        }
+        size_t grown = 0;
+        if (best<0){
+            if (largest<0){
+                best = buffers.size();
+                buffers.push_back(NULL);
+                bytes.push_back(0);
+                busy.push_back(false);
+            }else{
+                best = largest;
+                checkCUDA(__LINE__, deviceFree(device, buffers[best]));
+            }
+            checkCUDA(__LINE__, deviceMalloc(device, &buffers[best], n) );
+            grown = n - bytes[best];
+            bytes[best] = n;
+        }
+        busy[best] = true;
+        *p = buffers[best];
+        return grown;
+    };
+
+    void release(StorageT* p){
+        for (int i=0;i<buffers.size();++i){
+            if (buffers[i]==p) busy[i] = false;
+        }
+    };
+};
+
 class Response{
 public:
     std::string name;
@@ -2944,6 +5378,9 @@ public:
     std::vector<int> number_group;
 
     bool isProxy;
+    Device device;
+    ResponsePool* pool; // dataGPU is borrowed from the pool when set
+    Response* alias;    // written in place over alias, whose buffers it shares (see Net::planInPlace)
 
     StorageT* dataGPU;
     StorageT* diffGPU;
@@ -2959,8 +5396,17 @@ public:
 
     size_t numBytes(){ return sizeofStorageT*(marvin::numel(dim)); };
 
-    Response(std::string name_, bool need_diff_=false): name(name_), dataGPU(NULL), diffGPU(NULL), need_diff(need_diff_), isProxy(false){
-        checkCUDNN(__LINE__,cudnnCreateTensorDescriptor(&desc));
+    // false for a slice of a larger response, whose items are further apart than sizeofitem()
+    bool packed(){ return stride.empty() || size_t(stride[0])==sizeofitem(); };
+
+    Response(std::string name_, bool need_diff_=false): name(name_), desc(NULL), cublasHandle(NULL), dataGPU(NULL), diffGPU(NULL), need_diff(need_diff_), isProxy(false), device(DeviceGPU), pool(NULL), alias(NULL){
+    };
+
+    // the response whose buffers this one ends up using
+    Response* owner(){
+        Response* r = this;
+        while (r->alias!=NULL) r = r->alias;
+        return r;
     };
 
     size_t Malloc(std::vector<int> dim_, StorageT* dataGPUexisting=NULL, StorageT* diffGPUexisting=NULL){
@@ -2975,11 +5421,14 @@ public:
                 stride[d] = stride[d+1] *  dim[d+1];
             }
 
-            checkCUDNN(__LINE__,cudnnSetTensorNdDescriptor(desc,
-                                                    CUDNNStorageT,
-                                                    dim.size(),
-                                                    &dim[0],
-                                                    &stride[0]) );
+            if (device==DeviceGPU){
+                checkCUDNN(__LINE__,cudnnCreateTensorDescriptor(&desc));
+                checkCUDNN(__LINE__,cudnnSetTensorNdDescriptor(desc,
+                                                        CUDNNStorageT,
+                                                        dim.size(),
+                                                        &dim[0],
+                                                        &stride[0]) );
+            }
 
             std::cout<<"                                                                               ";
             std::cout<< (need_diff? "* " : "  ");
@@ -2991,8 +5440,20 @@ public:
 
             std::cout<<std::endl;
 
-            if (dataGPUexisting==NULL){            
-                checkCUDA(__LINE__, cudaMalloc(&dataGPU, numel(dim) * sizeofStorageT) );
+            if (dataGPUexisting==NULL && alias!=NULL){
+                // an alias not malloced yet, or without a diff to share, leaves this one with buffers of its own
+                if (alias->dataGPU!=NULL && (!need_diff || alias->diffGPU!=NULL)){
+                    dataGPUexisting = alias->dataGPU;
+                    diffGPUexisting = alias->diffGPU;
+                }else{
+                    alias = NULL;
+                }
+            }
+
+            if (dataGPUexisting==NULL && pool!=NULL){
+                memoryBytes += pool->acquire(numel(dim) * sizeofStorageT, &dataGPU);
+            }else if (dataGPUexisting==NULL){
+                checkCUDA(__LINE__, deviceMalloc(device, &dataGPU, numel(dim) * sizeofStorageT) );
                 memoryBytes += numel(dim) * sizeofStorageT;
             }else{
                 dataGPU = dataGPUexisting;
@@ -3001,7 +5462,7 @@ public:
 
             if (need_diff){
                 if (diffGPUexisting==NULL){                
-                    checkCUDA(__LINE__, cudaMalloc(&diffGPU, numel(dim) * sizeofStorageT) );
+                    checkCUDA(__LINE__, deviceMalloc(device, &diffGPU, numel(dim) * sizeofStorageT) );
                     memoryBytes += numel(dim) * sizeofStorageT;
                 }else{
                     diffGPU = diffGPUexisting;
@@ -3049,45 +5510,74 @@ public:
     }
 
     ~Response(){
-        checkCUDNN(__LINE__,cudnnDestroyTensorDescriptor(desc));
+        if (desc!=NULL) checkCUDNN(__LINE__,cudnnDestroyTensorDescriptor(desc));
         for (int i=0; i<desc_group.size();++i){
             checkCUDNN(__LINE__,cudnnDestroyTensorDescriptor(desc_group[i]));
         }
-        if (dataGPU!=NULL && !isProxy) checkCUDA(__LINE__, cudaFree(dataGPU));
-        if (diffGPU!=NULL && !isProxy) checkCUDA(__LINE__, cudaFree(diffGPU));
+        if (dataGPU!=NULL && !isProxy && pool==NULL) checkCUDA(__LINE__, deviceFree(device, dataGPU));
+        if (diffGPU!=NULL && !isProxy) checkCUDA(__LINE__, deviceFree(device, diffGPU));
+    };
+
+    // Makes this response channels [channel, channel+dim[1]) of parent, whose other dims it has: from now on it uses
+    // parent's buffers with parent's strides, and frees its own.
+    void sliceOf(Response* parent, int channel){
+        if (!isProxy){
+            if (dataGPU!=NULL) checkCUDA(__LINE__, deviceFree(device, dataGPU));
+            if (diffGPU!=NULL) checkCUDA(__LINE__, deviceFree(device, diffGPU));
+        }
+        size_t offset = size_t(channel) * parent->stride[1];
+        dataGPU = parent->dataGPU + offset;
+        if (diffGPU!=NULL) diffGPU = parent->diffGPU + offset;
+        isProxy = true;
+        stride = parent->stride;
+        if (desc!=NULL) checkCUDNN(__LINE__,cudnnSetTensorNdDescriptor(desc, CUDNNStorageT, dim.size(), &dim[0], &stride[0]));
+        for (int i=0;i<desc_group.size();++i){
+            std::vector<int> dim_group = dim;
+            dim_group[1] = dim[1]/number_group[i];
+            checkCUDNN(__LINE__,cudnnSetTensorNdDescriptor(desc_group[i], CUDNNStorageT, dim_group.size(), &dim_group[0], &stride[0]));
+        }
+    };
+
+    // after the last layer using it, the buffer may be handed to another response
+    void release(){
+        if (pool!=NULL && dataGPU!=NULL) pool->release(dataGPU);
     };
 
     void clearDiff(){
         if (diffGPU!=NULL && !isProxy){
-            checkCUDA(__LINE__, cudaMemset(diffGPU, 0, sizeofStorageT * numel(dim)));
+            checkCUDA(__LINE__, deviceMemset(device, diffGPU, 0, sizeofStorageT * numel(dim)));
         }
     };
 
     void print(std::vector<int> display_dim, bool printData=true){
         if (!printData && diffGPU==NULL) return;
         Tensor<StorageT>* feature = new Tensor<StorageT>(dim);
-        feature->readGPU((printData? dataGPU: diffGPU));
+        feature->readGPU((printData? dataGPU: diffGPU), device);
         feature->print(display_dim);
         delete feature;
     };
 
 
+    // the debugging summaries below skip slices: the response they belong to is checked as a whole
     int checkNaN(){
-        return marvin::checkNaN(dataGPU, numel(dim));
+        if (!packed()) return 0;
+        return marvin::checkNaN(dataGPU, numel(dim), device);
     };
 
     int checkNaNdiff(){
-        return marvin::checkNaN(diffGPU, numel(dim));
+        if (!packed()) return 0;
+        return marvin::checkNaN(diffGPU, numel(dim), device);
     };
 
     ComputeT ameanData(){
-        if (dataGPU!=NULL){
+        if (dataGPU!=NULL && packed()){
             ComputeT result;
             size_t n = numel(dim);
             //std::cout<<"n="<<n<<std::endl;
             //std::cout<<"cublasHandle="<<cublasHandle<<std::endl;
             //std::cout<<"dataGPU="<<dataGPU<<std::endl;
-            checkCUBLAS(__LINE__, GPUasum(cublasHandle, n, dataGPU, 1, &result));
+            if (device==DeviceCPU) result = CPU_asum(n, dataGPU);
+            else checkCUBLAS(__LINE__, GPUasum(cublasHandle, n, dataGPU, 1, &result));
             result /= ComputeT(n);
             return result;
         }else{
@@ -3095,10 +5585,11 @@ public:
         }
     };
     ComputeT ameanDiff(){
-        if (diffGPU!=NULL){
+        if (diffGPU!=NULL && packed()){
             ComputeT result;
             size_t n = numel(dim);
-            checkCUBLAS(__LINE__, GPUasum(cublasHandle, n, diffGPU, 1, &result));
+            if (device==DeviceCPU) result = CPU_asum(n, diffGPU);
+            else checkCUBLAS(__LINE__, GPUasum(cublasHandle, n, diffGPU, 1, &result));
             result /= ComputeT(n);
             return result;
         }else{
@@ -3126,6 +5617,7 @@ public:
 
     // parameters:
     int GPU;
+    Device device;
 
     std::string name;
     Phase phase;
@@ -3151,9 +5643,8 @@ public:
               weight_diffGPU(NULL), weight_histGPU(NULL), bias_dataGPU(NULL),
               bias_diffGPU(NULL), bias_histGPU(NULL), weight_numel(0),
               bias_numel(0), weight_decay_mult(ComputeT(1)),
-              bias_decay_mult(ComputeT(1)) {
-        checkCUDNN(__LINE__, cudnnCreate(&cudnnHandle));
-        checkCUBLAS(__LINE__, cublasCreate(&cublasHandle));
+              bias_decay_mult(ComputeT(1)), cudnnHandle(NULL),
+              cublasHandle(NULL), device(DeviceGPU) {
         std::random_device rd;
         rng.seed(rd());
     };
@@ -3164,26 +5655,24 @@ public:
                                bias_dataGPU(NULL), bias_diffGPU(NULL),
                                bias_histGPU(NULL), weight_numel(0),
                                bias_numel(0), weight_decay_mult(ComputeT(1)),
-                               bias_decay_mult(ComputeT(1)) {
-        checkCUDNN(__LINE__, cudnnCreate(&cudnnHandle));
-        checkCUBLAS(__LINE__, cublasCreate(&cublasHandle));
+                               bias_decay_mult(ComputeT(1)), cudnnHandle(NULL),
+                               cublasHandle(NULL), device(DeviceGPU) {
         std::random_device rd;
         rng.seed(rd());
     };
 
     virtual ~Layer() {
         if (weight_dataGPU != NULL)
-            checkCUDA(__LINE__, cudaFree(weight_dataGPU));
+            checkCUDA(__LINE__, deviceFree(device, weight_dataGPU));
 
-        if (bias_dataGPU != NULL) checkCUDA(__LINE__, cudaFree(bias_dataGPU));
+        if (bias_dataGPU != NULL) checkCUDA(__LINE__, deviceFree(device, bias_dataGPU));
     };
 
     ComputeT ameanWeightData() {
         if (weight_dataGPU == NULL) return -1;
         ComputeT result;
         size_t n = numel(weight_dim);
-        checkCUBLAS(__LINE__,
-                    GPUasum(cublasHandle, n, weight_dataGPU, 1, &result));
+        result = asum(n, weight_dataGPU);
         result /= ComputeT(n);
         return result;
     };
@@ -3192,26 +5681,24 @@ public:
         if (weight_diffGPU == NULL) return -1;
         ComputeT result;
         size_t n = numel(weight_dim);
-        checkCUBLAS(__LINE__,
-                    GPUasum(cublasHandle, n, weight_diffGPU, 1, &result));
+        result = asum(n, weight_diffGPU);
         result /= ComputeT(n);
         return result;
     };
 
     int checkNaNWeight(){
-        return marvin::checkNaN(weight_dataGPU, numel(weight_dim));
+        return marvin::checkNaN(weight_dataGPU, numel(weight_dim), device);
     };
 
     int checkNaNWeightDiff(){
-        return marvin::checkNaN(weight_diffGPU, numel(weight_dim));
+        return marvin::checkNaN(weight_diffGPU, numel(weight_dim), device);
     };    
 
     ComputeT ameanBiasData() {
         if (bias_dataGPU == NULL) return -1;
         ComputeT result;
         size_t n = numel(bias_dim);
-        checkCUBLAS(__LINE__,
-                    GPUasum(cublasHandle, n, bias_dataGPU, 1, &result));
+        result = asum(n, bias_dataGPU);
         result /= ComputeT(n);
         return result;
     };
@@ -3220,18 +5707,17 @@ public:
         if (bias_diffGPU == NULL) return -1;
         ComputeT result;
         size_t n = numel(bias_dim);
-        checkCUBLAS(__LINE__,
-                    GPUasum(cublasHandle, n, bias_diffGPU, 1, &result));
+        result = asum(n, bias_diffGPU);
         result /= ComputeT(n);
         return result;
     };
 
     int checkNaNBias(){
-        return marvin::checkNaN(bias_dataGPU, numel(bias_dim));
+        return marvin::checkNaN(bias_dataGPU, numel(bias_dim), device);
     };
 
     int checkNaNBiasDiff(){
-        return marvin::checkNaN(bias_diffGPU, numel(bias_dim));
+        return marvin::checkNaN(bias_diffGPU, numel(bias_dim), device);
     };       
 
     void addIn(Response *r) { in.push_back(r); };
@@ -3250,6 +5736,38 @@ public:
 
     virtual bool isDataLayer() { return false; };
 
+    // The input out[o] may share its buffers with, -1 if it needs its own: forward has to be done reading each
+    // element of that input before writing the same element of out[o], and, in Training, backward must not
+    // need the input's data and must compute the input's diff in place over out[o]'s.
+    virtual int inPlace(int o, Phase phase_) { return -1; };
+
+    // The input whose elements out[o] holds unchanged and in the same order, only under other dims; -1 if none.
+    // Net::planInPlace has out[o] share that input's buffers.
+    virtual int viewOf(int o) { return -1; };
+
+    // Whether forward and backward cope with r, one of in or out, being a slice of a larger response
+    // (Response::packed() false); restrided() is called once some of them have become one.
+    virtual bool strided(Response* r) { return false; };
+    virtual void restrided() { };
+
+    // asum on whichever device holds the buffer
+    ComputeT asum(size_t n, const StorageT* x) {
+        ComputeT result;
+        if (device == DeviceCPU) return CPU_asum(n, x);
+        checkCUBLAS(__LINE__, GPUasum(cublasHandle, n, x, 1, &result));
+        return result;
+    };
+
+    // C = alpha * op(A) * op(B) + beta * C on whichever device holds the buffers
+    void gemm(cublasOperation_t transa, cublasOperation_t transb, int m, int n, int k,
+              const ComputeT *alpha, const StorageT *A, int lda, const StorageT *B, int ldb,
+              const ComputeT *beta, StorageT *C, int ldc) {
+        if (device == DeviceCPU)
+            CPU_gemm(transa, transb, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+        else
+            checkCUBLAS(__LINE__, GPUgemm(cublasHandle, transa, transb, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc));
+    };
+
     void fillGPU(StorageT *GPUmem, std::vector<int> dim, Filler filler,
                  ComputeT param = 0) {
         int n = numel(dim);
@@ -3282,8 +5800,8 @@ public:
             }
             break;
         }
-        checkCUDA(__LINE__, cudaMemcpy(GPUmem, CPUbuf, n * sizeofStorageT,
-                                       cudaMemcpyHostToDevice));
+        checkCUDA(__LINE__, deviceMemcpy(device, GPUmem, CPUbuf, n * sizeofStorageT,
+                                         cudaMemcpyHostToDevice));
 
         delete[] CPUbuf;
     }
@@ -3296,25 +5814,25 @@ public:
 
     void clearDiff() {
         if (weight_diffGPU != NULL)
-            checkCUDA(__LINE__, cudaMemset(weight_diffGPU, 0,
-                                           sizeofStorageT * weight_numel));
+            checkCUDA(__LINE__, deviceMemset(device, weight_diffGPU, 0,
+                                             sizeofStorageT * weight_numel));
         if (bias_diffGPU != NULL)
-            checkCUDA(__LINE__, cudaMemset(bias_diffGPU, 0,
-                                           sizeofStorageT * bias_numel));
+            checkCUDA(__LINE__, deviceMemset(device, bias_diffGPU, 0,
+                                             sizeofStorageT * bias_numel));
         for(int l=0;l<sub_layers.size();++l) sub_layers[l]->clearDiff();
     };
 
     void clearHist() {
         if (weight_diffGPU != NULL)
-            checkCUDA(__LINE__, cudaMemset(weight_histGPU, 0,
-                                           sizeofStorageT * weight_numel));
+            checkCUDA(__LINE__, deviceMemset(device, weight_histGPU, 0,
+                                             sizeofStorageT * weight_numel));
         if (bias_diffGPU != NULL)
-            checkCUDA(__LINE__, cudaMemset(bias_histGPU, 0,
-                                           sizeofStorageT * bias_numel));
+            checkCUDA(__LINE__, deviceMemset(device, bias_histGPU, 0,
+                                             sizeofStorageT * bias_numel));
         for(int l=0;l<sub_layers.size();++l) sub_layers[l]->clearHist();
     };
 
-    void setWeights(std::vector<Tensor<StorageT> *> weights) {
+    virtual void setWeights(std::vector<Tensor<StorageT> *> weights) {
         for (int i = 0; i < weights.size(); ++i) {
             if (weight_dataGPU != NULL &&
                 weights[i]->name == name + ".weight") {
@@ -3331,7 +5849,7 @@ public:
                     std::cout << " " << name << ".weight";
                     veciPrint(weights[i]->dim);
                     std::cout << " is set." << std::endl;
-                    weights[i]->writeGPU(weight_dataGPU);
+                    weights[i]->writeGPU(weight_dataGPU, device);
                 } else {
                     std::cout << "[Warning] " << name <<
                     ".weight is found but not loaded because the numels are mismatched: ";
@@ -3356,7 +5874,7 @@ public:
                     std::cout << " " << name << ".bias";
                     veciPrint(weights[i]->dim);
                     std::cout << " is set." << std::endl;
-                    weights[i]->writeGPU(bias_dataGPU);
+                    weights[i]->writeGPU(bias_dataGPU, device);
                 } else {
                     std::cout << "[Warning] " << name <<
                     ".bias is found but not loaded because the numels are mismatched: ";
@@ -3372,24 +5890,24 @@ public:
         for(int l=0;l<sub_layers.size();++l) sub_layers[l]->setWeights(weights);
     };
 
-    void saveWeights(FILE *fp) {
+    virtual void saveWeights(FILE *fp, std::vector<TensorIndexEntry>& index) {
         if (weight_dataGPU != NULL) {
             Tensor <StorageT> *t = new Tensor<StorageT>(
                 name + ".weight", weight_dim);
-            t->readGPU(weight_dataGPU);
-            t->write(fp);
+            t->readGPU(weight_dataGPU, device);
+            writeIndexed(fp, t, index);
             delete t;
         }
 
         if (bias_dataGPU != NULL) {
             Tensor <StorageT> *t = new Tensor<StorageT>(
                 name + ".bias", bias_dim);
-            t->readGPU(bias_dataGPU);
-            t->write(fp);
+            t->readGPU(bias_dataGPU, device);
+            writeIndexed(fp, t, index);
             delete t;
         }
 
-        for(int l=0;l<sub_layers.size();++l) sub_layers[l]->saveWeights(fp);
+        for(int l=0;l<sub_layers.size();++l) sub_layers[l]->saveWeights(fp, index);
     };
 
     void printWeights(std::vector<int> display_weight,
@@ -3397,14 +5915,14 @@ public:
         if (weight_dataGPU != NULL) {
             Tensor <StorageT> *t = new Tensor<StorageT>(
                 name + ".weight", weight_dim);
-            t->readGPU(weight_dataGPU);
+            t->readGPU(weight_dataGPU, device);
             t->print(display_weight);
             delete t;
         }
         if (bias_dataGPU != NULL) {
             Tensor <StorageT> *t = new Tensor<StorageT>(
                 name + ".bias", bias_dim);
-            t->readGPU(bias_dataGPU);
+            t->readGPU(bias_dataGPU, device);
             t->print(display_bias);
             delete t;
         }
@@ -3419,38 +5937,38 @@ public:
                 std::cout << " " << name << ".weight_diff";
                 veciPrint(weights[i]->dim);
                 std::cout << " is set." << std::endl;
-                weights[i]->writeGPU(weight_diffGPU);
+                weights[i]->writeGPU(weight_diffGPU, device);
             }
             if (bias_diffGPU != NULL &&
                 weights[i]->name == name + ".bias_diff") {
                 std::cout << " " << name << ".bias_diff";
                 veciPrint(weights[i]->dim);
                 std::cout << " is set." << std::endl;
-                weights[i]->writeGPU(bias_diffGPU);
+                weights[i]->writeGPU(bias_diffGPU, device);
             }
         }
 
         for(int l=0;l<sub_layers.size();++l) sub_layers[l]->setDiffs(weights);
     };
 
-    void saveDiffs(FILE *fp) {
+    void saveDiffs(FILE *fp, std::vector<TensorIndexEntry>& index) {
         if (weight_diffGPU != NULL) {
             Tensor <StorageT> *t = new Tensor<StorageT>(
                 name + ".weight_diff", weight_dim);
-            t->readGPU(weight_diffGPU);
-            t->write(fp);
+            t->readGPU(weight_diffGPU, device);
+            writeIndexed(fp, t, index);
             delete t;
         }
 
         if (bias_diffGPU != NULL) {
             Tensor <StorageT> *t = new Tensor<StorageT>(
                 name + ".bias_diff", bias_dim);
-            t->readGPU(bias_diffGPU);
-            t->write(fp);
+            t->readGPU(bias_diffGPU, device);
+            writeIndexed(fp, t, index);
             delete t;
         }
 
-        for(int l=0;l<sub_layers.size();++l) sub_layers[l]->saveDiffs(fp);
+        for(int l=0;l<sub_layers.size();++l) sub_layers[l]->saveDiffs(fp, index);
     };
 
     void printDiffs(std::vector<int> display_weight,
@@ -3458,14 +5976,14 @@ public:
         if (weight_diffGPU != NULL) {
             Tensor <StorageT> *t = new Tensor<StorageT>(
                 name + ".weight_diff", weight_dim);
-            t->readGPU(weight_diffGPU);
+            t->readGPU(weight_diffGPU, device);
             t->print(display_weight);
             delete t;
         }
         if (bias_diffGPU != NULL) {
             Tensor <StorageT> *t = new Tensor<StorageT>(
                 name + ".bias_diff", bias_dim);
-            t->readGPU(bias_diffGPU);
+            t->readGPU(bias_diffGPU, device);
             t->print(display_bias);
             delete t;
         }
@@ -3474,10 +5992,17 @@ public:
 
     void update() {
         if (train_me) {
-            if (weight_numel > 0 && weight_histGPU != NULL)
-                bsa2b(weight_numel, weight_histGPU, weight_dataGPU);
-            if (bias_numel > 0 && bias_histGPU != NULL)
-                bsa2b(bias_numel, bias_histGPU, bias_dataGPU);
+            if (device == DeviceCPU) {
+                if (weight_numel > 0 && weight_histGPU != NULL)
+                    CPU_bsa2b(weight_numel, weight_histGPU, weight_dataGPU);
+                if (bias_numel > 0 && bias_histGPU != NULL)
+                    CPU_bsa2b(bias_numel, bias_histGPU, bias_dataGPU);
+            } else {
+                if (weight_numel > 0 && weight_histGPU != NULL)
+                    bsa2b(weight_numel, weight_histGPU, weight_dataGPU);
+                if (bias_numel > 0 && bias_histGPU != NULL)
+                    bsa2b(bias_numel, bias_histGPU, bias_dataGPU);
+            }
             for(int l=0;l<sub_layers.size();++l) sub_layers[l]->update();
         }
     };
@@ -3494,11 +6019,47 @@ public:
     bool random;
     int counter;
     int epoch;
+
+    // Data-parallel replicas of a net each train on their own part of one permutation per epoch, which they
+    // all draw alike from sampler_rng seeded the same; replica_rank is this one of replica_count.
+    int replica_rank;
+    int replica_count;
+    std::mt19937 sampler_rng;
+
     bool isDataLayer(){ return true; };
-    DataLayer(): counter(0), epoch(0), random(false){};
-    DataLayer(std::string name_): Layer(name_), counter(0), epoch(0), random(false){};
+    DataLayer(): counter(0), epoch(0), random(false), replica_rank(0), replica_count(1){
+        std::random_device rd;
+        sampler_rng.seed(rd());
+    };
+    DataLayer(std::string name_): Layer(name_), counter(0), epoch(0), random(false), replica_rank(0), replica_count(1){
+        std::random_device rd;
+        sampler_rng.seed(rd());
+    };
     virtual int numofitems() = 0;
     virtual void shuffle() = 0;
+
+    // called before Malloc on every replica, with the same seed; Testing layers keep reading in file order
+    void setReplica(int rank, int count, unsigned seed){
+        replica_rank = rank;
+        replica_count = count;
+        sampler_rng.seed(seed);
+        if (phase!=Testing) shuffle();
+    };
+
+    // This replica's contiguous part of the permutation perm. It is wrapped around at the end, so every
+    // replica gets the same number of items and they all finish an epoch at the same step. The part must hold
+    // at least one batch.
+    std::vector<size_t> partition(const std::vector<size_t>& perm, int batch_size){
+        if (replica_count<=1 || perm.empty()) return perm;
+        size_t share = (perm.size() + replica_count - 1) / replica_count;
+        if (share < size_t(batch_size)){
+            std::cerr<<"DataLayer "<<name<<": "<<perm.size()<<" items split over "<<replica_count<<" replicas leave "<<share<<" each, less than a batch of "<<batch_size<<std::endl;
+            FatalError(__LINE__);
+        }
+        std::vector<size_t> part(share);
+        for (size_t k=0;k<share;++k) part[k] = perm[(size_t(replica_rank) * share + k) % perm.size()];
+        return part;
+    };
 };
 
 
@@ -3532,7 +6093,7 @@ public:
         memoryBytes += out[0]->Malloc(dim);
         StorageT* dataStorageT = new StorageT[data.size()];
         for (size_t i=0; i<data.size(); ++i) dataStorageT[i] = CPUCompute2StorageT(data[i]); 
-        checkCUDA(__LINE__, cudaMemcpy(out[0]->dataGPU, dataStorageT, data.size() * sizeofStorageT, cudaMemcpyHostToDevice) );
+        checkCUDA(__LINE__, deviceMemcpy(device, out[0]->dataGPU, dataStorageT, data.size() * sizeofStorageT, cudaMemcpyHostToDevice) );
         delete [] dataStorageT;
         return memoryBytes;
     };
@@ -3557,7 +6118,7 @@ public:
     };
 
     ~TensorLayer(){
-        if (tensorGPU!=NULL) checkCUDA(__LINE__, cudaFree(tensorGPU));
+        if (tensorGPU!=NULL) checkCUDA(__LINE__, deviceFree(device, tensorGPU));
     };
 
     int numofitems(){
@@ -3589,7 +6150,7 @@ public:
             out[i]->need_diff = false;
             std::cout<<"tensorCPU->dim="; veciPrint(tensorCPU->dim); std::cout<<std::endl;
             memoryBytes += out[i]->Malloc(tensorCPU->dim);
-            checkCUDA(__LINE__, cudaMemcpy(out[i]->dataGPU, tensorCPU->CPUmem, tensorCPU-> numBytes(), cudaMemcpyHostToDevice) );
+            checkCUDA(__LINE__, deviceMemcpy(device, out[i]->dataGPU, tensorCPU->CPUmem, tensorCPU-> numBytes(), cudaMemcpyHostToDevice) );
             delete tensorCPU;
         }
         return memoryBytes;
@@ -3634,17 +6195,26 @@ public:
 
     void forward(Phase phase_){
         if (iter == 0){
-            GPU_set_zeros(1, out[1]->dataGPU);
-            GPU_set_one_hot(channel, out[0]->dataGPU, seed);
+            if (device==DeviceCPU){
+                CPU_set_zeros(1, out[1]->dataGPU);
+                CPU_set_one_hot(channel, out[0]->dataGPU, seed);
+            }else{
+                GPU_set_zeros(1, out[1]->dataGPU);
+                GPU_set_one_hot(channel, out[0]->dataGPU, seed);
+            }
 
             //std::cout<<seed<<" "<<std::endl;
             std::cout<<tensor2char->CPUmem[seed];
         }else{
-            GPU_set_ones(1, out[1]->dataGPU);
-
             size_t maxID;
             ComputeT maxValue;
-            GPU_maxElement(channel, resultResponse->dataGPU, &maxID, &maxValue);
+            if (device==DeviceCPU){
+                CPU_set_ones(1, out[1]->dataGPU);
+                CPU_maxElement(channel, resultResponse->dataGPU, &maxID, &maxValue);
+            }else{
+                GPU_set_ones(1, out[1]->dataGPU);
+                GPU_maxElement(channel, resultResponse->dataGPU, &maxID, &maxValue);
+            }
 
             //maxID = iter%65;
             //std::cout<<"CPU maxID="<<maxID<<std::endl;
@@ -3653,7 +6223,8 @@ public:
             //std::cout<<maxID<<" "<<maxValue<<std::endl;
             std::cout<<tensor2char->CPUmem[maxID];
 
-            GPU_set_one_hot(channel, out[0]->dataGPU, maxID);
+            if (device==DeviceCPU)  CPU_set_one_hot(channel, out[0]->dataGPU, maxID);
+            else                    GPU_set_one_hot(channel, out[0]->dataGPU, maxID);
         }
 
         ++iter;
@@ -3691,69 +6262,190 @@ public:
 
 
 
+// Tensors loaded by data layers, shared read-only by every layer and Solver replica that asks for the same key
+// (file and preprocessing), so the data is in memory once. Each acquire is matched by a release, and the last
+// release frees the tensor and the file it may be a view into.
+class SharedTensors{
+    struct Entry{
+        Tensor<StorageT>* tensor;
+        TensorFile* file;
+        int refs;
+    };
+    static std::map<std::string, Entry>& entries(){
+        static std::map<std::string, Entry> shared;
+        return shared;
+    };
+    static std::mutex& mtx(){
+        static std::mutex m;
+        return m;
+    };
+public:
+    // load is only called for a key that is not loaded yet; it returns the tensor and sets the file it views
+    typedef std::function<Tensor<StorageT>*(TensorFile*& file)> Loader;
+
+    static Tensor<StorageT>* acquire(const std::string& key, const Loader& load){
+        std::lock_guard<std::mutex> lock(mtx());
+        std::map<std::string, Entry>::iterator it = entries().find(key);
+        if (it!=entries().end()){
+            ++it->second.refs;
+            return it->second.tensor;
+        }
+        Entry e;
+        e.file = NULL;
+        e.tensor = load(e.file);
+        e.refs = 1;
+        entries()[key] = e;
+        return e.tensor;
+    };
+
+    static void release(Tensor<StorageT>* tensor){
+        if (tensor==NULL) return;
+        std::lock_guard<std::mutex> lock(mtx());
+        for (std::map<std::string, Entry>::iterator it=entries().begin();it!=entries().end();++it){
+            if (it->second.tensor!=tensor) continue;
+            if (--it->second.refs==0){
+                delete it->second.tensor;
+                if (it->second.file!=NULL) delete it->second.file;
+                entries().erase(it);
+            }
+            return;
+        }
+    };
+
+    // the same file under any spelling of its path
+    static std::string path(const std::string& filename){
+        char* resolved = realpath(filename.c_str(), NULL);
+        if (resolved==NULL) return filename;
+        std::string canonical(resolved);
+        free(resolved);
+        return canonical;
+    };
+};
+
+#define MEMORY_GATHER_BYTES (256*1024)     // bytes gathered per task by MemoryDataLayer
+
+// Shuffling permutes an index array rather than the data, and forward gathers the items of a batch from it,
+// so the dataset is never copied and a mapped file stays clean.
 class MemoryDataLayer : public DataLayer {
-    std::vector<Tensor<StorageT>*> dataCPU;
+    std::vector<Tensor<StorageT>*> dataCPU;  // shared with the other layers loading the same data
+    std::vector<size_t> ordering;       // empty until the first shuffle: items in file order
+    std::vector<StorageT*> batchCPU;    // gathered batch on its way to a GPU
     public:
     std::vector<std::string> file_data;
     std::vector<std::string> file_mean;
     std::vector<ComputeT> scale;
     std::vector<ComputeT> mean;
+    std::vector<std::string> file_cache;    // where to keep each preprocessed data file for the next run
     int batch_size;
 
     int numofitems(){
         return dataCPU[0]->dim[0];
     };
-    void init(){
-        train_me = false;
-        std::cout<<"MemoryDataLayer "<<name<<" loading data: "<<std::endl;
-        dataCPU.resize(file_data.size());
-        for (int i =0;i<file_data.size();i++){
-            dataCPU[i] = new Tensor<StorageT> (file_data[i],batch_size);
-            dataCPU[i]->print(veci(0));
+    // Describes the preprocessing of data file i, or "" if there is none. It is stored as the name of the
+    // tensor in the cache file, so a cache made from other inputs or settings is never used.
+    std::string preprocessKey(int i){
+        ComputeT s = i<scale.size() ? scale[i] : 1;
+        ComputeT m = i<mean.size() ? mean[i] : 0;
+        if (i>=file_mean.size() && s==1 && m==0) return "";
+        std::ostringstream key;
+        key.precision(9);
+        struct stat st;
+        if (stat(file_data[i].c_str(), &st)!=0) return "";
+        key<<"preprocessed "<<file_data[i]<<" "<<st.st_size<<" "<<st.st_mtime;
+        if (i<file_mean.size()){
+            if (stat(file_mean[i].c_str(), &st)!=0) return "";
+            key<<" mean "<<file_mean[i]<<" "<<st.st_size<<" "<<st.st_mtime;
+        }
+        key<<" scale "<<s<<" shift "<<m;
+        return key.str();
+    };
+
+    // the preprocessed data from file_cache[i], if it was made from the same inputs
+    bool loadCache(int i, const std::string& key, TensorFile*& file){
+        if (i>=file_cache.size() || file_cache[i].empty() || key.empty() || access(file_cache[i].c_str(), R_OK)!=0) return false;
+        TensorFile* cache = new TensorFile(file_cache[i]);
+        bool valid = cache->entries.size()==1 && cache->entries[0].typeID==typeID(typeid(StorageT)) && cache->entries[0].sizeofType==sizeof(StorageT);
+        if (valid){
+            std::string name = cache->entries[0].name;
+            name.erase(name.find_last_not_of(' ') + 1);
+            valid = name==key;
+        }
+        if (!valid){
+            delete cache;
+            return false;
         }
+        std::cout<<"  from the cache "<<file_cache[i]<<std::endl;
+        file = cache;
+        dataCPU[i] = file->get<StorageT>(0, batch_size);
+        return true;
+    };
+
+    void saveCache(int i, const std::string& key){
+        if (i>=file_cache.size() || file_cache[i].empty() || key.empty()) return;
+        // pad the name so that the header, and so the data, ends on a 64-byte boundary and can be mapped as is
+        std::string name = key;
+        size_t header = sizeof(uint8_t) + sizeof(uint32_t) + sizeof(int) + name.size() + sizeof(int) + dataCPU[i]->dim.size() * sizeof(int);
+        name.append((64 - header % 64) % 64, ' ');
+        std::string original = dataCPU[i]->name;
+        dataCPU[i]->name = name;
+        std::string tmp = file_cache[i] + ".tmp";
+        writeTensors<StorageT>(tmp, std::vector<Tensor<StorageT>*>(1, dataCPU[i]));
+        dataCPU[i]->name = original;
+        if (rename(tmp.c_str(), file_cache[i].c_str())!=0) std::cerr<<"MemoryDataLayer: cannot write the cache "<<file_cache[i]<<std::endl;
+    };
+
+    // file_mean subtraction, scale and mean of data file i in one pass
+    void preprocess(int i){
+        Tensor<StorageT>* meanCPU = NULL;
+        if (i<file_mean.size()){
+            meanCPU = new Tensor<StorageT>(file_mean[i],batch_size);
+            meanCPU->print(veci(0));
 
-        if (file_mean.size()>0){
-            for (int i =0;i<file_mean.size();i++){
-                Tensor<StorageT>* meanCPU = new Tensor<StorageT>(file_mean[i],batch_size);
-                meanCPU->print(veci(0));
-
-                if (meanCPU->numel() != dataCPU[i]->sizeofitem()){
-                    std::cerr<<"mean tensor file size error: "<<std::endl;
-                    std::cerr<<"mean"; veciPrint(meanCPU->dim); std::cerr<<std::endl;
-                    std::cerr<<"data"; veciPrint(dataCPU[i]->dim); std::cerr<<std::endl;
-                    FatalError(__LINE__);
-                };
-                StorageT* d  = dataCPU[i]->CPUmem;
-                StorageT* dE = dataCPU[i]->CPUmem + dataCPU[i]->numel();
-
-                StorageT* m  = meanCPU->CPUmem;
-                StorageT* mE = meanCPU->CPUmem + meanCPU->numel();
-
-                while(d!=dE){
-                    *d = CPUCompute2StorageT( CPUStorage2ComputeT(*d) - CPUStorage2ComputeT(*m) );
-                    ++m;
-                    if (m==mE) m = meanCPU->CPUmem;
-                    ++d;
-                }
-                delete meanCPU;
-            }
+            if (meanCPU->numel() != dataCPU[i]->sizeofitem()){
+                std::cerr<<"mean tensor file size error: "<<std::endl;
+                std::cerr<<"mean"; veciPrint(meanCPU->dim); std::cerr<<std::endl;
+                std::cerr<<"data"; veciPrint(dataCPU[i]->dim); std::cerr<<std::endl;
+                FatalError(__LINE__);
+            };
         }
+        ComputeT s = i<scale.size() ? scale[i] : 1;
+        ComputeT m = i<mean.size() ? mean[i] : 0;
+        if (meanCPU!=NULL || s!=1 || m!=0){
+            CPU_preprocess(dataCPU[i]->numel(), dataCPU[i]->sizeofitem(), dataCPU[i]->CPUmem, meanCPU==NULL ? NULL : meanCPU->CPUmem, s, m);
+        }
+        if (meanCPU!=NULL) delete meanCPU;
+    };
 
-        for (int i =0;i<scale.size();i++){
-            if (scale[i]!=1){
-                StorageT* dE = dataCPU[i]->CPUmem + dataCPU[i]->numel();
-                for(StorageT* d  = dataCPU[i]->CPUmem; d!=dE; ++d){
-                    *d = CPUCompute2StorageT( CPUStorage2ComputeT(*d) * scale[i] );
-                }
-            }
+    // data file i with its preprocessing done, from file_cache[i] when it holds it
+    Tensor<StorageT>* load(int i, TensorFile*& file){
+        std::string key = preprocessKey(i);
+        if (!loadCache(i, key, file)){
+            file = new TensorFile(file_data[i]);
+            if (file->entries.empty()){ std::cerr<<"MemoryDataLayer: no tensor in "<<file_data[i]<<std::endl; FatalError(__LINE__); }
+            dataCPU[i] = file->get<StorageT>(0, batch_size);
+            preprocess(i);
+            saveCache(i, key);
         }
-        for (int i =0;i<mean.size();i++){
-            if (mean[i]!=0){
-                StorageT* dE = dataCPU[i]->CPUmem + dataCPU[i]->numel();
-                for(StorageT* d  = dataCPU[i]->CPUmem; d!=dE; ++d){
-                    *d = CPUCompute2StorageT( CPUStorage2ComputeT(*d) - mean[i] );
-                }
-            }
+        dataCPU[i]->print(veci(0));
+        return dataCPU[i];
+    };
+
+    // what decides the content of dataCPU[i], so layers with the same one share it
+    std::string sharedKey(int i){
+        std::ostringstream key;
+        key.precision(9);
+        key<<"data "<<SharedTensors::path(file_data[i])<<" batch "<<batch_size;
+        if (i<file_mean.size()) key<<" mean "<<SharedTensors::path(file_mean[i]);
+        key<<" scale "<<(i<scale.size() ? scale[i] : 1)<<" shift "<<(i<mean.size() ? mean[i] : 0);
+        return key.str();
+    };
+
+    void init(){
+        train_me = false;
+        std::cout<<"MemoryDataLayer "<<name<<" loading data: "<<std::endl;
+        dataCPU.resize(file_data.size());
+        for (int i =0;i<file_data.size();i++){
+            dataCPU[i] = SharedTensors::acquire(sharedKey(i), [this, i](TensorFile*& file){ return load(i, file); });
         }
 
         if (phase!=Testing) shuffle();
@@ -3771,12 +6463,16 @@ class MemoryDataLayer : public DataLayer {
         SetValue(json, batch_size,  64)
         SetValue(json, scale,       std::vector<ComputeT>(0))
         SetValue(json, mean,        std::vector<ComputeT>(0))
+        SetValue(json, file_cache,  std::vector<std::string>(0))
         SetValue(json, random,      true)
         init();
     };
     ~MemoryDataLayer(){
         for (int i =0; i<dataCPU.size();i++){
-            delete dataCPU[i];
+            SharedTensors::release(dataCPU[i]);
+        }
+        for (int i =0; i<batchCPU.size();i++){
+            if (batchCPU[i]!=NULL) checkCUDA(__LINE__, deviceFree(DeviceCPU, batchCPU[i]));
         }
     };
     size_t Malloc(Phase phase_){
@@ -3798,18 +6494,23 @@ class MemoryDataLayer : public DataLayer {
             out[i]->receptive_offset.resize(data_dim.size()-2); fill_n(out[i]->receptive_offset.begin(),data_dim.size()-2,0);
             memoryBytes += out[i]->Malloc(data_dim);
         }
+        if (device==DeviceGPU && !ordering.empty()){
+            batchCPU.resize(file_data.size(), NULL);
+            for (int i = 0;i < file_data.size(); i++){
+                if (batchCPU[i]==NULL) checkCUDA(__LINE__, deviceMalloc(DeviceCPU, &batchCPU[i], batch_size * dataCPU[i]->sizeofitem() * sizeofStorageT) );
+            }
+        }
         return memoryBytes;
     }
+    // in file order without random, unless replicas have to split the items
     void shuffle(){
-        if (!random) return;
-        std::vector<size_t> v = randperm(dataCPU[0]->numofitems(), rng);
-        for(int i =0; i <dataCPU.size();i++){
-            dataCPU[i]->permute(v);
-        }
+        if (phase==Testing || (!random && replica_count<=1)) return;
+        ordering = partition(random ? randperm(numofitems(), sampler_rng) : identityperm(numofitems()), batch_size);
     };
 
     void forward(Phase phase_){
-        if (counter + batch_size >= dataCPU[0]->numofitems() ){
+        size_t items_epoch = ordering.empty() ? dataCPU[0]->numofitems() : ordering.size();
+        if (counter + batch_size >= items_epoch ){
             ++epoch;
             if(phase!=Testing){
                 shuffle();
@@ -3817,20 +6518,123 @@ class MemoryDataLayer : public DataLayer {
             }
         }
         for(int i =0; i <dataCPU.size();i++){
-            checkCUDA(__LINE__, cudaMemcpy(out[i]->dataGPU, dataCPU[i]->CPUmem +  (size_t(counter) * size_t( dataCPU[i]->sizeofitem())), batch_size * dataCPU[i]->sizeofitem() * sizeofStorageT, cudaMemcpyHostToDevice) );     
+            size_t bytes = dataCPU[i]->sizeofitem() * sizeofStorageT;
+            if (ordering.empty()){
+                checkCUDA(__LINE__, deviceMemcpy(device, out[i]->dataGPU, dataCPU[i]->CPUmem +  (size_t(counter) * size_t( dataCPU[i]->sizeofitem())), batch_size * bytes, cudaMemcpyHostToDevice) );     
+                continue;
+            }
+            // gather the items, several per task when they are small
+            char* src = (char*)(dataCPU[i]->CPUmem);
+            char* dst = (char*)(device==DeviceCPU ? out[i]->dataGPU : batchCPU[i]);
+            const size_t* items = &ordering[counter];
+            CPU_parallel_for(batch_size, [=](size_t begin, size_t end){
+                for (size_t k=begin;k<end;++k) memcpy(dst + k * bytes, src + items[k] * bytes, bytes);
+            }, std::max(size_t(1), size_t(MEMORY_GATHER_BYTES) / bytes));
+            if (device==DeviceGPU) checkCUDA(__LINE__, deviceMemcpy(device, out[i]->dataGPU, batchCPU[i], batch_size * bytes, cudaMemcpyHostToDevice) );
         }
         counter+=batch_size;
-        if (counter >= dataCPU[0]->numofitems()) counter = 0;
+        if (counter >= items_epoch) counter = 0;
     };
 };
 
 
-#if USE_OPENCV
+// Binary PGM/PPM (P5/P6) with 8-bit samples: what ImageDataLayer decodes when it is built without OpenCV.
+bool readPNM(const std::string& filename, int& width, int& height, int& channels, std::vector<uint8_t>& pixels){
+    FILE* fp = fopen(filename.c_str(),"rb");
+    if (fp==NULL) return false;
+    char magic[3] = {0,0,0};
+    int maxval = 0;
+    bool ok = fread(magic, 1, 2, fp)==2 && magic[0]=='P' && (magic[1]=='5' || magic[1]=='6');
+    // width, height and maxval, separated by whitespace and maybe comments
+    int* fields[3] = {&width, &height, &maxval};
+    for (int f=0;ok && f<3;++f){
+        int ch = fgetc(fp);
+        while (ch=='#' || isspace(ch)){
+            if (ch=='#') while (ch!='\n' && ch!=EOF) ch = fgetc(fp);
+            ch = fgetc(fp);
+        }
+        ungetc(ch, fp);
+        ok = fscanf(fp, "%d", fields[f])==1;
+    }
+    ok = ok && maxval>0 && maxval<256 && width>0 && height>0 && isspace(fgetc(fp));
+    if (ok){
+        channels = magic[1]=='5' ? 1 : 3;
+        pixels.resize(size_t(width) * height * channels);
+        ok = fread(pixels.data(), 1, pixels.size(), fp)==pixels.size();
+    }
+    fclose(fp);
+    return ok;
+}
+
+// Bilinear resize of interleaved 8-bit pixels, sampling at pixel centers as cv::resize does.
+void resizeBilinear(const uint8_t* src, int width, int height, int channels, uint8_t* dst, int out_width, int out_height){
+    for (int y=0;y<out_height;++y){
+        float fy = std::min(std::max((y + 0.5f) * height / out_height - 0.5f, 0.f), float(height-1));
+        int y0 = int(fy);
+        int y1 = std::min(y0+1, height-1);
+        float wy = fy - y0;
+        for (int x=0;x<out_width;++x){
+            float fx = std::min(std::max((x + 0.5f) * width / out_width - 0.5f, 0.f), float(width-1));
+            int x0 = int(fx);
+            int x1 = std::min(x0+1, width-1);
+            float wx = fx - x0;
+            for (int c=0;c<channels;++c){
+                float top    = src[(size_t(y0)*width+x0)*channels+c] * (1-wx) + src[(size_t(y0)*width+x1)*channels+c] * wx;
+                float bottom = src[(size_t(y1)*width+x0)*channels+c] * (1-wx) + src[(size_t(y1)*width+x1)*channels+c] * wx;
+                dst[(size_t(y)*out_width+x)*channels+c] = uint8_t(top * (1-wy) + bottom * wy + 0.5f);
+            }
+        }
+    }
+}
+
+// Decoded and resized images kept across epochs, dropping the least recently used once budget bytes are held.
+class DecodedImageCache{
+    typedef std::list<std::pair<int, std::vector<uint8_t> > > Items;
+    size_t budget;
+    size_t bytes;
+    Items items;                            // most recently used first
+    std::map<int, Items::iterator> index;
+    std::mutex mtx;
+public:
+    size_t hits;
+    size_t misses;
+
+    DecodedImageCache(size_t budget_): budget(budget_), bytes(0), hits(0), misses(0){};
+
+    bool get(int key, uint8_t* dst, size_t n){
+        std::lock_guard<std::mutex> lock(mtx);
+        std::map<int, Items::iterator>::iterator it = index.find(key);
+        if (it==index.end() || it->second->second.size()!=n){
+            ++misses;
+            return false;
+        }
+        items.splice(items.begin(), items, it->second);
+        memcpy(dst, it->second->second.data(), n);
+        ++hits;
+        return true;
+    };
+
+    void put(int key, const uint8_t* src, size_t n){
+        if (n > budget) return;
+        std::lock_guard<std::mutex> lock(mtx);
+        if (index.find(key)!=index.end()) return;
+        while (bytes + n > budget){
+            bytes -= items.back().second.size();
+            index.erase(items.back().first);
+            items.pop_back();
+        }
+        items.push_front(std::make_pair(key, std::vector<uint8_t>(src, src + n)));
+        index[key] = items.begin();
+        bytes += n;
+    };
+};
+
+// Images listed in file_list, decoded by decode_workers threads (with OpenCV when USE_OPENCV is set, as binary
+// PGM/PPM otherwise), resized to image_output and delivered in OpenCV's interleaved BGR order. With cache_size
+// (MB), decoded images are kept for later epochs.
 class ImageDataLayer : public DataLayer {
     StorageT* dataCPU;
-    StorageT* dataGPU;
     StorageT* labelCPU;
-    StorageT* labelGPU;
 
     Tensor<StorageT>* labelTensor;
 
@@ -3840,12 +6644,17 @@ class ImageDataLayer : public DataLayer {
     std::future<void> lock;
     int epoch_prefetch;
 
+    CPUThreadPool decoders;
+    DecodedImageCache* cache;
+
 public:
     std::string file_list;
     std::string file_label;
     std::vector<int> image_output;
     int batch_size;
     ComputeT mean_value;
+    int decode_workers;
+    int cache_size;
 
     ImageDataLayer(JSON* json){
         SetOrDie(json, name)
@@ -3856,14 +6665,14 @@ public:
         SetOrDie(json, mean_value)
         SetValue(json, batch_size,  64)
         SetValue(json, random,      true)
+        SetValue(json, decode_workers,  4)
+        SetValue(json, cache_size,      0)
         init();
     };
 
     void shuffle(){
-        if (!random) return;
-        if (phase!=Testing){
-            ordering = randperm(img_fname.size(), rng);
-        }
+        if (phase==Testing || (!random && replica_count<=1)) return;
+        ordering = partition(random ? randperm(img_fname.size(), sampler_rng) : identityperm(img_fname.size()), batch_size);
     };     
 
     int numofitems(){
@@ -3871,6 +6680,9 @@ public:
     };
     void init(){
         train_me = false;
+        epoch_prefetch = 0;
+        dataCPU  =NULL;
+        labelCPU =NULL;
         std::cout<<"ImageDataLayer "<<name<<" loading data: ";
 
         std::ifstream fin(file_list);
@@ -3884,8 +6696,14 @@ public:
         std::cout<<"# of images = "<<img_fname.size()<<std::endl;
 
 
-        labelTensor = new Tensor<StorageT>(file_label);
-        labelTensor->print(veci(0));
+        labelTensor = SharedTensors::acquire("label " + SharedTensors::path(file_label), [this](TensorFile*& file){
+            Tensor<StorageT>* label = new Tensor<StorageT>(file_label);
+            label->print(veci(0));
+            return label;
+        });
+
+        decoders.resize(decode_workers);
+        cache = cache_size>0 ? new DecodedImageCache(size_t(cache_size) << 20) : NULL;
 
         ordering.resize(numofitems());
         for (int i=0;i<numofitems();++i) ordering[i]=i;
@@ -3894,49 +6712,51 @@ public:
         }
     }
 
-    ImageDataLayer(std::string name_, Phase phase_, int batch_size_): DataLayer(name_), batch_size(batch_size_){
+    ImageDataLayer(std::string name_, Phase phase_, int batch_size_, int decode_workers_=4, int cache_size_=0): DataLayer(name_), batch_size(batch_size_), decode_workers(decode_workers_), cache_size(cache_size_){
         phase = phase_;
-
-        dataCPU  =NULL;
-        labelCPU =NULL;
-        dataGPU  =NULL;
-        labelGPU =NULL;
-
         init();
     };
 
     ~ImageDataLayer(){
-        if (labelTensor!=NULL) delete labelTensor;
-        if (dataCPU!=NULL)  delete [] dataCPU;
-        if (labelCPU!=NULL) delete [] labelCPU;
-        if (dataGPU!=NULL)  checkCUDA(__LINE__, cudaFree(dataGPU));
-        if (labelGPU!=NULL) checkCUDA(__LINE__, cudaFree(labelGPU));
+        if (lock.valid()) lock.wait();
+        if (cache!=NULL) delete cache;
+        SharedTensors::release(labelTensor);
+        if (dataCPU!=NULL)  checkCUDA(__LINE__, deviceFree(DeviceCPU, dataCPU));
+        if (labelCPU!=NULL) checkCUDA(__LINE__, deviceFree(DeviceCPU, labelCPU));
     };
 
+    // image image_i, decoded and resized into 3*image_output[0]*image_output[1] bytes
+    void decode(int image_i, uint8_t* pixels){
+#if USE_OPENCV
+        cv::Mat image = cv::imread(img_fname[image_i],CV_LOAD_IMAGE_COLOR);
+        if (image.empty()){ std::cerr<<"ImageDataLayer: cannot read "<<img_fname[image_i]<<std::endl; FatalError(__LINE__); }
+        cv::Mat image_resize;
+        cv::resize(image,image_resize,cv::Size(image_output[0],image_output[1]));
+        memcpy(pixels, image_resize.data, 3*image_output[0]*image_output[1]);
+#else
+        int width, height, channels;
+        std::vector<uint8_t> raw;
+        if (!readPNM(img_fname[image_i], width, height, channels, raw)){
+            std::cerr<<"ImageDataLayer: cannot read "<<img_fname[image_i]<<" (without OpenCV, images have to be binary PGM/PPM)"<<std::endl;
+            FatalError(__LINE__);
+        }
+        std::vector<uint8_t> bgr(size_t(width) * height * 3);
+        for (size_t p=0;p<size_t(width) * height;++p){
+            for (int c=0;c<3;++c) bgr[p*3+c] = channels==1 ? raw[p] : raw[p*3+2-c];
+        }
+        resizeBilinear(bgr.data(), width, height, 3, pixels, image_output[0], image_output[1]);
+#endif
+    }
+
     void prefetch(){
 
         size_t perImageSize = 3*image_output[0]*image_output[1];
-        cv::Size resize_size(image_output[0],image_output[1]);
 
+        // choose the images and copy their labels; the decoding is done in parallel below
+        std::vector<int> images(batch_size);
         for (size_t i=0;i<batch_size;++i){
-            // choose image
             int image_i = ordering[counter];
-
-            // read image
-            cv::Mat image_RGB = cv::imread(img_fname[image_i],CV_LOAD_IMAGE_UNCHANGED);
-            cv::Mat image_RGB_resize;
-
-            // resize image
-            cv::resize(image_RGB,image_RGB_resize,resize_size);
-
-            // convert image and subtract mean
-            StorageT* pImage = dataCPU+i*perImageSize;
-            StorageT* pImageEnd   = pImage+perImageSize;
-            uchar* pPixel = image_RGB_resize.data;
-            while(pImage!=pImageEnd){
-                *pImage = CPUCompute2StorageT(ComputeT(*pPixel)- mean_value);
-                ++pImage; ++pPixel;
-            }
+            images[i] = image_i;
 
             // copy label
             memcpy(labelCPU+i*labelTensor->sizeofitem(), labelTensor->CPUmem+image_i*labelTensor->sizeofitem(), labelTensor->sizeofitem()*sizeofStorageT );
@@ -3949,9 +6769,21 @@ public:
             }
         }
 
-        // copy from CPU to GPU
-        checkCUDA(__LINE__, cudaMemcpy(dataGPU, dataCPU, batch_size*perImageSize*sizeofStorageT, cudaMemcpyHostToDevice) );
-        checkCUDA(__LINE__, cudaMemcpy(labelGPU, labelCPU, batch_size*labelTensor->sizeofitem()*sizeofStorageT, cudaMemcpyHostToDevice) );
+        decoders.run(batch_size, 1, [&](size_t begin, size_t end){
+            std::vector<uint8_t> pixels(perImageSize);
+            for (size_t i=begin;i<end;++i){
+                if (cache==NULL || !cache->get(images[i], pixels.data(), perImageSize)){
+                    decode(images[i], pixels.data());
+                    if (cache!=NULL) cache->put(images[i], pixels.data(), perImageSize);
+                }
+
+                // convert image and subtract mean
+                StorageT* pImage = dataCPU+i*perImageSize;
+                for (size_t k=0;k<perImageSize;++k){
+                    pImage[k] = CPUCompute2StorageT(ComputeT(pixels[k])- mean_value);
+                }
+            }
+        });
     };
 
 
@@ -3966,13 +6798,8 @@ public:
         std::cout<< (train_me? "* " : "  ");
         std::cout<<name<<std::endl;
 
-        dataCPU  = new StorageT[batch_size*3*image_output[0]*image_output[1]];
-        checkCUDA(__LINE__, cudaMalloc(&dataGPU, batch_size*3*image_output[0]*image_output[1]*sizeofStorageT) );
-        memoryBytes += batch_size*3*image_output[0]*image_output[1]*sizeofStorageT;
-
-        labelCPU = new StorageT[batch_size* labelTensor->sizeofitem() ];
-        checkCUDA(__LINE__, cudaMalloc(&labelGPU, batch_size* labelTensor->sizeofitem()*sizeofStorageT) );
-        memoryBytes += batch_size* labelTensor->sizeofitem()*sizeofStorageT;
+        checkCUDA(__LINE__, deviceMalloc(DeviceCPU, &dataCPU, batch_size*3*image_output[0]*image_output[1]*sizeofStorageT) );
+        checkCUDA(__LINE__, deviceMalloc(DeviceCPU, &labelCPU, batch_size* labelTensor->sizeofitem() *sizeofStorageT) );
 
         out[0]->need_diff = false;
         std::vector<int> data_dim;
@@ -4005,12 +6832,12 @@ public:
         lock.wait();
         epoch = epoch_prefetch;
 
-        std::swap(out[0]->dataGPU,dataGPU);
-        std::swap(out[1]->dataGPU,labelGPU);
+        // copy from CPU to the device
+        checkCUDA(__LINE__, deviceMemcpy(device, out[0]->dataGPU, dataCPU, batch_size*3*image_output[0]*image_output[1]*sizeofStorageT, cudaMemcpyHostToDevice) );
+        checkCUDA(__LINE__, deviceMemcpy(device, out[1]->dataGPU, labelCPU, batch_size*labelTensor->sizeofitem()*sizeofStorageT, cudaMemcpyHostToDevice) );
         lock = std::async(std::launch::async,&ImageDataLayer::prefetch,this);
     };
 };
-#endif
 
 
 class PlaceHolderDataLayer : public DataLayer {
@@ -4062,9 +6889,9 @@ class PlaceHolderDataLayer : public DataLayer {
         }else{
             Tensor<StorageT>* meanCPU = new Tensor<StorageT>(file_mean);
             meanCPU->print(veci(0));
-            checkCUDA(__LINE__, cudaMalloc(&meanGPU, meanCPU->numBytes()) );
+            checkCUDA(__LINE__, deviceMalloc(device, &meanGPU, meanCPU->numBytes()) );
             memoryBytes += meanCPU->numBytes();
-            meanCPU->writeGPU(meanGPU);
+            meanCPU->writeGPU(meanGPU, device);
             delete meanCPU;
         }
 
@@ -4074,23 +6901,163 @@ class PlaceHolderDataLayer : public DataLayer {
     void forward(Phase phase_){};
 };
 
+// Record files keep all modalities of an item next to each other and to its label, so that DiskDataLayer gets
+// an item with one read instead of one per file. A record file is a tensor container holding
+//   "records"      uint8 [items, bytes per record]
+//   descriptors    one per field in record order, the label last: a tensor with the type, name and item
+//                  dimensions of the field, a first dimension of 0 and so no payload
+// Fields start on multiples of RECORD_FIELD_ALIGN bytes within a record, and records are padded to it.
+
+#define RECORD_FIELD_ALIGN 8
+
+struct RecordLayout{
+    std::vector<TensorIndexEntry> fields;
+    std::vector<size_t> offset;     // where each field starts in a record
+    size_t recordBytes;
+    size_t items;
+    size_t payload;                 // byte offset of the first record in the file
+
+    RecordLayout(): recordBytes(0), items(0), payload(0){};
+
+    size_t fieldBytes(int k) const{
+        return sizeofitem(fields[k].dim) * fields[k].sizeofType;
+    };
+
+    void place(){
+        offset.resize(fields.size());
+        recordBytes = 0;
+        for (int k=0;k<fields.size();++k){
+            offset[k] = recordBytes;
+            recordBytes = (recordBytes + fieldBytes(k) + RECORD_FIELD_ALIGN - 1) / RECORD_FIELD_ALIGN * RECORD_FIELD_ALIGN;
+        }
+    };
+
+    void read(std::string filename){
+        TensorFile file(filename);
+        if (file.entries.size()<3 || file.entries[0].typeID!=typeID(typeid(uint8_t)) || file.entries[0].dim.size()!=2){
+            std::cerr<<filename<<" is not a record file"<<std::endl;
+            FatalError(__LINE__);
+        }
+        items = file.entries[0].dim[0];
+        payload = file.entries[0].payload;
+        fields.assign(file.entries.begin()+1, file.entries.end());
+        place();
+        if (recordBytes != size_t(file.entries[0].dim[1])){
+            std::cerr<<filename<<": the records do not match the size of their fields"<<std::endl;
+            FatalError(__LINE__);
+        }
+    };
+};
+
+// Interleaves the first tensor of each of file_data and of file_label into the record file filename, streaming
+// through the inputs so they need not fit in memory.
+void writeRecords(std::string filename, std::vector<std::string> file_data, std::string file_label){
+    std::vector<std::string> sources = file_data;
+    sources.push_back(file_label);
+
+    RecordLayout layout;
+    std::vector<FILE*> fin(sources.size());
+    for (int k=0;k<sources.size();++k){
+        TensorFile index(sources[k]);
+        if (index.entries.empty()){ std::cerr<<"writeRecords: no tensor in "<<sources[k]<<std::endl; FatalError(__LINE__); }
+        TensorIndexEntry e = index.entries[0];
+        if (k==0) layout.items = e.dim[0];
+        else if (e.dim[0]!=layout.items){ std::cerr<<"writeRecords: "<<sources[k]<<" has a different number of items from "<<sources[0]<<std::endl; FatalError(__LINE__); }
+        fin[k] = fopen(sources[k].c_str(),"rb");
+        if (fin[k]==NULL || fseeko(fin[k], off_t(e.payload), SEEK_SET)!=0){ std::cerr<<"writeRecords: fail to open "<<sources[k]<<std::endl; FatalError(__LINE__); }
+        e.dim[0] = 0;
+        layout.fields.push_back(e);
+    }
+    layout.place();
+
+    FILE* fp = fopen(filename.c_str(),"wb");
+    if (fp==NULL){ std::cerr<<"writeRecords: fail to open file "<<filename<<std::endl; FatalError(__LINE__); }
+
+    std::vector<TensorIndexEntry> entries(1);
+    entries[0].name = "records";
+    entries[0].typeID = typeID(typeid(uint8_t));
+    entries[0].sizeofType = sizeof(uint8_t);
+    entries[0].dim.push_back(layout.items);
+    entries[0].dim.push_back(layout.recordBytes);
+    entries[0].header = ftello(fp);
+    writeTensorHeader(fp, entries[0]);
+    entries[0].payload = ftello(fp);
+
+    std::vector<char> record(layout.recordBytes, 0);
+    for (size_t i=0;i<layout.items;++i){
+        for (int k=0;k<fin.size();++k){
+            if (fread(&record[layout.offset[k]], 1, layout.fieldBytes(k), fin[k])!=layout.fieldBytes(k)){
+                std::cerr<<"writeRecords: "<<sources[k]<<" is truncated"<<std::endl;
+                FatalError(__LINE__);
+            }
+        }
+        fwrite(record.data(), 1, record.size(), fp);
+    }
+    for (int k=0;k<fin.size();++k){
+        fclose(fin[k]);
+        TensorIndexEntry e = layout.fields[k];
+        e.header = ftello(fp);
+        writeTensorHeader(fp, e);
+        e.payload = ftello(fp);
+        entries.push_back(e);
+    }
+    writeTensorIndex(fp, entries);
+    fclose(fp);
+}
+
+// the data type of a record file, which has to be that of all its fields except the label
+uint8_t readRecordTypeID(std::string filename){
+    RecordLayout layout;
+    layout.read(filename);
+    return layout.fields[0].typeID;
+}
+
+#define DISK_DIRECT_ALIGN 4096
+
 template <class T>
 class DiskDataLayer : public DataLayer {
-    std::future<void> lock;
-    
-    std::vector<size_t> ordering; 
+    // A ring of prefetch_depth batches, filled by prefetch_workers threads. Batches are planned in order (which
+    // items, where to crop, whether to mirror) under the lock, so the sequence does not depend on the number of
+    // workers; the items of the oldest unfinished batch then go to whichever worker is free.
+    // Items are read with pread on one descriptor per file. Since the shuffled order of the epoch is known, the
+    // items of the next readahead batches are announced to the kernel as coalesced byte ranges, which it reads
+    // asynchronously while the workers are busy; with direct_io the page cache is bypassed instead.
+    // On disks that only do well sequentially, shuffle_chunk makes an epoch visit whole runs of items instead.
+    // With file_records, an item and its label come in one record (see writeRecords) instead of one per file.
+    // Workers crop, mirror, convert to StorageT and subtract the mean in one pass, so forward only copies.
+    struct Batch{
+        std::vector<StorageT*> data;    // one per data file, ready for the responses
+        StorageT* label;
+        std::vector<int> items;
+        std::vector<bool> mirrors;
+        std::vector<int> crops;         // where the crop begins, size_crop.size() per item
+        int next;                       // next item to hand out
+        int done;                       // items assembled
+        int epoch;                      // epoch_prefetch once the batch was planned
+    };
+    std::vector<Batch> ring;
+    size_t planned;                     // batches planned so far
+    size_t consumed;                    // batches taken by forward
+    std::vector<std::thread> workers;
+    std::vector<int> dataFD;                        // one per data file, or the record file; shared by the workers
+    std::vector<std::vector<T*> > workerRaw;        // [worker][data file]: one item before cropping
+    std::vector<char*> workerRecord;                // [worker]: one record, with file_records
+    std::vector<char*> workerDirect;                // [worker]: staging for direct_io, aligned on use
+    size_t hinted;                      // position in ordering up to which readahead was requested
+    std::vector<bool> chunkRequested;   // chunks already read ahead this epoch, with shuffle_chunk>1
+    std::mutex mtx;
+    std::condition_variable cv_work;
+    std::condition_variable cv_ready;
+    bool stop;
+
     std::bernoulli_distribution* distribution_bernoulli;
     std::vector<std::uniform_int_distribution<int>*> distribution_uniform;
-
-    std::vector<FILE*> dataFILE;
-    std::vector<T*> dataCPU;
-    std::vector<T*> dataGPU;
-    std::vector<T*> item_raw;
+    std::vector<size_t> ordering; 
 
     Tensor<StorageT>* labelCPUall;
-    Tensor<StorageT>* labelCPU;
-    std::vector<StorageT*> mean_data_GPU;
-    StorageT* labelGPU;
+    std::vector<Tensor<StorageT>*> meanCPU;
+    std::vector<int> label_dim;
+    size_t labelSizeOfItem;
 
     size_t numel_per_channel_crop ;
     size_t numel_all_channel_crop ;
@@ -4100,7 +7067,10 @@ class DiskDataLayer : public DataLayer {
     int epoch_prefetch;
 
     size_t bytes_per_item;
-    size_t headerBytes;
+    size_t bytes_per_read;              // an item, or a whole record
+    size_t item_count;
+    std::vector<size_t> dataOffset;     // where the payload starts in each data file, or the record file
+    RecordLayout records;
     std::vector<int> size_data;
     public:
     bool mirror;
@@ -4108,79 +7078,152 @@ class DiskDataLayer : public DataLayer {
     std::vector<std::string> file_data;
     std::vector<std::string> file_mean;
     std::string file_label;
+    std::string file_records;           // the data and the label interleaved, instead of file_data and file_label
     int batch_size;
+    int prefetch_workers;
+    int prefetch_depth;
+    int readahead;                      // batches announced to the kernel ahead of the ones being read
+    bool direct_io;                     // O_DIRECT reads, for datasets much larger than the page cache
+    int shuffle_chunk;                  // >1: shuffle runs of this many consecutive items (see randpermChunked)
+    int shuffle_buffer;                 // items mixed across chunks; 0 means 16 chunks
 
     int numofitems(){
-        return labelCPUall->numofitems();
+        return item_count;
     };
 
     void init(){
         epoch_prefetch  = 0;
+        hinted = 0;
+        planned = 0;
+        consumed = 0;
+        stop = false;
         distribution_bernoulli = new std::bernoulli_distribution(0.5);  
-        //dataFILE = NULL;
-        //dataCPU = NULL;
-        //dataGPU = NULL;
-        labelCPU = NULL;
-        labelGPU = NULL;
         labelCPUall = NULL;
         train_me = false;
         std::cout<<"DiskDataLayer "<<name<<" loading data: "<<std::endl;
 
-        dataCPU.resize(file_data.size());
-        dataGPU.resize(file_data.size());
-        item_raw.resize(file_data.size());
-        dataFILE.resize(file_data.size());
+        if (prefetch_workers<1) prefetch_workers = 1;
+        if (prefetch_depth<1) prefetch_depth = 1;
 
         // open data file
-        for (int i = 0;i<file_data.size();++i){
-            dataFILE[i] = fopen(file_data[i].c_str(),"rb");
-            if (dataFILE[i] ==NULL){
+        std::vector<std::string> sources = file_records.empty() ? file_data : std::vector<std::string>(1, file_records);
+        dataFD.resize(sources.size(), -1);
+        for (int i = 0;i<sources.size();++i){
+            if (direct_io){
+                dataFD[i] = open(sources[i].c_str(), O_RDONLY | O_DIRECT);
+                if (dataFD[i]<0){
+                    std::cout<<"DiskDataLayer: "<<sources[i]<<" does not support direct I/O; reading through the page cache"<<std::endl;
+                    direct_io = false;
+                    for (int j = 0;j<i;++j) close(dataFD[j]);
+                    i = -1;
+                    continue;
+                }
+            }else{
+                dataFD[i] = open(sources[i].c_str(), O_RDONLY);
+            }
+            if (dataFD[i]<0){
                 std::cerr<<"Fail to open the data file"<<std::endl;
                 FatalError(__LINE__);
             }
         }
 
-        mean_data_GPU.resize(file_mean.size());
-        for (int i =0;i<file_mean.size();i++){
-            Tensor<StorageT>* meanCPU = new Tensor<StorageT>(file_mean[i],batch_size);
-            meanCPU->print(veci(0));
-            checkCUDA(__LINE__, cudaMalloc(&mean_data_GPU[i], meanCPU->numBytes()) );
-            meanCPU->writeGPU(mean_data_GPU[i]);
-            delete meanCPU;
-        }
-
         
-        Tensor<T> tensor;
-        headerBytes = tensor.readHeader(dataFILE[0]);
+        // the data is the first tensor of each file; its offset comes from the table of contents
+        std::vector<TensorIndexEntry> fields;
+        if (file_records.empty()){
+            dataOffset.resize(file_data.size());
+            for (int i = 0;i<file_data.size();++i){
+                TensorFile index(file_data[i]);
+                if (index.entries.empty()){ std::cerr<<"DiskDataLayer: no tensor in "<<file_data[i]<<std::endl; FatalError(__LINE__); }
+                fields.push_back(index.entries[0]);
+                dataOffset[i] = index.entries[0].payload;
+            }
+        }else{
+            // the fields before the label play the part of the data files
+            records.read(file_records);
+            fields.assign(records.fields.begin(), records.fields.end()-1);
+            file_data.clear();
+            for (int i = 0;i<fields.size();++i) file_data.push_back(fields[i].name);
+            dataOffset.assign(1, records.payload);
+        }
+        for (int i = 0;i<fields.size();++i){
+            const TensorIndexEntry& e = fields[i];
+            if (e.typeID!=typeID(typeid(T)) || e.sizeofType!=sizeof(T)){ std::cerr<<"DiskDataLayer: wrong data type in "<<file_data[i]<<std::endl; FatalError(__LINE__); }
+            if (i==0){
+                size_data.insert( size_data.end(), e.dim.begin()+1, e.dim.end() );
+            }else if (sizeofitem(e.dim)!=numel(size_data)){
+                std::cerr<<"DiskDataLayer: "<<file_data[i]<<" has a different item size from "<<file_data[0]<<std::endl; FatalError(__LINE__);
+            }
+        }
 
-        size_data.insert( size_data.end(), tensor.dim.begin()+1, tensor.dim.end() );
 
+        if (size_crop.size()+1 != size_data.size()){ std::cerr<<"DiskDataLayer: size_crop should have one entry per spatial dimension of the data"<<std::endl; FatalError(__LINE__); }
 
         numel_per_channel_crop = numel(size_crop);
         numel_all_channel_crop = size_data[0] * numel_per_channel_crop;
         numel_per_channel_orgi = sizeofitem(size_data);
         numel_batch_all_channel_crop = batch_size*numel_all_channel_crop;
         bytes_per_item = sizeof(T)* numel(size_data);
+        bytes_per_read = file_records.empty() ? bytes_per_item : records.recordBytes;
 
-        std::vector<int> data_dim;
-        data_dim.push_back(batch_size);
-        data_dim.push_back(size_data[0]);
-        data_dim.insert( data_dim.end(), size_crop.begin(), size_crop.end() );
-
-        for (int i = 0;i<file_data.size();++i){
-            dataCPU[i]  = new T[numel(data_dim)];
-            item_raw[i] = new T[numel(size_data)];
+        meanCPU.resize(file_mean.size());
+        for (int i =0;i<file_mean.size();i++){
+            meanCPU[i] = new Tensor<StorageT>(file_mean[i]);
+            meanCPU[i]->print(veci(0));
+            if (meanCPU[i]->numel()!=numel_all_channel_crop){ std::cerr<<"DiskDataLayer: the mean "<<file_mean[i]<<" should have the size of a cropped item"<<std::endl; FatalError(__LINE__); }
+        }
+
+        workerRaw.resize(prefetch_workers, std::vector<T*>(file_data.size(), NULL));
+        workerRecord.resize(prefetch_workers, NULL);
+        workerDirect.resize(prefetch_workers, NULL);
+        for (int w = 0;w<prefetch_workers;++w){
+            if (file_records.empty()){
+                for (int i = 0;i<file_data.size();++i){
+                    checkCUDA(__LINE__, deviceMalloc(DeviceCPU, &workerRaw[w][i], numel(size_data) * sizeof(T)) );
+                }
+            }else{
+                checkCUDA(__LINE__, deviceMalloc(DeviceCPU, &workerRecord[w], bytes_per_read) );
+            }
+            if (direct_io) checkCUDA(__LINE__, deviceMalloc(DeviceCPU, &workerDirect[w], bytes_per_read + 3 * DISK_DIRECT_ALIGN) );
         }
 
 
         // for label
-        labelCPUall = new Tensor<StorageT>(file_label);
-        labelCPUall -> print(veci(0));
-        std::cout<<"    "; labelCPUall->printRange();
-        while (labelCPUall->dim.size()<size_data.size()+1) labelCPUall->dim.push_back(1);
-        std::vector<int> label_dim = labelCPUall->dim;
+        if (file_records.empty()){
+            labelCPUall = SharedTensors::acquire("label " + SharedTensors::path(file_label), [this](TensorFile*& file){
+                Tensor<StorageT>* label = new Tensor<StorageT>(file_label);
+                label -> print(veci(0));
+                std::cout<<"    "; label->printRange();
+                return label;
+            });
+            label_dim = labelCPUall->dim;
+            item_count = labelCPUall->numofitems();
+        }else{
+            // read with each record
+            const TensorIndexEntry& e = records.fields.back();
+            if (!CPUConvertible(e.typeID)){ std::cerr<<"DiskDataLayer: the label in "<<file_records<<" should be half, float or double"<<std::endl; FatalError(__LINE__); }
+            label_dim = e.dim;
+            item_count = records.items;
+            std::cout<<"    "<<item_count<<" records of "<<records.recordBytes<<" bytes in "<<file_records<<std::endl;
+        }
+        while (label_dim.size()<size_data.size()+1) label_dim.push_back(1);
         label_dim[0] = batch_size;
-        labelCPU = new Tensor<StorageT>(label_dim);
+        labelSizeOfItem = sizeofitem(label_dim);
+
+        ring.resize(prefetch_depth);
+        for (int r = 0;r<prefetch_depth;++r){
+            Batch& b = ring[r];
+            b.data.resize(file_data.size());
+            for (int i = 0;i<file_data.size();++i){
+                checkCUDA(__LINE__, deviceMalloc(DeviceCPU, &b.data[i], numel_batch_all_channel_crop * sizeofStorageT) );
+            }
+            checkCUDA(__LINE__, deviceMalloc(DeviceCPU, &b.label, numel(label_dim) * sizeofStorageT) );
+            b.items.resize(batch_size);
+            b.mirrors.resize(batch_size);
+            b.crops.resize(batch_size * size_crop.size());
+            b.next = b.done = batch_size;
+            b.epoch = 0;
+        }
 
 
         distribution_uniform.resize(size_crop.size());
@@ -4195,8 +7238,8 @@ class DiskDataLayer : public DataLayer {
         }
     };
 
-    DiskDataLayer(std::string name_, Phase phase_, bool mirror_, std::vector<int> size_data_, std::vector<int> size_crop_, std::vector<std::string> file_data_, std::string file_label_, int batch_size_): 
-        DataLayer(name_), mirror(mirror_), size_data(size_data_), size_crop(size_crop_), file_data(file_data_), file_label(file_label_), batch_size(batch_size_){
+    DiskDataLayer(std::string name_, Phase phase_, bool mirror_, std::vector<int> size_data_, std::vector<int> size_crop_, std::vector<std::string> file_data_, std::string file_label_, int batch_size_, int prefetch_workers_=4, int prefetch_depth_=2, int readahead_=4, bool direct_io_=false, int shuffle_chunk_=1, int shuffle_buffer_=0): 
+        DataLayer(name_), mirror(mirror_), size_data(size_data_), size_crop(size_crop_), file_data(file_data_), file_label(file_label_), batch_size(batch_size_), prefetch_workers(prefetch_workers_), prefetch_depth(prefetch_depth_), readahead(readahead_), direct_io(direct_io_), shuffle_chunk(shuffle_chunk_), shuffle_buffer(shuffle_buffer_){
         phase = phase_;
         init();
     };
@@ -4205,159 +7248,246 @@ class DiskDataLayer : public DataLayer {
         SetOrDie(json, name)
         SetValue(json, phase,       Training)
         SetValue(json, mirror,      false)
-        SetOrDie(json, file_data    )
+        SetValue(json, file_records,"")
+        if (file_records.empty()){
+            SetOrDie(json, file_data    )
+        }
         SetValue(json, file_mean,   std::vector<std::string>(0))
         SetValue(json, file_label,"")
         SetOrDie(json, batch_size   )
         SetOrDie(json, size_crop    )
         SetValue(json, random,      true)
+        SetValue(json, prefetch_workers,    4)
+        SetValue(json, prefetch_depth,      2)
+        SetValue(json, readahead,           4)
+        SetValue(json, direct_io,           false)
+        SetValue(json, shuffle_chunk,       1)
+        SetValue(json, shuffle_buffer,      0)
         init();
     };
 
     ~DiskDataLayer(){
-        if (lock.valid()) lock.wait();
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            stop = true;
+        }
+        cv_work.notify_all();
+        for (int w = 0; w<workers.size();++w) workers[w].join();
+
         delete distribution_bernoulli;
         for (int i=0;i<distribution_uniform.size();++i) delete distribution_uniform[i];
-        for (int i = 0; i<dataFILE.size();++i){
-            if (dataFILE[i]!=NULL) fclose(dataFILE[i]);
+        for (int i = 0; i<dataFD.size();++i){
+            if (dataFD[i]>=0) close(dataFD[i]);
         }
-        for (int i = 0; i<dataCPU.size();++i){
-            if (dataCPU[i]!=NULL) delete [] dataCPU[i];
-        }
-        for (int i = 0; i<item_raw.size();++i){
-            if (item_raw[i]!=NULL) delete [] item_raw[i];
+        for (int w = 0; w<workerRaw.size();++w){
+            for (int i = 0; i<workerRaw[w].size();++i){
+                if (workerRaw[w][i]!=NULL) checkCUDA(__LINE__, deviceFree(DeviceCPU, workerRaw[w][i]));
+            }
+            if (workerRecord[w]!=NULL) checkCUDA(__LINE__, deviceFree(DeviceCPU, workerRecord[w]));
+            if (workerDirect[w]!=NULL) checkCUDA(__LINE__, deviceFree(DeviceCPU, workerDirect[w]));
         }
-
-        if (labelCPU!=NULL) delete labelCPU;
-        if (labelCPUall!=NULL) delete labelCPUall;
-
-        for (int i = 0; i<dataGPU.size();++i){
-            if (dataGPU[i]!=NULL) checkCUDA(__LINE__, cudaFree(dataGPU[i]));
+        for (int r = 0; r<ring.size();++r){
+            for (int i = 0; i<ring[r].data.size();++i){
+                checkCUDA(__LINE__, deviceFree(DeviceCPU, ring[r].data[i]));
+            }
+            checkCUDA(__LINE__, deviceFree(DeviceCPU, ring[r].label));
         }
 
-        if (labelGPU!=NULL) checkCUDA(__LINE__, cudaFree(labelGPU));
-
+        SharedTensors::release(labelCPUall);
 
-        for (int i =0;i<file_mean.size();i++){
-            if (mean_data_GPU[i]!=NULL) checkCUDA(__LINE__, cudaFree(mean_data_GPU[i]));
+        for (int i =0;i<meanCPU.size();i++){
+            if (meanCPU[i]!=NULL) delete meanCPU[i];
         }
     };
 
 
     void shuffle(){
-        if (!random) return;
-        if (phase!=Testing){
-            ordering = randperm(labelCPUall->numofitems(), rng);
-        }
+        if (phase==Testing || (!random && replica_count<=1)) return;
+        if (!random) ordering = partition(identityperm(numofitems()), batch_size);
+        else if (shuffle_chunk>1) ordering = partition(randpermChunked(numofitems(), shuffle_chunk, shuffle_buffer>0 ? shuffle_buffer : 16 * shuffle_chunk, sampler_rng), batch_size);
+        else ordering = partition(randperm(numofitems(), sampler_rng), batch_size);
     }; 
 
-    void prefetch(){
-
-        checkCUDA(__LINE__,cudaSetDevice(GPU));
-
-        
-        std::vector<size_t> begin_coor(size_crop.size());
-
-        for (size_t i=0;i<batch_size;++i){
-
-            int image_i = ordering[counter];
-            //std::cout<<"i"<<i<<"image_i"<<image_i<<"bytes_per_item"<<bytes_per_item<<std::endl;
+    // decide the items of the next batch, with their crops and mirrors, and collect into upcoming the items
+    // that should be read ahead; called with mtx held
+    void plan(Batch& b, std::vector<int>& upcoming){
+        size_t dims = size_crop.size();
+        size_t until = std::min(ordering.size(), size_t(counter) + size_t(readahead + 1) * batch_size);
+        for (;hinted<until;++hinted){
+            if (shuffle_chunk<=1){
+                upcoming.push_back(ordering[hinted]);
+                continue;
+            }
+            // the whole chunk, the first time one of its items comes up
+            size_t chunk = ordering[hinted] / shuffle_chunk;
+            if (chunkRequested.size() <= chunk) chunkRequested.resize(numofitems() / shuffle_chunk + 1, false);
+            if (chunkRequested[chunk]) continue;
+            chunkRequested[chunk] = true;
+            for (size_t i=chunk*shuffle_chunk;i<std::min(size_t(numofitems()), (chunk+1)*shuffle_chunk);++i) upcoming.push_back(i);
+        }
+        for (int i=0;i<batch_size;++i){
+            b.items[i] = ordering[counter];
 
-            //label 
-            size_t labelSizeOfItem = labelCPU->sizeofitem();
-            memcpy(labelCPU->CPUmem+i*labelSizeOfItem, labelCPUall->CPUmem+image_i*labelSizeOfItem, labelSizeOfItem*sizeofStorageT);
-            
             // mirror
             bool mirror_this = false;
             if (mirror) mirror_this = ((*distribution_bernoulli)(rng));
-            if (numel_per_channel_orgi != numel_per_channel_crop || mirror_this){
-                for (int d=0;d<size_crop.size();++d){
-                    begin_coor[d] = (numel_per_channel_orgi == numel_per_channel_crop) ? 0 : ((*(distribution_uniform[d]))(rng));
-                }
+            b.mirrors[i] = mirror_this;
+            for (int d=0;d<dims;++d){
+                b.crops[i*dims+d] = (numel_per_channel_orgi == numel_per_channel_crop) ? 0 : ((*(distribution_uniform[d]))(rng));
             }
-            
-
-            //for (int data_i = 0; data_i<file_data.size();data_i++){
-            for (int data_i = 0; data_i<file_data.size();data_i++){
-                // read file
-                fseek(dataFILE[data_i], headerBytes + bytes_per_item * image_i, SEEK_SET);
-                size_t read_cnt = fread(item_raw[data_i], 1, bytes_per_item, dataFILE[data_i]);
-                if (read_cnt != bytes_per_item){
-                    std::cerr<<"Error reading file for DiskDataLayer::prefetch : "<<dataFILE[data_i]<<std::endl;
-                    std::cerr<<"data_i"<<data_i<<"read_cnt: "<<read_cnt<<" bytes_per_item: "<<bytes_per_item<<std::endl;
-                    FatalError(__LINE__);
-                }
-
-                T* memBegin = dataCPU[data_i] + i * numel_all_channel_crop;
-                if (numel_per_channel_orgi == numel_per_channel_crop && !mirror_this){
-                    memcpy(memBegin, item_raw[data_i], bytes_per_item);
-                }
-                else{
-                    if (size_crop.size()==2){
-                        for (size_t x_crop = 0; x_crop < size_crop[0]; ++ x_crop){
-                            size_t x_orgi = x_crop + begin_coor[0];
-                            for (size_t y_crop=0; y_crop < size_crop[1]; ++ y_crop){
-                                size_t y_orgi = y_crop + begin_coor[1];
-                                if (mirror_this) y_orgi = size_data[2] - 1 - y_orgi;
-
-                                size_t idx_orgi = x_orgi * size_data[2] + y_orgi;
-                                size_t idx_crop = x_crop * size_crop[1] + y_crop;
-                                for (size_t c=0; c<size_data[0];++c){
-                                    memBegin[idx_crop+c*numel_per_channel_crop] =  item_raw[data_i][idx_orgi+c*numel_per_channel_orgi];
-                                }
-                            }               
-                        }
-                    }else if (size_crop.size()==3){
-                        for (size_t x_crop = 0; x_crop < size_crop[0]; ++ x_crop){
-                            size_t x_orgi = x_crop + begin_coor[0];
-                            for (size_t y_crop=0; y_crop < size_crop[1]; ++ y_crop){
-                                size_t y_orgi = y_crop + begin_coor[1];
-                                if (mirror_this) y_orgi = size_data[2] - 1 - y_orgi;
-
-                                for (size_t z_crop=0; z_crop<size_crop[2]; ++z_crop){
-                                    size_t z_orgi = z_crop + begin_coor[2];
-
-                                    size_t idx_orgi = (x_orgi * size_data[2] + y_orgi) * size_data[3] + z_orgi;
-                                    size_t idx_crop = (x_crop * size_crop[1] + y_crop) * size_crop[2] + z_crop;
-                                    for (size_t c=0; c<size_data[0];++c){
-                                        memBegin[idx_crop+c*numel_per_channel_crop] =  item_raw[data_i][idx_orgi+c*numel_per_channel_orgi];
-                                    }
-                                }
-                            }               
-                        }
-                    }
-                    else{
-                        std::cerr<<"Error: dimension unimplemented. You can implement by yourself."<<std::endl;
-                        FatalError(__LINE__);
-                    }
-                }
-            }//for (int data_i = 0; data_i<file_data.size();data_i++)
 
             counter++;
             if (counter>= ordering.size()){
                 if (phase!=Testing) shuffle();
                 counter = 0;
+                hinted = 0;
+                chunkRequested.assign(chunkRequested.size(), false);
                 ++epoch_prefetch;
             }
-        }//end for (size_t i=0;i<batch_size;++i)
-        //std::cout<<"numel_batch_all_channel_crop:  "<<numel_batch_all_channel_crop<<std::endl;
-        for (int data_i = 0; data_i<file_data.size();data_i++){
-            checkCUDA(__LINE__, cudaMemcpy( dataGPU[data_i],  dataCPU[data_i],  numel_batch_all_channel_crop*sizeof(T), cudaMemcpyHostToDevice) );
         }
-            
-        labelCPU->writeGPU(labelGPU);
+        b.next = 0;
+        b.done = 0;
+        b.epoch = epoch_prefetch;
+    };
+
+    // item image_i of data file data_i (or record image_i, with file_records) into dst
+    void read(int w, int data_i, int image_i, void* dst){
+        off_t offset = off_t(dataOffset[data_i] + bytes_per_read * image_i);
+        if (direct_io){
+            // O_DIRECT wants the offset, the length and the buffer aligned to the logical block size
+            char* buffer = (char*)((uintptr_t(workerDirect[w]) + DISK_DIRECT_ALIGN - 1) / DISK_DIRECT_ALIGN * DISK_DIRECT_ALIGN);
+            off_t begin = offset / DISK_DIRECT_ALIGN * DISK_DIRECT_ALIGN;
+            size_t span = (size_t(offset - begin) + bytes_per_read + DISK_DIRECT_ALIGN - 1) / DISK_DIRECT_ALIGN * DISK_DIRECT_ALIGN;
+            size_t read_cnt = preadFully(dataFD[data_i], buffer, span, begin);
+            if (read_cnt < size_t(offset - begin) + bytes_per_read) readError(data_i, read_cnt);
+            memcpy(dst, buffer + (offset - begin), bytes_per_read);
+        }else{
+            size_t read_cnt = preadFully(dataFD[data_i], dst, bytes_per_read, offset);
+            if (read_cnt != bytes_per_read) readError(data_i, read_cnt);
+        }
+    };
+
+    // pread until n bytes or the end of the file
+    static size_t preadFully(int fd, void* dst, size_t n, off_t offset){
+        size_t done = 0;
+        while (done < n){
+            ssize_t r = pread(fd, (char*)dst + done, n - done, offset + done);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            done += r;
+        }
+        return done;
+    };
+
+    void readError(int data_i, size_t read_cnt){
+        std::cerr<<"Error reading file for DiskDataLayer::prefetch : "<<(file_records.empty() ? file_data[data_i] : file_records)<<std::endl;
+        std::cerr<<"data_i"<<data_i<<"read_cnt: "<<read_cnt<<" bytes_per_read: "<<bytes_per_read<<std::endl;
+        FatalError(__LINE__);
+    };
+
+    // ask the kernel to start reading these items, merged into runs of consecutive items
+    void readAhead(std::vector<int>& upcoming){
+        if (upcoming.empty() || direct_io) return;
+        std::sort(upcoming.begin(), upcoming.end());
+        for (size_t k=0;k<upcoming.size();){
+            size_t run = 1;
+            while (k+run<upcoming.size() && upcoming[k+run]<=upcoming[k+run-1]+1) ++run;
+            size_t items = upcoming[k+run-1] - upcoming[k] + 1;
+            for (int data_i = 0; data_i<dataFD.size();data_i++){
+                posix_fadvise(dataFD[data_i], off_t(dataOffset[data_i] + bytes_per_read * upcoming[k]), off_t(bytes_per_read * items), POSIX_FADV_WILLNEED);
+            }
+            k += run;
+        }
+        upcoming.clear();
+    };
+
+    // read, crop and mirror item i of batch b on worker w
+    void assemble(Batch& b, int i, int w){
+        int image_i = b.items[i];
+        bool mirror_this = b.mirrors[i];
+        const int* begin_coor = &b.crops[i*size_crop.size()];
+
+        //label 
+        char* record = workerRecord[w];
+        if (record==NULL){
+            memcpy(b.label+i*labelSizeOfItem, labelCPUall->CPUmem+image_i*labelSizeOfItem, labelSizeOfItem*sizeofStorageT);
+        }else{
+            read(w, 0, image_i, record);
+            const char* label = record + records.offset.back();
+            switch (records.fields.back().typeID){
+                case 0: CPU_convert<half>  (labelSizeOfItem, label, b.label+i*labelSizeOfItem); break;
+                case 1: CPU_convert<float> (labelSizeOfItem, label, b.label+i*labelSizeOfItem); break;
+                case 2: CPU_convert<double>(labelSizeOfItem, label, b.label+i*labelSizeOfItem); break;
+            }
+        }
 
+        for (int data_i = 0; data_i<file_data.size();data_i++){
+            StorageT* memBegin = b.data[data_i] + i * numel_all_channel_crop;
+            const StorageT* mean = data_i<meanCPU.size() ? meanCPU[data_i]->CPUmem : NULL;
+            bool as_is = std::is_same<T, StorageT>::value && numel_per_channel_orgi == numel_per_channel_crop && !mirror_this && mean==NULL;
+            T* raw;
+            if (record!=NULL){
+                raw = (T*)(record + records.offset[data_i]);
+            }else if (as_is){
+                read(w, data_i, image_i, memBegin);
+                continue;
+            }else{
+                raw = workerRaw[w][data_i];
+                read(w, data_i, image_i, raw);
+            }
+            if (as_is) memcpy(memBegin, raw, bytes_per_item);
+            else CPU_crop_mirror_convert_subtract(size_data, size_crop, begin_coor, mirror_this, raw, mean, memBegin);
+        }//for (int data_i = 0; data_i<file_data.size();data_i++)
+    };
+
+    void prefetch(int w){
+        std::vector<int> upcoming;
+        std::unique_lock<std::mutex> lock(mtx);
+        while (!stop){
+            // the oldest batch with items left, or a new one if the ring has room
+            Batch* b = NULL;
+            for (size_t k=consumed;k<planned && b==NULL;++k){
+                if (ring[k % ring.size()].next < batch_size) b = &ring[k % ring.size()];
+            }
+            if (b==NULL && planned - consumed < ring.size()){
+                b = &ring[planned % ring.size()];
+                plan(*b, upcoming);
+                ++planned;
+                if (!upcoming.empty()){
+                    lock.unlock();
+                    readAhead(upcoming);
+                    lock.lock();
+                    continue;
+                }
+            }
+            if (b==NULL){
+                cv_work.wait(lock);
+                continue;
+            }
+            int i = b->next++;
+            lock.unlock();
+            assemble(*b, i, w);
+            lock.lock();
+            if (++b->done == batch_size) cv_ready.notify_all();
+        }
     };
 
     void forward(Phase phase_){
-        lock.wait();
-        epoch = epoch_prefetch;
+        Batch& b = ring[consumed % ring.size()];
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv_ready.wait(lock, [&]{ return consumed < planned && b.done == batch_size; });
+        }
+        epoch = b.epoch;
         for (int data_i = 0; data_i<file_data.size();data_i++){
-            StorageT* mean_data =  (data_i<mean_data_GPU.size()? mean_data_GPU[data_i]: NULL );
-            Kernel_convert_to_StorageT_subtract<<<CUDA_GET_BLOCKS(numel_batch_all_channel_crop), CUDA_NUM_THREADS>>>(CUDA_GET_LOOPS(numel_batch_all_channel_crop), numel_batch_all_channel_crop, numel_all_channel_crop, dataGPU[data_i], mean_data, out[data_i]->dataGPU);
+            checkCUDA(__LINE__, deviceMemcpy(device, out[data_i]->dataGPU, b.data[data_i], numel_batch_all_channel_crop*sizeofStorageT, cudaMemcpyHostToDevice) );
         }
-        std::swap(out[file_data.size()]->dataGPU,labelGPU);
-        lock = std::async(std::launch::async,&DiskDataLayer<T>::prefetch,this);
+        checkCUDA(__LINE__, deviceMemcpy(device, out[file_data.size()]->dataGPU, b.label, numel(label_dim)*sizeofStorageT, cudaMemcpyHostToDevice) );
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            ++consumed;
+        }
+        cv_work.notify_all();
     };
 
 
@@ -4391,22 +7521,96 @@ class DiskDataLayer : public DataLayer {
         }
 
         out[file_data.size()]->need_diff = false;
-        memoryBytes += out[file_data.size()]->Malloc(labelCPU->dim);
-        checkCUDA(__LINE__, cudaMalloc(&labelGPU, labelCPU->numBytes()) );
-        memoryBytes += labelCPU->numBytes();
+        memoryBytes += out[file_data.size()]->Malloc(label_dim);
 
-        for (int data_i = 0; data_i<file_data.size();data_i++){
-            checkCUDA(__LINE__, cudaMalloc(&dataGPU[data_i], numel_batch_all_channel_crop * sizeof(T)) );
-            memoryBytes += numel_batch_all_channel_crop * sizeof(T);
+        for (int w = workers.size();w<prefetch_workers;++w){
+            workers.push_back(std::thread(&DiskDataLayer<T>::prefetch,this,w));
         }
 
-        lock = std::async(std::launch::async,&DiskDataLayer<T>::prefetch,this);
-
         return memoryBytes;
     };  
 };
 
 
+// Algorithms picked by the convolution autotuner, kept in a text file with one line per tuned shape:
+// "<key> <fwdAlgo> <bwdDataAlgo> <bwdFilterAlgo>". The key names the device, the data type, the shape and the
+// workspace budget, so the same file can serve several networks and machines. Later lines override earlier ones.
+class ConvAutotuneCache{
+    std::string file;
+    std::map<std::string, std::vector<int> > entries;
+    std::mutex mtx;
+public:
+    ConvAutotuneCache(std::string file_): file(file_){
+        if (file.empty()) return;
+        std::ifstream fin(file.c_str());
+        std::string key;
+        std::vector<int> algos(3);
+        while (fin >> key >> algos[0] >> algos[1] >> algos[2]) entries[key] = algos;
+    };
+
+    bool find(const std::string& key, std::vector<int>& algos){
+        std::lock_guard<std::mutex> lock(mtx);
+        std::map<std::string, std::vector<int> >::iterator it = entries.find(key);
+        if (it == entries.end()) return false;
+        algos = it->second;
+        return true;
+    };
+
+    void save(const std::string& key, const std::vector<int>& algos){
+        std::lock_guard<std::mutex> lock(mtx);
+        entries[key] = algos;
+        if (file.empty()) return;
+        std::ofstream fout(file.c_str(), std::ios::app);
+        if (!fout){ std::cerr<<"Cannot write the autotune cache "<<file<<std::endl; return; }
+        fout<<key<<" "<<algos[0]<<" "<<algos[1]<<" "<<algos[2]<<std::endl;
+    };
+
+    // one cache per file, shared by all the layers of the process
+    static ConvAutotuneCache& get(const std::string& file){
+        static std::mutex registry;
+        static std::map<std::string, ConvAutotuneCache*> caches;
+        std::lock_guard<std::mutex> lock(registry);
+        ConvAutotuneCache*& cache = caches[file];
+        if (cache == NULL) cache = new ConvAutotuneCache(file);
+        return *cache;
+    };
+};
+
+// An ActivationLayer taken over by the Convolution or InnerProduct layer before it (see Net::planActivationFusion),
+// applied to the output right after the bias instead of in a pass of its own over a second response.
+struct FusedActivation{
+    bool enabled;
+    cudnnActivationMode_t mode;
+    cudnnActivationDescriptor_t desc;
+    Device device;
+
+    FusedActivation(): enabled(false), mode(CUDNN_ACTIVATION_RELU), desc(NULL), device(DeviceGPU){};
+
+    ~FusedActivation(){
+        if (desc!=NULL) checkCUDNN(__LINE__,cudnnDestroyActivationDescriptor(desc));
+    };
+
+    static bool supports(cudnnActivationMode_t mode_){
+        return mode_==CUDNN_ACTIVATION_RELU || mode_==CUDNN_ACTIVATION_SIGMOID || mode_==CUDNN_ACTIVATION_TANH;
+    };
+
+    void set(cudnnActivationMode_t mode_, Device device_){
+        enabled = true;
+        mode = mode_;
+        device = device_;
+        if (device==DeviceGPU && desc==NULL){
+            checkCUDNN(__LINE__,cudnnCreateActivationDescriptor(&desc));
+            checkCUDNN(__LINE__,cudnnSetActivationDescriptor(desc, mode, CUDNN_PROPAGATE_NAN, 99.0));
+        }
+    };
+
+    // in place on r, for the GPU paths without a fused kernel
+    void forward(cudnnHandle_t handle, Response* r){
+        if (device==DeviceCPU) CPU_activation_forward(mode, numel(r->dim), r->dataGPU, r->dataGPU);
+        else checkCUDNN(__LINE__,cudnnActivationForward(handle, desc, one, r->desc, r->dataGPU, zero, r->desc, r->dataGPU));
+    };
+};
+
 class ConvolutionLayer : public Layer {
     cudnnFilterDescriptor_t filter_desc;
     cudnnTensorDescriptor_t bias_desc;
@@ -4419,11 +7623,22 @@ class ConvolutionLayer : public Layer {
     std::vector<size_t> fwdAlgoWorkspaceSizes;
     std::vector<size_t> bwdDataAlgoWorkspaceSizes;
     std::vector<size_t> bwdFilterAlgoWorkspaceSizes;
+
+    // algorithms of the CPU engine, CPUConvAuto leaves the choice to CPUConvGeometry
+    CPUConvAlgo cpuFwdAlgo;
+    CPUConvAlgo cpuBwdDataAlgo;
+    CPUConvAlgo cpuBwdFilterAlgo;
 public:
     cudnnConvolutionFwdAlgo_t fwdAlgo;
     cudnnConvolutionBwdDataAlgo_t bwdDataAlgo;
     cudnnConvolutionBwdFilterAlgo_t bwdFilterAlgo;
 
+    // time the algorithms at Malloc and keep the fastest ones within autotune_workspace MB,
+    // remembering them in autotune_cache (no file when empty)
+    bool autotune;
+    int autotune_workspace;
+    std::string autotune_cache;
+
     int num_output;
     std::vector<int> window;
     std::vector<int> stride;
@@ -4431,6 +7646,8 @@ public:
     std::vector<int> upscale;
     int group;
 
+    FusedActivation activation;
+
     void init(){
         weight_dim.push_back(num_output);
         weight_dim.push_back(0);  // need the channel size from the input
@@ -4464,6 +7681,9 @@ public:
         SetValue(json, fwdAlgo,             CUDNN_CONVOLUTION_FWD_ALGO_IMPLICIT_GEMM)
         SetValue(json, bwdDataAlgo,         CUDNN_CONVOLUTION_BWD_DATA_ALGO_0)
         SetValue(json, bwdFilterAlgo,       CUDNN_CONVOLUTION_BWD_FILTER_ALGO_0)
+        SetValue(json, autotune,            false)
+        SetValue(json, autotune_workspace,  1024)
+        SetValue(json, autotune_cache,      "marvin_autotune.txt")
 
         init();
     };
@@ -4485,9 +7705,81 @@ public:
         bias_filler = bias_filler_;
         bias_filler_param = bias_filler_param_;
 
+        autotune = false;
+
         init();
     };
 
+    // describes the device, the data type, the shape of in[0] and the workspace budget
+    std::string autotuneKey(){
+        std::ostringstream key;
+        if (device==DeviceCPU){
+            key<<"CPU"<<CPUPool().size();
+        }else{
+            cudaDeviceProp prop;
+            checkCUDA(__LINE__, cudaGetDeviceProperties(&prop, GPU) );
+            std::string gpuName(prop.name);
+            std::replace(gpuName.begin(), gpuName.end(), ' ', '_');
+            key<<gpuName<<"_cudnn"<<cudnnGetVersion();
+        }
+        key<<"_type"<<DATATYPE;
+        const std::vector<int>* dims[6] = {&in[0]->dim, &out[0]->dim, &window, &stride, &padding, &upscale};
+        const char* names[6] = {"_in", "_out", "_w", "_s", "_p", "_u"};
+        for (int v=0;v<6;++v){
+            key<<names[v];
+            for (int d=0;d<dims[v]->size();++d) key<<(d>0?"x":"")<<(*dims[v])[d];
+        }
+        key<<"_g"<<group<<"_ws"<<autotune_workspace;
+        return key.str();
+    };
+
+    // pick the algorithms for the shape of in[0], from the cache or by timing them
+    void tune(){
+        ConvAutotuneCache& cache = ConvAutotuneCache::get(autotune_cache);
+        std::string key = autotuneKey();
+        std::vector<int> algos(3);
+        bool cached = cache.find(key, algos);
+        if (!cached){
+            size_t workspace = size_t(autotune_workspace) * 1024 * 1024;
+            if (device==DeviceCPU){
+                CPUConvGeometry geometry(in[0]->dim, out[0]->dim, window, stride, padding, upscale, group);
+                CPUConvAlgo fwd, bwdData, bwdFilter;
+                CPU_conv_autotune(geometry, workspace, fwd, bwdData, bwdFilter);
+                algos[0] = fwd;
+                algos[1] = bwdData;
+                algos[2] = bwdFilter;
+            }else{
+                // the results come sorted by time: keep the first one that ran within the budget
+                int returned = 0;
+                cudnnConvolutionFwdAlgoPerf_t fwdPerf[8];
+                checkCUDNN(__LINE__,cudnnFindConvolutionForwardAlgorithm(cudnnHandle, in[0]->getDesc(group), filter_desc, conv_desc, out[0]->getDesc(group), 8, &returned, fwdPerf) );
+                algos[0] = fwdAlgo;
+                for (int r=0;r<returned;++r) if (fwdPerf[r].status==CUDNN_STATUS_SUCCESS && fwdPerf[r].memory<=workspace){ algos[0] = fwdPerf[r].algo; break; }
+
+                cudnnConvolutionBwdDataAlgoPerf_t bwdDataPerf[8];
+                checkCUDNN(__LINE__,cudnnFindConvolutionBackwardDataAlgorithm(cudnnHandle, filter_desc, out[0]->getDesc(group), conv_desc, in[0]->getDesc(group), 8, &returned, bwdDataPerf) );
+                algos[1] = bwdDataAlgo;
+                for (int r=0;r<returned;++r) if (bwdDataPerf[r].status==CUDNN_STATUS_SUCCESS && bwdDataPerf[r].memory<=workspace){ algos[1] = bwdDataPerf[r].algo; break; }
+
+                cudnnConvolutionBwdFilterAlgoPerf_t bwdFilterPerf[8];
+                checkCUDNN(__LINE__,cudnnFindConvolutionBackwardFilterAlgorithm(cudnnHandle, in[0]->getDesc(group), out[0]->getDesc(group), conv_desc, filter_desc, 8, &returned, bwdFilterPerf) );
+                algos[2] = bwdFilterAlgo;
+                for (int r=0;r<returned;++r) if (bwdFilterPerf[r].status==CUDNN_STATUS_SUCCESS && bwdFilterPerf[r].memory<=workspace){ algos[2] = bwdFilterPerf[r].algo; break; }
+            }
+            cache.save(key, algos);
+        }
+        if (device==DeviceCPU){
+            cpuFwdAlgo       = CPUConvAlgo(algos[0]);
+            cpuBwdDataAlgo   = CPUConvAlgo(algos[1]);
+            cpuBwdFilterAlgo = CPUConvAlgo(algos[2]);
+        }else{
+            fwdAlgo       = cudnnConvolutionFwdAlgo_t(algos[0]);
+            bwdDataAlgo   = cudnnConvolutionBwdDataAlgo_t(algos[1]);
+            bwdFilterAlgo = cudnnConvolutionBwdFilterAlgo_t(algos[2]);
+        }
+        std::cout<<"    autotune"<<(cached?" (cached)":"")<<": fwdAlgo "<<algos[0]<<" bwdDataAlgo "<<algos[1]<<" bwdFilterAlgo "<<algos[2]<<std::endl;
+    };
+
     size_t Malloc(Phase phase_){
         size_t memoryBytes = 0;
         train_me = train_me && phase_ != Testing;
@@ -4501,41 +7793,43 @@ public:
 
         weight_dim[1] = in[0]->dim[1]/group;
 
-        // create descriptor
-        checkCUDNN(__LINE__,cudnnCreateFilterDescriptor(&filter_desc) );
-        checkCUDNN(__LINE__,cudnnCreateTensorDescriptor(&bias_desc) );
-        checkCUDNN(__LINE__,cudnnCreateConvolutionDescriptor(&conv_desc) );
-        // set descriptor
-        // set the parameters for convolution
+        if (device==DeviceGPU){
+            // create descriptor
+            checkCUDNN(__LINE__,cudnnCreateFilterDescriptor(&filter_desc) );
+            checkCUDNN(__LINE__,cudnnCreateTensorDescriptor(&bias_desc) );
+            checkCUDNN(__LINE__,cudnnCreateConvolutionDescriptor(&conv_desc) );
+            // set descriptor
+            // set the parameters for convolution
 
-        std::vector<int> weight_dim_group = weight_dim;
-        weight_dim_group[0] = weight_dim[0]/group;
+            std::vector<int> weight_dim_group = weight_dim;
+            weight_dim_group[0] = weight_dim[0]/group;
 
-        checkCUDNN(__LINE__,cudnnSetFilterNdDescriptor(filter_desc,
-                                                    CUDNNStorageT,
-                                                    CUDNN_TENSOR_NCHW,
-                                                    weight_dim.size(),
-                                                    &weight_dim_group[0]) );
+            checkCUDNN(__LINE__,cudnnSetFilterNdDescriptor(filter_desc,
+                                                        CUDNNStorageT,
+                                                        CUDNN_TENSOR_NCHW,
+                                                        weight_dim.size(),
+                                                        &weight_dim_group[0]) );
 
-        checkCUDNN(__LINE__,cudnnSetConvolutionNdDescriptor(conv_desc,
-                                                    padding.size(),
-                                                    &padding[0],
-                                                    &stride[0],
-                                                    &upscale[0],
-                                                    CUDNN_CROSS_CORRELATION,
-                                                    CUDNNConvComputeT) );
+            checkCUDNN(__LINE__,cudnnSetConvolutionNdDescriptor(conv_desc,
+                                                        padding.size(),
+                                                        &padding[0],
+                                                        &stride[0],
+                                                        &upscale[0],
+                                                        CUDNN_CROSS_CORRELATION,
+                                                        CUDNNConvComputeT) );
 
-        std::vector<int> bias_stride(bias_dim.size());
+            std::vector<int> bias_stride(bias_dim.size());
 
-        bias_stride[bias_dim.size()-1] = 1;
-        for (int d=bias_dim.size()-2;d>=0;--d){
-            bias_stride[d] = bias_stride[d+1] *  bias_dim[d+1];
+            bias_stride[bias_dim.size()-1] = 1;
+            for (int d=bias_dim.size()-2;d>=0;--d){
+                bias_stride[d] = bias_stride[d+1] *  bias_dim[d+1];
+            }
+            checkCUDNN(__LINE__,cudnnSetTensorNdDescriptor(bias_desc,
+                                                        CUDNNStorageT,
+                                                        bias_dim.size(),
+                                                        &bias_dim[0],
+                                                        &bias_stride[0]) );
         }
-        checkCUDNN(__LINE__,cudnnSetTensorNdDescriptor(bias_desc,
-                                                    CUDNNStorageT,
-                                                    bias_dim.size(),
-                                                    &bias_dim[0],
-                                                    &bias_stride[0]) );
 
 
         weight_numel = numel(weight_dim);
@@ -4543,12 +7837,12 @@ public:
 
         if (weight_numel>0){
             std::cout<<" weight"; veciPrint(weight_dim);
-            checkCUDA(__LINE__, cudaMalloc( &weight_dataGPU, weight_numel * sizeofStorageT) );
+            checkCUDA(__LINE__, deviceMalloc(device, &weight_dataGPU, weight_numel * sizeofStorageT) );
             memoryBytes += weight_numel * sizeofStorageT;
         }
         if (bias_numel>0){
             std::cout<<" bias"; veciPrint(bias_dim);
-            checkCUDA(__LINE__, cudaMalloc( &bias_dataGPU, bias_numel * sizeofStorageT) );
+            checkCUDA(__LINE__, deviceMalloc(device, &bias_dataGPU, bias_numel * sizeofStorageT) );
             memoryBytes += bias_numel * sizeofStorageT;
         }
         std::cout<<std::endl;
@@ -4560,12 +7854,20 @@ public:
             std::vector<int> dimOut;
             dimOut.resize(in[i]->dim.size());
 
-            checkCUDNN(__LINE__,cudnnGetConvolutionNdForwardOutputDim(conv_desc,
-                                                                in[i]->getDesc(group),
-                                                                filter_desc,
-                                                                dimOut.size(),
-                                                                &dimOut[0]
-                                                                ));
+            if (device==DeviceCPU){
+                dimOut[0] = in[i]->dim[0];
+                dimOut[1] = num_output/group;
+                for (int d=0;d<window.size();++d){
+                    dimOut[2+d] = (in[i]->dim[2+d] + 2*padding[d] - ((window[d]-1)*upscale[d]+1)) / stride[d] + 1;
+                }
+            }else{
+                checkCUDNN(__LINE__,cudnnGetConvolutionNdForwardOutputDim(conv_desc,
+                                                                    in[i]->getDesc(group),
+                                                                    filter_desc,
+                                                                    dimOut.size(),
+                                                                    &dimOut[0]
+                                                                    ));
+            }
             dimOut[1] *= group;
 
             size_t dall = in[i]->receptive_field.size();
@@ -4582,7 +7884,15 @@ public:
 
         }
 
-        // Allocate workspace
+        cpuFwdAlgo = cpuBwdDataAlgo = cpuBwdFilterAlgo = CPUConvAuto;
+        if (autotune) tune();
+
+        if (device==DeviceGPU) mallocWorkspaces();
+
+        return memoryBytes;
+    };
+
+    void mallocWorkspaces(){
         fwdAlgoWorkspaces.resize(in.size());
         bwdDataAlgoWorkspaces.resize(out.size());
         bwdFilterAlgoWorkspaces.resize(out.size());
@@ -4599,7 +7909,7 @@ public:
                                                                         out[i]->getDesc(group),
                                                                         fwdAlgo,
                                                                         &fwdAlgoWorkspaceSizes[i]));
-            checkCUDA(__LINE__, cudaMalloc( &fwdAlgoWorkspaces[i], fwdAlgoWorkspaceSizes[i]) );
+            checkCUDA(__LINE__, deviceMalloc(device, &fwdAlgoWorkspaces[i], fwdAlgoWorkspaceSizes[i]) );
         }
 
         for (int i=0;i<out.size();++i){
@@ -4619,16 +7929,80 @@ public:
                                                                                bwdFilterAlgo,
                                                                                &bwdFilterAlgoWorkspaceSizes[i]));
 
-            checkCUDA(__LINE__, cudaMalloc( &bwdDataAlgoWorkspaces[i], bwdDataAlgoWorkspaceSizes[i]) );
-            checkCUDA(__LINE__, cudaMalloc( &bwdFilterAlgoWorkspaces[i], bwdFilterAlgoWorkspaceSizes[i]) );
+            checkCUDA(__LINE__, deviceMalloc(device, &bwdDataAlgoWorkspaces[i], bwdDataAlgoWorkspaceSizes[i]) );
+            checkCUDA(__LINE__, deviceMalloc(device, &bwdFilterAlgoWorkspaces[i], bwdFilterAlgoWorkspaceSizes[i]) );
         }
+    };
 
-        return memoryBytes;
+    void freeWorkspaces(){
+        for (int i=0;i<fwdAlgoWorkspaces.size();++i)        checkCUDA(__LINE__, deviceFree(device, fwdAlgoWorkspaces[i]));
+        for (int i=0;i<bwdDataAlgoWorkspaces.size();++i)    checkCUDA(__LINE__, deviceFree(device, bwdDataAlgoWorkspaces[i]));
+        for (int i=0;i<bwdFilterAlgoWorkspaces.size();++i)  checkCUDA(__LINE__, deviceFree(device, bwdFilterAlgoWorkspaces[i]));
+    };
+
+    // the outputs can be slices of a Concat's output (the GPU adds the bias through a descriptor with their strides
+    // for up to 5 dimensions only), but not the inputs
+    bool strided(Response* r){
+        for (int o=0;o<out.size();++o) if (out[o]==r) return device==DeviceCPU || bias_dim.size()<=5;
+        return false;
+    };
+
+    // An output turned into a slice: keep the algorithms if cuDNN takes its strides with them, fall back to the
+    // ones that take any layout otherwise, and size the workspaces again.
+    void restrided(){
+        if (device!=DeviceGPU) return;
+        size_t bytes;
+        for (int i=0;i<out.size();++i){
+            if (cudnnGetConvolutionForwardWorkspaceSize(cudnnHandle, in[i]->getDesc(group), filter_desc, conv_desc, out[i]->getDesc(group), fwdAlgo, &bytes)!=CUDNN_STATUS_SUCCESS)
+                fwdAlgo = CUDNN_CONVOLUTION_FWD_ALGO_IMPLICIT_GEMM;
+            if (cudnnGetConvolutionBackwardDataWorkspaceSize(cudnnHandle, filter_desc, out[i]->getDesc(group), conv_desc, in[i]->getDesc(group), bwdDataAlgo, &bytes)!=CUDNN_STATUS_SUCCESS)
+                bwdDataAlgo = CUDNN_CONVOLUTION_BWD_DATA_ALGO_0;
+            if (cudnnGetConvolutionBackwardFilterWorkspaceSize(cudnnHandle, in[i]->getDesc(group), out[i]->getDesc(group), conv_desc, filter_desc, bwdFilterAlgo, &bytes)!=CUDNN_STATUS_SUCCESS)
+                bwdFilterAlgo = CUDNN_CONVOLUTION_BWD_FILTER_ALGO_0;
+        }
+        freeWorkspaces();
+        mallocWorkspaces();
     };
 
     void forward(Phase phase_){
+        if (device==DeviceCPU){
+            for (int i=0;i<in.size();++i){
+                CPUConvGeometry geometry(in[i]->dim, out[i]->dim, window, stride, padding, upscale, group);
+                geometry.out_item = out[i]->stride[0];
+                if (cpuFwdAlgo!=CPUConvAuto) geometry.algo = cpuFwdAlgo;
+                else if (fwdAlgo==CUDNN_CONVOLUTION_FWD_ALGO_WINOGRAD || fwdAlgo==CUDNN_CONVOLUTION_FWD_ALGO_WINOGRAD_NONFUSED) geometry.preferWinograd();
+                CPU_conv_forward(geometry, in[i]->dataGPU, weight_dataGPU, out[i]->dataGPU, false);
+                if (activation.enabled) CPU_bias_activation_forward(geometry.N, geometry.K, geometry.out_spel, bias_dataGPU, activation.mode, out[i]->dataGPU, geometry.out_item);
+                else CPU_bias_forward(geometry.N, geometry.K, geometry.out_spel, bias_dataGPU, out[i]->dataGPU, geometry.out_item);
+            }
+            return;
+        }
 
         for (int i=0;i<in.size();++i){
+#if CUDNN_MAJOR >= 6
+            // convolution, bias and ReLU in one kernel
+            if (activation.enabled && activation.mode==CUDNN_ACTIVATION_RELU && group==1 && bias_dim.size()<=5){
+                checkCUDNN(__LINE__,cudnnConvolutionBiasActivationForward(cudnnHandle,
+                                                      one,
+                                                      in[i]->getDesc(),
+                                                      in[i]->dataGPU,
+                                                      filter_desc,
+                                                      weight_dataGPU,
+                                                      conv_desc,
+                                                      fwdAlgo,
+                                                      fwdAlgoWorkspaces[i],
+                                                      fwdAlgoWorkspaceSizes[i],
+                                                      zero,
+                                                      out[i]->getDesc(),
+                                                      out[i]->dataGPU,
+                                                      bias_desc,
+                                                      bias_dataGPU,
+                                                      activation.desc,
+                                                      out[i]->getDesc(),
+                                                      out[i]->dataGPU) );
+                continue;
+            }
+#endif
             for (int g = 0; g < group; g++) {
                 checkCUDNN(__LINE__,cudnnConvolutionForward(cudnnHandle,
                                                       one,
@@ -4699,9 +8073,27 @@ public:
                 checkCUDNN(__LINE__,cudnnDestroyTensorDescriptor(bias_desc_bug) );
                 checkCUDNN(__LINE__,cudnnDestroyTensorDescriptor(out_desc_bug) );
             }
+            if (activation.enabled) activation.forward(cudnnHandle, out[i]);
         }
     };
     void backward(Phase phase_){
+        if (device==DeviceCPU){
+            for (int i=0;i<out.size();++i){
+                CPUConvGeometry geometry(in[i]->dim, out[i]->dim, window, stride, padding, upscale, group);
+                geometry.out_item = out[i]->stride[0];
+                const CPUConvAlgo chosen = geometry.algo;
+                if (in[i]->need_diff){
+                    if (cpuBwdDataAlgo!=CPUConvAuto) geometry.algo = cpuBwdDataAlgo;
+                    CPU_conv_backward_data(geometry, weight_dataGPU, out[i]->diffGPU, in[i]->diffGPU, true);
+                }
+                if (train_me){
+                    geometry.algo = cpuBwdFilterAlgo!=CPUConvAuto ? cpuBwdFilterAlgo : chosen;
+                    if (weight_numel>0) CPU_conv_backward_filter(geometry, in[i]->dataGPU, out[i]->diffGPU, weight_diffGPU, true);
+                    if (bias_numel>0)   CPU_bias_backward(geometry.N, geometry.K, geometry.out_spel, out[i]->diffGPU, bias_diffGPU, geometry.out_item);
+                }
+            }
+            return;
+        }
         for (int i=0;i<out.size();++i){
             // if bottom still needs to compute gradients
             if (in[i]->need_diff){
@@ -4744,18 +8136,13 @@ public:
         }
     };
     ~ConvolutionLayer(){
+        if (device==DeviceCPU) return;
         // destory the descriptor
         checkCUDNN(__LINE__,cudnnDestroyFilterDescriptor(filter_desc) );
         checkCUDNN(__LINE__,cudnnDestroyTensorDescriptor(bias_desc) );
         checkCUDNN(__LINE__,cudnnDestroyConvolutionDescriptor(conv_desc) );
 
-        for (int i=0;i<in.size();++i){
-            checkCUDA(__LINE__, cudaFree(fwdAlgoWorkspaces[i]));
-        }
-        for (int i=0;i<out.size();++i){
-            checkCUDA(__LINE__, cudaFree(bwdDataAlgoWorkspaces[i]));
-            checkCUDA(__LINE__, cudaFree(bwdFilterAlgoWorkspaces[i]));
-        }
+        freeWorkspaces();
     };
 };
 
@@ -4855,53 +8242,55 @@ public:
         weight_dim[0] = in[0]->dim[1];
         weight_dim[1] = num_output/group;
 
-        // create descriptor
-        checkCUDNN(__LINE__,cudnnCreateFilterDescriptor(&filter_desc) );
-        checkCUDNN(__LINE__,cudnnCreateTensorDescriptor(&bias_desc) );
-        checkCUDNN(__LINE__,cudnnCreateConvolutionDescriptor(&conv_desc) );
-        // set descriptor
-        // set the parameters for convolution
-
-        std::vector<int> weight_dim_group = weight_dim;
-        weight_dim_group[0] = weight_dim[0]/group;
-
-        checkCUDNN(__LINE__,cudnnSetFilterNdDescriptor(filter_desc,
-                                                    CUDNNStorageT,
-                                                    CUDNN_TENSOR_NCHW,
-                                                    weight_dim.size(),
-                                                    &weight_dim_group[0]) );
-
-        checkCUDNN(__LINE__,cudnnSetConvolutionNdDescriptor(conv_desc,
-                                                    padding.size(),
-                                                    &padding[0],
-                                                    &stride[0],
-                                                    &upscale[0],
-                                                    CUDNN_CROSS_CORRELATION,
-                                                    CUDNNConvComputeT) );
-
-        std::vector<int> bias_stride(bias_dim.size());
-
-        bias_stride[bias_dim.size()-1] = 1;
-        for (int d=bias_dim.size()-2;d>=0;--d){
-            bias_stride[d] = bias_stride[d+1] *  bias_dim[d+1];
-        }
-        checkCUDNN(__LINE__,cudnnSetTensorNdDescriptor(bias_desc,
-                                                    CUDNNStorageT,
-                                                    bias_dim.size(),
-                                                    &bias_dim[0],
-                                                    &bias_stride[0]) );
+        if (device==DeviceGPU){
+            // create descriptor
+            checkCUDNN(__LINE__,cudnnCreateFilterDescriptor(&filter_desc) );
+            checkCUDNN(__LINE__,cudnnCreateTensorDescriptor(&bias_desc) );
+            checkCUDNN(__LINE__,cudnnCreateConvolutionDescriptor(&conv_desc) );
+            // set descriptor
+            // set the parameters for convolution
+
+            std::vector<int> weight_dim_group = weight_dim;
+            weight_dim_group[0] = weight_dim[0]/group;
+
+            checkCUDNN(__LINE__,cudnnSetFilterNdDescriptor(filter_desc,
+                                                        CUDNNStorageT,
+                                                        CUDNN_TENSOR_NCHW,
+                                                        weight_dim.size(),
+                                                        &weight_dim_group[0]) );
+
+            checkCUDNN(__LINE__,cudnnSetConvolutionNdDescriptor(conv_desc,
+                                                        padding.size(),
+                                                        &padding[0],
+                                                        &stride[0],
+                                                        &upscale[0],
+                                                        CUDNN_CROSS_CORRELATION,
+                                                        CUDNNConvComputeT) );
+
+            std::vector<int> bias_stride(bias_dim.size());
+
+            bias_stride[bias_dim.size()-1] = 1;
+            for (int d=bias_dim.size()-2;d>=0;--d){
+                bias_stride[d] = bias_stride[d+1] *  bias_dim[d+1];
+            }
+            checkCUDNN(__LINE__,cudnnSetTensorNdDescriptor(bias_desc,
+                                                        CUDNNStorageT,
+                                                        bias_dim.size(),
+                                                        &bias_dim[0],
+                                                        &bias_stride[0]) );
+        }
 
         weight_numel = numel(weight_dim);
         bias_numel   = numel(bias_dim);
 
         if (weight_numel>0){
             std::cout<<" weight"; veciPrint(weight_dim);
-            checkCUDA(__LINE__, cudaMalloc( &weight_dataGPU, weight_numel * sizeofStorageT) );
+            checkCUDA(__LINE__, deviceMalloc(device, &weight_dataGPU, weight_numel * sizeofStorageT) );
             memoryBytes += weight_numel * sizeofStorageT;
         }
         if (bias_numel>0){
             std::cout<<" bias"; veciPrint(bias_dim);
-            checkCUDA(__LINE__, cudaMalloc( &bias_dataGPU, bias_numel * sizeofStorageT) );
+            checkCUDA(__LINE__, deviceMalloc(device, &bias_dataGPU, bias_numel * sizeofStorageT) );
             memoryBytes += bias_numel * sizeofStorageT;
         }
         std::cout<<std::endl;
@@ -4931,51 +8320,62 @@ public:
             memoryBytes += out[i]->Malloc(dimOut);
         }
 
-        // Allocate workspace
-        fwdAlgoWorkspaces.resize(in.size());
-        bwdDataAlgoWorkspaces.resize(out.size());
-        bwdFilterAlgoWorkspaces.resize(out.size());
-
-        fwdAlgoWorkspaceSizes.resize(in.size());
-        bwdDataAlgoWorkspaceSizes.resize(out.size());
-        bwdFilterAlgoWorkspaceSizes.resize(out.size());
-
-        for (int i=0;i<in.size();++i){
-            checkCUDNN(__LINE__,cudnnGetConvolutionForwardWorkspaceSize(cudnnHandle,
-                                                                        out[i]->getDesc(group),
-                                                                        filter_desc,
-                                                                        conv_desc,
-                                                                        in[i]->getDesc(group),
-                                                                        fwdAlgo,
-                                                                        &fwdAlgoWorkspaceSizes[i]));
-            checkCUDA(__LINE__, cudaMalloc( &fwdAlgoWorkspaces[i], fwdAlgoWorkspaceSizes[i]) );
-        }
-
-        for (int i=0;i<out.size();++i){
-            checkCUDNN(__LINE__,cudnnGetConvolutionBackwardDataWorkspaceSize(cudnnHandle,
-                                                                             filter_desc,
-                                                                             in[i]->getDesc(group),
-                                                                             conv_desc,
-                                                                             out[i]->getDesc(group),
-                                                                             bwdDataAlgo,
-                                                                             &bwdDataAlgoWorkspaceSizes[i]));
-
-            checkCUDNN(__LINE__,cudnnGetConvolutionBackwardFilterWorkspaceSize(cudnnHandle,
-                                                                               out[i]->getDesc(group),
-                                                                               in[i]->getDesc(group),
-                                                                               conv_desc,
-                                                                               filter_desc,
-                                                                               bwdFilterAlgo,
-                                                                               &bwdFilterAlgoWorkspaceSizes[i]));
-
-            checkCUDA(__LINE__, cudaMalloc( &bwdDataAlgoWorkspaces[i], bwdDataAlgoWorkspaceSizes[i]) );
-            checkCUDA(__LINE__, cudaMalloc( &bwdFilterAlgoWorkspaces[i], bwdFilterAlgoWorkspaceSizes[i]) );
+        if (device==DeviceGPU){
+            // Allocate workspace
+            fwdAlgoWorkspaces.resize(in.size());
+            bwdDataAlgoWorkspaces.resize(out.size());
+            bwdFilterAlgoWorkspaces.resize(out.size());
+
+            fwdAlgoWorkspaceSizes.resize(in.size());
+            bwdDataAlgoWorkspaceSizes.resize(out.size());
+            bwdFilterAlgoWorkspaceSizes.resize(out.size());
+
+            for (int i=0;i<in.size();++i){
+                checkCUDNN(__LINE__,cudnnGetConvolutionForwardWorkspaceSize(cudnnHandle,
+                                                                            out[i]->getDesc(group),
+                                                                            filter_desc,
+                                                                            conv_desc,
+                                                                            in[i]->getDesc(group),
+                                                                            fwdAlgo,
+                                                                            &fwdAlgoWorkspaceSizes[i]));
+                checkCUDA(__LINE__, deviceMalloc(device, &fwdAlgoWorkspaces[i], fwdAlgoWorkspaceSizes[i]) );
+            }
+
+            for (int i=0;i<out.size();++i){
+                checkCUDNN(__LINE__,cudnnGetConvolutionBackwardDataWorkspaceSize(cudnnHandle,
+                                                                                 filter_desc,
+                                                                                 in[i]->getDesc(group),
+                                                                                 conv_desc,
+                                                                                 out[i]->getDesc(group),
+                                                                                 bwdDataAlgo,
+                                                                                 &bwdDataAlgoWorkspaceSizes[i]));
+
+                checkCUDNN(__LINE__,cudnnGetConvolutionBackwardFilterWorkspaceSize(cudnnHandle,
+                                                                                   out[i]->getDesc(group),
+                                                                                   in[i]->getDesc(group),
+                                                                                   conv_desc,
+                                                                                   filter_desc,
+                                                                                   bwdFilterAlgo,
+                                                                                   &bwdFilterAlgoWorkspaceSizes[i]));
+
+                checkCUDA(__LINE__, deviceMalloc(device, &bwdDataAlgoWorkspaces[i], bwdDataAlgoWorkspaceSizes[i]) );
+                checkCUDA(__LINE__, deviceMalloc(device, &bwdFilterAlgoWorkspaces[i], bwdFilterAlgoWorkspaceSizes[i]) );
+            }
         }
 
         return memoryBytes;
     };
 
     void forward(Phase phase_){
+        if (device==DeviceCPU){
+            // deconvolution is the transpose of a convolution from out to in
+            for (int i=0;i<in.size();++i){
+                CPUConvGeometry geometry(out[i]->dim, in[i]->dim, window, stride, padding, upscale, group);
+                CPU_conv_backward_data(geometry, weight_dataGPU, in[i]->dataGPU, out[i]->dataGPU, false);
+                CPU_bias_forward(geometry.N, geometry.C, geometry.in_spel, bias_dataGPU, out[i]->dataGPU);
+            }
+            return;
+        }
 
         for (int i=0;i<in.size();++i){
             for (int g = 0; g < group; g++) {
@@ -5048,6 +8448,17 @@ public:
         }
     };
     void backward(Phase phase_){
+        if (device==DeviceCPU){
+            for (int i=0;i<out.size();++i){
+                CPUConvGeometry geometry(out[i]->dim, in[i]->dim, window, stride, padding, upscale, group);
+                if (in[i]->need_diff) CPU_conv_forward(geometry, out[i]->diffGPU, weight_dataGPU, in[i]->diffGPU, true);
+                if (train_me){
+                    if (weight_numel>0) CPU_conv_backward_filter(geometry, out[i]->diffGPU, in[i]->dataGPU, weight_diffGPU, true);
+                    if (bias_numel>0)   CPU_bias_backward(geometry.N, geometry.C, geometry.in_spel, out[i]->diffGPU, bias_diffGPU);
+                }
+            }
+            return;
+        }
         for (int i=0;i<out.size();++i){
             // if bottom still needs to compute gradients
             if (in[i]->need_diff){
@@ -5095,17 +8506,18 @@ public:
         }
     };
     ~DeconvolutionLayer(){
+        if (device==DeviceCPU) return;
         // destory the descriptor
         checkCUDNN(__LINE__,cudnnDestroyFilterDescriptor(filter_desc) );
         checkCUDNN(__LINE__,cudnnDestroyTensorDescriptor(bias_desc) );
         checkCUDNN(__LINE__,cudnnDestroyConvolutionDescriptor(conv_desc) );
 
         for (int i=0;i<in.size();++i){
-            checkCUDA(__LINE__, cudaFree(fwdAlgoWorkspaces[i]));
+            checkCUDA(__LINE__, deviceFree(device, fwdAlgoWorkspaces[i]));
         }
         for (int i=0;i<out.size();++i){
-            checkCUDA(__LINE__, cudaFree(bwdDataAlgoWorkspaces[i]));
-            checkCUDA(__LINE__, cudaFree(bwdFilterAlgoWorkspaces[i]));
+            checkCUDA(__LINE__, deviceFree(device, bwdDataAlgoWorkspaces[i]));
+            checkCUDA(__LINE__, deviceFree(device, bwdFilterAlgoWorkspaces[i]));
         }
     };
 };
@@ -5119,6 +8531,8 @@ public:
 
     StorageT* bias_multGPU; // a std::vector with size # of mini-batch training example
 
+    FusedActivation activation;
+
     InnerProductLayer(std::string name_,
                     int num_output_,
                     bool bias_term_=true,
@@ -5179,16 +8593,17 @@ public:
 
         if (weight_numel>0){
             std::cout<<" weight"; veciPrint(weight_dim);
-            checkCUDA(__LINE__, cudaMalloc(&weight_dataGPU, weight_numel * sizeofStorageT) );
+            checkCUDA(__LINE__, deviceMalloc(device, &weight_dataGPU, weight_numel * sizeofStorageT) );
             memoryBytes += weight_numel * sizeofStorageT;
         }
 
         if (bias_numel>0){
             std::cout<<" bias"; veciPrint(bias_dim);
-            checkCUDA(__LINE__, cudaMalloc(&bias_dataGPU, bias_numel * sizeofStorageT) );
+            checkCUDA(__LINE__, deviceMalloc(device, &bias_dataGPU, bias_numel * sizeofStorageT) );
             memoryBytes += bias_numel * sizeofStorageT;
-            checkCUDA(__LINE__, cudaMalloc(&bias_multGPU, num_items * sizeofStorageT) );
-            Kernel_set_value<<<CUDA_GET_BLOCKS(num_items), CUDA_NUM_THREADS>>>(CUDA_GET_LOOPS(num_items), num_items, bias_multGPU, CPUCompute2StorageT(1));
+            checkCUDA(__LINE__, deviceMalloc(device, &bias_multGPU, num_items * sizeofStorageT) );
+            if (device==DeviceCPU) CPU_set_value(num_items, bias_multGPU, CPUCompute2StorageT(1));
+            else Kernel_set_value<<<CUDA_GET_BLOCKS(num_items), CUDA_NUM_THREADS>>>(CUDA_GET_LOOPS(num_items), num_items, bias_multGPU, CPUCompute2StorageT(1));
             memoryBytes += num_items * sizeofStorageT;
         }
         std::cout<<std::endl;
@@ -5221,16 +8636,22 @@ public:
 
     void forward(Phase phase_){
         for (int i=0;i<in.size();++i){
-            checkCUBLAS(__LINE__, GPUgemm(cublasHandle, CUBLAS_OP_T, CUBLAS_OP_N, num_output, num_items, num_input, oneComputeT, weight_dataGPU, num_input, in[i]->dataGPU, num_input, zeroComputeT, out[i]->dataGPU, num_output) );
+            gemm(CUBLAS_OP_T, CUBLAS_OP_N, num_output, num_items, num_input, oneComputeT, weight_dataGPU, num_input, in[i]->dataGPU, num_input, zeroComputeT, out[i]->dataGPU, num_output);
+            if (activation.enabled && device==DeviceCPU){
+                // bias and activation in one pass over the (num_items, num_output) result
+                CPU_bias_activation_forward(num_items, num_output, 1, bias_numel>0 ? bias_dataGPU : NULL, activation.mode, out[i]->dataGPU);
+                continue;
+            }
             if (bias_numel>0)
-                checkCUBLAS(__LINE__, GPUgemm(cublasHandle, CUBLAS_OP_N, CUBLAS_OP_N, num_output, num_items, 1, oneComputeT, bias_dataGPU, num_output, bias_multGPU, 1, oneComputeT, out[i]->dataGPU, num_output) );
+                gemm(CUBLAS_OP_N, CUBLAS_OP_N, num_output, num_items, 1, oneComputeT, bias_dataGPU, num_output, bias_multGPU, 1, oneComputeT, out[i]->dataGPU, num_output);
+            if (activation.enabled) activation.forward(cudnnHandle, out[i]);
         }
     };
 
     void backward(Phase phase_){
         for (int i=0;i<in.size();++i){
             if (in[i]->need_diff){
-                checkCUBLAS(__LINE__, GPUgemm(cublasHandle, CUBLAS_OP_N, CUBLAS_OP_N, num_input, num_items, num_output, oneComputeT, weight_dataGPU, num_input, out[i]->diffGPU, num_output, oneComputeT, in[i]->diffGPU, num_input) );
+                gemm(CUBLAS_OP_N, CUBLAS_OP_N, num_input, num_items, num_output, oneComputeT, weight_dataGPU, num_input, out[i]->diffGPU, num_output, oneComputeT, in[i]->diffGPU, num_input);
             }
         }
 
@@ -5238,17 +8659,17 @@ public:
             if (train_me){
                 ComputeT beta = ComputeT(1);
                 if (weight_numel>0){
-                    checkCUBLAS(__LINE__, GPUgemm(cublasHandle, CUBLAS_OP_N, CUBLAS_OP_T, num_input, num_output, num_items, oneComputeT, in[i]->dataGPU,  num_input, out[i]->diffGPU, num_output, &beta, weight_diffGPU, num_input) );
+                    gemm(CUBLAS_OP_N, CUBLAS_OP_T, num_input, num_output, num_items, oneComputeT, in[i]->dataGPU,  num_input, out[i]->diffGPU, num_output, &beta, weight_diffGPU, num_input);
                 }
                 if (bias_numel>0){
-                    checkCUBLAS(__LINE__, GPUgemm(cublasHandle, CUBLAS_OP_N, CUBLAS_OP_N, num_output,         1, num_items, oneComputeT, out[i]->diffGPU, num_output, bias_multGPU,    num_items, &beta, bias_diffGPU,    num_output) );
+                    gemm(CUBLAS_OP_N, CUBLAS_OP_N, num_output,         1, num_items, oneComputeT, out[i]->diffGPU, num_output, bias_multGPU,    num_items, &beta, bias_diffGPU,    num_output);
                 }
             }
         }
     };
 
     ~InnerProductLayer(){
-        if (bias_multGPU!=NULL) checkCUDA(__LINE__, cudaFree(bias_multGPU));
+        if (bias_multGPU!=NULL) checkCUDA(__LINE__, deviceFree(device, bias_multGPU));
     };
 };
 
@@ -5281,8 +8702,10 @@ public:
         stateSizes.resize(in.size());
         reserveSpaceSizes.resize(in.size());
         
-        for (int i=0;i<in.size();++i){
-            checkCUDNN(__LINE__,cudnnCreateDropoutDescriptor(&dropoutDescs[i]));
+        if (device==DeviceGPU){
+            for (int i=0;i<in.size();++i){
+                checkCUDNN(__LINE__,cudnnCreateDropoutDescriptor(&dropoutDescs[i]));
+            }
         }
         
         size_t memoryBytes = 0;
@@ -5302,14 +8725,26 @@ public:
             memoryBytes += out[i]->Malloc(in[i]->dim);
         }
 
+        if (device==DeviceCPU){
+            // the reserve space keeps one byte of mask per element
+            for (int i=0;i<in.size();++i){
+                states[i] = NULL;
+                stateSizes[i] = 0;
+                reserveSpaceSizes[i] = SIZEmask[i];
+                checkCUDA(__LINE__,deviceMalloc(device, &reserveSpaces[i], reserveSpaceSizes[i]));
+                memoryBytes += reserveSpaceSizes[i];
+            }
+            return memoryBytes;
+        }
+
         std::random_device rd;
 
         for (int i=0;i<in.size();++i){
             checkCUDNN(__LINE__,cudnnDropoutGetStatesSize(cudnnHandle, &stateSizes[i]));
-            checkCUDA(__LINE__,cudaMalloc(&states[i], stateSizes[i]) );
+            checkCUDA(__LINE__,deviceMalloc(device, &states[i], stateSizes[i]) );
             memoryBytes += stateSizes[i];
             checkCUDNN(__LINE__,cudnnDropoutGetReserveSpaceSize(in[i]->getDesc(), &reserveSpaceSizes[i]));
-            checkCUDA(__LINE__,cudaMalloc(&reserveSpaces[i], reserveSpaceSizes[i]));
+            checkCUDA(__LINE__,deviceMalloc(device, &reserveSpaces[i], reserveSpaceSizes[i]));
             memoryBytes += reserveSpaceSizes[i];
             checkCUDNN(__LINE__,cudnnSetDropoutDescriptor(dropoutDescs[i],
                                                           cudnnHandle,
@@ -5321,15 +8756,26 @@ public:
 
         return memoryBytes;
     };
+
+    int inPlace(int o, Phase phase_){ return o; };
+
     ~DropoutLayer(){
+        if (device==DeviceCPU){
+            for (int i=0;i<reserveSpaces.size();++i) checkCUDA(__LINE__, deviceFree(device, reserveSpaces[i]));
+            return;
+        }
         for (int i=0;i<in.size();++i){
             checkCUDNN(__LINE__,cudnnDestroyDropoutDescriptor(dropoutDescs[i]));
-            checkCUDA(__LINE__, cudaFree(states[i]));
-            checkCUDA(__LINE__, cudaFree(reserveSpaces[i]));
+            checkCUDA(__LINE__, deviceFree(device, states[i]));
+            checkCUDA(__LINE__, deviceFree(device, reserveSpaces[i]));
         }
     };
     void forward(Phase phase_){
-        if ( phase_==Training ){
+        if ( phase_==Training && device==DeviceCPU ){
+            for (int i=0;i<in.size();++i){
+                CPU_dropout_forward(SIZEmask[i], dropout_rate, rng(), in[i]->dataGPU, out[i]->dataGPU, (uint8_t*)reserveSpaces[i]);
+            }
+        }else if ( phase_==Training ){
             for (int i=0;i<in.size();++i){
                 checkCUDNN(__LINE__,cudnnDropoutForward(cudnnHandle,
                                                         dropoutDescs[i],
@@ -5343,14 +8789,18 @@ public:
             }
         }else{
             for (int i=0;i<in.size();++i){
-                if (out[i]!=in[i]){
-                    checkCUDA(__LINE__,cudaMemcpy(out[i]->dataGPU, in[i]->dataGPU, sizeofStorageT*SIZEmask[i], cudaMemcpyDeviceToDevice));
+                if (out[i]->dataGPU!=in[i]->dataGPU){
+                    checkCUDA(__LINE__,deviceMemcpy(device, out[i]->dataGPU, in[i]->dataGPU, sizeofStorageT*SIZEmask[i], cudaMemcpyDeviceToDevice));
                 }
             }
         }
     };
     void backward(Phase phase_){
-        if ( phase_==Training ){
+        if ( phase_==Training && device==DeviceCPU ){
+            for (int i=0;i<in.size();++i){
+                CPU_dropout_backward(SIZEmask[i], dropout_rate, (uint8_t*)reserveSpaces[i], out[i]->diffGPU, in[i]->diffGPU);
+            }
+        }else if ( phase_==Training ){
             for (int i=0;i<in.size();++i){
                 checkCUDNN(__LINE__,cudnnDropoutBackward(cudnnHandle,
                                                          dropoutDescs[i],
@@ -5367,7 +8817,7 @@ public:
             FatalError(__LINE__);
             for (int i=0;i<in.size();++i){
                 if (out[i]!=in[i]){
-                    checkCUDA(__LINE__,cudaMemcpy(in[i]->diffGPU, out[i]->diffGPU, sizeofStorageT*SIZEmask[i], cudaMemcpyDeviceToDevice));
+                    checkCUDA(__LINE__,deviceMemcpy(device, in[i]->diffGPU, out[i]->diffGPU, sizeofStorageT*SIZEmask[i], cudaMemcpyDeviceToDevice));
                 }
             }
         }
@@ -5386,6 +8836,9 @@ public:
         SetValue(json, stable_gradient, true)
     };
 
+    // backward only looks at the output
+    int inPlace(int o, Phase phase_){ return o; };
+
     size_t Malloc(Phase phase_){
         size_t memoryBytes = 0;
         std::cout<< (train_me? "* " : "  ");
@@ -5404,6 +8857,12 @@ public:
         return memoryBytes;
     };
     void forward(Phase phase_){
+        if (device==DeviceCPU){
+            for (int i=0;i<in.size();++i){
+                CPU_softmax_forward(in[i]->dim[0], in[i]->dim[1], sizeofitem(in[i]->dim)/in[i]->dim[1], in[i]->dataGPU, out[i]->dataGPU);
+            }
+            return;
+        }
         for (int i=0;i<in.size();++i){
             checkCUDNN(__LINE__,cudnnSoftmaxForward(cudnnHandle,
                                               CUDNN_SOFTMAX_ACCURATE ,
@@ -5420,8 +8879,11 @@ public:
             if (in[i]->need_diff){
                 if (stable_gradient){
                     if (in[i]->diffGPU != out[i]->diffGPU){
-                        xpy(numel(in[i]->dim), out[i]->diffGPU, in[i]->diffGPU);
+                        if (device==DeviceCPU)  CPU_xpy(numel(in[i]->dim), out[i]->diffGPU, in[i]->diffGPU);
+                        else                    xpy(numel(in[i]->dim), out[i]->diffGPU, in[i]->diffGPU);
                     }
+                }else if (device==DeviceCPU){
+                    CPU_softmax_backward(in[i]->dim[0], sizeofitem(in[i]->dim), out[i]->dataGPU, out[i]->diffGPU, in[i]->diffGPU);
                 }else{
                     checkCUDNN(__LINE__,cudnnSoftmaxBackward(cudnnHandle, CUDNN_SOFTMAX_ACCURATE,
                                                       CUDNN_SOFTMAX_MODE_INSTANCE, //CUDNN_SOFTMAX_MODE_CHANNEL,
@@ -5450,8 +8912,14 @@ public:
         SetValue(json, phase,               TrainingTesting)
     };
 
+    // backward looks at x only for ReLU's x > 0, which is y > 0
+    int inPlace(int o, Phase phase_){ return o; };
+
+    // item by item on the CPU, cuDNN takes the strides from the descriptors
+    bool strided(Response* r){ return true; };
+
     ~ActivationLayer() {
-        checkCUDNN(__LINE__,cudnnDestroyActivationDescriptor(activationDesc));
+        if (device==DeviceGPU) checkCUDNN(__LINE__,cudnnDestroyActivationDescriptor(activationDesc));
     }
 
     size_t Malloc(Phase phase_){
@@ -5459,8 +8927,10 @@ public:
         std::cout<< (train_me? "* " : "  ");
         std::cout<<name<<std::endl;
 
-        checkCUDNN(__LINE__,cudnnCreateActivationDescriptor(&activationDesc));
-        checkCUDNN(__LINE__,cudnnSetActivationDescriptor(activationDesc, mode, CUDNN_PROPAGATE_NAN, 99.0)); // TODO: Refactor duplicate code
+        if (device==DeviceGPU){
+            checkCUDNN(__LINE__,cudnnCreateActivationDescriptor(&activationDesc));
+            checkCUDNN(__LINE__,cudnnSetActivationDescriptor(activationDesc, mode, CUDNN_PROPAGATE_NAN, 99.0)); // TODO: Refactor duplicate code
+        }
 
         if (in.size()==0) { std::cout<<std::endl<<"ActivationLayer in shouldn't be empty"<<std::endl; FatalError(__LINE__); }
         if (in.size()!=out.size()) { std::cout<<std::endl<<"ActivationLayer #in should be the same as #out"<<std::endl; FatalError(__LINE__); }
@@ -5475,6 +8945,18 @@ public:
         return memoryBytes;
     };
     void forward(Phase phase_){
+        if (device==DeviceCPU){
+            for (int i=0;i<in.size();++i){
+                if (in[i]->packed() && out[i]->packed()){
+                    CPU_activation_forward(mode, numel(in[i]->dim), in[i]->dataGPU, out[i]->dataGPU);
+                    continue;
+                }
+                for (int n=0;n<in[i]->dim[0];++n){
+                    CPU_activation_forward(mode, in[i]->sizeofitem(), in[i]->dataGPU + size_t(n) * in[i]->stride[0], out[i]->dataGPU + size_t(n) * out[i]->stride[0]);
+                }
+            }
+            return;
+        }
         for (int i=0;i<in.size();++i){
             // CUDNN bug
             checkCUDNN(__LINE__,cudnnActivationForward(cudnnHandle,
@@ -5488,7 +8970,14 @@ public:
     void backward(Phase phase_){
         for (int i=0;i<in.size();++i){
             // if bottom still needs to compute gradients
-            if (in[i]->need_diff){
+            if (in[i]->need_diff && device==DeviceCPU && in[i]->packed() && out[i]->packed()){
+                CPU_activation_backward(mode, numel(in[i]->dim), out[i]->dataGPU, out[i]->diffGPU, in[i]->dataGPU, in[i]->diffGPU);
+            }else if (in[i]->need_diff && device==DeviceCPU){
+                for (int n=0;n<in[i]->dim[0];++n){
+                    size_t x = size_t(n) * in[i]->stride[0], y = size_t(n) * out[i]->stride[0];
+                    CPU_activation_backward(mode, in[i]->sizeofitem(), out[i]->dataGPU + y, out[i]->diffGPU + y, in[i]->dataGPU + x, in[i]->diffGPU + x);
+                }
+            }else if (in[i]->need_diff){
                 checkCUDNN(__LINE__,cudnnActivationBackward(cudnnHandle,
                                                     activationDesc,
                                                     one,
@@ -5520,11 +9009,10 @@ public:
                                                 &stride[0]));
     };
 
-    PoolingLayer(std::string name_, cudnnPoolingMode_t mode_, std::vector<int> window_, std::vector<int> padding_, std::vector<int> stride_): Layer(name_), mode(mode_), window(window_), padding(padding_), stride(stride_){
-        init();
+    PoolingLayer(std::string name_, cudnnPoolingMode_t mode_, std::vector<int> window_, std::vector<int> padding_, std::vector<int> stride_): Layer(name_), desc(NULL), mode(mode_), window(window_), padding(padding_), stride(stride_){
     };
 
-    PoolingLayer(JSON* json){
+    PoolingLayer(JSON* json): desc(NULL){
         SetOrDie(json, name)
         SetValue(json, phase,               TrainingTesting)
         SetValue(json, mode,                CUDNN_POOLING_MAX)
@@ -5532,8 +9020,6 @@ public:
         std::vector<int> zeros = std::vector<int>(window.size(),0);
         SetValue(json, padding,             zeros)
         SetValue(json, stride,              window)
-
-        init();
     };
 
     size_t Malloc(Phase phase_){
@@ -5541,6 +9027,8 @@ public:
         std::cout<< (train_me? "* " : "  ");
         std::cout<<name<<std::endl;
 
+        if (device==DeviceGPU) init();
+
         if (in.size()==0) { std::cout<<std::endl<<"PoolingLayer in shouldn't be empty"<<std::endl; FatalError(__LINE__); }
         if (in.size()!=out.size()) { std::cout<<std::endl<<"PoolingLayer #in should be the same as #out"<<std::endl; FatalError(__LINE__); }
 
@@ -5570,6 +9058,14 @@ public:
         return memoryBytes;
     };
     void forward(Phase phase_){
+        if (device==DeviceCPU){
+            for (int i=0;i<in.size();++i){
+                std::vector<int> dimIn(in[i]->dim.begin()+2, in[i]->dim.end());
+                std::vector<int> dimOut(out[i]->dim.begin()+2, out[i]->dim.end());
+                CPU_pooling(mode, size_t(in[i]->dim[0])*in[i]->dim[1], dimIn, dimOut, window, stride, padding, in[i]->dataGPU, out[i]->dataGPU, NULL, NULL);
+            }
+            return;
+        }
         for (int i=0;i<in.size();++i){
             checkCUDNN(__LINE__,cudnnPoolingForward(cudnnHandle,
                                                 desc,
@@ -5583,7 +9079,11 @@ public:
     void backward(Phase phase_){
         for (int i=0;i<in.size();++i){
             // if bottom still needs to compute gradients
-            if (in[i]->need_diff){
+            if (in[i]->need_diff && device==DeviceCPU){
+                std::vector<int> dimIn(in[i]->dim.begin()+2, in[i]->dim.end());
+                std::vector<int> dimOut(out[i]->dim.begin()+2, out[i]->dim.end());
+                CPU_pooling(mode, size_t(in[i]->dim[0])*in[i]->dim[1], dimIn, dimOut, window, stride, padding, in[i]->dataGPU, NULL, out[i]->diffGPU, in[i]->diffGPU);
+            }else if (in[i]->need_diff){
                 checkCUDNN(__LINE__,cudnnPoolingBackward(cudnnHandle,
                                                     desc,
                                                     one,
@@ -5595,7 +9095,7 @@ public:
         }
     };
     ~PoolingLayer(){
-        checkCUDNN(__LINE__,cudnnDestroyPoolingDescriptor(desc) );
+        if (desc!=NULL) checkCUDNN(__LINE__,cudnnDestroyPoolingDescriptor(desc) );
     };
 };
 
@@ -5615,20 +9115,17 @@ public:
         if (k<CUDNN_LRN_MIN_K){ std::cout<<"LRN k out of range ["<< CUDNN_LRN_MIN_K <<",Inf): k="<<k<<std::endl; FatalError(__LINE__); }
 
         if (beta<CUDNN_LRN_MIN_BETA){ std::cout<<"LRN beta out of range ["<< CUDNN_LRN_MIN_BETA <<",Inf): beta="<<beta<<std::endl; FatalError(__LINE__); }
-
-        checkCUDNN(__LINE__,cudnnCreateLRNDescriptor(&desc) );
-        checkCUDNN(__LINE__,cudnnSetLRNDescriptor(desc, local_size, (double)(alpha), (double)(beta), (double)(k)) );
     };
 
     ~LRNLayer(){
-        checkCUDNN(__LINE__,cudnnDestroyLRNDescriptor(desc));
+        if (desc!=NULL) checkCUDNN(__LINE__,cudnnDestroyLRNDescriptor(desc));
     };
 
-    LRNLayer(std::string name_, LRN mode_, unsigned int local_size_, ComputeT alpha_, ComputeT beta_, ComputeT k_): Layer(name_), mode(mode_), local_size(local_size_), alpha(alpha_), beta(beta_), k(k_) {
+    LRNLayer(std::string name_, LRN mode_, unsigned int local_size_, ComputeT alpha_, ComputeT beta_, ComputeT k_): Layer(name_), desc(NULL), mode(mode_), local_size(local_size_), alpha(alpha_), beta(beta_), k(k_) {
         init();
     };
 
-    LRNLayer(JSON* json){
+    LRNLayer(JSON* json): desc(NULL){
         SetOrDie(json, name)
         SetValue(json, phase,           TrainingTesting)
         SetValue(json, mode,            CrossChannel)
@@ -5647,6 +9144,13 @@ public:
         if (in.size()==0) { std::cout<<std::endl<<"LRNLayer in shouldn't be empty"<<std::endl; FatalError(__LINE__); }
         if (in.size()!=out.size()) { std::cout<<std::endl<<"LRNLayer #in should be the same as #out"<<std::endl; FatalError(__LINE__); }
 
+        if (device==DeviceGPU){
+            checkCUDNN(__LINE__,cudnnCreateLRNDescriptor(&desc) );
+            checkCUDNN(__LINE__,cudnnSetLRNDescriptor(desc, local_size, (double)(alpha), (double)(beta), (double)(k)) );
+        }else if (mode!=CrossChannel){
+            std::cout<<std::endl<<"LRNLayer only supports CrossChannel on the CPU"<<std::endl; FatalError(__LINE__);
+        }
+
         for (int i=0;i<out.size();++i){
             out[i]->need_diff = in[i]->need_diff;
             out[i]->receptive_field = in[i]->receptive_field;
@@ -5658,6 +9162,12 @@ public:
     };
 
     void forward(Phase phase_){
+        if (device==DeviceCPU){
+            for (int i=0;i<in.size();++i){
+                CPU_LRN(in[i]->dim[0], in[i]->dim[1], sizeofitem(in[i]->dim)/in[i]->dim[1], local_size, alpha, beta, k, in[i]->dataGPU, NULL, out[i]->dataGPU, NULL);
+            }
+            return;
+        }
         for (int i=0;i<in.size();++i){
             switch(mode){
                 case CrossChannel:
@@ -5688,7 +9198,9 @@ public:
     void backward(Phase phase_){
         for (int i=0;i<in.size();++i){
             // if bottom still needs to compute gradients
-            if (in[i]->need_diff){
+            if (in[i]->need_diff && device==DeviceCPU){
+                CPU_LRN(in[i]->dim[0], in[i]->dim[1], sizeofitem(in[i]->dim)/in[i]->dim[1], local_size, alpha, beta, k, in[i]->dataGPU, out[i]->dataGPU, in[i]->diffGPU, out[i]->diffGPU);
+            }else if (in[i]->need_diff){
                 switch(mode){
                     case CrossChannel:
                         checkCUDNN(__LINE__,cudnnLRNCrossChannelBackward(cudnnHandle, desc, CUDNN_LRN_CROSS_CHANNEL_DIM1,
@@ -5780,16 +9292,21 @@ public:
         return memoryBytes;
     };
 
+    int viewOf(int o){ return o; };
+
+    // both only do something when out[i] didn't get to be a view of in[i]
     void forward(Phase phase_){
         for (int i=0;i<in.size();++i){
-            checkCUDA(__LINE__,cudaMemcpy(out[i]->dataGPU, in[i]->dataGPU, in[i]->numBytes(), cudaMemcpyDeviceToDevice));
+            if (out[i]->dataGPU==in[i]->dataGPU) continue;
+            checkCUDA(__LINE__,deviceMemcpy(device, out[i]->dataGPU, in[i]->dataGPU, in[i]->numBytes(), cudaMemcpyDeviceToDevice));
         }
     };
     void backward(Phase phase_){
         for(int i=0;i<in.size();i++){
-            if (in[i]->need_diff){
+            if (in[i]->need_diff && in[i]->diffGPU!=out[i]->diffGPU){
                 size_t N = numel(in[i]->dim);
-                Kernel_elementwise_acc<<<CUDA_GET_BLOCKS(N), CUDA_NUM_THREADS>>>(CUDA_GET_LOOPS(N), N, in[i]->diffGPU, out[i]->diffGPU);
+                if (device==DeviceCPU) CPU_elementwise_acc(N, in[i]->diffGPU, out[i]->diffGPU);
+                else Kernel_elementwise_acc<<<CUDA_GET_BLOCKS(N), CUDA_NUM_THREADS>>>(CUDA_GET_LOOPS(N), N, in[i]->diffGPU, out[i]->diffGPU);
             }
         }
     };
@@ -5838,6 +9355,14 @@ public:
     };
 
     void forward(Phase phase_){
+        if (device==DeviceCPU){
+            for (int i=0;i<out.size();++i){
+                std::vector<int> od(out[i]->dim.begin()+1, out[i]->dim.end());
+                std::vector<int> id(in[i*2]->dim.begin()+1, in[i*2]->dim.end());
+                CPU_ROI(numel(out[i]->dim), out[i]->dataGPU, in[i*2]->dataGPU, in[i*2+1]->dataGPU, od, id, true);
+            }
+            return;
+        }
         for (int i=0;i<out.size();++i){
             size_t N = numel(out[i]->dim);
             switch(shape.size()){
@@ -5858,7 +9383,11 @@ public:
     };
     void backward(Phase phase_){
         for(int i=0;i<out.size();i++){
-            if (in[i*2]->need_diff){
+            if (in[i*2]->need_diff && device==DeviceCPU){
+                std::vector<int> od(out[i]->dim.begin()+1, out[i]->dim.end());
+                std::vector<int> id(in[i*2]->dim.begin()+1, in[i*2]->dim.end());
+                CPU_ROI(numel(out[i]->dim), out[i]->diffGPU, in[i*2]->diffGPU, in[i*2+1]->dataGPU, od, id, false);
+            }else if (in[i*2]->need_diff){
                 size_t N = numel(out[i]->dim);
                 switch(shape.size()){
                     case 3:
@@ -5897,7 +9426,7 @@ public:
     ~ROIPoolingLayer(){
         for (int i=0;i<GPUIndex.size();++i){
             if (GPUIndex[i]!=NULL){
-                checkCUDA(__LINE__, cudaFree(GPUIndex[i]) );
+                checkCUDA(__LINE__, deviceFree(device, GPUIndex[i]) );
                 GPUIndex[i] = NULL;
             }
         }
@@ -5929,7 +9458,7 @@ public:
             memoryBytes += out[i]->Malloc(dim);
 
             if (in[i*2]->need_diff){
-                checkCUDA(__LINE__, cudaMalloc(&GPUIndex[i], numel(out[i]->dim) * sizeof(size_t)) );
+                checkCUDA(__LINE__, deviceMalloc(device, &GPUIndex[i], numel(out[i]->dim) * sizeof(size_t)) );
                 memoryBytes += numel(out[i]->dim) * sizeof(size_t);
             }
         }
@@ -5937,6 +9466,14 @@ public:
     };
 
     void forward(Phase phase_){
+        if (device==DeviceCPU){
+            for (int i=0;i<out.size();++i){
+                if (shape.size()!=2 && shape.size()!=3){ std::cerr<<"Haven't implemented yet"<<std::endl; FatalError(__LINE__); }
+                std::vector<int> in_spatial(in[i*2]->dim.begin()+2, in[i*2]->dim.end());
+                CPU_ROIPoolForward(in[i*2+1]->dim[0], in[i*2]->dataGPU, in[i*2+1]->dataGPU, out[i]->dataGPU, GPUIndex[i], spatial_scale, in[i*2]->dim[1], in_spatial, shape);
+            }
+            return;
+        }
         for (int i=0;i<out.size();++i){
             size_t N = numel(out[i]->dim);
             switch(shape.size()){
@@ -5954,7 +9491,9 @@ public:
     };
     void backward(Phase phase_){
         for(int i=0;i<out.size();i++){
-            if (in[i*2]->need_diff){
+            if (in[i*2]->need_diff && device==DeviceCPU){
+                CPU_ROIPoolBackward(in[i*2+1]->dim[0], in[i*2]->diffGPU, out[i]->diffGPU, GPUIndex[i], in[i*2]->dim[1], numel(shape));
+            }else if (in[i*2]->need_diff){
                 size_t N = numel(in[i*2]->dim);
                 switch(shape.size()){
                     case 2:
@@ -5989,6 +9528,15 @@ public:
         SetValue(json, last_in_is_coeff, false)
         SetValue(json, coeff,       std::vector<ComputeT>())
     };
+
+    // SUM writes out[o] from the first input of its group element by element; backward adds out[o]'s diff to
+    // each input's, which for the first one is already there when it counts with coefficient 1
+    int inPlace(int o, Phase phase_){
+        if (mode!=ElementWise_SUM) return -1;
+        if (phase_==Training && (last_in_is_coeff || (!coeff.empty() && coeff[0]!=1))) return -1;
+        return o * (in.size()/out.size());
+    };
+
     size_t Malloc(Phase phase_){
         size_t memoryBytes = 0;
         std::cout<< (train_me? "* " : "  ");
@@ -6028,9 +9576,16 @@ public:
             case ElementWise_EQL:
                 for (int i=0;i<out.size();++i){
                     int n = numel(out[i]->dim);
-                    GPU_set_ones(n, out[i]->dataGPU);
-                    for (int j=i*in_group+1; j<(i+1)*in_group; ++j){
-                        GPU_elementwise_comparison(n, out[i]->dataGPU, in[i*in_group]->dataGPU, in[j]->dataGPU);
+                    if (device==DeviceCPU){
+                        CPU_set_ones(n, out[i]->dataGPU);
+                        for (int j=i*in_group+1; j<(i+1)*in_group; ++j){
+                            CPU_elementwise_comparison(n, out[i]->dataGPU, in[i*in_group]->dataGPU, in[j]->dataGPU);
+                        }
+                    }else{
+                        GPU_set_ones(n, out[i]->dataGPU);
+                        for (int j=i*in_group+1; j<(i+1)*in_group; ++j){
+                            GPU_elementwise_comparison(n, out[i]->dataGPU, in[i*in_group]->dataGPU, in[j]->dataGPU);
+                        }
                     }
                 }
             break;
@@ -6043,10 +9598,12 @@ public:
                     size_t N = numel(in[i]->dim);
                     size_t items = in[i]->dim[0];
                     size_t dim = in[i]->sizeofitem();
-                    CoeffElementWiseSumReplace<<<CUDA_GET_BLOCKS(N),CUDA_NUM_THREADS>>>(CUDA_GET_LOOPS(N), N, coeff[0], coeff_data, 0 * items, dim, in[i]->dataGPU, out[j]->dataGPU);
+                    if (device==DeviceCPU) CPU_CoeffElementWiseSum(N, false, coeff[0], coeff_data, 0 * items, dim, in[i]->dataGPU, out[j]->dataGPU);
+                    else CoeffElementWiseSumReplace<<<CUDA_GET_BLOCKS(N),CUDA_NUM_THREADS>>>(CUDA_GET_LOOPS(N), N, coeff[0], coeff_data, 0 * items, dim, in[i]->dataGPU, out[j]->dataGPU);
                     for (i=i+1; i<(j+1)*in_group - last_in_is_coeff; ++i){
                         size_t ii = i-j*in_group;
-                        CoeffElementWiseSumAccumulate<<<CUDA_GET_BLOCKS(N),CUDA_NUM_THREADS>>>(CUDA_GET_LOOPS(N), N, coeff[ii], coeff_data, ii * items, dim, in[i]->dataGPU, out[j]->dataGPU);
+                        if (device==DeviceCPU) CPU_CoeffElementWiseSum(N, true, coeff[ii], coeff_data, ii * items, dim, in[i]->dataGPU, out[j]->dataGPU);
+                        else CoeffElementWiseSumAccumulate<<<CUDA_GET_BLOCKS(N),CUDA_NUM_THREADS>>>(CUDA_GET_LOOPS(N), N, coeff[ii], coeff_data, ii * items, dim, in[i]->dataGPU, out[j]->dataGPU);
                     }
                 }
             break;
@@ -6071,7 +9628,9 @@ public:
                     size_t dim = in[i]->sizeofitem();
                     for (; i<(j+1)*in_group - last_in_is_coeff; ++i){
                         size_t ii = i-j*in_group;
-                        CoeffElementWiseSumAccumulate<<<CUDA_GET_BLOCKS(N),CUDA_NUM_THREADS>>>(CUDA_GET_LOOPS(N), N, coeff[ii], coeff_data, ii * items, dim, out[j]->diffGPU, in[i]->diffGPU);
+                        if (in[i]->diffGPU==out[j]->diffGPU) continue; // in place
+                        if (device==DeviceCPU) CPU_CoeffElementWiseSum(N, true, coeff[ii], coeff_data, ii * items, dim, out[j]->diffGPU, in[i]->diffGPU);
+                        else CoeffElementWiseSumAccumulate<<<CUDA_GET_BLOCKS(N),CUDA_NUM_THREADS>>>(CUDA_GET_LOOPS(N), N, coeff[ii], coeff_data, ii * items, dim, out[j]->diffGPU, in[i]->diffGPU);
                     }
                 }
             break;
@@ -6135,7 +9694,10 @@ public:
             int offset = 0;
             int numofitems = out[j]->dim[0];
             for(int i=j*in_group; i<(j+1)*in_group;i++){
-                copyGPUforward (numofitems, in[i]->dataGPU, out[j]->dataGPU, sizeofitem(in[i]->dim), sizeofitem(out[j]->dim), offset);
+                // nothing to do for the inputs that are slices of the output already
+                if (in[i]->dataGPU==out[j]->dataGPU + offset){ offset += sizeofitem(in[i]->dim); continue; }
+                if (device==DeviceCPU)  CPU_copyforward(numofitems, in[i]->dataGPU, out[j]->dataGPU, sizeofitem(in[i]->dim), sizeofitem(out[j]->dim), offset);
+                else                    copyGPUforward (numofitems, in[i]->dataGPU, out[j]->dataGPU, sizeofitem(in[i]->dim), sizeofitem(out[j]->dim), offset);
                 offset += sizeofitem(in[i]->dim);
             }
         }
@@ -6145,8 +9707,9 @@ public:
             int offset = 0;
             int numofitems = out[j]->dim[0];
             for(int i=j*in_group; i<(j+1)*in_group;i++){
-                if (in[i]->need_diff){
-                    copyGPUbackward(numofitems, in[i]->diffGPU, out[j]->diffGPU, sizeofitem(in[i]->dim), sizeofitem(out[j]->dim), offset);
+                if (in[i]->need_diff && in[i]->diffGPU!=out[j]->diffGPU + offset){
+                    if (device==DeviceCPU)  CPU_copybackward(numofitems, in[i]->diffGPU, out[j]->diffGPU, sizeofitem(in[i]->dim), sizeofitem(out[j]->dim), offset);
+                    else                    copyGPUbackward(numofitems, in[i]->diffGPU, out[j]->diffGPU, sizeofitem(in[i]->dim), sizeofitem(out[j]->dim), offset);
                 }
                 offset += sizeofitem(in[i]->dim);
             }
@@ -6190,9 +9753,9 @@ public:
 
     ~LossLayer() {
         if (loss_values != NULL)
-            checkCUDA(__LINE__, cudaFree(loss_values));
+            checkCUDA(__LINE__, deviceFree(device, loss_values));
         if (loss_weightsGPU != NULL)
-            checkCUDA(__LINE__, cudaFree(loss_weightsGPU));
+            checkCUDA(__LINE__, deviceFree(device, loss_weightsGPU));
     };
 
     size_t Malloc(Phase phase_) {
@@ -6289,20 +9852,20 @@ public:
         scale = loss_weight / loss_numel;
 
         memoryBytes += loss_numel * sizeofStorageT;
-        checkCUDA(__LINE__, cudaMalloc(&loss_values, memoryBytes));
+        checkCUDA(__LINE__, deviceMalloc(device, &loss_values, memoryBytes));
 
 
         if (loss_weights.size() > 0) {
             size_t newBytes = loss_weights.size() * sizeofStorageT;
-            checkCUDA(__LINE__, cudaMalloc(&loss_weightsGPU, newBytes));
+            checkCUDA(__LINE__, deviceMalloc(device, &loss_weightsGPU, newBytes));
             memoryBytes += newBytes;
 
             StorageT *CPUram = new StorageT[loss_weights.size()];
             for (int i = 0; i < loss_weights.size(); ++i) {
                 CPUram[i] = CPUCompute2StorageT(loss_weights[i]);
             }
-            checkCUDA(__LINE__, cudaMemcpy(loss_weightsGPU, CPUram, newBytes,
-                                           cudaMemcpyHostToDevice));
+            checkCUDA(__LINE__, deviceMemcpy(device, loss_weightsGPU, CPUram, newBytes,
+                                              cudaMemcpyHostToDevice));
             delete[] CPUram;
         }
 
@@ -6323,46 +9886,77 @@ public:
         switch(mode){
             case MultinomialLogistic_StableSoftmax:
             case MultinomialLogistic:
-                Accuracy_MultinomialLogistic<<<CUDA_GET_BLOCKS(loss_numel),
-                    CUDA_NUM_THREADS>>>(
-                        CUDA_GET_LOOPS(loss_numel),
-                        loss_numel, in[0]->dim[1], numspel(in[0]->dim),
+                if (device==DeviceCPU){
+                    CPU_Accuracy_MultinomialLogistic(loss_numel, in[0]->dim[1], numspel(in[0]->dim),
                         (in.size()==3 ? numel(in[2]->dim) : 0),
                         in[0]->dataGPU, in[1]->dataGPU, loss_weightsGPU,
                         (in.size()==3 ? in[2]->dataGPU : NULL),
                         loss_values);
-                checkCUBLAS(__LINE__, GPUasum(cublasHandle, loss_numel,
-                                              loss_values, 1, &resultSum));
+                }else{
+                    Accuracy_MultinomialLogistic<<<CUDA_GET_BLOCKS(loss_numel),
+                        CUDA_NUM_THREADS>>>(
+                            CUDA_GET_LOOPS(loss_numel),
+                            loss_numel, in[0]->dim[1], numspel(in[0]->dim),
+                            (in.size()==3 ? numel(in[2]->dim) : 0),
+                            in[0]->dataGPU, in[1]->dataGPU, loss_weightsGPU,
+                            (in.size()==3 ? in[2]->dataGPU : NULL),
+                            loss_values);
+                }
+                resultSum = asum(loss_numel, loss_values);
                 result += resultSum / loss_numel;
-                Loss_MultinomialLogistic<<<CUDA_GET_BLOCKS(loss_numel),
-                    CUDA_NUM_THREADS>>>(
-                        CUDA_GET_LOOPS(loss_numel),
-                        loss_numel, in[0]->dim[1], numspel(in[0]->dim),
+                if (device==DeviceCPU){
+                    CPU_Loss_MultinomialLogistic(loss_numel, in[0]->dim[1], numspel(in[0]->dim),
                         (in.size()==3 ? numel(in[2]->dim) : 0),
                         in[0]->dataGPU, in[1]->dataGPU, loss_weightsGPU,
                         (in.size()==3 ? in[2]->dataGPU : NULL),
                         loss_values);
+                }else{
+                    Loss_MultinomialLogistic<<<CUDA_GET_BLOCKS(loss_numel),
+                        CUDA_NUM_THREADS>>>(
+                            CUDA_GET_LOOPS(loss_numel),
+                            loss_numel, in[0]->dim[1], numspel(in[0]->dim),
+                            (in.size()==3 ? numel(in[2]->dim) : 0),
+                            in[0]->dataGPU, in[1]->dataGPU, loss_weightsGPU,
+                            (in.size()==3 ? in[2]->dataGPU : NULL),
+                            loss_values);
+                }
                 break;
             case SmoothL1:
-                Loss_SmoothL1<<<CUDA_GET_BLOCKS(loss_numel),
-                    CUDA_NUM_THREADS>>>(
-                        CUDA_GET_LOOPS(loss_numel),
-                        loss_numel, in[0]->dataGPU, in[1]->dataGPU,
+                if (device==DeviceCPU){
+                    CPU_Loss_SmoothL1(loss_numel, in[0]->dataGPU, in[1]->dataGPU,
                         (in.size()==3 ? in[2]->dataGPU : NULL), loss_values);
+                }else{
+                    Loss_SmoothL1<<<CUDA_GET_BLOCKS(loss_numel),
+                        CUDA_NUM_THREADS>>>(
+                            CUDA_GET_LOOPS(loss_numel),
+                            loss_numel, in[0]->dataGPU, in[1]->dataGPU,
+                            (in.size()==3 ? in[2]->dataGPU : NULL), loss_values);
+                }
                 break;
             case Contrastive:
-                Loss_Contrastive<<<CUDA_GET_BLOCKS(numExamples),
-                    CUDA_NUM_THREADS>>>(CUDA_GET_LOOPS(loss_numel),
-                        loss_numel, in[0]->dim[1],
+                if (device==DeviceCPU){
+                    CPU_Loss_Contrastive(loss_numel, in[0]->dim[1],
                         margin,in[0]->dataGPU, in[1]->dataGPU, in[2]->dataGPU,
                         loss_values);
+                }else{
+                    Loss_Contrastive<<<CUDA_GET_BLOCKS(numExamples),
+                        CUDA_NUM_THREADS>>>(CUDA_GET_LOOPS(loss_numel),
+                            loss_numel, in[0]->dim[1],
+                            margin,in[0]->dataGPU, in[1]->dataGPU, in[2]->dataGPU,
+                            loss_values);
+                }
                 break;
             case EuclideanSSE:
-                Loss_EuclideanSSE<<<CUDA_GET_BLOCKS(loss_numel),
-                    CUDA_NUM_THREADS>>>(
-                        CUDA_GET_LOOPS(loss_numel),
-                        loss_numel, in[0]->dataGPU, in[1]->dataGPU,
+                if (device==DeviceCPU){
+                    CPU_Loss_EuclideanSSE(loss_numel, in[0]->dataGPU, in[1]->dataGPU,
                         (in.size()==3 ? in[2]->dataGPU : NULL), loss_values);
+                }else{
+                    Loss_EuclideanSSE<<<CUDA_GET_BLOCKS(loss_numel),
+                        CUDA_NUM_THREADS>>>(
+                            CUDA_GET_LOOPS(loss_numel),
+                            loss_numel, in[0]->dataGPU, in[1]->dataGPU,
+                            (in.size()==3 ? in[2]->dataGPU : NULL), loss_values);
+                }
                 break;
             case HingeL1:
                 break;
@@ -6374,8 +9968,7 @@ public:
                 break;
         }
         ComputeT lossSum;
-        checkCUBLAS(__LINE__, GPUasum(cublasHandle, loss_numel,
-                                      loss_values, 1, &lossSum));
+        lossSum = asum(loss_numel, loss_values);
         loss += lossSum/loss_numel;
     };
 
@@ -6385,48 +9978,82 @@ public:
         if (in[0]->need_diff){
             switch(mode){
                 case MultinomialLogistic_StableSoftmax:
-                    LossGrad_MultinomialLogistic_StableSoftmax<<<
-                        CUDA_GET_BLOCKS(loss_numel), CUDA_NUM_THREADS>>>(
-                            CUDA_GET_LOOPS(loss_numel),
-                            loss_numel, in[0]->dim[1], numspel(in[0]->dim),
+                    if (device==DeviceCPU){
+                        CPU_LossGrad_MultinomialLogistic_StableSoftmax(loss_numel, in[0]->dim[1], numspel(in[0]->dim),
                             (in.size()==3 ? numel(in[2]->dim) : 0), scale,
                             in[0]->dataGPU, in[1]->dataGPU, loss_weightsGPU,
                             (in.size()==3 ? in[2]->dataGPU : NULL),
                             in[0]->diffGPU);
+                    }else{
+                        LossGrad_MultinomialLogistic_StableSoftmax<<<
+                            CUDA_GET_BLOCKS(loss_numel), CUDA_NUM_THREADS>>>(
+                                CUDA_GET_LOOPS(loss_numel),
+                                loss_numel, in[0]->dim[1], numspel(in[0]->dim),
+                                (in.size()==3 ? numel(in[2]->dim) : 0), scale,
+                                in[0]->dataGPU, in[1]->dataGPU, loss_weightsGPU,
+                                (in.size()==3 ? in[2]->dataGPU : NULL),
+                                in[0]->diffGPU);
+                    }
                     break;
                 case MultinomialLogistic:
-                    LossGrad_MultinomialLogistic<<<
-                        CUDA_GET_BLOCKS(loss_numel), CUDA_NUM_THREADS>>>(
-                            CUDA_GET_LOOPS(loss_numel),
-                            loss_numel, in[0]->dim[1], numspel(in[0]->dim),
+                    if (device==DeviceCPU){
+                        CPU_LossGrad_MultinomialLogistic(loss_numel, in[0]->dim[1], numspel(in[0]->dim),
                             (in.size()==3 ? numel(in[2]->dim) : 0), scale,
                             in[0]->dataGPU, in[1]->dataGPU, loss_weightsGPU,
                             (in.size()==3 ? in[2]->dataGPU : NULL),
                             in[0]->diffGPU);
+                    }else{
+                        LossGrad_MultinomialLogistic<<<
+                            CUDA_GET_BLOCKS(loss_numel), CUDA_NUM_THREADS>>>(
+                                CUDA_GET_LOOPS(loss_numel),
+                                loss_numel, in[0]->dim[1], numspel(in[0]->dim),
+                                (in.size()==3 ? numel(in[2]->dim) : 0), scale,
+                                in[0]->dataGPU, in[1]->dataGPU, loss_weightsGPU,
+                                (in.size()==3 ? in[2]->dataGPU : NULL),
+                                in[0]->diffGPU);
+                    }
                     break;
                 case SmoothL1:
-                    LossGrad_SmoothL1<<<CUDA_GET_BLOCKS(loss_numel),
-                        CUDA_NUM_THREADS>>>(
-                            CUDA_GET_LOOPS(loss_numel),
-                            loss_numel, scale, in[0]->dataGPU, in[1]->dataGPU,
+                    if (device==DeviceCPU){
+                        CPU_LossGrad_SmoothL1(loss_numel, scale, in[0]->dataGPU, in[1]->dataGPU,
                             (in.size()==3 ? in[2]->dataGPU : NULL),
                             in[0]->diffGPU);
+                    }else{
+                        LossGrad_SmoothL1<<<CUDA_GET_BLOCKS(loss_numel),
+                            CUDA_NUM_THREADS>>>(
+                                CUDA_GET_LOOPS(loss_numel),
+                                loss_numel, scale, in[0]->dataGPU, in[1]->dataGPU,
+                                (in.size()==3 ? in[2]->dataGPU : NULL),
+                                in[0]->diffGPU);
+                    }
                     break;
                 case Contrastive:
-                    LossGrad_Contrastive<<<CUDA_GET_BLOCKS(numExamples),
-                        CUDA_NUM_THREADS>>>(
-                            CUDA_GET_LOOPS(loss_numel),
-                            loss_numel, in[0]->dim[1], margin, scale,
+                    if (device==DeviceCPU){
+                        CPU_LossGrad_Contrastive(loss_numel, in[0]->dim[1], margin, scale,
                             in[0]->dataGPU, in[1]->dataGPU, in[2]->dataGPU,
                             in[0]->diffGPU, in[1]->diffGPU);
+                    }else{
+                        LossGrad_Contrastive<<<CUDA_GET_BLOCKS(numExamples),
+                            CUDA_NUM_THREADS>>>(
+                                CUDA_GET_LOOPS(loss_numel),
+                                loss_numel, in[0]->dim[1], margin, scale,
+                                in[0]->dataGPU, in[1]->dataGPU, in[2]->dataGPU,
+                                in[0]->diffGPU, in[1]->diffGPU);
+                    }
                     break;
                 case EuclideanSSE:
-                    LossGrad_EuclideanSSE<<<CUDA_GET_BLOCKS(loss_numel),
-                        CUDA_NUM_THREADS>>>(
-                            CUDA_GET_LOOPS(loss_numel),
-                            loss_numel, scale, in[0]->dataGPU, in[1]->dataGPU,
+                    if (device==DeviceCPU){
+                        CPU_LossGrad_EuclideanSSE(loss_numel, scale, in[0]->dataGPU, in[1]->dataGPU,
                             (in.size()==3 ? in[2]->dataGPU : NULL),
                             in[0]->diffGPU);
+                    }else{
+                        LossGrad_EuclideanSSE<<<CUDA_GET_BLOCKS(loss_numel),
+                            CUDA_NUM_THREADS>>>(
+                                CUDA_GET_LOOPS(loss_numel),
+                                loss_numel, scale, in[0]->dataGPU, in[1]->dataGPU,
+                                (in.size()==3 ? in[2]->dataGPU : NULL),
+                                in[0]->diffGPU);
+                    }
                     break;
                 case HingeL1:
                     break;
@@ -6548,7 +10175,7 @@ public:
         std::cout << name << std::endl;
         size_t memoryBytes = 0;
         const size_t X_bytes = in[1]->numBytes();
-        checkCUDA(__LINE__, cudaMalloc(&X_acts_diff, X_bytes) );
+        checkCUDA(__LINE__, deviceMalloc(device, &X_acts_diff, X_bytes) );
         X_count = numel( in[1]->dim);
         count = numel(out[1]->dim);
         hidden_dim = numspel(in[0]->dim);
@@ -6556,13 +10183,23 @@ public:
     };
     ~LSTMUnitLayer(){
         
-        if (X_acts_diff!=NULL)  checkCUDA(__LINE__, cudaFree(X_acts_diff));
+        if (X_acts_diff!=NULL)  checkCUDA(__LINE__, deviceFree(device, X_acts_diff));
     };
     void forward(Phase phase_){
+        if (device==DeviceCPU){
+            CPU_LSTM_acts_forward(X_count, hidden_dim, in[1]->dataGPU, X_acts);
+            CPU_LSTM_unit_forward(count, hidden_dim, in[0]->dataGPU, X_acts, in[2]->dataGPU, out[0]->dataGPU, out[1]->dataGPU);
+            return;
+        }
         LSTMActsForward<<<CUDA_GET_BLOCKS(X_count), CUDA_NUM_THREADS>>>(CUDA_GET_LOOPS(X_count), X_count, hidden_dim, in[1]->dataGPU, X_acts);
         LSTMUnitForward<<<CUDA_GET_BLOCKS(count), CUDA_NUM_THREADS>>>(CUDA_GET_LOOPS(count), count, hidden_dim, in[0]->dataGPU, X_acts, in[2]->dataGPU, out[0]->dataGPU, out[1]->dataGPU);
     };
     void backward(Phase phase_){
+        if (device==DeviceCPU){
+            CPU_LSTM_unit_backward(count, hidden_dim, in[0]->dataGPU, X_acts, out[0]->dataGPU, out[1]->dataGPU, in[2]->dataGPU, out[0]->diffGPU, out[1]->diffGPU, in[0]->diffGPU, X_acts_diff);
+            CPU_LSTM_acts_backward(X_count, hidden_dim, X_acts, X_acts_diff, in[1]->diffGPU);
+            return;
+        }
         LSTMUnitBackward<<<CUDA_GET_BLOCKS(count), CUDA_NUM_THREADS>>>(CUDA_GET_LOOPS(count), count, hidden_dim, in[0]->dataGPU, X_acts, out[0]->dataGPU, out[1]->dataGPU, in[2]->dataGPU, out[0]->diffGPU, out[1]->diffGPU, in[0]->diffGPU, X_acts_diff);
         LSTMActsBackward<<<CUDA_GET_BLOCKS(X_count), CUDA_NUM_THREADS>>>(CUDA_GET_LOOPS(X_count), X_count, hidden_dim, X_acts, X_acts_diff, in[1]->diffGPU);
     };
@@ -6640,6 +10277,7 @@ public:
 
         Response* pResponse_h_0 = new Response("h_0", train_me);
         pResponse_h_0->cublasHandle = cublasHandle;
+        pResponse_h_0->device = device;
         pResponse_h_0->Malloc(dim);
         responses_h_.push_back(pResponse_h_0);
 
@@ -6648,6 +10286,7 @@ public:
         for (int t=1;t<seq_length_T+1;++t){
             Response* pResponse_h_t = new Response("h_"+int_to_str(t), train_me);
             pResponse_h_t->cublasHandle = cublasHandle;
+            pResponse_h_t->device = device;
             pResponse_h_t->Malloc(dim, out[0]->dataGPU + items_h_t * (t-1), out[0]->diffGPU + items_h_t * (t-1));
             responses_h_.push_back(pResponse_h_t);
         }
@@ -6660,6 +10299,7 @@ public:
         for (int t=0;t<seq_length_T;++t){
             Response* pResponse_cont_t = new Response("cont_"+int_to_str(t), false);
             pResponse_cont_t->cublasHandle = cublasHandle;
+            pResponse_cont_t->device = device;
             pResponse_cont_t->Malloc(dim, in[1]->dataGPU + items_cont_t*t, NULL);
             //std::cout<<"pResponse_cont_t="<<pResponse_cont_t->dataGPU<<std::endl;
             responses_cont_.push_back(pResponse_cont_t);
@@ -6672,6 +10312,7 @@ public:
         while (dim.size()<3) dim.push_back(1);
         in0 = new Response(this->in[0]->name+"_proxy", in[0]->need_diff);
         in0->cublasHandle = cublasHandle;
+        in0->device = device;
         in0->Malloc(dim, in[0]->dataGPU, in[0]->diffGPU);
 
         // Add layer to transform all timesteps of x to the hidden state dimension.
@@ -6679,10 +10320,12 @@ public:
         pLayer_x_transform = new InnerProductLayer("x_transform", num_output*4, true, weight_lr_mult, weight_filler, weight_filler_param, bias_lr_mult, bias_filler, bias_filler_param);
         pLayer_x_transform->cudnnHandle = cudnnHandle;
         pLayer_x_transform->cublasHandle = cublasHandle;
+        pLayer_x_transform->device = device;
         pLayer_x_transform->GPU = GPU;
         pLayer_x_transform->addIn(in0);
         pResponse_W_xc_x = new Response("W_xc_x", train_me);
         pResponse_W_xc_x->cublasHandle = cublasHandle;
+        pResponse_W_xc_x->device = device;
         pLayer_x_transform->addOut(pResponse_W_xc_x);
         memoryBytes += pLayer_x_transform->Malloc(phase_);
         sub_layers.push_back(pLayer_x_transform);
@@ -6696,6 +10339,7 @@ public:
         for (int t=0;t<seq_length_T;++t){
             Response* pResponse_W_xc_x_t = new Response("W_xc_x_"+int_to_str(t), train_me);
             pResponse_W_xc_x_t->cublasHandle = cublasHandle;
+            pResponse_W_xc_x_t->device = device;
             pResponse_W_xc_x_t->Malloc(dim, pResponse_W_xc_x->dataGPU + items_W_xc_x_t*t, pResponse_W_xc_x->diffGPU  + items_W_xc_x_t*t);
             responses_W_xc_x_.push_back(pResponse_W_xc_x_t);
         }
@@ -6706,10 +10350,12 @@ public:
             pLayer_x_static_transform = new InnerProductLayer("W_xc_x_static", num_output*4, false, weight_lr_mult, weight_filler, weight_filler_param, bias_lr_mult, bias_filler, bias_filler_param);
             pLayer_x_static_transform->cudnnHandle = cudnnHandle;
             pLayer_x_static_transform->cublasHandle = cublasHandle;
+            pLayer_x_static_transform->device = device;
             pLayer_x_static_transform->GPU = GPU;
             pLayer_x_static_transform ->addIn(this->in[2]);
             pResponse_W_xc_x_static = new Response("W_xc_x_static", train_me);
             pResponse_W_xc_x_static->cublasHandle = cublasHandle;
+            pResponse_W_xc_x_static->device = device;
             pLayer_x_static_transform ->addOut(pResponse_W_xc_x_static);
             memoryBytes += pLayer_x_static_transform->Malloc(phase_);
             sub_layers.push_back(pLayer_x_static_transform);
@@ -6723,6 +10369,7 @@ public:
         for (int t=0;t<seq_length_T+1;++t){
             Response* pResponse_c_t = new Response("c_"+int_to_str(t), train_me);
             pResponse_c_t->cublasHandle = cublasHandle;
+            pResponse_c_t->device = device;
             pResponse_c_t->Malloc(dim);
             responses_c_.push_back(pResponse_c_t);
         }
@@ -6735,6 +10382,7 @@ public:
         for (int t=0;t<seq_length_T;++t){
             Response* pResponse_h_conted_t = new Response("h_conted_"+int_to_str(t), train_me);
             pResponse_h_conted_t->cublasHandle = cublasHandle;
+            pResponse_h_conted_t->device = device;
             pResponse_h_conted_t->Malloc(dim);
             responses_h_conted_.push_back(pResponse_h_conted_t);
         }
@@ -6749,6 +10397,7 @@ public:
         for (int t=0;t<seq_length_T;++t){
             Response* pResponse_W_hc_h_t = new Response("W_hc_h_"+int_to_str(t), train_me);
             pResponse_W_hc_h_t->cublasHandle = cublasHandle;
+            pResponse_W_hc_h_t->device = device;
             pResponse_W_hc_h_t->Malloc(dim);
             responses_W_hc_h_.push_back(pResponse_W_hc_h_t);
         }
@@ -6762,6 +10411,7 @@ public:
         for (int t=0;t<seq_length_T;++t){
             Response* pResponse_gate_input_t = new Response("gate_input_"+int_to_str(t), train_me);
             pResponse_gate_input_t->cublasHandle = cublasHandle;
+            pResponse_gate_input_t->device = device;
             pResponse_gate_input_t->Malloc(dim);
             responses_gate_input_.push_back(pResponse_gate_input_t);
         }
@@ -6769,7 +10419,7 @@ public:
         size_t X_bytes = sizeofStorageT * numel(dim);
         for (int t=0;t<seq_length_T;++t){
             StorageT* X_acts;
-            checkCUDA(__LINE__, cudaMalloc(&X_acts, X_bytes) );
+            checkCUDA(__LINE__, deviceMalloc(device, &X_acts, X_bytes) );
             X_acts_.push_back(X_acts);
         }
         memoryBytes += X_bytes * seq_length_T;
@@ -6784,6 +10434,7 @@ public:
         pLayer_h_conted = new ElementWiseLayer("h_conted", ElementWise_SUM, true);
         pLayer_h_conted->cudnnHandle = cudnnHandle;
         pLayer_h_conted->cublasHandle = cublasHandle;
+        pLayer_h_conted->device = device;
         pLayer_h_conted->GPU = GPU;
         pLayer_h_conted->addIn(responses_h_[0]);
         pLayer_h_conted->addIn(responses_cont_[0]);
@@ -6796,6 +10447,7 @@ public:
         pLayer_transform = new InnerProductLayer("transform", num_output*4, false, weight_lr_mult, weight_filler, weight_filler_param, bias_lr_mult, bias_filler, bias_filler_param);
         pLayer_transform->cudnnHandle = cudnnHandle;
         pLayer_transform->cublasHandle = cublasHandle;
+        pLayer_transform->device = device;
         pLayer_transform->GPU = GPU;                    
         pLayer_transform->addIn(responses_h_conted_[0]);
         pLayer_transform->addOut(responses_W_hc_h_[0]);
@@ -6808,6 +10460,7 @@ public:
         pLayer_gate_input = new ElementWiseLayer("gate_input", ElementWise_SUM);
         pLayer_gate_input->cudnnHandle = cudnnHandle;
         pLayer_gate_input->cublasHandle = cublasHandle;
+        pLayer_gate_input->device = device;
         pLayer_gate_input->GPU = GPU;                    
         pLayer_gate_input->addIn(responses_W_hc_h_[0]);
         pLayer_gate_input->addIn(responses_W_xc_x_[0]);
@@ -6834,6 +10487,7 @@ public:
         pLayer_lstm_unit = new LSTMUnitLayer("lstm_unit");
         pLayer_lstm_unit->cudnnHandle = cudnnHandle;
         pLayer_lstm_unit->cublasHandle = cublasHandle;
+        pLayer_lstm_unit->device = device;
         pLayer_lstm_unit->GPU = GPU;                    
         pLayer_lstm_unit->addIn(responses_c_[0]);
         pLayer_lstm_unit->addIn(responses_gate_input_[0]);
@@ -6883,17 +10537,17 @@ public:
     };
 
     void reset(){
-        checkCUDA(__LINE__,cudaMemset(responses_c_[0]->dataGPU, 0, responses_c_[0]->numBytes()));        
-        checkCUDA(__LINE__,cudaMemset(responses_h_[0]->dataGPU, 0, responses_h_[0]->numBytes()));
+        checkCUDA(__LINE__,deviceMemset(device, responses_c_[0]->dataGPU, 0, responses_c_[0]->numBytes()));        
+        checkCUDA(__LINE__,deviceMemset(device, responses_h_[0]->dataGPU, 0, responses_h_[0]->numBytes()));
     };
 
     void forward(Phase phase_){
 
         // copy c[T] to c[0]
-        checkCUDA(__LINE__,cudaMemcpy(responses_c_[responses_c_.size()-1]->dataGPU, responses_c_[0]->dataGPU, responses_c_[0]->numBytes(), cudaMemcpyDeviceToDevice));
+        checkCUDA(__LINE__,deviceMemcpy(device, responses_c_[responses_c_.size()-1]->dataGPU, responses_c_[0]->dataGPU, responses_c_[0]->numBytes(), cudaMemcpyDeviceToDevice));
 
         // copy h[T] to h[0]
-        checkCUDA(__LINE__,cudaMemcpy(responses_h_[responses_h_.size()-1]->dataGPU, responses_h_[0]->dataGPU, responses_h_[0]->numBytes(), cudaMemcpyDeviceToDevice));
+        checkCUDA(__LINE__,deviceMemcpy(device, responses_h_[responses_h_.size()-1]->dataGPU, responses_h_[0]->dataGPU, responses_h_[0]->numBytes(), cudaMemcpyDeviceToDevice));
 
         ComputeT avg;
 
@@ -7128,7 +10782,7 @@ public:
         for (int r=0;r<responses_W_hc_h_.size();++r) delete responses_W_hc_h_[r];
         for (int r=0;r<responses_gate_input_.size();++r) delete responses_gate_input_[r];
 
-        for (int t=0;t<X_acts_.size();++t)  checkCUDA(__LINE__, cudaFree(X_acts_[t]));
+        for (int t=0;t<X_acts_.size();++t)  checkCUDA(__LINE__, deviceFree(device, X_acts_[t]));
     };
 };
 
@@ -7148,9 +10802,11 @@ class BatchNormalizationLayer : public Layer{
     StorageT* resultSaveInvVariance;
     // StorageT* resultBnScaleDiff;     => weight_diffGPU
     // StorageT* resultBnBiasDiff;      => bias_diffGPU
+
+    bool statistics_loaded;             // the running statistics came with the weights
 public:
 
-    BatchNormalizationLayer(JSON* json){
+    BatchNormalizationLayer(JSON* json): bnScaleBiasMeanVarDesc(NULL){
         if (in.size() != out.size()){ std::cout << "BatchNormalizationLayer " << name << " needs same number of input and output responses" << std::endl; FatalError(__LINE__); }
         for (int i = 1; i < in.size(); ++i){
             if (!same_dim(in[0]->dim, in[i]->dim)){ std::cout <<"BatchNormalizationLayer" << name << " requires same dim for each input" << std::endl; FatalError(__LINE__); }
@@ -7169,7 +10825,12 @@ public:
         SetValue(json, bias_filler_param,       0.001)
 
         numForwardTrainingPasses = 0;
+        statistics_loaded = false;
     };
+
+    // Training backward needs x. The CPU forward reads all of a statistic's elements before writing them,
+    // cuDNN makes no such promise.
+    int inPlace(int o, Phase phase_){ return phase_==Testing && device==DeviceCPU ? o : -1; };
     // BatchNormalizationLayer(attributes)
 
     size_t Malloc(Phase phase_){
@@ -7231,8 +10892,10 @@ public:
         bias_dim = dim;
 
         // We check that the dimensions of all in responses are the same, so this is OK
-        checkCUDNN(__LINE__, cudnnCreateTensorDescriptor(&bnScaleBiasMeanVarDesc) );
-        checkCUDNN(__LINE__, cudnnDeriveBNTensorDescriptor(bnScaleBiasMeanVarDesc, in[0]->getDesc(), mode) );
+        if (device==DeviceGPU){
+            checkCUDNN(__LINE__, cudnnCreateTensorDescriptor(&bnScaleBiasMeanVarDesc) );
+            checkCUDNN(__LINE__, cudnnDeriveBNTensorDescriptor(bnScaleBiasMeanVarDesc, in[0]->getDesc(), mode) );
+        }
         
         // These should be the same, but for clarity
         weight_numel = numel(weight_dim);
@@ -7241,18 +10904,26 @@ public:
         size_t sizeofBNScaleBiasMeanVar = numel(dim) * sizeofStorageT;
 
         std::cout << " 6x bnScaleBiasMeanVar"; veciPrint(dim);
-        checkCUDA(__LINE__, cudaMalloc( &weight_dataGPU,            sizeofBNScaleBiasMeanVar) );
-        checkCUDA(__LINE__, cudaMalloc( &bias_dataGPU,              sizeofBNScaleBiasMeanVar) );
+        checkCUDA(__LINE__, deviceMalloc(device, &weight_dataGPU,            sizeofBNScaleBiasMeanVar) );
+        checkCUDA(__LINE__, deviceMalloc(device, &bias_dataGPU,              sizeofBNScaleBiasMeanVar) );
         memoryBytes += sizeofBNScaleBiasMeanVar * 2;
 
         // TODO: We could allocate this as a contiguous block of memory
         // We want to keep a history of the running statistic for each in response
-        checkCUDA(__LINE__, cudaMalloc( &resultRunningMean,         sizeofBNScaleBiasMeanVar * in.size()) );
-        checkCUDA(__LINE__, cudaMalloc( &resultRunningInvVariance,  sizeofBNScaleBiasMeanVar * in.size()) );
-        checkCUDA(__LINE__, cudaMalloc( &resultSaveMean,            sizeofBNScaleBiasMeanVar * in.size()) );
-        checkCUDA(__LINE__, cudaMalloc( &resultSaveInvVariance,     sizeofBNScaleBiasMeanVar * in.size()) );
+        checkCUDA(__LINE__, deviceMalloc(device, &resultRunningMean,         sizeofBNScaleBiasMeanVar * in.size()) );
+        checkCUDA(__LINE__, deviceMalloc(device, &resultRunningInvVariance,  sizeofBNScaleBiasMeanVar * in.size()) );
+        checkCUDA(__LINE__, deviceMalloc(device, &resultSaveMean,            sizeofBNScaleBiasMeanVar * in.size()) );
+        checkCUDA(__LINE__, deviceMalloc(device, &resultSaveInvVariance,     sizeofBNScaleBiasMeanVar * in.size()) );
         memoryBytes += sizeofBNScaleBiasMeanVar * 4 * in.size();
 
+        // running statistics that leave the data as it is until training replaces them
+        Tensor<StorageT>* initial = new Tensor<StorageT>(veci(1, int(numel(dim) * in.size())));
+        CPU_set_value(initial->numel(), initial->CPUmem, CPUCompute2StorageT(0));
+        initial->writeGPU(resultRunningMean, device);
+        CPU_set_value(initial->numel(), initial->CPUmem, CPUCompute2StorageT(1));
+        initial->writeGPU(resultRunningInvVariance, device);
+        delete initial;
+
         for (int i = 0; i < out.size(); ++i){
             out[i]->need_diff = train_me || in[i]->need_diff; // if one of them need the grad
             out[i]->receptive_field = in[i]->receptive_field;
@@ -7264,6 +10935,88 @@ public:
         return memoryBytes;
     };
 
+    // The running statistics are kept with the weights as name.running_mean and name.running_variance (what
+    // cudnn and CPU_batchnorm_forward accumulate in resultRunningInvVariance), one copy for all the in's.
+    void setWeights(std::vector<Tensor<StorageT>*> weights){
+        Layer::setWeights(weights);
+        bool mean = false, variance = false;
+        for (int i = 0; i < weights.size(); ++i){
+            bool isMean = weights[i]->name == name + ".running_mean";
+            bool isVariance = weights[i]->name == name + ".running_variance";
+            if (!isMean && !isVariance) continue;
+            if (numel(weights[i]->dim) != weight_numel){
+                std::cout << "[Warning] " << weights[i]->name << " is found but not loaded because the numels are mismatched" << std::endl;
+                continue;
+            }
+            for (int k = 0; k < in.size(); ++k){
+                weights[i]->writeGPU((isMean ? resultRunningMean : resultRunningInvVariance) + k * weight_numel, device);
+            }
+            std::cout << " " << weights[i]->name; veciPrint(weights[i]->dim); std::cout << " is set." << std::endl;
+            mean = mean || isMean;
+            variance = variance || isVariance;
+        }
+        statistics_loaded = statistics_loaded || (mean && variance);
+    };
+
+    void saveWeights(FILE* fp, std::vector<TensorIndexEntry>& index){
+        Layer::saveWeights(fp, index);
+        if (resultRunningMean == NULL) return;
+        Tensor<StorageT>* t = new Tensor<StorageT>(name + ".running_mean", weight_dim);
+        t->readGPU(resultRunningMean, device);
+        writeIndexed(fp, t, index);
+        delete t;
+        t = new Tensor<StorageT>(name + ".running_variance", weight_dim);
+        t->readGPU(resultRunningInvVariance, device);
+        writeIndexed(fp, t, index);
+        delete t;
+    };
+
+    // whether the statistics are per channel of the output of producer, so that its weights can absorb them
+    bool foldable(Layer* producer){
+        if (in.size() != 1 || out.size() != 1 || producer->out.size() != 1) return false;
+        InnerProductLayer* ip = dynamic_cast<InnerProductLayer*>(producer);
+        if (ip != NULL) return ip->bias_term;
+        return dynamic_cast<ConvolutionLayer*>(producer) != NULL && mode == CUDNN_BATCHNORM_SPATIAL;
+    };
+
+    // With the running statistics, y = scale * (x - mean) / sqrt(variance + epsilon) + bias is x * k + (bias - mean * k)
+    // for each channel. Multiplies the weights of producer for that channel by k and folds the rest into its bias.
+    void foldInto(Layer* producer){
+        if (!statistics_loaded){
+            std::cerr << name << ": folding needs " << name << ".running_mean and " << name << ".running_variance with the weights" << std::endl;
+            FatalError(__LINE__);
+        }
+        size_t channels = weight_numel;
+        if (producer->bias_numel != channels || producer->weight_numel % channels != 0){
+            std::cerr << name << " cannot be folded into " << producer->name << std::endl;
+            FatalError(__LINE__);
+        }
+        Tensor<StorageT>* scale    = new Tensor<StorageT>(weight_dim);  scale->readGPU(weight_dataGPU, device);
+        Tensor<StorageT>* shift    = new Tensor<StorageT>(bias_dim);    shift->readGPU(bias_dataGPU, device);
+        Tensor<StorageT>* mean     = new Tensor<StorageT>(weight_dim);  mean->readGPU(resultRunningMean, device);
+        Tensor<StorageT>* variance = new Tensor<StorageT>(weight_dim);  variance->readGPU(resultRunningInvVariance, device);
+        Tensor<StorageT>* weight   = new Tensor<StorageT>(producer->weight_dim); weight->readGPU(producer->weight_dataGPU, device);
+        Tensor<StorageT>* bias     = new Tensor<StorageT>(producer->bias_dim);   bias->readGPU(producer->bias_dataGPU, device);
+
+        size_t row = producer->weight_numel / channels;
+        for (size_t c = 0; c < channels; ++c){
+            double k = CPUStorage2ComputeT(scale->CPUmem[c]) / sqrt(CPUStorage2ComputeT(variance->CPUmem[c]) + epsilon);
+            for (size_t r = 0; r < row; ++r){
+                weight->CPUmem[c * row + r] = CPUCompute2StorageT(ComputeT(CPUStorage2ComputeT(weight->CPUmem[c * row + r]) * k));
+            }
+            double b = (CPUStorage2ComputeT(bias->CPUmem[c]) - CPUStorage2ComputeT(mean->CPUmem[c])) * k + CPUStorage2ComputeT(shift->CPUmem[c]);
+            bias->CPUmem[c] = CPUCompute2StorageT(ComputeT(b));
+        }
+        weight->writeGPU(producer->weight_dataGPU, device);
+        bias->writeGPU(producer->bias_dataGPU, device);
+
+        delete scale; delete shift; delete mean; delete variance; delete weight; delete bias;
+    };
+
+    // statistics layout of in[0] viewed as (N, stats, inner), the same grouping cudnn uses for each mode
+    size_t statsCount(){ return mode == CUDNN_BATCHNORM_SPATIAL ? in[0]->dim[1] : sizeofitem(in[0]->dim); };
+    size_t statsInner(){ return mode == CUDNN_BATCHNORM_SPATIAL ? numspel(in[0]->dim) : 1; };
+
     // TODO: 'Much higher performance for HW-packed tensors for both x and y'
     // TODO: We should keep running tally of where we are in dataGPU and diffGPU
     // TODO: Implement groups?
@@ -7274,6 +11027,12 @@ public:
                 int weight_index = i * weight_numel;
                 int bias_index = i * bias_numel;
 
+                if (device==DeviceCPU){
+                    CPU_batchnorm_forward(in[i]->dim[0], statsCount(), statsInner(), epsilon, 1. / (1 + numForwardTrainingPasses),
+                        in[i]->dataGPU, out[i]->dataGPU, weight_dataGPU, bias_dataGPU,
+                        resultRunningMean + weight_index, resultRunningInvVariance + bias_index,
+                        resultSaveMean + weight_index, resultSaveInvVariance + bias_index);
+                }else
                 checkCUDNN(__LINE__, cudnnBatchNormalizationForwardTraining(
                     cudnnHandle,
                     mode,
@@ -7296,13 +11055,16 @@ public:
                 // We want the next in response to use the running
                 // mean/variance we have just computed
                 if (i < in.size() - 1) {                    
-                    checkCUDA(__LINE__, cudaMemcpy(resultRunningMean + weight_index + weight_numel, resultRunningMean + weight_index, sizeofStorageT * weight_numel, cudaMemcpyDeviceToDevice));
-                    checkCUDA(__LINE__, cudaMemcpy(resultRunningInvVariance + bias_index + bias_numel, resultRunningInvVariance + bias_index, sizeofStorageT * bias_numel, cudaMemcpyDeviceToDevice));
-                    checkCUDA(__LINE__, cudaMemcpy(resultSaveMean + weight_index + weight_numel, resultSaveMean + weight_index, sizeofStorageT * weight_numel, cudaMemcpyDeviceToDevice));
-                    checkCUDA(__LINE__, cudaMemcpy(resultSaveInvVariance + bias_index + bias_numel, resultSaveInvVariance + bias_index, sizeofStorageT * bias_numel, cudaMemcpyDeviceToDevice));
+                    checkCUDA(__LINE__, deviceMemcpy(device, resultRunningMean + weight_index + weight_numel, resultRunningMean + weight_index, sizeofStorageT * weight_numel, cudaMemcpyDeviceToDevice));
+                    checkCUDA(__LINE__, deviceMemcpy(device, resultRunningInvVariance + bias_index + bias_numel, resultRunningInvVariance + bias_index, sizeofStorageT * bias_numel, cudaMemcpyDeviceToDevice));
+                    checkCUDA(__LINE__, deviceMemcpy(device, resultSaveMean + weight_index + weight_numel, resultSaveMean + weight_index, sizeofStorageT * weight_numel, cudaMemcpyDeviceToDevice));
+                    checkCUDA(__LINE__, deviceMemcpy(device, resultSaveInvVariance + bias_index + bias_numel, resultSaveInvVariance + bias_index, sizeofStorageT * bias_numel, cudaMemcpyDeviceToDevice));
                 }
 
                 numForwardTrainingPasses++;
+            } else if (device==DeviceCPU){
+                CPU_batchnorm_forward(in[i]->dim[0], statsCount(), statsInner(), epsilon, 1,
+                    in[i]->dataGPU, out[i]->dataGPU, weight_dataGPU, bias_dataGPU, NULL, NULL, NULL, NULL);
             } else{
                 checkCUDNN(__LINE__, cudnnBatchNormalizationForwardTraining(
                     cudnnHandle,
@@ -7356,6 +11118,12 @@ public:
             int weight_index = i * weight_numel;
             int bias_index = i * bias_numel;
 
+            if (device==DeviceCPU){
+                CPU_batchnorm_backward(in[0]->dim[0], statsCount(), statsInner(),
+                    in[0]->dataGPU, out[0]->diffGPU, in[0]->diffGPU,
+                    weight_dataGPU, weight_diffGPU, bias_diffGPU,
+                    resultSaveMean + weight_index, resultSaveInvVariance + bias_index);
+            }else
             checkCUDNN(__LINE__, cudnnBatchNormalizationBackward(
                 cudnnHandle,
                 mode,
@@ -7382,21 +11150,21 @@ public:
         // the next forward pass should take care of propagating new running
         // values
             if (i < in.size() - 1) {                    
-                checkCUDA(__LINE__, cudaMemcpy(resultRunningMean + weight_index, resultRunningMean + last_weight_index, sizeofStorageT * weight_numel, cudaMemcpyDeviceToDevice));
-                checkCUDA(__LINE__, cudaMemcpy(resultRunningInvVariance + bias_index, resultRunningInvVariance + last_bias_index, sizeofStorageT * weight_numel, cudaMemcpyDeviceToDevice));
-                checkCUDA(__LINE__, cudaMemcpy(resultSaveMean + weight_index, resultSaveMean + last_weight_index, sizeofStorageT * weight_numel, cudaMemcpyDeviceToDevice));
-                checkCUDA(__LINE__, cudaMemcpy(resultSaveInvVariance + bias_index, resultSaveInvVariance + last_bias_index, sizeofStorageT * weight_numel, cudaMemcpyDeviceToDevice));
+                checkCUDA(__LINE__, deviceMemcpy(device, resultRunningMean + weight_index, resultRunningMean + last_weight_index, sizeofStorageT * weight_numel, cudaMemcpyDeviceToDevice));
+                checkCUDA(__LINE__, deviceMemcpy(device, resultRunningInvVariance + bias_index, resultRunningInvVariance + last_bias_index, sizeofStorageT * weight_numel, cudaMemcpyDeviceToDevice));
+                checkCUDA(__LINE__, deviceMemcpy(device, resultSaveMean + weight_index, resultSaveMean + last_weight_index, sizeofStorageT * weight_numel, cudaMemcpyDeviceToDevice));
+                checkCUDA(__LINE__, deviceMemcpy(device, resultSaveInvVariance + bias_index, resultSaveInvVariance + last_bias_index, sizeofStorageT * weight_numel, cudaMemcpyDeviceToDevice));
             }
         }
     };
 
     ~BatchNormalizationLayer(){
-        checkCUDNN(__LINE__, cudnnDestroyTensorDescriptor(bnScaleBiasMeanVarDesc) );
+        if (bnScaleBiasMeanVarDesc != NULL) checkCUDNN(__LINE__, cudnnDestroyTensorDescriptor(bnScaleBiasMeanVarDesc) );
 
-        if (resultRunningMean != NULL)          checkCUDA(__LINE__, cudaFree(resultRunningMean) );
-        if (resultRunningInvVariance != NULL)   checkCUDA(__LINE__, cudaFree(resultRunningInvVariance) );
-        if (resultSaveMean != NULL)             checkCUDA(__LINE__, cudaFree(resultSaveMean) );
-        if (resultSaveInvVariance != NULL)      checkCUDA(__LINE__, cudaFree(resultSaveInvVariance) );
+        if (resultRunningMean != NULL)          checkCUDA(__LINE__, deviceFree(device, resultRunningMean) );
+        if (resultRunningInvVariance != NULL)   checkCUDA(__LINE__, deviceFree(device, resultRunningInvVariance) );
+        if (resultSaveMean != NULL)             checkCUDA(__LINE__, deviceFree(device, resultSaveMean) );
+        if (resultSaveInvVariance != NULL)      checkCUDA(__LINE__, deviceFree(device, resultSaveInvVariance) );
     };
 };
 
@@ -7415,7 +11183,34 @@ public:
     std::vector<Response*> responses;
     std::vector<LossLayer*> loss_layers;
     int GPU;
+    Device device;
+    int CPU_threads;
+    bool reuse_responses;                    // Testing only: responses with disjoint lifetimes share buffers
+    bool fold_batchnorm;                     // Testing only: BatchNormalization folded into the layer before it
+    bool fuse_activations;                   // Testing only: Activation done by the Convolution/InnerProduct before it
+    bool in_place;                           // outputs share their input's buffers wherever the layer allows it
+    bool concat_views;                       // Concat inputs written straight into their slice of its output
+    std::vector<std::string> keep_responses; // read after forward(), so they keep their own buffers
+    ResponsePool* responsePool;
+    MemoryAccount memory;                    // everything allocated by Malloc
     bool debug_mode;
+
+    // a BatchNormalizationLayer taken out of the layers, with the weights of the layer it is folded into as
+    // they were loaded
+    struct FoldedBatchNorm{
+        Layer* layer;
+        BatchNormalizationLayer* bn;
+        Tensor<StorageT>* weight;
+        Tensor<StorageT>* bias;
+    };
+    std::vector<FoldedBatchNorm> folded;
+
+    // the input in of concat, together with every response sharing its buffers, lives in its slice of the output
+    struct ConcatSlice{
+        ConcatLayer* concat;
+        int in;
+    };
+    std::vector<ConcatSlice> slices;
     int train_iter;
     int test_iter;
     int display_iter;
@@ -7423,11 +11218,28 @@ public:
     cudnnHandle_t cudnnHandle;
     cublasHandle_t cublasHandle;
 
+    void setDevice(){
+        if (device==DeviceGPU) checkCUDA(__LINE__,cudaSetDevice(GPU));
+    };
+
+    void synchronize(){
+        if (device==DeviceGPU){
+            checkCUDA(__LINE__,cudaDeviceSynchronize());
+            checkCUDA(__LINE__,cudaGetLastError());
+        }
+    };
+
     void init(JSON* architecture_obj){
-        checkCUDA(__LINE__,cudaSetDevice(GPU));
+        cudnnHandle = NULL;
+        cublasHandle = NULL;
+        responsePool = NULL;
+        setCPUThreads(CPU_threads);
+        if (device==DeviceGPU){
+            checkCUDA(__LINE__,cudaSetDevice(GPU));
 
-        checkCUDNN(__LINE__,cudnnCreate(&cudnnHandle) );
-        checkCUBLAS(__LINE__, cublasCreate(&cublasHandle) );
+            checkCUDNN(__LINE__,cudnnCreate(&cudnnHandle) );
+            checkCUBLAS(__LINE__, cublasCreate(&cublasHandle) );
+        }
 
         std::vector<SequenceGenerationLayer*> sequence_layers;
 
@@ -7442,7 +11254,7 @@ public:
 
                  if (0==type.compare("MemoryData"))     pLayer = new MemoryDataLayer(p);
             else if (0==type.compare("DiskData")){
-                uint8_t fpTypeid = readTypeID(p->member["file_data"]->returnString());
+                uint8_t fpTypeid = p->member.find("file_records")!=p->member.end() ? readRecordTypeID(p->member["file_records"]->returnString()) : readTypeID(p->member["file_data"]->returnString());
                      if (fpTypeid==typeID(typeid(half)))        pLayer = new DiskDataLayer<half>(p);
                 else if (fpTypeid==typeID(typeid(float)))       pLayer = new DiskDataLayer<float>(p);
                 else if (fpTypeid==typeID(typeid(double)))      pLayer = new DiskDataLayer<double>(p);
@@ -7457,9 +11269,7 @@ public:
                 else if (fpTypeid==typeID(typeid(char)))        pLayer = new DiskDataLayer<char>(p);
                 else if (fpTypeid==typeID(typeid(bool)))        pLayer = new DiskDataLayer<bool>(p);
             }
-#if USE_OPENCV
             else if (0==type.compare("ImageData"))              pLayer = new ImageDataLayer(p);
-#endif            
             else if (0==type.compare("ElementWise"))            pLayer = new ElementWiseLayer(p);
             else if (0==type.compare("Concat"))                 pLayer = new ConcatLayer(p);
             else if (0==type.compare("Convolution"))            pLayer = new ConvolutionLayer(p);
@@ -7485,6 +11295,7 @@ public:
             pLayer->cudnnHandle = cudnnHandle;
             pLayer->cublasHandle = cublasHandle;
             pLayer->GPU = GPU;
+            pLayer->device = device;
 
             addLayer(pLayer);
 
@@ -7495,6 +11306,7 @@ public:
                     if (pResponse==NULL){
                         pResponse = addResponse(new Response(out[i]));
                         pResponse->cublasHandle = cublasHandle;
+                        pResponse->device = device;
                     }
                     pLayer->addOut(pResponse);
                 }
@@ -7507,6 +11319,7 @@ public:
                     if (pResponse==NULL){
                         pResponse = addResponse(new Response(in[i]));
                         pResponse->cublasHandle = cublasHandle;
+                        pResponse->device = device;
                     }
                     pLayer->addIn(pResponse);
                 }
@@ -7524,6 +11337,14 @@ public:
         JSON* architecture_obj = new JSON;
         parseNetworkJSON(filename, NULL, test_obj, architecture_obj);
         SetValue(test_obj, GPU,             0)
+        SetValue(test_obj, device,          DeviceGPU)
+        SetValue(test_obj, CPU_threads,     0)
+        SetValue(test_obj, reuse_responses, false)
+        SetValue(test_obj, fold_batchnorm,  false)
+        SetValue(test_obj, fuse_activations,false)
+        SetValue(test_obj, in_place,        false)
+        SetValue(test_obj, concat_views,    false)
+        SetValue(test_obj, keep_responses,  std::vector<std::string>())
         SetValue(test_obj, debug_mode,      false)
         SetValue(test_obj, display_iter,    1)
 
@@ -7533,21 +11354,37 @@ public:
         delete architecture_obj;
     };
 
-    Net(JSON* architecture_obj, int GPU_ = 0): GPU(GPU_){
+    Net(JSON* architecture_obj, int GPU_ = 0, Device device_ = DeviceGPU, int CPU_threads_ = 0): GPU(GPU_), device(device_), CPU_threads(CPU_threads_), reuse_responses(false), fold_batchnorm(false), fuse_activations(false), in_place(false), concat_views(false){
         init(architecture_obj);
     };
 
+    // this net is replica rank of count training together; seed has to be the same for all of them. Each data
+    // layer draws from its own seed, alike on every replica, so that two layers reading the same number of items
+    // (the pairs of a siamese net) do not go through them in the same order.
+    void setReplica(int rank, int count, unsigned seed){
+        for (int l=0; l<layers.size();++l){
+            if (layers[l]->isDataLayer()) ((DataLayer*) layers[l])->setReplica(rank, count, seed + l);
+        }
+    };
+
     ~Net(){
-        checkCUDA(__LINE__,cudaSetDevice(GPU));
+        setDevice();
 
         for (int i=0;i<layers.size();++i){
             delete layers[i];
         }
+        for (int f=0;f<folded.size();++f){
+            delete folded[f].bn;
+            if (folded[f].weight!=NULL) delete folded[f].weight;
+            if (folded[f].bias!=NULL)   delete folded[f].bias;
+        }
         for (int i=0;i<responses.size();++i){
             delete responses[i];
         }
-        checkCUDNN(__LINE__,cudnnDestroy(cudnnHandle) );
-        checkCUBLAS(__LINE__, cublasDestroy(cublasHandle) );
+        if (responsePool!=NULL) delete responsePool;
+        MemoryArena::get().forget(&memory);
+        if (cudnnHandle!=NULL)  checkCUDNN(__LINE__,cudnnDestroy(cudnnHandle) );
+        if (cublasHandle!=NULL) checkCUBLAS(__LINE__, cublasDestroy(cublasHandle) );
     };
 
     Layer* getLayer(std::string name){
@@ -7579,25 +11416,32 @@ public:
     };
 
     void randInit(){
-        checkCUDA(__LINE__,cudaSetDevice(GPU));
+        setDevice();
         for (int l=0; l<layers.size();++l){
             layers[l]->randInit();
         }
     };
 
     void loadWeights(std::vector<Tensor<StorageT>*> weights, bool diff=false){
-        checkCUDA(__LINE__,cudaSetDevice(GPU));
+        setDevice();
+        // weights not in this file stay as loaded before, not as folded
+        unfoldBatchNorm();
         // let the layers find their weights based on their names
         for (int l=0; l<layers.size();++l){
             layers[l]->setWeights(weights);
             if (diff) layers[l]->setDiffs(weights);
         }
+        for (int f=0; f<folded.size();++f){
+            folded[f].bn->setWeights(weights);
+        }
+        foldBatchNorm();
     };
 
     void loadWeights(std::string filename, bool diff=false){
         std::cout<< "====================================================================================================================================="<<std::endl;
 
-        std::vector<Tensor<StorageT>*> weights = readTensors<StorageT>(filename);
+        TensorFile file(filename);
+        std::vector<Tensor<StorageT>*> weights = file.tensors<StorageT>();
         loadWeights(weights, diff);
 
         // release memory for the weights
@@ -7614,15 +11458,360 @@ public:
             fp = fopen(filename.c_str(),"wb");
         }
 
+        unfoldBatchNorm();
+        std::vector<TensorIndexEntry> index;
         for (int l=0; l<layers.size();++l){
-            layers[l]->saveWeights(fp);
-            if (diff) layers[l]->saveDiffs(fp);
+            layers[l]->saveWeights(fp, index);
+            if (diff) layers[l]->saveDiffs(fp, index);
         }
+        for (int f=0; f<folded.size();++f){
+            folded[f].bn->saveWeights(fp, index);
+            if (folded[f].weight!=NULL) folded[f].bn->foldInto(folded[f].layer);
+        }
+        writeTensorIndex(fp, index);
         fclose(fp);
     };
 
+    // Takes out of the layers each BatchNormalizationLayer whose input only comes from a Convolution or InnerProduct
+    // layer with per-channel statistics, and has that layer write the normalized response directly. This saves
+    // the pass over the activations and the buffer in between; loadWeights then folds the running statistics
+    // into the weights. Unlike a BatchNormalizationLayer in Testing, which normalizes with the statistics of the
+    // batch, the folded layers use the running statistics saved with the model.
+    void planBatchNormFolding(){
+        for (int l=0;l<layers.size();++l){
+            BatchNormalizationLayer* bn = dynamic_cast<BatchNormalizationLayer*>(layers[l]);
+            if (bn==NULL || bn->phase==Training || bn->in.size()!=1) continue;
+            Response* r = bn->in[0];
+
+            Layer* producer = NULL;
+            int writers = 0, readers = 0;
+            for (int k=0;k<layers.size();++k){
+                for (int o=0;o<layers[k]->out.size();++o) if (layers[k]->out[o]==r){ producer = layers[k]; ++writers; }
+                for (int i=0;i<layers[k]->in.size();++i)  if (layers[k]->in[i]==r) ++readers;
+            }
+            if (writers!=1 || readers!=1 || producer->phase==Training || !bn->foldable(producer)) continue;
+            if (std::find(keep_responses.begin(), keep_responses.end(), r->name)!=keep_responses.end()) continue;
+
+            std::cout<<"Folding "<<bn->name<<" into "<<producer->name<<std::endl;
+            producer->out[0] = bn->out[0];
+            bn->in[0] = bn->out[0];
+            responses.erase(std::find(responses.begin(), responses.end(), r));
+            delete r;
+
+            FoldedBatchNorm f;
+            f.layer = producer;
+            f.bn = bn;
+            f.weight = NULL;
+            f.bias = NULL;
+            folded.push_back(f);
+            layers.erase(layers.begin()+l);
+            --l;
+        }
+    };
+
+    // Removes each ActivationLayer whose input only comes from a Convolution or InnerProduct layer and has that
+    // layer apply the activation to its output, right after the bias, writing the activation's response
+    // directly. An activation written in place by hand (the same response in and out, as in all the shipped
+    // models) fuses too when no layer reads the response between the producer and the activation; the response
+    // then stays and only the layer goes. Runs after planBatchNormFolding, so Convolution -> BatchNormalization
+    // -> ReLU fuses as well.
+    void planActivationFusion(){
+        for (int l=0;l<layers.size();++l){
+            ActivationLayer* act = dynamic_cast<ActivationLayer*>(layers[l]);
+            if (act==NULL || act->phase==Training || act->in.size()!=1 || !FusedActivation::supports(act->mode)) continue;
+            Response* r = act->in[0];
+            bool inplace = act->out[0]==r;
+
+            // the other layers writing or reading r: at all, or before the activation when in place (a Dropout
+            // running in place after it does not matter)
+            Layer* producer = NULL;
+            int writers = 0, readers = 0;
+            for (int k=0;k<layers.size();++k){
+                if (k==l || (inplace && k>l)) continue;
+                for (int o=0;o<layers[k]->out.size();++o) if (layers[k]->out[o]==r){ producer = layers[k]; ++writers; }
+                for (int i=0;i<layers[k]->in.size();++i)  if (layers[k]->in[i]==r) ++readers;
+            }
+            if (writers!=1 || readers!=0 || producer->phase==Training || producer->out.size()!=1) continue;
+            if (!inplace && std::find(keep_responses.begin(), keep_responses.end(), r->name)!=keep_responses.end()) continue;
+
+            FusedActivation* fused = NULL;
+            ConvolutionLayer* conv = dynamic_cast<ConvolutionLayer*>(producer);
+            InnerProductLayer* ip = dynamic_cast<InnerProductLayer*>(producer);
+            if (conv!=NULL) fused = &conv->activation;
+            else if (ip!=NULL) fused = &ip->activation;
+            if (fused==NULL || fused->enabled) continue;
+
+            std::cout<<"Fusing "<<act->name<<" into "<<producer->name<<std::endl;
+            fused->set(act->mode, device);
+            if (!inplace){
+                producer->out[0] = act->out[0];
+                responses.erase(std::find(responses.begin(), responses.end(), r));
+                delete r;
+            }
+            layers.erase(layers.begin()+l);
+            delete act;
+            --l;
+        }
+    };
+
+    int writersOf(Response* r){
+        int writers = 0;
+        for (int l=0;l<layers.size();++l){
+            for (int o=0;o<layers[l]->out.size();++o) if (layers[l]->out[o]==r) ++writers;
+        }
+        return writers;
+    };
+
+    int readersOf(Response* r){
+        int readers = 0;
+        for (int l=0;l<layers.size();++l){
+            for (int i=0;i<layers[l]->in.size();++i) if (layers[l]->in[i]==r) ++readers;
+        }
+        return readers;
+    };
+
+    // whether layer reads in[i] only to have an output be a view of it
+    bool viewed(Layer* layer, int i){
+        for (int o=0;o<layer->out.size();++o){
+            if (layer->viewOf(o)==i && layer->out[o]->alias==layer->in[i]) return true;
+        }
+        return false;
+    };
+
+    // Outputs that are views of an input share its buffers when no other layer writes them or reads the input:
+    // sharing the diff as well is only right when the view's diff is all the input gets. Responses
+    // written in place by hand (the same name in "in" and "out") are rejected when the layer can't run in place.
+    // With in_place, each output the layer allows also overwrites its input, as long as the buffer behind that
+    // input is written once by a layer with inputs of its own (not filled once from outside), is read by no
+    // other layer except through views (in Testing: by no later one but the loss layers) and backs none of
+    // keep_responses.
+    // A net malloced for Training runs its Testing layers too.
+    void planInPlace(){
+        for (int l=0;l<layers.size();++l){
+            for (int o=0;o<layers[l]->out.size();++o){
+                int k = layers[l]->viewOf(o);
+                Response* y = layers[l]->out[o];
+                if (k<0 || y==layers[l]->in[k] || y->alias!=NULL || writersOf(y)!=1 || readersOf(layers[l]->in[k])!=1) continue;
+                y->alias = layers[l]->in[k];
+            }
+        }
+
+        for (int l=0;l<layers.size();++l){
+            Layer* layer = layers[l];
+            if (phase==Testing && layer->phase==Training) continue;
+            Phase runs = (phase==Training && layer->phase!=Testing) ? Training : Testing;
+
+            for (int o=0;o<layer->out.size();++o){
+                int k = layer->inPlace(o, runs);
+                for (int i=0;i<layer->in.size();++i){
+                    if (layer->in[i]==layer->out[o] && i!=k){
+                        std::cerr<<"Layer "<<layer->name<<" cannot run in place on "<<layer->out[o]->name<<(runs==Training ? " when training" : "")<<std::endl;
+                        FatalError(__LINE__);
+                    }
+                }
+                if (!in_place || k<0) continue;
+                Response* x = layer->in[k];
+                Response* y = layer->out[o];
+                if (x==y || y->alias!=NULL) continue;
+
+                // readers before this layer are done with the buffer, unless they still need it in backward or, for
+                // the loss layers, in eval() after the forward pass
+                Response* buffer = x->owner();
+                int producer = -1, writers = 0, readers = 0, y_early = 0;
+                for (int j=0;j<layers.size();++j){
+                    bool loss = std::find(loss_layers.begin(), loss_layers.end(), layers[j])!=loss_layers.end();
+                    for (int w=0;w<layers[j]->out.size();++w){
+                        if (layers[j]->out[w]==buffer){ producer = j; ++writers; }
+                    }
+                    for (int r=0;r<layers[j]->in.size();++r){
+                        if (layers[j]->in[r]->owner()==buffer && !viewed(layers[j], r) && (phase==Training || j>=l || loss)) ++readers;
+                        if (layers[j]->in[r]==y && j<=l) ++y_early;
+                    }
+                }
+                if (writers!=1 || producer>=l || layers[producer]->in.empty() || readers!=1 || writersOf(y)!=1 || y_early>0) continue;
+                bool kept = false;
+                for (int r=0;r<keep_responses.size();++r){
+                    Response* k_r = getResponse(keep_responses[r]);
+                    if (k_r!=NULL && k_r->owner()==buffer) kept = true;
+                }
+                if (kept) continue;
+
+                std::cout<<"In place: "<<y->name<<" over "<<x->name<<std::endl;
+                y->alias = x;
+            }
+        }
+    };
+
+    // A Concat input is written into the output directly when every other layer touching its buffer copes with
+    // strides (Layer::strided), a single layer with inputs of its own produces it (others may only run in place on
+    // it), the Concat reads it only once and neither it nor the output backs one of keep_responses. In Training, the layers reading it must write the same buffer too: anything else would add
+    // to the output's diff in backward, and the output itself may not be overwritten in place.
+    void planConcatViews(){
+        std::map<Response*, bool> sliced;
+        for (int l=0;l<layers.size();++l){
+            ConcatLayer* concat = dynamic_cast<ConcatLayer*>(layers[l]);
+            if (concat==NULL || (phase==Testing && concat->phase==Training)) continue;
+            int in_group = concat->in.size()/concat->out.size();
+            for (int i=0;i<concat->in.size();++i){
+                Response* root = concat->in[i]->owner();
+                Response* out = concat->out[i/in_group]->owner();
+                if (sliced[root] || root==out) continue;
+
+                // one producer, and possibly layers running in place on it by hand (a ReLU after a Convolution)
+                bool ok = true;
+                int producers = 0;
+                for (int j=0;j<layers.size();++j){
+                    for (int w=0;w<layers[j]->out.size();++w){
+                        if (layers[j]->out[w]!=root) continue;
+                        int k = layers[j]->inPlace(w, phase);
+                        if (k<0 || layers[j]->in[k]!=root) ++producers;
+                    }
+                }
+                if (producers!=1) continue;
+
+                for (int j=0;j<layers.size() && ok;++j){
+                    Layer* layer = layers[j];
+                    bool reads = false, writes = false;
+                    for (int r=0;r<layer->in.size();++r){
+                        if (layer->in[r]->owner()!=root) continue;
+                        if (layer==concat && r!=i) ok = false;
+                        if (layer!=concat && !layer->strided(layer->in[r])) ok = false;
+                        reads = true;
+                    }
+                    for (int w=0;w<layer->out.size();++w){
+                        if (layer->out[w]->owner()==out && layer->out[w]!=out && phase==Training) ok = false;
+                        if (layer->out[w]->owner()!=root) continue;
+                        if (layer->in.empty() || !layer->strided(layer->out[w])) ok = false;
+                        writes = true;
+                    }
+                    if (reads && !writes && layer!=concat && phase==Training) ok = false;
+                }
+                for (int k=0;k<keep_responses.size() && ok;++k){
+                    Response* k_r = getResponse(keep_responses[k]);
+                    if (k_r!=NULL && (k_r->owner()==root || k_r->owner()==out)) ok = false;
+                }
+                if (!ok) continue;
+
+                ConcatSlice slice;
+                slice.concat = concat;
+                slice.in = i;
+                slices.push_back(slice);
+                sliced[root] = true;
+            }
+        }
+    };
+
+    // after concat has malloced its outputs, moves the responses of its slices into them
+    void sliceConcat(Layer* concat){
+        int in_group = concat->in.size()/concat->out.size();
+        for (int s=0;s<slices.size();++s){
+            if (slices[s].concat!=concat) continue;
+            int i = slices[s].in;
+            Response* root = concat->in[i]->owner();
+            Response* out = concat->out[i/in_group];
+            if (root->isProxy || root->pool!=NULL || out->pool!=NULL) continue;
+
+            int channel = 0;
+            for (int k=(i/in_group)*in_group;k<i;++k) channel += concat->in[k]->dim[1];
+
+            std::vector<Response*> members;
+            bool ok = true;
+            for (int r=0;r<responses.size();++r){
+                Response* m = responses[r];
+                if (m->owner()!=root) continue;
+                if (m->dataGPU!=root->dataGPU || m->dim.size()!=out->dim.size() || (m->diffGPU!=NULL && out->diffGPU==NULL)) ok = false;
+                for (int d=0;d<m->dim.size() && ok;++d){
+                    if (d!=1 && m->dim[d]!=out->dim[d]) ok = false;
+                }
+                members.push_back(m);
+            }
+            if (!ok) continue;
+
+            std::cout<<"Concat view: "<<root->name<<" at channel "<<channel<<" of "<<out->name<<std::endl;
+            // the owner last: it frees the buffers the others share
+            for (int m=0;m<members.size();++m){
+                if (members[m]!=root) members[m]->sliceOf(out, channel);
+            }
+            root->sliceOf(out, channel);
+
+            for (int l=0;l<layers.size();++l){
+                bool touched = false;
+                for (int r=0;r<layers[l]->in.size();++r)  if (layers[l]->in[r]->owner()==root && layers[l]!=concat) touched = true;
+                for (int w=0;w<layers[l]->out.size();++w) if (layers[l]->out[w]->owner()==root) touched = true;
+                if (touched) layers[l]->restrided();
+            }
+        }
+    };
+
+    // puts back the weights as they were loaded into the layers BatchNormalization was folded into
+    void unfoldBatchNorm(){
+        for (int f=0;f<folded.size();++f){
+            if (folded[f].weight==NULL) continue;
+            folded[f].weight->writeGPU(folded[f].layer->weight_dataGPU, device);
+            folded[f].bias->writeGPU(folded[f].layer->bias_dataGPU, device);
+        }
+    };
+
+    void foldBatchNorm(){
+        for (int f=0;f<folded.size();++f){
+            Layer* layer = folded[f].layer;
+            if (folded[f].weight==NULL){
+                folded[f].weight = new Tensor<StorageT>(layer->weight_dim);
+                folded[f].bias   = new Tensor<StorageT>(layer->bias_dim);
+            }
+            folded[f].weight->readGPU(layer->weight_dataGPU, device);
+            folded[f].bias->readGPU(layer->bias_dataGPU, device);
+            folded[f].bn->foldInto(layer);
+        }
+    };
+
+    // Liveness of the responses over the layer order, which is both the Malloc and the forward order: a response
+    // is released after the last layer that reads or writes it, so the buffer can serve a response created later.
+    // Responses read before any layer writes them (fed from outside, or recurrent), outputs of layers without
+    // inputs (which may fill them only once), keep_responses and the inputs of the loss layers (evaluated after the
+    // whole forward pass) are not shared. Responses written in place count as their owner, which is released after
+    // the last of them.
+    void planResponses(std::vector<std::vector<Response*> >& released){
+        std::map<Response*, int> last;
+        std::map<Response*, bool> written, pinned;
+        for (int l=0;l<layers.size();++l){
+            for (int i=0;i<layers[l]->in.size();++i){
+                Response* r = layers[l]->in[i]->owner();
+                if (!written[r]) pinned[r] = true;
+                last[r] = l;
+            }
+            for (int o=0;o<layers[l]->out.size();++o){
+                Response* r = layers[l]->out[o]->owner();
+                written[r] = true;
+                if (layers[l]->in.empty()) pinned[r] = true;
+                last[r] = l;
+            }
+        }
+        for (int k=0;k<keep_responses.size();++k){
+            Response* r = getResponse(keep_responses[k]);
+            if (r==NULL){ std::cerr<<"keep_responses: no response named "<<keep_responses[k]<<std::endl; FatalError(__LINE__); }
+            pinned[r->owner()] = true;
+        }
+        for (int l=0;l<loss_layers.size();++l){
+            for (int i=0;i<loss_layers[l]->in.size();++i) pinned[loss_layers[l]->in[i]->owner()] = true;
+        }
+        // a Concat output is written from the first layer writing one of its slices on
+        for (int s=0;s<slices.size();++s){
+            Layer* concat = slices[s].concat;
+            pinned[concat->in[slices[s].in]->owner()] = true;
+            for (int o=0;o<concat->out.size();++o) pinned[concat->out[o]->owner()] = true;
+        }
+
+        responsePool = new ResponsePool(device);
+        for (std::map<Response*, int>::iterator it=last.begin(); it!=last.end(); ++it){
+            if (pinned[it->first]) continue;
+            it->first->pool = responsePool;
+            released[it->second].push_back(it->first);
+        }
+    };
+
     size_t Malloc(Phase phase_ = Testing){
-        checkCUDA(__LINE__,cudaSetDevice(GPU));
+        setDevice();
 
         phase = phase_;
 
@@ -7630,16 +11819,41 @@ public:
         std::cout<< "  Layers:                                                                        Responses:                                          "<<std::endl;
         std::cout<< "====================================================================================================================================="<<std::endl;
 
-        size_t memoryBytes = 0;
+        MemoryAccountScope scope(&memory);
+
+        if (phase==Testing && fold_batchnorm) planBatchNormFolding();
+        if (phase==Testing && fuse_activations) planActivationFusion();
+        planInPlace();
+        if (concat_views) planConcatViews();
+
+        // responses released after each layer, when they share buffers
+        std::vector<std::vector<Response*> > released(layers.size());
+        if (phase==Testing && reuse_responses) planResponses(released);
 
         for (int l=0;l<layers.size();++l){
-            memoryBytes += layers[l]->Malloc(phase);
+            layers[l]->Malloc(phase);
+            if (!slices.empty()) sliceConcat(layers[l]);
+            for (int r=0;r<released[l].size();++r) released[l][r]->release();
+        }
+        // the folded ones only for their weights and statistics; their response is already there
+        for (int f=0;f<folded.size();++f){
+            folded[f].bn->Malloc(phase);
+        }
+
+        if (responsePool!=NULL){
+            std::cout<< "Responses share ";  memorySizePrint(responsePool->totalBytes());
+            std::cout<< " instead of ";      memorySizePrint(responsePool->requestedBytes); std::cout<<std::endl;
         }
 
         std::cout<< "====================================================================================================================================="<<std::endl;
-        std::cout<< "GPU " << GPU << ": Total GPU memory: ";    memorySizePrint(memoryBytes);   std::cout<<std::endl;
+        if (device==DeviceCPU)  std::cout<< "CPU: Total memory: ";
+        else                    std::cout<< "GPU " << GPU << ": Total GPU memory: ";    memorySizePrint(memory.on(device));   std::cout<<std::endl;
+        if (device==DeviceGPU && memory.hostBytes>0){
+            std::cout<< "Host memory (data staging): ";  memorySizePrint(memory.hostBytes);  std::cout<<std::endl;
+        }
+        MemoryArena::get().print();
 
-        return memoryBytes;
+        return memory.on(device);
     };
 
     void forward(){
@@ -7656,7 +11870,7 @@ public:
                 layers[l]->forward(phase);
 
                 if (debug_mode){
-                    checkCUDA(__LINE__,cudaDeviceSynchronize()); checkCUDA(__LINE__,cudaGetLastError());
+                    synchronize();
                     if (layers[l]->out.size()>0){
                         for (size_t o=0; o<layers[l]->out.size();++o){
                             ComputeT avg = layers[l]->out[o]->ameanData();
@@ -7686,7 +11900,7 @@ public:
                 layers[l]->backward(phase);
 
                 if (debug_mode){
-                    checkCUDA(__LINE__,cudaDeviceSynchronize()); checkCUDA(__LINE__,cudaGetLastError());
+                    synchronize();
                     ComputeT avg;
                     avg = layers[l]->ameanWeightDiff(); if (avg!=-1) std::cout<<" weight.diff: "<<avg;
                     avg = layers[l]->ameanBiasDiff();   if (avg!=-1) std::cout<<" bias.diff: "<<avg;
@@ -7716,16 +11930,16 @@ public:
     };
 
     void eval(bool sync){
-        checkCUDA(__LINE__,cudaSetDevice(GPU));
+        setDevice();
         for (int l=0; l<loss_layers.size();++l){
             if (loss_layers[l]->phase == phase || loss_layers[l]->phase == TrainingTesting)
                 loss_layers[l]->eval();
         }
-        if(sync) checkCUDA(__LINE__,cudaDeviceSynchronize());
+        if(sync) synchronize();
     };
 
     void stepTest(bool sync){
-        checkCUDA(__LINE__,cudaSetDevice(GPU));
+        setDevice();
 
         resetLoss();
         for (int i=0; i < test_iter; ++i){
@@ -7737,12 +11951,12 @@ public:
             loss_layers[l]->loss   /= test_iter;
         }
 
-        if(sync) checkCUDA(__LINE__,cudaDeviceSynchronize());
+        if(sync) synchronize();
     };
 
 
     void stepTrain(bool sync){
-        checkCUDA(__LINE__,cudaSetDevice(GPU));
+        setDevice();
 
         update();
 
@@ -7761,7 +11975,7 @@ public:
             loss_layers[l]->loss   /= train_iter;
         }
 
-        if(sync) checkCUDA(__LINE__,cudaDeviceSynchronize());
+        if(sync) synchronize();
     };
 
 
@@ -7814,12 +12028,12 @@ public:
             }
             std::cout << std::endl;
 
-            rdataTensor->readGPU(rData->dataGPU);
+            rdataTensor->readGPU(rData->dataGPU, device);
 
             for(int i=0;i<responseNames.size();++i){
                 Response* r= getResponse(responseNames[i]);
                 Tensor<StorageT>* features = new Tensor<StorageT>(r->dim);
-                features->readGPU(r->dataGPU);
+                features->readGPU(r->dataGPU, device);
 
                 size_t spel = numspel(r->dim);
 
@@ -7958,6 +12172,7 @@ public:
         std::vector<Tensor<StorageT>*> features(responseNames.size(),NULL);
 
         std::vector<FILE*> files(responseNames.size(),NULL);
+        std::vector<TensorIndexEntry> entries(responseNames.size());   // the one tensor of each open file
 
         DataLayer* pDataLayer = NULL;
         for (int l=0; l<layers.size();++l){
@@ -8040,16 +12255,17 @@ public:
                                 dim[0] = pDataLayer->numofitems() - samplesSaved;
                             }
                         }
-                        features[i]->writeHeader(files[i],dim);
+                        entries[i] = writeIndexedHeader(files[i], features[i], dim);
 
                         file_counter[i]++;
                     }
 
-                    features[i]->readGPU(r-> dataGPU);
+                    features[i]->readGPU(r->dataGPU, device);
                     features[i]->writeData(files[i], total_size[i]);
                     total_size[i] -= features[i]->numel();
 
                     if (itersPerSave !=0 && iter % itersPerSave == itersPerSave-1){
+                        writeTensorIndex(files[i], std::vector<TensorIndexEntry>(1, entries[i]));
                         fclose(files[i]);
                         files[i] = NULL;
                     }
@@ -8060,6 +12276,7 @@ public:
 
         for(int i=0;i<responseNames.size();++i){
             if (files[i] != NULL){
+                writeTensorIndex(files[i], std::vector<TensorIndexEntry>(1, entries[i]));
                 fclose(files[i]);
                 files[i] = NULL;
             }
@@ -8102,6 +12319,11 @@ public:
 
     std::vector<int> GPU;
     int GPU_solver;
+    Device device;
+    int CPU_threads;
+    bool in_place;          // see Net::in_place
+    bool concat_views;      // see Net::concat_views
+    MemoryAccount memory;   // the solver history
 
     // machine learning paramters
     SolverAlgorithm solver;
@@ -8157,36 +12379,59 @@ public:
         SetValue(train_obj, GPU,            veci(1,0))
         SetOrDie(train_obj, path            )
         SetValue(train_obj, GPU_solver,     -1)
+        SetValue(train_obj, device,         DeviceGPU)
+        SetValue(train_obj, CPU_threads,    0)
+        SetValue(train_obj, in_place,       false)
+        SetValue(train_obj, concat_views,   false)
+
+        if (device==DeviceCPU){
+            // the CPU backend parallelizes inside each layer, so one net is enough
+            GPU = veci(1,0);
+            GPU_solver = 0;
+        }
 
         if (GPU_solver==-1) GPU_solver=GPU[0];
 
         singleGPU = GPU.size()==1 && GPU_solver==GPU[0];
 
-        int nGPUs = 0;
-        checkCUDA(__LINE__, cudaGetDeviceCount(&nGPUs));
-        if (nGPUs==0){
-            std::cerr<<"There is no NVIDIA GPU available in this machine."<<std::endl;
-            FatalError(__LINE__);
-        }else if (nGPUs==1){
-            std::cout<<"There is 1 NVIDIA GPU available in this machine."<<std::endl;
+        if (device==DeviceCPU){
+            std::cout<<"Running on the CPU with "<<(CPU_threads>0 ? CPU_threads : int(std::thread::hardware_concurrency()))<<" threads."<<std::endl;
         }else{
-            std::cout<<"There are "<< nGPUs<< " NVIDIA GPUs available in this machine."<<std::endl;
-        }
-        std::vector<int>::iterator largestGPUid = max_element(GPU.begin(), GPU.end());
-        if (*largestGPUid>=nGPUs){
-            std::cerr<<"Largest GPU ID request for GPU #"<<*largestGPUid<<" exceeds the number of available GPUs"<<std::endl;
-            FatalError(__LINE__);
+            int nGPUs = 0;
+            checkCUDA(__LINE__, cudaGetDeviceCount(&nGPUs));
+            if (nGPUs==0){
+                std::cerr<<"There is no NVIDIA GPU available in this machine."<<std::endl;
+                FatalError(__LINE__);
+            }else if (nGPUs==1){
+                std::cout<<"There is 1 NVIDIA GPU available in this machine."<<std::endl;
+            }else{
+                std::cout<<"There are "<< nGPUs<< " NVIDIA GPUs available in this machine."<<std::endl;
+            }
+            std::vector<int>::iterator largestGPUid = max_element(GPU.begin(), GPU.end());
+            if (*largestGPUid>=nGPUs){
+                std::cerr<<"Largest GPU ID request for GPU #"<<*largestGPUid<<" exceeds the number of available GPUs"<<std::endl;
+                FatalError(__LINE__);
+            }
         }
 
         nets.resize(GPU.size());
         threads.resize(GPU.size());
         for (int n=0;n<nets.size();++n){
-            nets[n] = new Net(architecture_obj, GPU[n]);
+            nets[n] = new Net(architecture_obj, GPU[n], device, CPU_threads);
             nets[n]->debug_mode = debug_mode;
+            nets[n]->in_place   = in_place;
+            nets[n]->concat_views = concat_views;
             nets[n]->train_iter = train_iter;
             nets[n]->test_iter  = test_iter;
         }
 
+        // one permutation per epoch shared out between the replicas, so an epoch is one pass over the data
+        if (nets.size()>1){
+            std::random_device rd;
+            unsigned seed = rd();
+            for (int n=0;n<nets.size();++n) nets[n]->setReplica(n, nets.size(), seed);
+        }
+
         delete train_obj;
         delete architecture_obj;
 
@@ -8210,6 +12455,10 @@ public:
 
     };
 
+    void setDevice(){
+        if (device==DeviceGPU) checkCUDA(__LINE__,cudaSetDevice(GPU_solver));
+    };
+
     ComputeT learning_rate(){
         ComputeT rate;
         switch(lr_policy){
@@ -8249,8 +12498,8 @@ public:
     size_t Malloc(Phase phase_ = Training){
         phase = phase_;
 
-        int nGPUs = 0;
-        checkCUDA(__LINE__, cudaGetDeviceCount(&nGPUs));
+        int nGPUs = 1;
+        if (device==DeviceGPU) checkCUDA(__LINE__, cudaGetDeviceCount(&nGPUs));
         std::vector<size_t> memoryBytes(nGPUs,0);
 
         for (int n=0;n<nets.size();++n){
@@ -8281,16 +12530,16 @@ public:
         }
 
         if (phase == Training || phase == TrainingTesting){
-            checkCUDA(__LINE__,cudaSetDevice(GPU_solver));
+            MemoryAccountScope scope(&memory);
+            setDevice();
             for (int l=0; l<nets[0]->layers.size(); ++l){
                 if (nets[0]->layers[l]->train_me){
                     size_t weight_numel = nets[0]->layers[l]->weight_numel;
                     size_t   bias_numel = nets[0]->layers[l]->bias_numel;
                     if (weight_numel>0){
                         size_t weight_bytes = (1 + nets.size() + extraHistoryCount) * weight_numel * sizeofStorageT;
-                        checkCUDA(__LINE__, cudaMalloc(&(nets[0]->layers[l]->weight_histGPU), weight_bytes));
-                        checkCUDA(__LINE__, cudaMemset(nets[0]->layers[l]->weight_histGPU, 0, weight_bytes));
-                        memoryBytes[GPU_solver] += weight_bytes;
+                        checkCUDA(__LINE__, deviceMalloc(device, &(nets[0]->layers[l]->weight_histGPU), weight_bytes));
+                        checkCUDA(__LINE__, deviceMemset(device, nets[0]->layers[l]->weight_histGPU, 0, weight_bytes));
                         for (int n=0;n<nets.size();++n){
                             nets[n]->layers[l]->weight_histGPU = nets[0]->layers[l]->weight_histGPU;
                             nets[n]->layers[l]->weight_diffGPU = nets[0]->layers[l]->weight_histGPU + weight_numel * (n+1);
@@ -8298,9 +12547,8 @@ public:
                     }
                     if (bias_numel>0){
                         size_t bias_bytes = (1 + nets.size() + extraHistoryCount) * bias_numel * sizeofStorageT;
-                        checkCUDA(__LINE__, cudaMalloc(&(nets[0]->layers[l]->bias_histGPU), bias_bytes));
-                        checkCUDA(__LINE__, cudaMemset(nets[0]->layers[l]->bias_histGPU, 0, bias_bytes));
-                        memoryBytes[GPU_solver] += bias_bytes;
+                        checkCUDA(__LINE__, deviceMalloc(device, &(nets[0]->layers[l]->bias_histGPU), bias_bytes));
+                        checkCUDA(__LINE__, deviceMemset(device, nets[0]->layers[l]->bias_histGPU, 0, bias_bytes));
                         for (int n=0;n<nets.size();++n){
                             nets[n]->layers[l]->bias_histGPU = nets[0]->layers[l]->bias_histGPU;
                             nets[n]->layers[l]->bias_diffGPU = nets[0]->layers[l]->bias_histGPU + bias_numel * (n+1);
@@ -8313,9 +12561,8 @@ public:
                             size_t   bias_numel = nets[0]->layers[l]->sub_layers[ll]->bias_numel;
                             if (weight_numel>0){
                                 size_t weight_bytes = (1 + nets.size() + extraHistoryCount) * weight_numel * sizeofStorageT;
-                                checkCUDA(__LINE__, cudaMalloc(&(nets[0]->layers[l]->sub_layers[ll]->weight_histGPU), weight_bytes));
-                                checkCUDA(__LINE__, cudaMemset(nets[0]->layers[l]->sub_layers[ll]->weight_histGPU, 0, weight_bytes));
-                                memoryBytes[GPU_solver] += weight_bytes;
+                                checkCUDA(__LINE__, deviceMalloc(device, &(nets[0]->layers[l]->sub_layers[ll]->weight_histGPU), weight_bytes));
+                                checkCUDA(__LINE__, deviceMemset(device, nets[0]->layers[l]->sub_layers[ll]->weight_histGPU, 0, weight_bytes));
                                 for (int n=0;n<nets.size();++n){
                                     nets[n]->layers[l]->sub_layers[ll]->weight_histGPU = nets[0]->layers[l]->sub_layers[ll]->weight_histGPU;
                                     nets[n]->layers[l]->sub_layers[ll]->weight_diffGPU = nets[0]->layers[l]->sub_layers[ll]->weight_histGPU + weight_numel * (n+1);
@@ -8323,9 +12570,8 @@ public:
                             }
                             if (bias_numel>0){
                                 size_t bias_bytes = (1 + nets.size() + extraHistoryCount) * bias_numel * sizeofStorageT;
-                                checkCUDA(__LINE__, cudaMalloc(&(nets[0]->layers[l]->sub_layers[ll]->bias_histGPU), bias_bytes));
-                                checkCUDA(__LINE__, cudaMemset(nets[0]->layers[l]->sub_layers[ll]->bias_histGPU, 0, bias_bytes));
-                                memoryBytes[GPU_solver] += bias_bytes;
+                                checkCUDA(__LINE__, deviceMalloc(device, &(nets[0]->layers[l]->sub_layers[ll]->bias_histGPU), bias_bytes));
+                                checkCUDA(__LINE__, deviceMemset(device, nets[0]->layers[l]->sub_layers[ll]->bias_histGPU, 0, bias_bytes));
                                 for (int n=0;n<nets.size();++n){
                                     nets[n]->layers[l]->sub_layers[ll]->bias_histGPU = nets[0]->layers[l]->sub_layers[ll]->bias_histGPU;
                                     nets[n]->layers[l]->sub_layers[ll]->bias_diffGPU = nets[0]->layers[l]->sub_layers[ll]->bias_histGPU + bias_numel * (n+1);
@@ -8338,7 +12584,13 @@ public:
             }
         }
 
+        memoryBytes[GPU_solver] += memory.on(device);
+
         std::cout<< "====================================================================================================================================="<<std::endl;
+        if (device==DeviceCPU){
+            std::cout<< "CPU: Total memory: "; memorySizePrint(memoryBytes[0]);   std::cout<<std::endl;
+            return memoryBytes[0];
+        }
         for (int n=0;n<nGPUs;++n){
             if (memoryBytes[n]>0){
                 std::cout<< "GPU " << n << ": Total GPU memory: ";  memorySizePrint(memoryBytes[n]);    std::cout<<std::endl;
@@ -8356,59 +12608,60 @@ public:
     };
 
     ~Solver(){
-        checkCUDA(__LINE__,cudaSetDevice(GPU_solver));
+        setDevice();
         for (int l=0; l<nets[0]->layers.size(); ++l){
             if (nets[0]->layers[l]->train_me){
                 if (nets[0]->layers[l]->weight_numel>0){
-                    if (nets[0]->layers[l]->weight_histGPU!=NULL) checkCUDA(__LINE__, cudaFree(nets[0]->layers[l]->weight_histGPU));
+                    if (nets[0]->layers[l]->weight_histGPU!=NULL) checkCUDA(__LINE__, deviceFree(device, nets[0]->layers[l]->weight_histGPU));
                 }
                 if (nets[0]->layers[l]->bias_numel>0){
-                    if (nets[0]->layers[l]->bias_histGPU!=NULL) checkCUDA(__LINE__, cudaFree(nets[0]->layers[l]->bias_histGPU));
+                    if (nets[0]->layers[l]->bias_histGPU!=NULL) checkCUDA(__LINE__, deviceFree(device, nets[0]->layers[l]->bias_histGPU));
                 }
 
                 for(int ll=0; ll<nets[0]->layers[l]->sub_layers.size(); ++ll){
                     if (nets[0]->layers[l]->sub_layers[ll]->train_me){
                         if (nets[0]->layers[l]->sub_layers[ll]->weight_numel>0){
-                            if (nets[0]->layers[l]->sub_layers[ll]->weight_histGPU!=NULL) checkCUDA(__LINE__, cudaFree(nets[0]->layers[l]->sub_layers[ll]->weight_histGPU));
+                            if (nets[0]->layers[l]->sub_layers[ll]->weight_histGPU!=NULL) checkCUDA(__LINE__, deviceFree(device, nets[0]->layers[l]->sub_layers[ll]->weight_histGPU));
                         }
                         if (nets[0]->layers[l]->sub_layers[ll]->bias_numel>0){
-                            if (nets[0]->layers[l]->sub_layers[ll]->bias_histGPU!=NULL) checkCUDA(__LINE__, cudaFree(nets[0]->layers[l]->sub_layers[ll]->bias_histGPU));
+                            if (nets[0]->layers[l]->sub_layers[ll]->bias_histGPU!=NULL) checkCUDA(__LINE__, deviceFree(device, nets[0]->layers[l]->sub_layers[ll]->bias_histGPU));
                         }
                     }
                 }
             }
         }
+        MemoryArena::get().forget(&memory);
     };
 
     void randInit(){
         nets[0]->randInit();
         for (int n=1;n<nets.size();++n){
             for (int l=0; l<nets[0]->layers.size(); ++l){
-                if (nets[0]->layers[l]->weight_numel>0) checkCUDA(__LINE__, cudaMemcpy(nets[n]->layers[l]->weight_dataGPU, nets[0]->layers[l]->weight_dataGPU, nets[0]->layers[l]->weight_numel*sizeofStorageT, cudaMemcpyDeviceToDevice) );
-                if (nets[0]->layers[l]->bias_numel>0)   checkCUDA(__LINE__, cudaMemcpy(nets[n]->layers[l]->bias_dataGPU, nets[0]->layers[l]->bias_dataGPU, nets[0]->layers[l]->bias_numel*sizeofStorageT, cudaMemcpyDeviceToDevice) );
+                if (nets[0]->layers[l]->weight_numel>0) checkCUDA(__LINE__, deviceMemcpy(device, nets[n]->layers[l]->weight_dataGPU, nets[0]->layers[l]->weight_dataGPU, nets[0]->layers[l]->weight_numel*sizeofStorageT, cudaMemcpyDeviceToDevice) );
+                if (nets[0]->layers[l]->bias_numel>0)   checkCUDA(__LINE__, deviceMemcpy(device, nets[n]->layers[l]->bias_dataGPU, nets[0]->layers[l]->bias_dataGPU, nets[0]->layers[l]->bias_numel*sizeofStorageT, cudaMemcpyDeviceToDevice) );
                 for(int ll=0; ll<nets[0]->layers[l]->sub_layers.size(); ++ll){
-                    if (nets[0]->layers[l]->sub_layers[ll]->weight_numel>0) checkCUDA(__LINE__, cudaMemcpy(nets[n]->layers[l]->sub_layers[ll]->weight_dataGPU, nets[0]->layers[l]->sub_layers[ll]->weight_dataGPU, nets[0]->layers[l]->sub_layers[ll]->weight_numel*sizeofStorageT, cudaMemcpyDeviceToDevice) );
-                    if (nets[0]->layers[l]->sub_layers[ll]->bias_numel>0)   checkCUDA(__LINE__, cudaMemcpy(nets[n]->layers[l]->sub_layers[ll]->bias_dataGPU, nets[0]->layers[l]->sub_layers[ll]->bias_dataGPU, nets[0]->layers[l]->sub_layers[ll]->bias_numel*sizeofStorageT, cudaMemcpyDeviceToDevice) );
+                    if (nets[0]->layers[l]->sub_layers[ll]->weight_numel>0) checkCUDA(__LINE__, deviceMemcpy(device, nets[n]->layers[l]->sub_layers[ll]->weight_dataGPU, nets[0]->layers[l]->sub_layers[ll]->weight_dataGPU, nets[0]->layers[l]->sub_layers[ll]->weight_numel*sizeofStorageT, cudaMemcpyDeviceToDevice) );
+                    if (nets[0]->layers[l]->sub_layers[ll]->bias_numel>0)   checkCUDA(__LINE__, deviceMemcpy(device, nets[n]->layers[l]->sub_layers[ll]->bias_dataGPU, nets[0]->layers[l]->sub_layers[ll]->bias_dataGPU, nets[0]->layers[l]->sub_layers[ll]->bias_numel*sizeofStorageT, cudaMemcpyDeviceToDevice) );
                 }
             }
         }
     };
 
     void solve(ComputeT learning_rate){
-        checkCUDA(__LINE__,cudaSetDevice(GPU_solver));
+        setDevice();
         for (int l=0; l<nets[0]->layers.size(); ++l){
             if (nets[0]->layers[l]->train_me){
                 if (nets[0]->layers[l]->weight_numel>0)
-                    update_solver(solver, regularizer, iter, nets[0]->layers[l]->weight_numel, nets.size(), weight_decay * nets[0]->layers[l]->weight_decay_mult, momentum, momentum2, delta, rms_decay, learning_rate * nets[0]->layers[l]->weight_lr_mult, nets[0]->layers[l]->weight_dataGPU, nets[0]->layers[l]->weight_histGPU);
+                    (device==DeviceCPU ? CPU_update_solver : update_solver)(solver, regularizer, iter, nets[0]->layers[l]->weight_numel, nets.size(), weight_decay * nets[0]->layers[l]->weight_decay_mult, momentum, momentum2, delta, rms_decay, learning_rate * nets[0]->layers[l]->weight_lr_mult, nets[0]->layers[l]->weight_dataGPU, nets[0]->layers[l]->weight_histGPU);
                 if (nets[0]->layers[l]->bias_numel>0)
-                    update_solver(solver, regularizer, iter, nets[0]->layers[l]->bias_numel, nets.size(), weight_decay * nets[0]->layers[l]->bias_decay_mult, momentum, momentum2, delta, rms_decay, learning_rate * nets[0]->layers[l]->bias_lr_mult, nets[0]->layers[l]->bias_dataGPU, nets[0]->layers[l]->bias_histGPU);
+                    (device==DeviceCPU ? CPU_update_solver : update_solver)(solver, regularizer, iter, nets[0]->layers[l]->bias_numel, nets.size(), weight_decay * nets[0]->layers[l]->bias_decay_mult, momentum, momentum2, delta, rms_decay, learning_rate * nets[0]->layers[l]->bias_lr_mult, nets[0]->layers[l]->bias_dataGPU, nets[0]->layers[l]->bias_histGPU);
 
                 for(int ll=0; ll<nets[0]->layers[l]->sub_layers.size(); ++ll){
                     if (nets[0]->layers[l]->sub_layers[ll]->train_me){
                         if (nets[0]->layers[l]->sub_layers[ll]->weight_numel>0)
-                            update_solver(solver, regularizer, iter, nets[0]->layers[l]->sub_layers[ll]->weight_numel, nets.size(), weight_decay * nets[0]->layers[l]->sub_layers[ll]->weight_decay_mult, momentum, momentum2, delta, rms_decay, learning_rate * nets[0]->layers[l]->sub_layers[ll]->weight_lr_mult, nets[0]->layers[l]->sub_layers[ll]->weight_dataGPU, nets[0]->layers[l]->sub_layers[ll]->weight_histGPU);
+                            (device==DeviceCPU ? CPU_update_solver : update_solver)(solver, regularizer, iter, nets[0]->layers[l]->sub_layers[ll]->weight_numel, nets.size(), weight_decay * nets[0]->layers[l]->sub_layers[ll]->weight_decay_mult, momentum, momentum2, delta, rms_decay, learning_rate * nets[0]->layers[l]->sub_layers[ll]->weight_lr_mult, nets[0]->layers[l]->sub_layers[ll]->weight_dataGPU, nets[0]->layers[l]->sub_layers[ll]->weight_histGPU);
                         if (nets[0]->layers[l]->sub_layers[ll]->bias_numel>0)
-                            update_solver(solver, regularizer, iter, nets[0]->layers[l]->sub_layers[ll]->bias_numel, nets.size(), weight_decay * nets[0]->layers[l]->sub_layers[ll]->bias_decay_mult, momentum, momentum2, delta, rms_decay, learning_rate * nets[0]->layers[l]->sub_layers[ll]->bias_lr_mult, nets[0]->layers[l]->sub_layers[ll]->bias_dataGPU, nets[0]->layers[l]->sub_layers[ll]->bias_histGPU);
+                            (device==DeviceCPU ? CPU_update_solver : update_solver)(solver, regularizer, iter, nets[0]->layers[l]->sub_layers[ll]->bias_numel, nets.size(), weight_decay * nets[0]->layers[l]->sub_layers[ll]->bias_decay_mult, momentum, momentum2, delta, rms_decay, learning_rate * nets[0]->layers[l]->sub_layers[ll]->bias_lr_mult, nets[0]->layers[l]->sub_layers[ll]->bias_dataGPU, nets[0]->layers[l]->sub_layers[ll]->bias_histGPU);
                     }
                 }
 
@@ -8420,7 +12673,8 @@ public:
 
         std::cout<< "====================================================================================================================================="<<std::endl;
 
-        std::vector<Tensor<StorageT>*> weights = readTensors<StorageT>(filename);
+        TensorFile file(filename);
+        std::vector<Tensor<StorageT>*> weights = file.tensors<StorageT>();
 
         for (int i=0;i<nets.size();++i){
             nets[i]->loadWeights(weights, diff);
@@ -8437,7 +12691,7 @@ public:
 
     void train(int iter_begin = 0){
 
-        checkCUDA(__LINE__,cudaSetDevice(GPU_solver));
+        setDevice();
 
         phase = Training;
         current_step = 0;
@@ -8498,7 +12752,7 @@ public:
 
             ComputeT lrate = learning_rate();
             solve(lrate);
-            checkCUDA(__LINE__,cudaDeviceSynchronize());
+            if (device==DeviceGPU) checkCUDA(__LINE__,cudaDeviceSynchronize());
 
             if (iter!=iter_begin && iter % snapshot_iter==0){
                 saveWeights(path+"_snapshot_"+std::to_string(iter)+".marvin",false);